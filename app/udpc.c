@@ -23,7 +23,10 @@ static volatile sig_atomic_t terminate;
 static void
 on_signal(int s)
 {
-    (void)s;
+    if (s == SIGQUIT) {
+        net_stats_dump_request();
+        return;
+    }
     terminate = 1;
     net_interrupt();
     close(0);
@@ -36,6 +39,7 @@ setup(void)
     struct ip_iface *iface;
 
     signal(SIGINT, on_signal);
+    signal(SIGQUIT, on_signal);
     if (net_init() == -1) {
         errorf("net_init() failure");
         return -1;
@@ -1,12 +1,12 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
-#include <sys/time.h>
 
 #include "platform.h"
 
 #include "util.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ether.h"
 #include "arp.h"
 #include "ip.h"
@@ -19,8 +19,15 @@
 #define ARP_OP_REQUEST 0x0001
 #define ARP_OP_REPLY   0x0002
 
-#define ARP_CACHE_SIZE 32
-#define ARP_CACHE_TIMEOUT 30 /* seconds */
+#define ARP_CACHE_BUCKETS_MIN 64 /* power of two, doubled as the entries grow */
+#define ARP_CACHE_MAX 4096 /* the oldest one is reused beyond this */
+#define ARP_CACHE_TIMEOUT 30000000 /* micro seconds */
+#define ARP_CACHE_REFRESH 5000000 /* micro seconds, an entry in use is probed this long before the timeout */
+
+#define ARP_REQUEST_INTERVAL 1000000 /* micro seconds */
+#define ARP_REQUEST_RETRY 3
+
+#define ARP_PENDING_MAX 8 /* packets per entry waiting for the reply */
 
 #define ARP_CACHE_STATE_FREE       0
 #define ARP_CACHE_STATE_INCOMPLETE 1
@@ -43,15 +50,36 @@ struct arp_ether {
     uint8_t tpa[IP_ADDR_LEN];
 };
 
+struct arp_pending {
+    struct list_head entry;
+    struct net_device *dev;
+    struct pbuf *pb; /* IP datagram */
+};
+
 struct arp_cache {
+    struct list_head entry; /* hash bucket (or the free list) */
     unsigned char state;
     ip_addr_t pa;
     uint8_t ha[ETHER_ADDR_LEN];
-    struct timeval timestamp;
+    uint64_t timestamp; /* clock_usec() */
+    uint64_t requested; /* clock_usec() of the last request for it */
+    int retry;
+    struct net_iface *iface; /* to send the requests and the pending packets */
+    struct list_head pending;
+    int pending_num;
+    struct net_timeout timer; /* retries the request, or expires the entry (not armed for the static ones) */
 };
 
+/*
+ * NOTE: The entries are allocated as needed and recycled through the free list but never freed,
+ *       since a timeout may fire for an entry being released (the handler checks the state).
+ */
 static mutex_t mutex = MUTEX_INITIALIZER;
-static struct arp_cache caches[ARP_CACHE_SIZE];
+static struct list_head *buckets;
+static size_t buckets_num;
+static size_t caches_num; /* entries in the buckets */
+static size_t caches_alloc; /* entries allocated */
+static struct list_head caches_free = LIST_HEAD_INITIALIZER(caches_free);
 
 static char *
 arp_opcode_ntoa(uint16_t opcode)
@@ -72,6 +100,10 @@ arp_dump(const uint8_t *data, size_t len)
     ip_addr_t spa, tpa;
     char addr[128];
 
+    if (!LOG_ENABLED(LOG_LEVEL_DEBUG)) {
+        return;
+    }
+
     message = (struct arp_ether *)data;
     flockfile(stderr);
     fprintf(stderr, "        hrd: 0x%04x\n", ntoh16(message->hdr.hrd));
@@ -97,37 +129,123 @@ arp_dump(const uint8_t *data, size_t len)
  * NOTE: ARP Cache functions must be called after mutex locked
  */
 
-static struct arp_cache *
-arp_cache_alloc(void)
+static uint32_t
+arp_cache_hash(ip_addr_t pa)
 {
-    struct arp_cache *entry, *oldest = NULL;
+    uint32_t h = pa;
+
+    /* MurmurHash3 finalizer */
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static struct list_head *
+arp_cache_bucket(ip_addr_t pa)
+{
+    return &buckets[arp_cache_hash(pa) & (buckets_num - 1)];
+}
+
+/* NOTE: doubles the buckets, the entries stay where they are if no memory */
+static void
+arp_cache_grow(void)
+{
+    struct list_head *old, *entry;
+    struct arp_cache *cache;
+    size_t old_num, i;
 
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state == ARP_CACHE_STATE_FREE) {
-            return entry;
+    old = buckets;
+    old_num = buckets_num;
+    buckets = memory_alloc(sizeof(*buckets) * old_num * 2);
+    if (!buckets) {
+        buckets = old;
+        return;
+    }
+    buckets_num = old_num * 2;
+    for (i = 0; i < buckets_num; i++) {
+        list_init(&buckets[i]);
+    }
+    for (i = 0; i < old_num; i++) {
+        while ((entry = list_pop(&old[i])) != NULL) {
+            cache = list_entry(entry, struct arp_cache, entry);
+            list_add_tail(&cache->entry, arp_cache_bucket(cache->pa));
         }
-        if (!oldest || timercmp(&oldest->timestamp, &entry->timestamp, >)) {
-            oldest = entry;
+    }
+    memory_free(old);
+}
+
+static void
+arp_cache_delete(struct arp_cache *cache);
+static void
+arp_timer(void *arg);
+
+static struct arp_cache *
+arp_cache_alloc(ip_addr_t pa)
+{
+    struct arp_cache *cache, *oldest = NULL;
+    struct list_head *entry;
+    size_t i;
+
+    entry = list_pop(&caches_free);
+    if (entry) {
+        cache = list_entry(entry, struct arp_cache, entry);
+    } else if (caches_alloc < ARP_CACHE_MAX && (cache = memory_alloc(sizeof(*cache))) != NULL) {
+        list_init(&cache->pending);
+        net_timeout_init(&cache->timer, arp_timer, cache);
+        caches_alloc++;
+    } else {
+        for (i = 0; i < buckets_num; i++) {
+            list_foreach(entry, &buckets[i]) {
+                cache = list_entry(entry, struct arp_cache, entry);
+                if (cache->state != ARP_CACHE_STATE_STATIC && (!oldest || oldest->timestamp > cache->timestamp)) {
+                    oldest = cache;
+                }
+            }
         }
+        if (!oldest) {
+            return NULL;
+        }
+        arp_cache_delete(oldest);
+        cache = list_entry(list_pop(&caches_free), struct arp_cache, entry);
+    }
+    cache->pa = pa;
+    cache->retry = 0;
+    cache->requested = 0;
+    list_add_tail(&cache->entry, arp_cache_bucket(pa));
+    if (++caches_num > buckets_num) {
+        arp_cache_grow();
     }
-    return oldest;
+    return cache;
+}
+
+static void
+arp_cache_touch(struct arp_cache *cache)
+{
+    cache->timestamp = clock_usec();
+    net_timeout_arm(&cache->timer, cache->timestamp + ARP_CACHE_TIMEOUT);
 }
 
 static struct arp_cache *
 arp_cache_select(ip_addr_t pa)
 {
-    struct arp_cache *entry;
+    struct list_head *entry;
+    struct arp_cache *cache;
 
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state != ARP_CACHE_STATE_FREE && entry->pa == pa) {
-            return entry;
+    list_foreach(entry, arp_cache_bucket(pa)) {
+        cache = list_entry(entry, struct arp_cache, entry);
+        if (cache->pa == pa) {
+            return cache;
         }
     }
     return NULL;
 }
 
+/* NOTE: the pending packets are moved to the list given, to be sent after the mutex unlocked */
 static struct arp_cache *
-arp_cache_update(ip_addr_t pa, const uint8_t *ha)
+arp_cache_update(ip_addr_t pa, const uint8_t *ha, struct list_head *pending)
 {
     struct arp_cache *cache;
     char addr1[IP_ADDR_STR_LEN];
@@ -140,7 +258,12 @@ arp_cache_update(ip_addr_t pa, const uint8_t *ha)
     }
     cache->state = ARP_CACHE_STATE_RESOLVED;
     memcpy(cache->ha, ha, ETHER_ADDR_LEN);
-    gettimeofday(&cache->timestamp, NULL);
+    cache->retry = 0;
+    arp_cache_touch(cache);
+    while (!list_empty(&cache->pending)) {
+        list_add_tail(list_pop(&cache->pending), pending);
+    }
+    cache->pending_num = 0;
     debugf("UPDATE: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
     return cache;
 }
@@ -152,15 +275,14 @@ arp_cache_insert(ip_addr_t pa, const uint8_t *ha)
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
 
-    cache = arp_cache_alloc();
+    cache = arp_cache_alloc(pa);
     if (!cache) {
         errorf("arp_cache_alloc() failure");
         return NULL;
     }
     cache->state = ARP_CACHE_STATE_RESOLVED;
-    cache->pa = pa;
     memcpy(cache->ha, ha, ETHER_ADDR_LEN);
-    gettimeofday(&cache->timestamp, NULL);
+    arp_cache_touch(cache);
     debugf("INSERT: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
     return cache;
 }
@@ -168,67 +290,147 @@ arp_cache_insert(ip_addr_t pa, const uint8_t *ha)
 static void
 arp_cache_delete(struct arp_cache *cache)
 {
+    struct list_head *entry;
+    struct arp_pending *pending;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
 
     debugf("DELETE: pa=%s, ha=%s", ip_addr_ntop(cache->pa, addr1, sizeof(addr1)), ether_addr_ntop(cache->ha, addr2, sizeof(addr2)));
+    while ((entry = list_pop(&cache->pending)) != NULL) {
+        pending = list_entry(entry, struct arp_pending, entry);
+        pbuf_free(pending->pb);
+        memory_free(pending);
+    }
+    cache->pending_num = 0;
     cache->state = ARP_CACHE_STATE_FREE;
     cache->pa = 0;
     memset(cache->ha, 0, ETHER_ADDR_LEN);
-    timerclear(&cache->timestamp);
+    cache->timestamp = 0;
+    cache->iface = NULL;
+    net_timeout_cancel(&cache->timer);
+    list_del(&cache->entry);
+    list_add_tail(&cache->entry, &caches_free);
+    caches_num--;
+}
+
+/* NOTE: keep the packet until the reply arrives, the oldest one is dropped if too many */
+static void
+arp_cache_pending(struct arp_cache *cache, struct pbuf *pb)
+{
+    struct arp_pending *pending;
+
+    if (cache->pending_num >= ARP_PENDING_MAX) {
+        pending = list_entry(list_pop(&cache->pending), struct arp_pending, entry);
+        pbuf_free(pending->pb);
+        cache->pending_num--;
+        debugf("too many pending packets, drop the oldest one");
+    } else {
+        pending = memory_alloc(sizeof(*pending));
+        if (!pending) {
+            errorf("memory_alloc() failure");
+            return;
+        }
+    }
+    pending->pb = pbuf_own(pb);
+    if (!pending->pb) {
+        errorf("pbuf_own() failure");
+        memory_free(pending);
+        return;
+    }
+    pending->dev = cache->iface->dev;
+    list_add_tail(&pending->entry, &cache->pending);
+    cache->pending_num++;
 }
 
+/* NOTE: dst is the hardware address already known (to refresh the entry), broadcast if NULL */
 static int
-arp_request(struct net_iface *iface, ip_addr_t tpa)
+arp_request(struct net_iface *iface, ip_addr_t tpa, const uint8_t *dst)
 {
-    struct arp_ether request;
-
-    request.hdr.hrd = hton16(ARP_HRD_ETHER);
-    request.hdr.pro = hton16(ARP_PRO_IP);
-    request.hdr.hln = ETHER_ADDR_LEN;
-    request.hdr.pln = IP_ADDR_LEN;
-    request.hdr.op = hton16(ARP_OP_REQUEST);
-    memcpy(request.sha, iface->dev->addr, ETHER_ADDR_LEN);
-    memcpy(request.spa, &((struct ip_iface *)iface)->unicast, IP_ADDR_LEN);
-    memset(request.tha, 0, ETHER_ADDR_LEN);
-    memcpy(request.tpa, &tpa, IP_ADDR_LEN);
-    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(request.hdr.op), ntoh16(request.hdr.op), sizeof(request));
-    arp_dump((uint8_t *)&request, sizeof(request));
-    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&request, sizeof(request), iface->dev->broadcast);
+    struct pbuf *pb;
+    struct arp_ether *request;
+    int ret;
+
+    pb = pbuf_alloc(PBUF_HEADROOM, sizeof(*request));
+    if (!pb) {
+        errorf("pbuf_alloc() failure");
+        return -1;
+    }
+    request = (struct arp_ether *)pb->data;
+    request->hdr.hrd = hton16(ARP_HRD_ETHER);
+    request->hdr.pro = hton16(ARP_PRO_IP);
+    request->hdr.hln = ETHER_ADDR_LEN;
+    request->hdr.pln = IP_ADDR_LEN;
+    request->hdr.op = hton16(ARP_OP_REQUEST);
+    memcpy(request->sha, iface->dev->addr, ETHER_ADDR_LEN);
+    memcpy(request->spa, &((struct ip_iface *)iface)->unicast, IP_ADDR_LEN);
+    memset(request->tha, 0, ETHER_ADDR_LEN);
+    memcpy(request->tpa, &tpa, IP_ADDR_LEN);
+    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(request->hdr.op), ntoh16(request->hdr.op), pb->len);
+    arp_dump(pb->data, pb->len);
+    ret = net_device_output(iface->dev, ETHER_TYPE_ARP, pb, dst ? dst : iface->dev->broadcast);
+    pbuf_free(pb);
+    return ret;
 }
 
 static int
 arp_reply(struct net_iface *iface, const uint8_t *tha, ip_addr_t tpa, const uint8_t *dst)
 {
-    struct arp_ether reply;
-
-    reply.hdr.hrd = hton16(ARP_HRD_ETHER);
-    reply.hdr.pro = hton16(ARP_PRO_IP);
-    reply.hdr.hln = ETHER_ADDR_LEN;
-    reply.hdr.pln = IP_ADDR_LEN;
-    reply.hdr.op = hton16(ARP_OP_REPLY);
-    memcpy(reply.sha, iface->dev->addr, ETHER_ADDR_LEN);
-    memcpy(reply.spa, &((struct ip_iface *)iface)->unicast, IP_ADDR_LEN);
-    memcpy(reply.tha, tha, ETHER_ADDR_LEN);
-    memcpy(reply.tpa, &tpa, IP_ADDR_LEN);
-    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(reply.hdr.op), ntoh16(reply.hdr.op), sizeof(reply));
-    arp_dump((uint8_t *)&reply, sizeof(reply));
-    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&reply, sizeof(reply), dst);
+    struct pbuf *pb;
+    struct arp_ether *reply;
+    int ret;
+
+    pb = pbuf_alloc(PBUF_HEADROOM, sizeof(*reply));
+    if (!pb) {
+        errorf("pbuf_alloc() failure");
+        return -1;
+    }
+    reply = (struct arp_ether *)pb->data;
+    reply->hdr.hrd = hton16(ARP_HRD_ETHER);
+    reply->hdr.pro = hton16(ARP_PRO_IP);
+    reply->hdr.hln = ETHER_ADDR_LEN;
+    reply->hdr.pln = IP_ADDR_LEN;
+    reply->hdr.op = hton16(ARP_OP_REPLY);
+    memcpy(reply->sha, iface->dev->addr, ETHER_ADDR_LEN);
+    memcpy(reply->spa, &((struct ip_iface *)iface)->unicast, IP_ADDR_LEN);
+    memcpy(reply->tha, tha, ETHER_ADDR_LEN);
+    memcpy(reply->tpa, &tpa, IP_ADDR_LEN);
+    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(reply->hdr.op), ntoh16(reply->hdr.op), pb->len);
+    arp_dump(pb->data, pb->len);
+    ret = net_device_output(iface->dev, ETHER_TYPE_ARP, pb, dst);
+    pbuf_free(pb);
+    return ret;
 }
 
 static void
-arp_input(const uint8_t *data, size_t len, struct net_device *dev)
+arp_output_pending(struct list_head *pending, const uint8_t *ha)
+{
+    struct list_head *entry;
+    struct arp_pending *packet;
+
+    while ((entry = list_pop(pending)) != NULL) {
+        packet = list_entry(entry, struct arp_pending, entry);
+        if (net_device_output(packet->dev, NET_PROTOCOL_TYPE_IP, packet->pb, ha) == -1) {
+            errorf("net_device_output() failure, dev=%s", packet->dev->name);
+        }
+        pbuf_free(packet->pb);
+        memory_free(packet);
+    }
+}
+
+static void
+arp_input(struct pbuf *pb, struct net_device *dev)
 {
     struct arp_ether *msg;
     ip_addr_t spa, tpa;
     int merge = 0;
     struct net_iface *iface;
+    struct list_head pending = LIST_HEAD_INITIALIZER(pending);
 
-    if (len < sizeof(*msg)) {
+    if (pb->len < sizeof(*msg)) {
         errorf("too short");
         return;
     }
-    msg = (struct arp_ether *)data;
+    msg = (struct arp_ether *)pb->data;
     if (ntoh16(msg->hdr.hrd) != ARP_HRD_ETHER || msg->hdr.hln != ETHER_ADDR_LEN) {
         errorf("unsupported hardware address");
         return;
@@ -237,16 +439,18 @@ arp_input(const uint8_t *data, size_t len, struct net_device *dev)
         errorf("unsupported protocol address");
         return;
     }
-    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", dev->name, arp_opcode_ntoa(msg->hdr.op), ntoh16(msg->hdr.op), len);
-    arp_dump(data, len);
+    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", dev->name, arp_opcode_ntoa(msg->hdr.op), ntoh16(msg->hdr.op), pb->len);
+    arp_dump(pb->data, pb->len);
     memcpy(&spa, msg->spa, sizeof(spa));
     memcpy(&tpa, msg->tpa, sizeof(tpa));
     mutex_lock(&mutex);
-    if (arp_cache_update(spa, msg->sha)) {
+    if (arp_cache_update(spa, msg->sha, &pending)) {
         /* updated */
         merge = 1;
     }
     mutex_unlock(&mutex);
+    /* NOTE: the packets waiting for the reply */
+    arp_output_pending(&pending, msg->sha);
     iface = net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
     if (iface && ((struct ip_iface *)iface)->unicast == tpa) {
         if (!merge) {
@@ -260,10 +464,15 @@ arp_input(const uint8_t *data, size_t len, struct net_device *dev)
     }
 }
 
+/*
+ * NOTE: pb is the IP datagram to be sent to pa (with the header), it is kept and sent once
+ *       resolved if ARP_RESOLVE_INCOMPLETE is returned. It may be NULL.
+ */
 int
-arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
+arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha, struct pbuf *pb)
 {
     struct arp_cache *cache;
+    uint64_t now;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
 
@@ -278,47 +487,77 @@ arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
     mutex_lock(&mutex);
     cache = arp_cache_select(pa);
     if (!cache) {
-        cache = arp_cache_alloc();
+        cache = arp_cache_alloc(pa);
         if (!cache) {
             mutex_unlock(&mutex);
             errorf("arp_cache_alloc() failure");
             return ARP_RESOLVE_ERROR;
         }
         cache->state = ARP_CACHE_STATE_INCOMPLETE;
-        cache->pa = pa;
-        gettimeofday(&cache->timestamp, NULL);
-        arp_request(iface, pa);
+        cache->iface = iface;
+        cache->timestamp = cache->requested = clock_usec();
+        net_timeout_arm(&cache->timer, cache->requested + ARP_REQUEST_INTERVAL);
+        if (pb) {
+            arp_cache_pending(cache, pb);
+        }
+        arp_request(iface, pa, NULL);
         mutex_unlock(&mutex);
         debugf("cache not found, pa=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)));
         return ARP_RESOLVE_INCOMPLETE;
     }
     if (cache->state == ARP_CACHE_STATE_INCOMPLETE) {
-        arp_request(iface, pa); /* just in case packet loss */
+        /* NOTE: the request is retried by the timer */
+        if (pb) {
+            arp_cache_pending(cache, pb);
+        }
         mutex_unlock(&mutex);
         return ARP_RESOLVE_INCOMPLETE;
     }
     memcpy(ha, cache->ha, ETHER_ADDR_LEN);
+    if (cache->state == ARP_CACHE_STATE_RESOLVED) {
+        now = clock_usec();
+        if (now >= cache->timestamp + ARP_CACHE_TIMEOUT - ARP_CACHE_REFRESH && now >= cache->requested + ARP_REQUEST_INTERVAL) {
+            /* NOTE: in use and about to expire, ask the neighbor directly before it does (the reply touches it) */
+            cache->requested = now;
+            arp_request(iface, pa, cache->ha);
+        }
+    }
     mutex_unlock(&mutex);
     debugf("resolved, pa=%s, ha=%s",
         ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
     return ARP_RESOLVE_FOUND;
 }
 
+/* NOTE: arg is the cache entry, it may have been deleted or refreshed since the timeout was armed */
 static void
-arp_timer(void)
+arp_timer(void *arg)
 {
     struct arp_cache *entry;
-    struct timeval now, diff;
+    uint64_t now;
+    char addr[IP_ADDR_STR_LEN];
 
+    entry = arg;
+    now = clock_usec();
     mutex_lock(&mutex);
-    gettimeofday(&now, NULL);
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state != ARP_CACHE_STATE_FREE && entry->state != ARP_CACHE_STATE_STATIC) {
-            timersub(&now, &entry->timestamp, &diff);
-            if (diff.tv_sec > ARP_CACHE_TIMEOUT) {
-                arp_cache_delete(entry);
-            }
+    switch (entry->state) {
+    case ARP_CACHE_STATE_INCOMPLETE:
+        if (now < entry->requested + ARP_REQUEST_INTERVAL) {
+            break;
+        }
+        if (++entry->retry >= ARP_REQUEST_RETRY) {
+            debugf("no reply, pa=%s", ip_addr_ntop(entry->pa, addr, sizeof(addr)));
+            arp_cache_delete(entry);
+            break;
         }
+        entry->requested = now;
+        net_timeout_arm(&entry->timer, now + ARP_REQUEST_INTERVAL);
+        arp_request(entry->iface, entry->pa, NULL);
+        break;
+    case ARP_CACHE_STATE_RESOLVED:
+        if (now >= entry->timestamp + ARP_CACHE_TIMEOUT) {
+            arp_cache_delete(entry);
+        }
+        break;
     }
     mutex_unlock(&mutex);
 }
@@ -326,14 +565,19 @@ arp_timer(void)
 int
 arp_init(void)
 {
-    struct timeval interval = {1, 0};
+    size_t i;
 
-    if (net_protocol_register("ARP", NET_PROTOCOL_TYPE_ARP, arp_input) == -1) {
-        errorf("net_protocol_register() failure");
+    buckets = memory_alloc(sizeof(*buckets) * ARP_CACHE_BUCKETS_MIN);
+    if (!buckets) {
+        errorf("memory_alloc() failure");
         return -1;
     }
-    if (net_timer_register("ARP Timer", interval, arp_timer) == -1) {
-        errorf("net_timer_register() failure");
+    buckets_num = ARP_CACHE_BUCKETS_MIN;
+    for (i = 0; i < buckets_num; i++) {
+        list_init(&buckets[i]);
+    }
+    if (net_protocol_register("ARP", NET_PROTOCOL_TYPE_ARP, arp_input) == -1) {
+        errorf("net_protocol_register() failure");
         return -1;
     }
     return 0;
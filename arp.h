@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include "net.h"
+#include "pbuf.h"
 #include "ip.h"
 
 #define ARP_RESOLVE_ERROR      -1
@@ -11,7 +12,7 @@
 #define ARP_RESOLVE_FOUND       1
 
 extern int
-arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha);
+arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha, struct pbuf *pb);
 extern int
 arp_init(void);
 
@@ -0,0 +1,880 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#include "util.h"
+#include "net.h"
+#include "ether.h"
+#include "ip.h"
+#include "tcp.h"
+#include "sock.h"
+#include "trace.h"
+
+#include "driver/loopback.h"
+#include "driver/ether_tap.h"
+#include "driver/shmem.h"
+
+#include "test/test.h"
+
+#define BENCH_PORT_TCP_BULK 9001
+#define BENCH_PORT_TCP_RR   9002
+#define BENCH_PORT_UDP_RR   9003
+#define BENCH_PORT_TCP_CRR  9004
+#define BENCH_PORT_UDP_PPS  9005
+
+#define BENCH_BULK_SIZE   65536
+#define BENCH_MSG_MAX     65507
+#define BENCH_BATCH       32
+#define BENCH_SAMPLES_MAX (4 * 1024 * 1024) /* NOTE: the ops beyond it are counted, but not sampled */
+#define BENCH_LOST_TIMEOUT 1000 /* ms */
+
+#define BENCH_UDP_PPS_DATA 'D'
+#define BENCH_UDP_PPS_END  'E'
+
+#define BENCH_ROLE_BOTH   0
+#define BENCH_ROLE_SERVER 1
+#define BENCH_ROLE_CLIENT 2
+
+struct bench_result {
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t elapsed; /* nsec */
+    uint64_t *samples; /* nsec, NULL if the test does not measure the latency */
+    size_t num;
+    int lossy; /* the test reports the sent and the lost ones */
+    uint64_t sent;
+    uint64_t lost;
+};
+
+struct bench_test {
+    const char *name;
+    uint16_t port;
+    int type;
+    void *(*server)(void *arg);
+    int (*client)(struct bench_test *test, struct bench_result *result);
+    int enabled;
+    struct sockaddr_in peer; /* the server of the test */
+    int soc;
+    pthread_t thread;
+    int done; /* the server thread has returned */
+};
+
+static volatile sig_atomic_t terminate;
+
+static int workers = 1;
+static int seconds = 5;
+static size_t msglen = 64;
+static long connections = 10000;
+static int role = BENCH_ROLE_BOTH;
+static const char *ifname;
+static const char *shmpath;
+static const char *ifaddr = ETHER_TAP_IP_ADDR;
+static const char *netmask = ETHER_TAP_NETMASK;
+static const char *peer;
+static const char *tracefile;
+static struct sockaddr_in local_addr = { .sin_family=AF_INET };
+static struct sockaddr_in peer_addr = { .sin_family=AF_INET };
+
+static void
+on_signal(int s)
+{
+    (void)s;
+    terminate = 1;
+    net_interrupt();
+}
+
+static uint64_t
+now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_sample(struct bench_result *result, uint64_t nsec)
+{
+    if (!result->samples) {
+        result->samples = malloc(sizeof(*result->samples) * BENCH_SAMPLES_MAX);
+        if (!result->samples) {
+            errorf("malloc() failure");
+            return -1;
+        }
+    }
+    if (result->num < BENCH_SAMPLES_MAX) {
+        result->samples[result->num++] = nsec;
+    }
+    return 0;
+}
+
+static int
+bench_sample_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* NOTE: nearest-rank percentile of the sorted samples, in usec */
+static double
+bench_percentile(const struct bench_result *result, double p)
+{
+    size_t rank;
+
+    rank = (size_t)(p * result->num + 0.999999);
+    if (rank) {
+        rank--;
+    }
+    return result->samples[MIN(rank, result->num - 1)] / 1000.0;
+}
+
+static void
+bench_report(const struct bench_test *test, struct bench_result *result)
+{
+    double sec;
+
+    sec = result->elapsed / 1e9;
+    printf("{\"test\":\"%s\",\"device\":\"%s\",\"workers\":%d,\"msglen\":%zu,\"seconds\":%.3f,\"ops\":%" PRIu64 ",\"ops_per_sec\":%.1f,\"mbps\":%.3f",
+        test->name, ifname ? ifname : (shmpath ? "shmem" : "loopback"), workers, test->port == BENCH_PORT_TCP_BULK ? BENCH_BULK_SIZE : msglen,
+        sec, result->ops, sec ? result->ops / sec : 0.0, sec ? result->bytes * 8 / sec / 1e6 : 0.0);
+    if (result->num) {
+        qsort(result->samples, result->num, sizeof(*result->samples), bench_sample_cmp);
+        printf(",\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f",
+            bench_percentile(result, 0.5), bench_percentile(result, 0.99), bench_percentile(result, 0.999));
+    }
+    if (result->lossy) {
+        printf(",\"sent\":%" PRIu64 ",\"lost\":%" PRIu64, result->sent, result->lost);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+/* NOTE: the histograms count since the start, the test takes the difference */
+static void
+bench_trace_report(const struct bench_test *test, uint64_t before[TRACE_STAGE_NUM][HISTOGRAM_BUCKETS])
+{
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    int stage, i;
+
+    for (stage = 0; stage < TRACE_STAGE_NUM; stage++) {
+        histogram_snapshot(trace_histogram(stage), buckets);
+        for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            buckets[i] -= before[stage][i];
+        }
+        if (!histogram_count(buckets)) {
+            continue;
+        }
+        printf("{\"test\":\"%s\",\"stage\":\"%s\",\"count\":%" PRIu64 ",\"p50_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64 ",\"p999_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}\n",
+            test->name, trace_stage_name(stage), histogram_count(buckets), histogram_percentile(buckets, 0.5),
+            histogram_percentile(buckets, 0.99), histogram_percentile(buckets, 0.999), histogram_percentile(buckets, 1.0));
+    }
+    fflush(stdout);
+}
+
+static int
+bench_recv_all(int soc, uint8_t *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = sock_recv(soc, buf + done, len - done);
+        if (ret <= 0) {
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static int
+bench_connect(struct bench_test *test, int nodelay)
+{
+    int soc, on = 1;
+
+    soc = sock_open(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (soc == -1) {
+        errorf("sock_open() failure");
+        return -1;
+    }
+    if (nodelay && sock_setsockopt(soc, SOL_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) {
+        errorf("sock_setsockopt() failure");
+        sock_close(soc);
+        return -1;
+    }
+    if (sock_connect(soc, (struct sockaddr *)&test->peer, sizeof(test->peer)) == -1) {
+        errorf("sock_connect() failure");
+        sock_close(soc);
+        return -1;
+    }
+    return soc;
+}
+
+/*
+ * Servers
+ */
+
+static void *
+tcp_bulk_server(void *arg)
+{
+    struct bench_test *test = arg;
+    int acc;
+    static uint8_t buf[BENCH_BULK_SIZE];
+
+    while (!terminate) {
+        acc = sock_accept(test->soc, NULL, NULL);
+        if (acc == -1) {
+            continue;
+        }
+        while (!terminate && sock_recv(acc, buf, sizeof(buf)) > 0);
+        sock_close(acc);
+    }
+    return NULL;
+}
+
+static void *
+tcp_rr_server(void *arg)
+{
+    struct bench_test *test = arg;
+    int acc, on = 1;
+    ssize_t ret;
+    static uint8_t buf[BENCH_MSG_MAX];
+
+    while (!terminate) {
+        acc = sock_accept(test->soc, NULL, NULL);
+        if (acc == -1) {
+            continue;
+        }
+        sock_setsockopt(acc, SOL_TCP, TCP_NODELAY, &on, sizeof(on));
+        while (!terminate) {
+            ret = sock_recv(acc, buf, sizeof(buf));
+            if (ret <= 0 || sock_send(acc, buf, ret) != ret) {
+                break;
+            }
+        }
+        sock_close(acc);
+    }
+    return NULL;
+}
+
+static void *
+tcp_crr_server(void *arg)
+{
+    struct bench_test *test = arg;
+    int acc;
+    uint8_t buf[64];
+
+    while (!terminate) {
+        acc = sock_accept(test->soc, NULL, NULL);
+        if (acc == -1) {
+            continue;
+        }
+        if (sock_recv(acc, buf, 1) == 1 && sock_send(acc, buf, 1) == 1) {
+            /* NOTE: wait for the FIN, the client closes first and keeps the TIME-WAIT */
+            while (!terminate && sock_recv(acc, buf, sizeof(buf)) > 0);
+        }
+        sock_close(acc);
+    }
+    return NULL;
+}
+
+static void *
+udp_rr_server(void *arg)
+{
+    struct bench_test *test = arg;
+    struct sockaddr_in foreign;
+    int foreignlen;
+    ssize_t ret;
+    static uint8_t buf[BENCH_MSG_MAX];
+
+    while (!terminate) {
+        foreignlen = sizeof(foreign);
+        ret = sock_recvfrom(test->soc, buf, sizeof(buf), (struct sockaddr *)&foreign, &foreignlen);
+        if (ret == -1) {
+            continue;
+        }
+        sock_sendto(test->soc, buf, ret, (struct sockaddr *)&foreign, foreignlen);
+    }
+    return NULL;
+}
+
+static void *
+udp_pps_server(void *arg)
+{
+    struct bench_test *test = arg;
+    static uint8_t bufs[BENCH_BATCH][BENCH_MSG_MAX];
+    struct mmsghdr msgs[BENCH_BATCH];
+    struct sockaddr_in foreign;
+    uint64_t received = 0;
+    int i, n;
+
+    while (!terminate) {
+        for (i = 0; i < BENCH_BATCH; i++) {
+            msgs[i].msg_buf = bufs[i];
+            msgs[i].msg_size = sizeof(bufs[i]);
+            msgs[i].msg_name = (struct sockaddr *)&foreign;
+            msgs[i].msg_namelen = sizeof(foreign);
+        }
+        n = sock_recvmmsg(test->soc, msgs, BENCH_BATCH);
+        if (n == -1) {
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            if (msgs[i].msg_len && bufs[i][0] == BENCH_UDP_PPS_END) {
+                /* NOTE: the datagrams of a flow are queued in order, all the data ones are counted */
+                sock_sendto(test->soc, &received, sizeof(received), msgs[i].msg_name, msgs[i].msg_namelen);
+                received = 0;
+                continue;
+            }
+            received++;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Clients
+ */
+
+static int
+tcp_bulk_client(struct bench_test *test, struct bench_result *result)
+{
+    int soc, infolen;
+    ssize_t ret;
+    struct tcp_info info;
+    uint64_t start, deadline;
+    static uint8_t buf[BENCH_BULK_SIZE];
+
+    soc = bench_connect(test, 0);
+    if (soc == -1) {
+        return -1;
+    }
+    memset(buf, 0x5a, sizeof(buf));
+    start = now_nsec();
+    deadline = start + (uint64_t)seconds * 1000000000;
+    while (!terminate && now_nsec() < deadline) {
+        ret = sock_send(soc, buf, sizeof(buf));
+        if (ret <= 0) {
+            errorf("sock_send() failure");
+            break;
+        }
+        result->ops++;
+    }
+    result->elapsed = now_nsec() - start;
+    /* NOTE: the bytes the receiver has acknowledged, not the ones still sitting in the send buffer */
+    infolen = sizeof(info);
+    if (sock_getsockopt(soc, SOL_TCP, TCP_INFO, &info, &infolen) == -1) {
+        errorf("sock_getsockopt() failure");
+        sock_close(soc);
+        return -1;
+    }
+    result->bytes = info.bytes_acked;
+    sock_close(soc);
+    return 0;
+}
+
+static int
+tcp_rr_client(struct bench_test *test, struct bench_result *result)
+{
+    int soc, ret = 0;
+    uint64_t start, deadline, t;
+    static uint8_t buf[BENCH_MSG_MAX];
+
+    soc = bench_connect(test, 1);
+    if (soc == -1) {
+        return -1;
+    }
+    memset(buf, 0x5a, msglen);
+    start = now_nsec();
+    deadline = start + (uint64_t)seconds * 1000000000;
+    for (t = start; !terminate && t < deadline; ) {
+        if (sock_send(soc, buf, msglen) != (ssize_t)msglen || bench_recv_all(soc, buf, msglen) == -1) {
+            errorf("request/response failure");
+            ret = -1;
+            break;
+        }
+        result->ops++;
+        result->bytes += msglen * 2;
+        bench_sample(result, now_nsec() - t);
+        t = now_nsec();
+    }
+    result->elapsed = now_nsec() - start;
+    sock_close(soc);
+    return ret;
+}
+
+static int
+tcp_crr_client(struct bench_test *test, struct bench_result *result)
+{
+    int soc, ret = 0;
+    uint64_t start, deadline, t;
+    uint8_t c = 0x5a;
+
+    start = now_nsec();
+    deadline = start + (uint64_t)seconds * 1000000000;
+    /* NOTE: every connection leaves a TIME-WAIT PCB and takes an ephemeral port for a while */
+    for (t = start; !terminate && t < deadline && result->ops < (uint64_t)connections; ) {
+        soc = bench_connect(test, 0);
+        if (soc == -1) {
+            ret = -1;
+            break;
+        }
+        if (sock_send(soc, &c, 1) != 1 || bench_recv_all(soc, &c, 1) == -1) {
+            errorf("request/response failure");
+            sock_close(soc);
+            ret = -1;
+            break;
+        }
+        sock_close(soc);
+        result->ops++;
+        result->bytes += 2;
+        bench_sample(result, now_nsec() - t);
+        t = now_nsec();
+    }
+    result->elapsed = now_nsec() - start;
+    return ret;
+}
+
+static int
+bench_udp_open(void)
+{
+    int soc;
+
+    soc = sock_open(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (soc == -1) {
+        errorf("sock_open() failure");
+        return -1;
+    }
+    return soc;
+}
+
+/* NOTE: wait for a datagram up to BENCH_LOST_TIMEOUT, 0 on timeout */
+static ssize_t
+bench_udp_recv(int soc, void *buf, size_t size)
+{
+    struct pollfd pfd = { .fd=soc, .events=POLLIN };
+    struct sockaddr_in foreign;
+    int foreignlen = sizeof(foreign);
+    int ret;
+
+    ret = sock_poll(&pfd, 1, BENCH_LOST_TIMEOUT);
+    if (ret <= 0) {
+        return ret;
+    }
+    return sock_recvfrom(soc, buf, size, (struct sockaddr *)&foreign, &foreignlen);
+}
+
+/* NOTE: an exchange before the clock starts, e.g. the first datagram may be lost while resolving the address */
+static int
+bench_udp_warmup(int soc, struct bench_test *test, const void *req, size_t len)
+{
+    static uint8_t buf[BENCH_MSG_MAX];
+    int retry;
+
+    for (retry = 0; retry < 3; retry++) {
+        sock_sendto(soc, req, len, (struct sockaddr *)&test->peer, sizeof(test->peer));
+        if (bench_udp_recv(soc, buf, sizeof(buf)) > 0) {
+            return 0;
+        }
+    }
+    errorf("no response from the server");
+    return -1;
+}
+
+static int
+udp_rr_client(struct bench_test *test, struct bench_result *result)
+{
+    int soc;
+    uint32_t seq, got;
+    ssize_t ret;
+    uint64_t start, deadline, t;
+    static uint8_t buf[BENCH_MSG_MAX];
+
+    soc = bench_udp_open();
+    if (soc == -1) {
+        return -1;
+    }
+    memset(buf, 0xff, msglen);
+    if (bench_udp_warmup(soc, test, buf, msglen) == -1) {
+        sock_close(soc);
+        return -1;
+    }
+    result->lossy = 1;
+    start = now_nsec();
+    deadline = start + (uint64_t)seconds * 1000000000;
+    for (seq = 0, t = start; !terminate && t < deadline; seq++) {
+        memcpy(buf, &seq, sizeof(seq));
+        if (sock_sendto(soc, buf, msglen, (struct sockaddr *)&test->peer, sizeof(test->peer)) != (ssize_t)msglen) {
+            errorf("sock_sendto() failure");
+            break;
+        }
+        result->sent++;
+        /* NOTE: a late response of a request already counted as lost is skipped */
+        do {
+            ret = bench_udp_recv(soc, buf, sizeof(buf));
+            memcpy(&got, buf, sizeof(got));
+        } while (ret > 0 && got != seq);
+        if (ret <= 0) {
+            result->lost++;
+        } else {
+            result->ops++;
+            result->bytes += msglen * 2;
+            bench_sample(result, now_nsec() - t);
+        }
+        t = now_nsec();
+    }
+    result->elapsed = now_nsec() - start;
+    sock_close(soc);
+    return 0;
+}
+
+static int
+udp_pps_client(struct bench_test *test, struct bench_result *result)
+{
+    int soc, i, n, retry;
+    ssize_t ret;
+    uint64_t start, deadline, received = 0;
+    static uint8_t buf[BENCH_MSG_MAX];
+    struct mmsghdr msgs[BENCH_BATCH];
+    uint8_t end = BENCH_UDP_PPS_END;
+
+    soc = bench_udp_open();
+    if (soc == -1) {
+        return -1;
+    }
+    /* NOTE: the report of the server resets its count as well */
+    if (bench_udp_warmup(soc, test, &end, sizeof(end)) == -1) {
+        sock_close(soc);
+        return -1;
+    }
+    memset(buf, BENCH_UDP_PPS_DATA, msglen);
+    for (i = 0; i < BENCH_BATCH; i++) {
+        msgs[i].msg_buf = buf;
+        msgs[i].msg_size = msglen;
+        msgs[i].msg_name = (struct sockaddr *)&test->peer;
+        msgs[i].msg_namelen = sizeof(test->peer);
+    }
+    result->lossy = 1;
+    start = now_nsec();
+    deadline = start + (uint64_t)seconds * 1000000000;
+    while (!terminate && now_nsec() < deadline) {
+        n = sock_sendmmsg(soc, msgs, BENCH_BATCH);
+        if (n == -1) {
+            errorf("sock_sendmmsg() failure");
+            break;
+        }
+        result->sent += n;
+    }
+    result->elapsed = now_nsec() - start;
+    for (retry = 0; retry < 3; retry++) {
+        sock_sendto(soc, &end, sizeof(end), (struct sockaddr *)&test->peer, sizeof(test->peer));
+        ret = bench_udp_recv(soc, &received, sizeof(received));
+        if (ret == sizeof(received)) {
+            break;
+        }
+    }
+    if (retry == 3) {
+        errorf("no report from the server");
+        sock_close(soc);
+        return -1;
+    }
+    /* NOTE: the rate at the receiver, the ones dropped on the way are reported as lost */
+    result->ops = received;
+    result->bytes = received * msglen;
+    result->lost = result->sent - MIN(received, result->sent);
+    sock_close(soc);
+    return 0;
+}
+
+static struct bench_test tests[] = {
+    { .name="tcp_bulk", .port=BENCH_PORT_TCP_BULK, .type=SOCK_STREAM, .server=tcp_bulk_server, .client=tcp_bulk_client },
+    { .name="tcp_rr",   .port=BENCH_PORT_TCP_RR,   .type=SOCK_STREAM, .server=tcp_rr_server,   .client=tcp_rr_client   },
+    { .name="udp_rr",   .port=BENCH_PORT_UDP_RR,   .type=SOCK_DGRAM,  .server=udp_rr_server,   .client=udp_rr_client   },
+    { .name="tcp_crr",  .port=BENCH_PORT_TCP_CRR,  .type=SOCK_STREAM, .server=tcp_crr_server,  .client=tcp_crr_client  },
+    { .name="udp_pps",  .port=BENCH_PORT_UDP_PPS,  .type=SOCK_DGRAM,  .server=udp_pps_server,  .client=udp_pps_client  },
+};
+
+static void *
+bench_server(void *arg)
+{
+    struct bench_test *test = arg;
+
+    test->server(test);
+    __atomic_store_n(&test->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int
+bench_server_open(struct bench_test *test)
+{
+    struct sockaddr_in local = local_addr;
+
+    local.sin_port = hton16(test->port);
+    test->soc = sock_open(AF_INET, test->type, 0);
+    if (test->soc == -1) {
+        errorf("sock_open() failure");
+        return -1;
+    }
+    if (sock_bind(test->soc, (struct sockaddr *)&local, sizeof(local)) == -1) {
+        errorf("sock_bind() failure, port=%u", test->port);
+        return -1;
+    }
+    if (test->type == SOCK_STREAM && sock_listen(test->soc, 16) == -1) {
+        errorf("sock_listen() failure");
+        return -1;
+    }
+    if (pthread_create(&test->thread, NULL, bench_server, test) != 0) {
+        errorf("pthread_create() failure");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+setup(void)
+{
+    struct net_device *dev;
+    struct ip_iface *iface;
+    char hwaddr[ETHER_ADDR_STR_LEN];
+
+    signal(SIGINT, on_signal);
+    net_worker_setup(workers);
+    if (net_init() == -1) {
+        errorf("net_init() failure");
+        return -1;
+    }
+    if (shmpath) {
+        dev = shmem_init(shmpath);
+        if (!dev) {
+            errorf("shmem_init() failure");
+            return -1;
+        }
+        iface = ip_iface_alloc(ifaddr, netmask);
+    } else if (!ifname) {
+        dev = loopback_init();
+        if (!dev) {
+            errorf("loopback_init() failure");
+            return -1;
+        }
+        iface = ip_iface_alloc(LOOPBACK_IP_ADDR, LOOPBACK_NETMASK);
+    } else {
+        /* NOTE: the two ends of a TAP pair get distinct addresses, derive the MAC from the IP address */
+        snprintf(hwaddr, sizeof(hwaddr), "00:00:5e:00:53:%02x", ntoh32(local_addr.sin_addr) & 0xff);
+        dev = ether_tap_init(ifname, hwaddr);
+        if (!dev) {
+            errorf("ether_tap_init() failure");
+            return -1;
+        }
+        iface = ip_iface_alloc(ifaddr, netmask);
+    }
+    if (!iface) {
+        errorf("ip_iface_alloc() failure");
+        return -1;
+    }
+    if (ip_iface_register(dev, iface) == -1) {
+        errorf("ip_iface_register() failure");
+        return -1;
+    }
+    if (net_run() == -1) {
+        errorf("net_run() failure");
+        return -1;
+    }
+    return 0;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-w workers] [-t seconds] [-l msglen] [-n connections] [-T tracefile] [-v]\n", name);
+    fprintf(stderr, "       %*s [-i tap | -s path] [-a addr [-m netmask] -r server|client [-p peer]] [test...]\n", (int)strlen(name), "");
+    fprintf(stderr, "tests: tcp_bulk tcp_rr udp_rr tcp_crr udp_pps (all by default)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt, verbose = 0, ret = 0, stage;
+    size_t i;
+    struct bench_test *test;
+    struct bench_result result;
+    static uint64_t before[TRACE_STAGE_NUM][HISTOGRAM_BUCKETS];
+    FILE *fp;
+
+    /*
+     * Parse command line parameters
+     */
+    while ((opt = getopt(argc, argv, "w:t:l:n:T:vi:s:a:m:r:p:")) != -1) {
+        switch (opt) {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'l':
+            msglen = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            connections = strtol(optarg, NULL, 10);
+            break;
+        case 'T':
+            tracefile = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'i':
+            ifname = optarg;
+            break;
+        case 's':
+            shmpath = optarg;
+            break;
+        case 'a':
+            ifaddr = optarg;
+            break;
+        case 'm':
+            netmask = optarg;
+            break;
+        case 'r':
+            if (strcmp(optarg, "server") == 0) {
+                role = BENCH_ROLE_SERVER;
+            } else if (strcmp(optarg, "client") == 0) {
+                role = BENCH_ROLE_CLIENT;
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'p':
+            peer = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (workers < 1 || seconds < 1 || msglen < sizeof(uint32_t) || msglen > BENCH_MSG_MAX || connections < 1) {
+        usage(argv[0]);
+        return -1;
+    }
+    /* NOTE: a TAP pair (or a shmem device) needs two stacks, i.e. a server process and a client process */
+    if ((ifname && shmpath) || ((ifname || shmpath) && (role == BENCH_ROLE_BOTH || (role == BENCH_ROLE_CLIENT && !peer)))) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (ip_addr_pton((ifname || shmpath) ? ifaddr : LOOPBACK_IP_ADDR, &local_addr.sin_addr) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", ifaddr);
+        return -1;
+    }
+    if (ip_addr_pton(peer ? peer : LOOPBACK_IP_ADDR, &peer_addr.sin_addr) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", peer);
+        return -1;
+    }
+    for (i = 0; i < countof(tests); i++) {
+        tests[i].enabled = (optind == argc);
+        tests[i].peer = peer_addr;
+        tests[i].peer.sin_port = hton16(tests[i].port);
+    }
+    for (; optind < argc; optind++) {
+        for (i = 0; i < countof(tests); i++) {
+            if (strcmp(tests[i].name, argv[optind]) == 0) {
+                tests[i].enabled = 1;
+                break;
+            }
+        }
+        if (i == countof(tests)) {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (!verbose) {
+        log_set_level(LOG_LEVEL_WARN);
+    }
+    /*
+     * Setup protocol stack
+     */
+    if (setup() == -1) {
+        errorf("setup() failure");
+        return -1;
+    }
+    /*
+     * Benchmark Code
+     */
+    if (tracefile && trace_start() == -1) {
+        errorf("trace_start() failure");
+        return -1;
+    }
+    if (role != BENCH_ROLE_CLIENT) {
+        for (i = 0; i < countof(tests); i++) {
+            if (tests[i].enabled && bench_server_open(&tests[i]) == -1) {
+                tests[i].enabled = 0;
+                ret = -1;
+            }
+        }
+    }
+    if (role == BENCH_ROLE_SERVER) {
+        while (!terminate) {
+            pause();
+        }
+    }
+    if (role != BENCH_ROLE_SERVER) {
+        for (i = 0; i < countof(tests) && !terminate; i++) {
+            test = &tests[i];
+            if (!test->enabled) {
+                continue;
+            }
+            memset(&result, 0, sizeof(result));
+            for (stage = 0; tracefile && stage < TRACE_STAGE_NUM; stage++) {
+                histogram_snapshot(trace_histogram(stage), before[stage]);
+            }
+            if (test->client(test, &result) == -1) {
+                errorf("%s failure", test->name);
+                ret = -1;
+            }
+            bench_report(test, &result);
+            if (tracefile) {
+                bench_trace_report(test, before);
+            }
+            free(result.samples);
+        }
+    }
+    if (tracefile) {
+        /* NOTE: the latest TRACE_RING_SIZE events, i.e. the end of the last test (or of the server side) */
+        trace_stop();
+        fp = fopen(tracefile, "w");
+        if (!fp) {
+            errorf("fopen() failure, file=%s", tracefile);
+            ret = -1;
+        } else {
+            trace_dump(fp);
+            fclose(fp);
+        }
+    }
+    if (role != BENCH_ROLE_CLIENT) {
+        terminate = 1;
+        for (i = 0; i < countof(tests); i++) {
+            if (tests[i].enabled) {
+                /* NOTE: a server may not be asleep yet when interrupted, poke it until it returns */
+                while (!__atomic_load_n(&tests[i].done, __ATOMIC_ACQUIRE)) {
+                    net_interrupt();
+                    usleep(10000);
+                }
+                pthread_join(tests[i].thread, NULL);
+                sock_close(tests[i].soc);
+            }
+        }
+    }
+    /*
+     * Cleanup protocol stack
+     */
+    net_shutdown();
+    return ret;
+}
@@ -3,7 +3,9 @@
 
 #include "net.h"
 
+#define ETHER_PCAP_FLAG_MMAP 0x0001 /* use PACKET_MMAP (TPACKET_V3) RX/TX rings instead of recvmmsg/sendmmsg */
+
 extern struct net_device *
-ether_pcap_init(const char *name, const char *addr);
+ether_pcap_init(const char *name, const char *addr, int flags);
 
 #endif
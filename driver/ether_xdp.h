@@ -0,0 +1,13 @@
+#ifndef ETHER_XDP_H
+#define ETHER_XDP_H
+
+#include "net.h"
+
+#define ETHER_XDP_FLAG_ZEROCOPY  0x0001 /* bind with XDP_ZEROCOPY (requires driver support), XDP_COPY otherwise */
+#define ETHER_XDP_FLAG_SKB_MODE  0x0002 /* attach the XDP program in generic (SKB) mode */
+#define ETHER_XDP_FLAG_BUSY_POLL 0x0004 /* prefer busy polling the NIC queue over interrupts */
+
+extern struct net_device *
+ether_xdp_init(const char *name, const char *addr, unsigned int queue, int flags);
+
+#endif
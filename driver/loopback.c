@@ -3,17 +3,18 @@
 
 #include "util.h"
 #include "net.h"
+#include "pbuf.h"
 
 #include "loopback.h"
 
 #define LOOPBACK_MTU UINT16_MAX /* maximum size of IP datagram */
 
 static int
-loopback_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+loopback_transmit(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
-    debugdump(data, len);
-    net_input_handler(type, data, len, dev);
+    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, pb->len);
+    debugdump(pb->data, pb->len);
+    net_input_handler(type, pb, dev); /* hand over the buffer itself, no copy */
     return 0;
 }
 
@@ -29,6 +30,8 @@ loopback_setup(struct net_device *dev)
     dev->hlen = 0; /* non header */
     dev->alen = 0; /* non address */
     dev->flags = NET_DEVICE_FLAG_LOOPBACK;
+    /* NOTE: nothing can corrupt it, neither the IP header nor the transport checksum is ever summed */
+    dev->features = NET_DEVICE_FEATURE_RXCSUM | NET_DEVICE_FEATURE_TXCSUM | NET_DEVICE_FEATURE_IPCSUM;
     dev->ops = &loopback_ops;
 }
 
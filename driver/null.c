@@ -3,14 +3,15 @@
 
 #include "util.h"
 #include "net.h"
+#include "pbuf.h"
 
 #define NULL_MTU UINT16_MAX /* maximum size of IP datagram */
 
 static int
-null_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+null_transmit(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
-    debugdump(data, len);
+    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, pb->len);
+    debugdump(pb->data, pb->len);
     /* drop data */
     return 0;
 }
@@ -0,0 +1,9 @@
+#ifndef SHMEM_H
+#define SHMEM_H
+
+#include "net.h"
+
+extern struct net_device *
+shmem_init(const char *path);
+
+#endif
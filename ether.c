@@ -6,8 +6,11 @@
 
 #include "util.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ether.h"
 
+#define ETHER_RX_HEADROOM 2 /* keep the network layer header 4-byte aligned */
+
 struct ether_hdr {
     uint8_t dst[ETHER_ADDR_LEN];
     uint8_t src[ETHER_ADDR_LEN];
@@ -71,6 +74,10 @@ ether_dump(const uint8_t *frame, size_t flen)
     struct ether_hdr *hdr;
     char addr[ETHER_ADDR_STR_LEN];
 
+    if (!LOG_ENABLED(LOG_LEVEL_DEBUG)) {
+        return;
+    }
+
     hdr = (struct ether_hdr *)frame;
     flockfile(stderr);
     fprintf(stderr, "        src: %s\n", ether_addr_ntop(hdr->src, addr, sizeof(addr)));
@@ -83,50 +90,98 @@ ether_dump(const uint8_t *frame, size_t flen)
 }
 
 int
-ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, ssize_t (*callback)(struct net_device *dev, const uint8_t *data, size_t len))
+ether_transmit_helper(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX] = {};
-    struct ether_hdr *hdr;
-    size_t flen, pad = 0;
+    struct ether_hdr hdr;
+    size_t pad = 0;
 
-    hdr = (struct ether_hdr *)frame;
-    memcpy(hdr->dst, dst, ETHER_ADDR_LEN);
-    memcpy(hdr->src, dev->addr, ETHER_ADDR_LEN);
-    hdr->type = hton16(type);
-    memcpy(hdr + 1, data, len);
-    if (len < ETHER_PAYLOAD_SIZE_MIN) {
-        pad = ETHER_PAYLOAD_SIZE_MIN - len;
+    if (pb->len < ETHER_PAYLOAD_SIZE_MIN) {
+        pad = ETHER_PAYLOAD_SIZE_MIN - pb->len;
     }
-    flen = sizeof(*hdr) + len + pad;
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
-    ether_dump(frame, flen);
-    return callback(dev, frame, flen) == (ssize_t)flen ? 0 : -1;
+    memcpy(hdr.dst, dst, ETHER_ADDR_LEN);
+    memcpy(hdr.src, dev->addr, ETHER_ADDR_LEN);
+    hdr.type = hton16(type);
+    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr.type), type, sizeof(hdr) + pb->len + pad);
+    ether_dump((uint8_t *)&hdr, sizeof(hdr));
+    /* NOTE: the header and the padding are sent apart from the payload, pb is left untouched */
+    return net_device_xmit(dev, &hdr, sizeof(hdr), pb, pad);
 }
 
+/*
+ * NOTE: Filter and parse the received frames in pbs[] (each trimmed to the frame length).
+ *       The frames for this host are moved to the front, with the ether header pulled and
+ *       pb->type set, and their number is returned. The others are left behind them.
+ */
 int
-ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size))
+ether_input_helper(struct net_device *dev, struct pbuf **pbs, int n)
 {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX];
-    ssize_t flen;
+    struct pbuf *pb;
     struct ether_hdr *hdr;
-    uint16_t type;
+    int i, num = 0;
 
-    flen = callback(dev, frame, sizeof(frame));
-    if (flen < (ssize_t)sizeof(*hdr)) {
-        errorf("input data is too short");
+    for (i = 0; i < n; i++) {
+        pb = pbs[i];
+        if (pb->len < sizeof(*hdr)) {
+            errorf("input data is too short");
+            continue;
+        }
+        hdr = (struct ether_hdr *)pb->data;
+        if (memcmp(dev->addr, hdr->dst, ETHER_ADDR_LEN) != 0) {
+            if (memcmp(ETHER_ADDR_BROADCAST, hdr->dst, ETHER_ADDR_LEN) != 0) {
+                /* for other host */
+                continue;
+            }
+        }
+        pb->type = ntoh16(hdr->type);
+        debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), pb->type, pb->len);
+        ether_dump(pb->data, pb->len);
+        pbuf_pull(pb, sizeof(*hdr));
+        pbs[i] = pbs[num];
+        pbs[num++] = pb;
+    }
+    return num;
+}
+
+/*
+ * NOTE: The callback fills up to n frames into pbs[] (trimmed to the frame length) and
+ *       returns the number of frames, 0 if there is nothing to read, -1 on error.
+ *       This returns the number of frames for this host, with the ether header pulled.
+ */
+int
+ether_poll_helper(struct net_device *dev, struct pbuf **pbs, int max, int (*callback)(struct net_device *dev, struct pbuf **pbs, int n))
+{
+    int n, i, num;
+
+    for (n = 0; n < max; n++) {
+        pbs[n] = pbuf_alloc(ETHER_RX_HEADROOM, ETHER_FRAME_SIZE_MAX);
+        if (!pbs[n]) {
+            errorf("pbuf_alloc() failure");
+            break;
+        }
+    }
+    if (!n) {
         return -1;
     }
-    hdr = (struct ether_hdr *)frame;
-    if (memcmp(dev->addr, hdr->dst, ETHER_ADDR_LEN) != 0) {
-        if (memcmp(ETHER_ADDR_BROADCAST, hdr->dst, ETHER_ADDR_LEN) != 0) {
-            /* for other host */
-            return -1;
+    max = n;
+    while (1) {
+        n = callback(dev, pbs, max);
+        if (n <= 0) {
+            break;
+        }
+        num = ether_input_helper(dev, pbs, n);
+        if (num) {
+            n = num;
+            break;
         }
+        /* every frame was for other hosts, reset them and read again */
+        for (i = 0; i < max; i++) {
+            pbuf_reset(pbs[i], ETHER_RX_HEADROOM, ETHER_FRAME_SIZE_MAX);
+        }
+    }
+    for (i = MAX(n, 0); i < max; i++) {
+        pbuf_free(pbs[i]);
     }
-    type = ntoh16(hdr->type);
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
-    ether_dump(frame, flen);
-    return net_input_handler(type, (uint8_t *)(hdr + 1), flen - sizeof(*hdr), dev);
+    return n;
 }
 
 void
@@ -31,9 +31,11 @@ extern char *
 ether_addr_ntop(const uint8_t *n, char *p, size_t size);
 
 extern int
-ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst, ssize_t (*callback)(struct net_device *dev, const uint8_t *buf, size_t len));
+ether_transmit_helper(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst);
 extern int
-ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size));
+ether_input_helper(struct net_device *dev, struct pbuf **pbs, int n);
+extern int
+ether_poll_helper(struct net_device *dev, struct pbuf **pbs, int max, int (*callback)(struct net_device *dev, struct pbuf **pbs, int n));
 extern void
 ether_setup_helper(struct net_device *net_device);
 
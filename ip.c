@@ -2,29 +2,64 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
 
 #include "platform.h"
 
 #include "util.h"
 #include "net.h"
+#include "pbuf.h"
 #include "arp.h"
 #include "ip.h"
+#include "icmp.h"
+#include "trace.h"
 
 struct ip_protocol {
     struct ip_protocol *next;
     char name[16];
     uint8_t type;
-    void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface);
+    void (*handler)(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface);
+    int (*gro)(const struct pbuf *head, const struct pbuf *pb, size_t hlen, ip_addr_t src, ip_addr_t dst);
 };
 
 struct ip_route {
-    struct ip_route *next;
     ip_addr_t network;
     ip_addr_t netmask;
     ip_addr_t nexthop;
     struct ip_iface *iface;
 };
 
+#define IP_FLAG_DF     0x4000
+#define IP_FLAG_MF     0x2000
+#define IP_OFFSET_MASK 0x1fff
+
+#define IP_GRO_FLOWS 8 /* flows coalesced at once in a batch */
+
+#define IP_REASS_MAX     32 /* datagrams being reassembled at once */
+#define IP_REASS_MEM_MAX (1024 * 1024) /* bytes held by the fragments of all of them */
+#define IP_REASS_TIMEOUT 30000000 /* usec */
+
+struct ip_frag {
+    struct list_head entry;
+    struct pbuf *pb; /* the payload of the fragment */
+    size_t offset;
+};
+
+struct ip_reass {
+    int used;
+    ip_addr_t src;
+    ip_addr_t dst;
+    uint16_t id; /* network byte order */
+    uint8_t protocol;
+    uint8_t hdr[IP_HDR_SIZE_MAX]; /* of the first fragment */
+    uint16_t hlen; /* 0 until the first fragment arrives */
+    size_t total; /* payload length, 0 until the last fragment arrives */
+    size_t mem;
+    uint64_t expire;
+    struct list_head frags; /* sorted by offset */
+    struct net_timeout timer;
+};
+
 struct ip_hdr {
     uint8_t vhl;
     uint8_t tos;
@@ -45,7 +80,16 @@ const ip_addr_t IP_ADDR_BROADCAST = 0xffffffff; /* 255.255.255.255 */
 /* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
 static struct ip_iface *ifaces;
 static struct ip_protocol *protocols;
-static struct ip_route *routes;
+
+static mutex_t reass_mutex = MUTEX_INITIALIZER;
+static struct ip_reass reass_table[IP_REASS_MAX];
+static size_t reass_mem;
+
+static struct counters stats;
+static const char * const stats_names[IP_STATS_NUM] = {
+    "in_receives", "in_hdr_errors", "in_csum_errors", "in_addr_errors", "in_unknown_protos", "in_delivers",
+    "reasm_reqds", "reasm_oks", "reasm_fails", "out_requests", "out_no_routes", "out_discards", "frag_creates"
+};
 
 int
 ip_addr_pton(const char *p, ip_addr_t *n)
@@ -124,6 +168,10 @@ ip_dump(const uint8_t *data, size_t len)
     uint16_t total, offset;
     char addr[IP_ADDR_STR_LEN];
 
+    if (!LOG_ENABLED(LOG_LEVEL_DEBUG)) {
+        return;
+    }
+
     flockfile(stderr);
     hdr = (struct ip_hdr *)data;
     v = (hdr->vhl & 0xf0) >> 4;
@@ -147,79 +195,457 @@ ip_dump(const uint8_t *data, size_t len)
     funlockfile(stderr);
 }
 
-/* NOTE: must not be call after net_run() */
-static struct ip_route *
-ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface)
+/*
+ * IP Routing Table
+ *
+ * NOTE: The routes live in a path-compressed binary trie keyed by the prefix (host byte order).
+ *       The trie is never modified in place: an update copies the nodes on the path to the
+ *       changed prefix and publishes the new root, so a lookup runs without a lock. The nodes
+ *       replaced are freed once the lookups of the epoch before the root was published are over,
+ *       the ones entering after that are counted on the other side of routes_readers[].
+ */
+
+struct ip_route_node {
+    struct ip_route_node *child[2];
+    struct ip_route_node *next; /* fresh/retired list during an update */
+    uint32_t prefix; /* host byte order */
+    uint8_t plen;
+    struct ip_route *route; /* NULL for a branch node */
+};
+
+struct ip_route_update {
+    struct ip_route_node *fresh; /* allocated for the new version */
+    struct ip_route_node *retired; /* replaced in the new version */
+};
+
+#define IP_ROUTE_MASK(plen) ((plen) ? 0xffffffff << (32 - (plen)) : 0)
+#define IP_ROUTE_BIT(addr, pos) (((addr) >> (31 - (pos))) & 1)
+
+static mutex_t routes_mutex = MUTEX_INITIALIZER; /* serializes the updates */
+static struct ip_route_node *routes;
+static unsigned int routes_readers[2]; /* the lookups running, by the parity of the epoch they entered in */
+static unsigned int routes_epoch;
+static unsigned int routes_gen = 1; /* bumped after every update, see struct ip_route_cache */
+
+/* NOTE: a per-thread cache of the lookup results, valid while the generation matches */
+#define IP_ROUTE_CACHE_SIZE 64 /* power of two */
+
+struct ip_route_cache {
+    unsigned int gen;
+    ip_addr_t dst;
+    struct ip_route route;
+};
+
+static __thread struct ip_route_cache route_cache[IP_ROUTE_CACHE_SIZE];
+
+static uint32_t
+ip_route_hash(uint32_t h)
+{
+    /* MurmurHash3 finalizer */
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static int
+ip_route_plen(ip_addr_t netmask)
+{
+    uint32_t mask;
+    int plen = 0;
+
+    mask = ntoh32(netmask);
+    while (mask & 0x80000000) {
+        mask <<= 1;
+        plen++;
+    }
+    return mask ? -1 : plen; /* NOTE: non-contiguous */
+}
+
+static struct ip_route_node *
+ip_route_node_alloc(struct ip_route_update *update, uint32_t prefix, uint8_t plen, struct ip_route *route)
+{
+    struct ip_route_node *node;
+
+    node = memory_alloc(sizeof(*node));
+    if (!node) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    node->prefix = prefix & IP_ROUTE_MASK(plen);
+    node->plen = plen;
+    node->route = route;
+    node->next = update->fresh;
+    update->fresh = node;
+    return node;
+}
+
+/* NOTE: a private copy of the node for the new version, the original is retired */
+static struct ip_route_node *
+ip_route_node_copy(struct ip_route_update *update, struct ip_route_node *node)
+{
+    struct ip_route_node *copy;
+
+    copy = ip_route_node_alloc(update, node->prefix, node->plen, node->route);
+    if (!copy) {
+        return NULL;
+    }
+    copy->child[0] = node->child[0];
+    copy->child[1] = node->child[1];
+    node->next = update->retired;
+    update->retired = node;
+    return copy;
+}
+
+/* NOTE: returns the new root of the subtree, *err is set if the route exists (or no memory) */
+static struct ip_route_node *
+ip_route_node_insert(struct ip_route_update *update, struct ip_route_node *node, uint32_t prefix, uint8_t plen, struct ip_route *route, int *err)
+{
+    struct ip_route_node *copy, *leaf, *branch, *child;
+    uint8_t common;
+    uint32_t diff;
+
+    if (!node) {
+        leaf = ip_route_node_alloc(update, prefix, plen, route);
+        if (!leaf) {
+            *err = -1;
+        }
+        return leaf;
+    }
+    diff = (prefix ^ node->prefix) & IP_ROUTE_MASK(MIN(plen, node->plen));
+    common = diff ? __builtin_clz(diff) : MIN(plen, node->plen);
+    if (common == node->plen) {
+        if (plen == node->plen) {
+            if (node->route) {
+                *err = -1;
+                return NULL;
+            }
+            copy = ip_route_node_copy(update, node);
+            if (!copy) {
+                *err = -1;
+                return NULL;
+            }
+            copy->route = route;
+            return copy;
+        }
+        child = ip_route_node_insert(update, node->child[IP_ROUTE_BIT(prefix, node->plen)], prefix, plen, route, err);
+        if (!child) {
+            return NULL;
+        }
+        copy = ip_route_node_copy(update, node);
+        if (!copy) {
+            *err = -1;
+            return NULL;
+        }
+        copy->child[IP_ROUTE_BIT(prefix, node->plen)] = child;
+        return copy;
+    }
+    /* NOTE: the existing subtree is shared as is, under the new route or a new branch */
+    leaf = ip_route_node_alloc(update, prefix, plen, route);
+    if (!leaf) {
+        *err = -1;
+        return NULL;
+    }
+    if (common == plen) {
+        leaf->child[IP_ROUTE_BIT(node->prefix, plen)] = node;
+        return leaf;
+    }
+    branch = ip_route_node_alloc(update, prefix, common, NULL);
+    if (!branch) {
+        *err = -1;
+        return NULL;
+    }
+    branch->child[IP_ROUTE_BIT(prefix, common)] = leaf;
+    branch->child[IP_ROUTE_BIT(node->prefix, common)] = node;
+    return branch;
+}
+
+/* NOTE: returns the new root of the subtree, *err is set if the route is not found */
+static struct ip_route_node *
+ip_route_node_delete(struct ip_route_update *update, struct ip_route_node *node, uint32_t prefix, uint8_t plen, struct ip_route **route, int *err)
+{
+    struct ip_route_node *copy, *child;
+    int bit;
+
+    if (!node || node->plen > plen || ((prefix ^ node->prefix) & IP_ROUTE_MASK(node->plen))) {
+        *err = -1;
+        return NULL;
+    }
+    if (node->plen == plen) {
+        if (!node->route) {
+            *err = -1;
+            return NULL;
+        }
+        *route = node->route;
+        copy = ip_route_node_copy(update, node);
+        if (!copy) {
+            *err = -1;
+            return NULL;
+        }
+        copy->route = NULL;
+    } else {
+        bit = IP_ROUTE_BIT(prefix, node->plen);
+        child = ip_route_node_delete(update, node->child[bit], prefix, plen, route, err);
+        if (*err) {
+            return NULL;
+        }
+        copy = ip_route_node_copy(update, node);
+        if (!copy) {
+            *err = -1;
+            return NULL;
+        }
+        copy->child[bit] = child;
+    }
+    if (copy->route || (copy->child[0] && copy->child[1])) {
+        return copy;
+    }
+    /* NOTE: a branch with a single child is not needed anymore (the copy is freed with the fresh ones unused) */
+    return copy->child[0] ? copy->child[0] : copy->child[1];
+}
+
+static int
+ip_route_node_reachable(struct ip_route_node *root, struct ip_route_node *node)
+{
+    while (root) {
+        if (root == node) {
+            return 1;
+        }
+        if (root->plen >= node->plen) {
+            return 0;
+        }
+        root = root->child[IP_ROUTE_BIT(node->prefix, root->plen)];
+    }
+    return 0;
+}
+
+/* NOTE: must be called after routes_mutex locked */
+static void
+ip_route_update_commit(struct ip_route_update *update, struct ip_route_node *root, struct ip_route *retired)
+{
+    struct ip_route_node *node;
+    unsigned int epoch;
+
+    /* NOTE: the fresh nodes collapsed by ip_route_node_delete() never made it into the new version */
+    while (update->fresh) {
+        node = update->fresh;
+        update->fresh = node->next;
+        if (!ip_route_node_reachable(root, node)) {
+            memory_free(node);
+        }
+    }
+    __atomic_store_n(&routes, root, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&routes_gen, 1, __ATOMIC_SEQ_CST);
+    /* NOTE: a lookup that may still see the old version has entered before the store above, in the old epoch */
+    epoch = __atomic_fetch_add(&routes_epoch, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&routes_readers[epoch & 1], __ATOMIC_SEQ_CST)) {
+        sched_yield(); /* a lookup is short, and the new ones do not keep this from draining */
+    }
+    while (update->retired) {
+        node = update->retired;
+        update->retired = node->next;
+        memory_free(node);
+    }
+    memory_free(retired);
+}
+
+static void
+ip_route_update_abort(struct ip_route_update *update)
+{
+    struct ip_route_node *node;
+
+    while (update->fresh) {
+        node = update->fresh;
+        update->fresh = node->next;
+        memory_free(node);
+    }
+    update->retired = NULL; /* NOTE: still in use by the current version */
+}
+
+static int
+ip_route_insert(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface)
 {
+    struct ip_route_update update = {};
     struct ip_route *route;
+    struct ip_route_node *root;
+    int plen, err = 0;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     char addr3[IP_ADDR_STR_LEN];
     char addr4[IP_ADDR_STR_LEN];
 
+    plen = ip_route_plen(netmask);
+    if (plen == -1 || (network & ~netmask)) {
+        errorf("invalid prefix, network=%s, netmask=%s",
+            ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
     route = memory_alloc(sizeof(*route));
     if (!route) {
         errorf("memory_alloc() failure");
-        return NULL;
+        return -1;
     }
     route->network = network;
     route->netmask = netmask;
     route->nexthop = nexthop;
     route->iface = iface;
-    route->next = routes;
-    routes = route;
+    mutex_lock(&routes_mutex);
+    root = ip_route_node_insert(&update, routes, ntoh32(network), plen, route, &err);
+    if (err) {
+        ip_route_update_abort(&update);
+        mutex_unlock(&routes_mutex);
+        errorf("already exists or no memory, network=%s, netmask=%s",
+            ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        memory_free(route);
+        return -1;
+    }
+    ip_route_update_commit(&update, root, NULL);
+    mutex_unlock(&routes_mutex);
     infof("network=%s, netmask=%s, nexthop=%s, iface=%s dev=%s",
-        ip_addr_ntop(route->network, addr1, sizeof(addr1)),
-        ip_addr_ntop(route->netmask, addr2, sizeof(addr2)),
-        ip_addr_ntop(route->nexthop, addr3, sizeof(addr3)),
-        ip_addr_ntop(route->iface->unicast, addr4, sizeof(addr4)),
+        ip_addr_ntop(network, addr1, sizeof(addr1)),
+        ip_addr_ntop(netmask, addr2, sizeof(addr2)),
+        ip_addr_ntop(nexthop, addr3, sizeof(addr3)),
+        ip_addr_ntop(iface->unicast, addr4, sizeof(addr4)),
         NET_IFACE(iface)->dev->name
     );
-    return route;
+    return 0;
 }
 
-static struct ip_route *
-ip_route_lookup(ip_addr_t dst)
+static int
+ip_route_remove(ip_addr_t network, ip_addr_t netmask)
 {
-    struct ip_route *route, *candidate = NULL;
+    struct ip_route_update update = {};
+    struct ip_route *route = NULL;
+    struct ip_route_node *root;
+    int plen, err = 0;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
 
-    for (route = routes; route; route = route->next) {
-        if ((dst & route->netmask) == route->network) {
-            if (!candidate || ntoh32(candidate->netmask) < ntoh32(route->netmask)) {
-                candidate = route;
-            }
+    plen = ip_route_plen(netmask);
+    if (plen == -1) {
+        errorf("invalid netmask, netmask=%s", ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    mutex_lock(&routes_mutex);
+    root = ip_route_node_delete(&update, routes, ntoh32(network), plen, &route, &err);
+    if (err) {
+        ip_route_update_abort(&update);
+        mutex_unlock(&routes_mutex);
+        errorf("not found or no memory, network=%s, netmask=%s",
+            ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    ip_route_update_commit(&update, root, route);
+    mutex_unlock(&routes_mutex);
+    infof("network=%s, netmask=%s", ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+    return 0;
+}
+
+/* NOTE: the longest prefix match, the result is copied out since the route may be deleted anytime */
+static int
+ip_route_lookup(ip_addr_t dst, struct ip_route *result)
+{
+    struct ip_route_cache *cache;
+    struct ip_route_node *node;
+    struct ip_route *route = NULL;
+    unsigned int gen, epoch;
+    uint32_t addr;
+
+    cache = &route_cache[ip_route_hash(dst) & (IP_ROUTE_CACHE_SIZE - 1)];
+    gen = __atomic_load_n(&routes_gen, __ATOMIC_SEQ_CST);
+    if (cache->gen == gen && cache->dst == dst) {
+        *result = cache->route;
+        return 0;
+    }
+    addr = ntoh32(dst);
+    /* NOTE: stay counted only if the epoch did not change meanwhile, or the updater may not wait for us */
+    while (1) {
+        epoch = __atomic_load_n(&routes_epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&routes_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&routes_epoch, __ATOMIC_SEQ_CST) == epoch) {
+            break;
         }
+        __atomic_sub_fetch(&routes_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
     }
-    return candidate;
+    node = __atomic_load_n(&routes, __ATOMIC_SEQ_CST);
+    while (node) {
+        if ((addr ^ node->prefix) & IP_ROUTE_MASK(node->plen)) {
+            break;
+        }
+        if (node->route) {
+            route = node->route;
+        }
+        if (node->plen == 32) {
+            break;
+        }
+        node = node->child[IP_ROUTE_BIT(addr, node->plen)];
+    }
+    if (route) {
+        *result = *route;
+    }
+    __atomic_sub_fetch(&routes_readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    if (!route) {
+        return -1;
+    }
+    /* NOTE: gen was loaded before the root, a version published since then leaves this entry stale */
+    cache->gen = gen;
+    cache->dst = dst;
+    cache->route = *result;
+    return 0;
 }
 
-/* NOTE: must not be call after net_run() */
 int
-ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
+ip_route_add(const char *network, const char *netmask, const char *nexthop, struct ip_iface *iface)
 {
-    ip_addr_t gw;
+    ip_addr_t net, mask, gw = IP_ADDR_ANY;
 
-    if (ip_addr_pton(gateway, &gw) == -1) {
-        errorf("ip_addr_pton() failure, addr=%s", gateway);
+    if (ip_addr_pton(network, &net) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", network);
         return -1;
     }
-    if (!ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, gw, iface)) {
-        errorf("ip_route_add() failure");
+    if (ip_addr_pton(netmask, &mask) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", netmask);
         return -1;
     }
-    return 0;
+    if (nexthop && ip_addr_pton(nexthop, &gw) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", nexthop);
+        return -1;
+    }
+    return ip_route_insert(net, mask, gw, iface);
+}
+
+int
+ip_route_del(const char *network, const char *netmask)
+{
+    ip_addr_t net, mask;
+
+    if (ip_addr_pton(network, &net) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", network);
+        return -1;
+    }
+    if (ip_addr_pton(netmask, &mask) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", netmask);
+        return -1;
+    }
+    return ip_route_remove(net, mask);
+}
+
+int
+ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
+{
+    return ip_route_add("0.0.0.0", "0.0.0.0", gateway, iface);
 }
 
 struct ip_iface *
 ip_route_get_iface(ip_addr_t dst)
 {
-    struct ip_route *route;
+    struct ip_route route;
 
-    route = ip_route_lookup(dst);
-    if (!route) {
+    if (ip_route_lookup(dst, &route) == -1) {
         return NULL;
     }
-    return route->iface;
+    return route.iface;
 }
 
 struct ip_iface *
@@ -259,8 +685,8 @@ ip_iface_register(struct net_device *dev, struct ip_iface *iface)
         errorf("net_device_add_iface() failure");
         return -1;
     }
-    if (!ip_route_add(iface->unicast & iface->netmask, iface->netmask, IP_ADDR_ANY, iface)) {
-        errorf("ip_route_add() failure");
+    if (ip_route_insert(iface->unicast & iface->netmask, iface->netmask, IP_ADDR_ANY, iface) == -1) {
+        errorf("ip_route_insert() failure");
         return -1;
     }
     iface->next = ifaces;
@@ -286,8 +712,285 @@ ip_iface_select(ip_addr_t addr)
     return entry;
 }
 
+/*
+ * IP Reassembly
+ *
+ * NOTE: The fragments are kept as the received buffers (pbuf_own()) sorted by the offset,
+ *       and copied into a single buffer only once the datagram is complete.
+ */
+
+static void
+ip_reass_free_locked(struct ip_reass *reass)
+{
+    struct list_head *entry;
+    struct ip_frag *frag;
+
+    while ((entry = list_pop(&reass->frags)) != NULL) {
+        frag = list_entry(entry, struct ip_frag, entry);
+        pbuf_free(frag->pb);
+        memory_free(frag);
+    }
+    net_timeout_cancel(&reass->timer);
+    reass_mem -= reass->mem;
+    reass->mem = 0;
+    reass->used = 0;
+}
+
+static void
+ip_reass_timeout(void *arg)
+{
+    struct ip_reass *reass;
+    struct ip_frag *frag;
+    uint8_t data[IP_HDR_SIZE_MAX + 8];
+    size_t len = 0;
+    ip_addr_t src = IP_ADDR_ANY;
+    char addr[IP_ADDR_STR_LEN];
+
+    reass = arg;
+    mutex_lock(&reass_mutex);
+    /* NOTE: the slot may have been recycled since the timeout was armed */
+    if (!reass->used || clock_usec() < reass->expire) {
+        mutex_unlock(&reass_mutex);
+        return;
+    }
+    debugf("timeout, src=%s, id=%u", ip_addr_ntop(reass->src, addr, sizeof(addr)), reass->id);
+    counters_add(&stats, IP_STATS_REASM_FAILS, 1);
+    frag = list_entry(list_first(&reass->frags), struct ip_frag, entry);
+    if (reass->hlen && !frag->offset) {
+        /* rfc792: the first fragment is required to tell the source about it */
+        memcpy(data, reass->hdr, reass->hlen);
+        len = MIN(frag->pb->len, 8);
+        memcpy(data + reass->hlen, frag->pb->data, len);
+        len += reass->hlen;
+        src = reass->src;
+    }
+    ip_reass_free_locked(reass);
+    mutex_unlock(&reass_mutex);
+    if (len) {
+        icmp_output(ICMP_TYPE_TIME_EXCEEDED, ICMP_CODE_EXCEEDED_FRAGMENT, 0, data, len, IP_ADDR_ANY, src);
+    }
+}
+
+/* NOTE: must be called after reass_mutex locked */
+static struct ip_reass *
+ip_reass_get(struct ip_hdr *hdr)
+{
+    struct ip_reass *reass, *candidate = NULL, *oldest = NULL;
+
+    for (reass = reass_table; reass < tailof(reass_table); reass++) {
+        if (!reass->used) {
+            if (!candidate) {
+                candidate = reass;
+            }
+            continue;
+        }
+        if (reass->src == hdr->src && reass->dst == hdr->dst && reass->id == hdr->id && reass->protocol == hdr->protocol) {
+            return reass;
+        }
+        if (!oldest || reass->expire < oldest->expire) {
+            oldest = reass;
+        }
+    }
+    if (!candidate) {
+        debugf("table is full, drop the oldest");
+        ip_reass_free_locked(oldest);
+        candidate = oldest;
+    }
+    candidate->used = 1;
+    candidate->src = hdr->src;
+    candidate->dst = hdr->dst;
+    candidate->id = hdr->id;
+    candidate->protocol = hdr->protocol;
+    candidate->hlen = 0;
+    candidate->total = 0;
+    candidate->expire = clock_usec() + IP_REASS_TIMEOUT;
+    net_timeout_arm(&candidate->timer, candidate->expire);
+    return candidate;
+}
+
+/* NOTE: must be called after reass_mutex locked, frees the oldest ones except keep until len fits */
+static int
+ip_reass_reserve_locked(struct ip_reass *keep, size_t len)
+{
+    struct ip_reass *reass, *oldest;
+
+    while (reass_mem + len > IP_REASS_MEM_MAX) {
+        oldest = NULL;
+        for (reass = reass_table; reass < tailof(reass_table); reass++) {
+            if (reass->used && reass != keep && (!oldest || reass->expire < oldest->expire)) {
+                oldest = reass;
+            }
+        }
+        if (!oldest) {
+            return -1;
+        }
+        debugf("memory is short, drop the oldest");
+        ip_reass_free_locked(oldest);
+    }
+    reass_mem += len;
+    keep->mem += len;
+    return 0;
+}
+
+/* NOTE: must be called after reass_mutex locked, the fragments must cover the payload from 0 to total without a hole */
+static int
+ip_reass_complete_locked(struct ip_reass *reass)
+{
+    struct list_head *entry;
+    struct ip_frag *frag;
+    size_t next = 0;
+
+    if (!reass->hlen || !reass->total) {
+        return 0;
+    }
+    list_foreach(entry, &reass->frags) {
+        frag = list_entry(entry, struct ip_frag, entry);
+        if (frag->offset != next) {
+            return 0;
+        }
+        next += frag->pb->len;
+    }
+    return next == reass->total;
+}
+
+/* NOTE: must be called after reass_mutex locked, returns the complete datagram (or NULL) */
+static struct pbuf *
+ip_reass_build_locked(struct ip_reass *reass)
+{
+    struct pbuf *pb;
+    struct ip_hdr *hdr;
+    struct list_head *entry;
+    struct ip_frag *frag;
+    uint8_t *p;
+
+    pb = pbuf_alloc(PBUF_HEADROOM, reass->hlen + reass->total);
+    if (!pb) {
+        errorf("pbuf_alloc() failure");
+        return NULL;
+    }
+    memcpy(pb->data, reass->hdr, reass->hlen);
+    p = pb->data + reass->hlen;
+    frag = list_entry(list_first(&reass->frags), struct ip_frag, entry);
+    pb->dev = frag->pb->dev;
+    pb->type = frag->pb->type;
+    list_foreach(entry, &reass->frags) {
+        frag = list_entry(entry, struct ip_frag, entry);
+        memcpy(p, frag->pb->data, frag->pb->len);
+        p += frag->pb->len;
+    }
+    hdr = (struct ip_hdr *)pb->data;
+    /* NOTE: the header of the first fragment has been verified, update its checksum for the rewritten fields */
+    hdr->sum = cksum16_update(hdr->sum, hdr->total, hton16(pb->len));
+    hdr->total = hton16(pb->len);
+    hdr->sum = cksum16_update(hdr->sum, hdr->offset, 0);
+    hdr->offset = 0;
+    return pb;
+}
+
+/*
+ * NOTE: pb is a fragment (the header is not pulled yet), it is kept in the table (or dropped) and
+ *       the reassembled datagram is returned once complete. The caller must free it.
+ */
+static struct pbuf *
+ip_reass_input(struct pbuf *pb, uint16_t hlen, uint16_t total)
+{
+    struct ip_hdr *hdr;
+    struct ip_reass *reass;
+    struct ip_frag *frag, *new;
+    struct list_head *entry, *pos;
+    uint16_t offset;
+    size_t off, len;
+    int more;
+    struct pbuf *ret = NULL;
+
+    hdr = (struct ip_hdr *)pb->data;
+    offset = ntoh16(hdr->offset);
+    off = (offset & IP_OFFSET_MASK) << 3;
+    len = total - hlen;
+    more = (offset & IP_FLAG_MF) != 0;
+    if ((more && (!len || len & 7)) || hlen + off + len > IP_TOTAL_SIZE_MAX) {
+        errorf("invalid fragment, offset=%zu, len=%zu, more=%d", off, len, more);
+        counters_add(&stats, IP_STATS_REASM_FAILS, 1);
+        return NULL;
+    }
+    mutex_lock(&reass_mutex);
+    reass = ip_reass_get(hdr);
+    if (!off) {
+        memcpy(reass->hdr, hdr, hlen);
+        reass->hlen = hlen;
+    }
+    if (!more) {
+        if (reass->total && reass->total != off + len) {
+            goto DROP;
+        }
+        if (!reass->total) {
+            /* NOTE: the fragments queued before the end is known may lie beyond it */
+            list_foreach(entry, &reass->frags) {
+                frag = list_entry(entry, struct ip_frag, entry);
+                if (frag->offset + frag->pb->len > off + len) {
+                    debugf("fragment beyond the end, offset=%zu, len=%zu", frag->offset, frag->pb->len);
+                    goto DROP;
+                }
+            }
+        }
+        reass->total = off + len;
+    }
+    if (reass->total && off + len > reass->total) {
+        goto DROP;
+    }
+    /* NOTE: find the position, an exact duplicate is ignored and any other overlap discards it all (rfc1858) */
+    pos = &reass->frags;
+    list_foreach(entry, &reass->frags) {
+        frag = list_entry(entry, struct ip_frag, entry);
+        if (frag->offset == off && frag->pb->len == len) {
+            mutex_unlock(&reass_mutex);
+            return NULL;
+        }
+        if (off < frag->offset + frag->pb->len && frag->offset < off + len) {
+            debugf("overlapped fragment, offset=%zu, len=%zu", off, len);
+            goto DROP;
+        }
+        if (off < frag->offset) {
+            pos = entry;
+            break;
+        }
+    }
+    new = memory_alloc(sizeof(*new));
+    if (!new) {
+        errorf("memory_alloc() failure");
+        goto DROP;
+    }
+    if (ip_reass_reserve_locked(reass, sizeof(*new) + sizeof(*pb) + pb->size) == -1) {
+        errorf("too much memory for reassembly");
+        memory_free(new);
+        goto DROP;
+    }
+    new->pb = pbuf_own(pb);
+    if (!new->pb) {
+        errorf("pbuf_own() failure");
+        memory_free(new);
+        goto DROP;
+    }
+    pbuf_trim(new->pb, total);
+    pbuf_pull(new->pb, hlen);
+    new->offset = off;
+    list_add_tail(&new->entry, pos); /* in front of the first fragment after it (or at the end) */
+    if (ip_reass_complete_locked(reass)) {
+        ret = ip_reass_build_locked(reass);
+        ip_reass_free_locked(reass);
+        counters_add(&stats, ret ? IP_STATS_REASM_OKS : IP_STATS_REASM_FAILS, 1);
+    }
+    mutex_unlock(&reass_mutex);
+    return ret;
+DROP:
+    ip_reass_free_locked(reass);
+    mutex_unlock(&reass_mutex);
+    counters_add(&stats, IP_STATS_REASM_FAILS, 1);
+    return NULL;
+}
+
 static void
-ip_input(const uint8_t *data, size_t len, struct net_device *dev)
+ip_input(struct pbuf *pb, struct net_device *dev)
 {
     struct ip_hdr *hdr;
     uint8_t v;
@@ -295,91 +998,120 @@ ip_input(const uint8_t *data, size_t len, struct net_device *dev)
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
     struct ip_protocol *proto;
+    struct pbuf *reassembled = NULL;
 
-    if (len < IP_HDR_SIZE_MIN) {
+    TRACE_POINT(TRACE_STAGE_IP_INPUT, pb);
+    counters_add(&stats, IP_STATS_IN_RECEIVES, 1);
+    if (pb->len < IP_HDR_SIZE_MIN) {
         errorf("too short");
+        counters_add(&stats, IP_STATS_IN_HDR_ERRORS, 1);
         return;
     }
-    hdr = (struct ip_hdr *)data;
+    hdr = (struct ip_hdr *)pb->data;
     v = hdr->vhl >> 4;
     if (v != IP_VERSION_IPV4) {
         errorf("ip version error: v=%u", v);
+        counters_add(&stats, IP_STATS_IN_HDR_ERRORS, 1);
         return;
     }
     hlen = (hdr->vhl & 0x0f) << 2;
-    if (len < hlen) {
-        errorf("header length error: hlen=%u, len=%zu", hlen, len);
+    if (pb->len < hlen) {
+        errorf("header length error: hlen=%u, len=%zu", hlen, pb->len);
+        counters_add(&stats, IP_STATS_IN_HDR_ERRORS, 1);
         return;
     }
     total = ntoh16(hdr->total);
-    if (len < total) {
-        errorf("total length error: total=%u, len=%zu", total, len);
+    if (pb->len < total) {
+        errorf("total length error: total=%u, len=%zu", total, pb->len);
+        counters_add(&stats, IP_STATS_IN_HDR_ERRORS, 1);
         return;
     }
-    if (cksum16((uint16_t *)hdr, hlen, 0) != 0) {
+    if (!(dev->features & NET_DEVICE_FEATURE_IPCSUM) && cksum16((uint16_t *)hdr, hlen, 0) != 0) {
         errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, hlen, -hdr->sum)));
-        return;
-    }
-    offset = ntoh16(hdr->offset);
-    if (offset & 0x2000 || offset & 0x1fff) {
-        errorf("fragments does not support");
+        counters_add(&stats, IP_STATS_IN_CSUM_ERRORS, 1);
         return;
     }
     iface = (struct ip_iface *)net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
     if (!iface) {
         /* iface is not registered to the device */
+        counters_add(&stats, IP_STATS_IN_ADDR_ERRORS, 1);
         return;
     }
     if (hdr->dst != iface->unicast) {
         if (hdr->dst != iface->broadcast && hdr->dst != IP_ADDR_BROADCAST) {
             /* for other host */
+            counters_add(&stats, IP_STATS_IN_ADDR_ERRORS, 1);
+            return;
+        }
+    }
+    offset = ntoh16(hdr->offset);
+    if (offset & (IP_FLAG_MF | IP_OFFSET_MASK)) {
+        counters_add(&stats, IP_STATS_REASM_REQDS, 1);
+        reassembled = ip_reass_input(pb, hlen, total);
+        if (!reassembled) {
+            /* NOTE: kept for reassembly, or dropped */
             return;
         }
+        pb = reassembled;
+        hdr = (struct ip_hdr *)pb->data;
+        total = pb->len;
     }
     debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
         dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(hdr->protocol), hdr->protocol, total);
-    ip_dump(data, total);
+    ip_dump(pb->data, total);
     for (proto = protocols; proto; proto = proto->next) {
         if (proto->type == hdr->protocol) {
-            proto->handler((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, iface);
-            return;
+            pbuf_trim(pb, total); /* drop link layer padding */
+            pbuf_pull(pb, hlen);
+            counters_add(&stats, IP_STATS_IN_DELIVERS, 1);
+            proto->handler(pb, hdr->src, hdr->dst, iface);
+            break;
         }
     }
-    /* unsupported protocol */
+    if (!proto) {
+        /* NOTE: an unsupported protocol is silently ignored */
+        counters_add(&stats, IP_STATS_IN_UNKNOWN_PROTOS, 1);
+    }
+    pbuf_free(reassembled);
 }
 
 static int
-ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_addr_t dst)
+ip_output_device(struct ip_path *path, struct pbuf *pb)
 {
-    uint8_t hwaddr[NET_DEVICE_ADDR_LEN] = {};
+    struct ip_iface *iface = path->iface;
     int ret;
 
-    if (NET_IFACE(iface)->dev->flags & NET_DEVICE_FLAG_NEED_ARP) {
-        if (dst == iface->broadcast || dst == IP_ADDR_BROADCAST) {
-            memcpy(hwaddr, NET_IFACE(iface)->dev->broadcast, NET_IFACE(iface)->dev->alen);
+    if (NET_IFACE(iface)->dev->flags & NET_DEVICE_FLAG_NEED_ARP && !path->resolved) {
+        if (path->nexthop == iface->broadcast || path->nexthop == IP_ADDR_BROADCAST) {
+            memcpy(path->hwaddr, NET_IFACE(iface)->dev->broadcast, NET_IFACE(iface)->dev->alen);
         } else {
-            ret = arp_resolve(NET_IFACE(iface), dst, hwaddr);
+            ret = arp_resolve(NET_IFACE(iface), path->nexthop, path->hwaddr, pb);
             if (ret != ARP_RESOLVE_FOUND) {
+                /* NOTE: an incomplete one keeps the packet and sends it once resolved */
                 return ret;
             }
         }
+        path->resolved = 1;
     }
-    return net_device_output(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, data, len, hwaddr);
+    return net_device_output(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, pb, path->hwaddr);
 }
 
 static ssize_t
-ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id, uint16_t offset)
+ip_output_core(struct ip_path *path, uint8_t protocol, struct pbuf *pb, ip_addr_t src, uint16_t id, uint16_t offset)
 {
-    uint8_t buf[IP_TOTAL_SIZE_MAX];
     struct ip_hdr *hdr;
     uint16_t hlen, total;
     char addr[IP_ADDR_STR_LEN];
 
-    hdr = (struct ip_hdr *)buf;
     hlen = sizeof(*hdr);
+    hdr = (struct ip_hdr *)pbuf_push(pb, hlen);
+    if (!hdr) {
+        errorf("pbuf_push() failure");
+        return -1;
+    }
     hdr->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
     hdr->tos = 0;
-    total = hlen + len;
+    total = pb->len;
     hdr->total = hton16(total);
     hdr->id = hton16(id);
     hdr->offset = hton16(offset);
@@ -387,13 +1119,44 @@ ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, si
     hdr->protocol = protocol;
     hdr->sum = 0;
     hdr->src = src;
-    hdr->dst = dst;
-    hdr->sum = cksum16((uint16_t *)hdr, hlen, 0); /* don't convert byteorder */
-    memcpy(hdr+1, data, len);
+    hdr->dst = path->dst;
+    if (!(NET_IFACE(path->iface)->dev->features & NET_DEVICE_FEATURE_IPCSUM)) {
+        hdr->sum = cksum16((uint16_t *)hdr, hlen, 0); /* don't convert byteorder */
+    }
     debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
-        NET_IFACE(iface)->dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(protocol), protocol, total);
-    ip_dump(buf, total);
-    return ip_output_device(iface, buf, total, nexthop);
+        NET_IFACE(path->iface)->dev->name, ip_addr_ntop(path->iface->unicast, addr, sizeof(addr)), ip_protocol_name(protocol), protocol, total);
+    ip_dump(pb->data, total);
+    return ip_output_device(path, pb);
+}
+
+/* NOTE: each fragment is copied into its own buffer since every one of them needs a header in front */
+static ssize_t
+ip_output_fragments(struct ip_path *path, uint8_t protocol, struct pbuf *pb, ip_addr_t src, uint16_t id)
+{
+    struct pbuf *frag;
+    size_t unit, off, len;
+    uint16_t flags;
+    ssize_t ret;
+
+    unit = (NET_IFACE(path->iface)->dev->mtu - IP_HDR_SIZE_MIN) & ~7;
+    for (off = 0; off < pb->len; off += len) {
+        len = MIN(unit, pb->len - off);
+        frag = pbuf_alloc(PBUF_HEADROOM, len);
+        if (!frag) {
+            errorf("pbuf_alloc() failure");
+            return -1;
+        }
+        memcpy(frag->data, pb->data + off, len);
+        flags = (off + len < pb->len) ? IP_FLAG_MF : 0;
+        ret = ip_output_core(path, protocol, frag, src, id, flags | (off >> 3));
+        pbuf_free(frag);
+        if (ret == -1) {
+            errorf("ip_output_core() failure, offset=%zu", off);
+            return -1;
+        }
+        counters_add(&stats, IP_STATS_FRAG_CREATES, 1);
+    }
+    return pb->len;
 }
 
 static uint16_t
@@ -409,46 +1172,83 @@ ip_generate_id(void)
     return ret;
 }
 
+/* NOTE: look up the route once for many datagrams to dst, the link address of the next hop is resolved by the first one sent */
+int
+ip_path_resolve(ip_addr_t dst, struct ip_path *path)
+{
+    struct ip_route route;
+    char addr[IP_ADDR_STR_LEN];
+
+    if (ip_route_lookup(dst, &route) == -1) {
+        errorf("no route to host, addr=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
+        counters_add(&stats, IP_STATS_OUT_NO_ROUTES, 1);
+        return -1;
+    }
+    path->dst = dst;
+    path->nexthop = (route.nexthop != IP_ADDR_ANY) ? route.nexthop : dst;
+    path->iface = route.iface;
+    path->resolved = 0;
+    memset(path->hwaddr, 0, sizeof(path->hwaddr));
+    return 0;
+}
+
 ssize_t
-ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
+ip_output_path(uint8_t protocol, struct pbuf *pb, ip_addr_t src, struct ip_path *path)
 {
-    struct ip_route *route;
-    struct ip_iface *iface;
+    struct ip_iface *iface = path->iface;
+    struct net_device *dev;
     char addr[IP_ADDR_STR_LEN];
-    ip_addr_t nexthop;
     uint16_t id;
+    size_t len;
 
-    if (src == IP_ADDR_ANY && dst == IP_ADDR_BROADCAST) {
+    counters_add(&stats, IP_STATS_OUT_REQUESTS, 1);
+    if (src == IP_ADDR_ANY && path->dst == IP_ADDR_BROADCAST) {
         errorf("source address is required for broadcast addresses");
         return -1;
     }
-    route = ip_route_lookup(dst);
-    if (!route) {
-        errorf("no route to host, addr=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
-        return -1;
-    }
-    iface = route->iface;
     if (src != IP_ADDR_ANY && src != iface->unicast) {
         errorf("unable to output with specified source address, addr=%s", ip_addr_ntop(src, addr, sizeof(addr)));
         return -1;
     }
-    nexthop = (route->nexthop != IP_ADDR_ANY) ? route->nexthop : dst;
-    if (NET_IFACE(iface)->dev->mtu < IP_HDR_SIZE_MIN + len) {
-        errorf("too long, dev=%s, mtu=%u, tatal=%zu",
-            NET_IFACE(iface)->dev->name, NET_IFACE(iface)->dev->mtu, IP_HDR_SIZE_MIN + len);
+    len = pb->len;
+    if (len > IP_PAYLOAD_SIZE_MAX) {
+        errorf("too long, len=%zu", len);
         return -1;
     }
     id = ip_generate_id();
-    if (ip_output_core(iface, protocol, data, len, iface->unicast, dst, nexthop, id, 0) == -1) {
+    dev = NET_IFACE(iface)->dev;
+    if (dev->mtu < IP_HDR_SIZE_MIN + len && !(pb->gso_size && dev->features & NET_DEVICE_FEATURE_TSO)) {
+        /* NOTE: a checksum left to the device must be filled before the datagram is cut */
+        pbuf_csum_fill(pb);
+        if (ip_output_fragments(path, protocol, pb, iface->unicast, id) == -1) {
+            errorf("ip_output_fragments() failure");
+            counters_add(&stats, IP_STATS_OUT_DISCARDS, 1);
+            return -1;
+        }
+        return len;
+    }
+    if (ip_output_core(path, protocol, pb, iface->unicast, id, 0) == -1) {
         errorf("ip_output_core() failure");
+        counters_add(&stats, IP_STATS_OUT_DISCARDS, 1);
         return -1;
     }
     return len;
 }
 
+ssize_t
+ip_output(uint8_t protocol, struct pbuf *pb, ip_addr_t src, ip_addr_t dst)
+{
+    struct ip_path path;
+
+    if (ip_path_resolve(dst, &path) == -1) {
+        return -1;
+    }
+    return ip_output_path(protocol, pb, src, &path);
+}
+
 /* NOTE: must not be call after net_run() */
 int
-ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface))
+ip_protocol_register(const char *name, uint8_t type, void (*handler)(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface))
 {
     struct ip_protocol *entry;
 
@@ -472,6 +1272,28 @@ ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8
     return 0;
 }
 
+/*
+ * NOTE: gro() tells whether the payload of pb can be appended to the one of head (both start at the
+ *       IP header of hlen bytes and have the same addresses): -1 if pb is of another flow, 0 if it
+ *       is of the same flow but cannot follow head, or else the length of its transport header.
+ *       A positive result also means the transport checksums of both have been verified.
+ *       Must not be call after net_run().
+ */
+int
+ip_protocol_set_gro(uint8_t type, int (*gro)(const struct pbuf *head, const struct pbuf *pb, size_t hlen, ip_addr_t src, ip_addr_t dst))
+{
+    struct ip_protocol *entry;
+
+    for (entry = protocols; entry; entry = entry->next) {
+        if (entry->type == type) {
+            entry->gro = gro;
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%02x", type);
+    return -1;
+}
+
 char *
 ip_protocol_name(uint8_t type)
 {
@@ -485,12 +1307,212 @@ ip_protocol_name(uint8_t type)
     return "UNKNOWN";
 }
 
+/*
+ * Generic Receive Offload
+ *
+ * NOTE: The consecutive datagrams of a flow in a batch are coalesced into one before ip_input(),
+ *       so that the upper layer handles them at once. Only the plain ones (no options, no fragments)
+ *       of the protocols providing gro() are, the IP header is checked here instead of ip_input().
+ */
+
+static struct ip_protocol *
+ip_gro_protocol(const struct pbuf *pb)
+{
+    const struct ip_hdr *hdr;
+    struct ip_protocol *proto;
+
+    if (pb->len < IP_HDR_SIZE_MIN) {
+        return NULL;
+    }
+    hdr = (const struct ip_hdr *)pb->data;
+    if (hdr->vhl != ((IP_VERSION_IPV4 << 4) | (IP_HDR_SIZE_MIN >> 2)) || ntoh16(hdr->total) != pb->len) {
+        return NULL;
+    }
+    if (ntoh16(hdr->offset) & (IP_FLAG_MF | IP_OFFSET_MASK)) {
+        return NULL;
+    }
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == hdr->protocol) {
+            break;
+        }
+    }
+    if (!proto || !proto->gro) {
+        return NULL;
+    }
+    if (!(pb->dev->features & NET_DEVICE_FEATURE_IPCSUM) && cksum16((uint16_t *)hdr, IP_HDR_SIZE_MIN, 0) != 0) {
+        /* NOTE: leave it to ip_input() to be dropped */
+        return NULL;
+    }
+    return proto;
+}
+
+/* NOTE: append the payload of pb (after off bytes) to head, which is replaced with a larger copy for the first time */
+static int
+ip_gro_append(struct pbuf **head, const struct pbuf *pb, size_t off)
+{
+    struct pbuf *merged;
+    struct ip_hdr *hdr;
+    uint16_t total;
+
+    if (pbuf_tailroom(*head) < pb->len - off || PBUF_IS_EXTERNAL(*head) || (*head)->ref > 1) {
+        merged = pbuf_alloc(PBUF_HEADROOM, IP_TOTAL_SIZE_MAX);
+        if (!merged) {
+            errorf("pbuf_alloc() failure");
+            return -1;
+        }
+        memcpy(merged->data, (*head)->data, (*head)->len);
+        pbuf_trim(merged, (*head)->len);
+        merged->dev = (*head)->dev;
+        merged->type = (*head)->type;
+        merged->flags = (*head)->flags;
+        merged->gso_size = (*head)->gso_size ? (*head)->gso_size : (*head)->len - off;
+        pbuf_free(*head);
+        *head = merged;
+    }
+    memcpy(pbuf_put(*head, pb->len - off), pb->data + off, pb->len - off);
+    hdr = (struct ip_hdr *)(*head)->data;
+    total = hton16((*head)->len);
+    hdr->sum = cksum16_update(hdr->sum, hdr->total, total);
+    hdr->total = total;
+    return 0;
+}
+
+/* NOTE: see net_protocol_set_gro() */
+static int
+ip_gro(struct pbuf **pbs, int n)
+{
+    struct {
+        int index; /* of the head in pbs[] */
+        struct ip_protocol *proto;
+    } flows[IP_GRO_FLOWS];
+    struct ip_protocol *proto;
+    struct ip_hdr *hdr, *head;
+    struct pbuf *pb;
+    int num = 0, i, j, ret, out = 0;
+
+    for (i = 0; i < n; i++) {
+        pb = pbs[i];
+        proto = ip_gro_protocol(pb);
+        if (!proto) {
+            if (pb->len >= IP_HDR_SIZE_MIN) {
+                /* NOTE: the flow of pb ends at its head too, the ones behind must not jump over pb */
+                hdr = (struct ip_hdr *)pb->data;
+                for (j = 0; j < num; j++) {
+                    head = (struct ip_hdr *)pbs[flows[j].index]->data;
+                    if (head->src == hdr->src && head->dst == hdr->dst && flows[j].proto->type == hdr->protocol) {
+                        flows[j--] = flows[--num];
+                    }
+                }
+            }
+            pbs[out++] = pb;
+            continue;
+        }
+        hdr = (struct ip_hdr *)pb->data;
+        for (j = 0; j < num; j++) {
+            head = (struct ip_hdr *)pbs[flows[j].index]->data;
+            if (head->src != hdr->src || head->dst != hdr->dst || flows[j].proto != proto) {
+                continue;
+            }
+            ret = 0;
+            if (head->tos == hdr->tos && head->ttl == hdr->ttl
+                && pbs[flows[j].index]->len + pb->len - IP_HDR_SIZE_MIN <= IP_TOTAL_SIZE_MAX) {
+                ret = proto->gro(pbs[flows[j].index], pb, IP_HDR_SIZE_MIN, hdr->src, hdr->dst);
+            }
+            if (ret == -1) {
+                continue;
+            }
+            if (ret > 0) {
+                pbs[flows[j].index]->flags |= PBUF_FLAG_CSUM_VALID;
+                if (ip_gro_append(&pbs[flows[j].index], pb, IP_HDR_SIZE_MIN + ret) == 0) {
+                    pbuf_free(pb);
+                    break;
+                }
+            }
+            /* NOTE: the flow ends at the head, the ones behind must not jump over pb */
+            flows[j] = flows[--num];
+            j = num;
+            break;
+        }
+        if (j < num) {
+            /* coalesced */
+            continue;
+        }
+        if (num < IP_GRO_FLOWS) {
+            flows[num].index = out;
+            flows[num].proto = proto;
+            num++;
+        }
+        pbs[out++] = pb;
+    }
+    return out;
+}
+
+/* NOTE: addresses and ports in network byte order, the same tuple always gives the same hash */
+uint32_t
+ip_flow_hash(ip_addr_t src, ip_addr_t dst, uint16_t sport, uint16_t dport, uint8_t protocol)
+{
+    uint32_t h;
+
+    h = ip_route_hash(src ^ protocol);
+    h = ip_route_hash(h ^ dst);
+    h = ip_route_hash(h ^ ((uint32_t)sport << 16 | dport));
+    return h;
+}
+
+/*
+ * NOTE: Steer by the 4-tuple of TCP/UDP (by the addresses for the others), the fragments
+ *       have no ports to look at, so all of them (including the first one) use 0 instead.
+ */
+static uint32_t
+ip_flow_steer(const struct pbuf *pb)
+{
+    const struct ip_hdr *hdr;
+    const uint16_t *ports;
+    uint16_t hlen, sport = 0, dport = 0;
+
+    if (pb->len < IP_HDR_SIZE_MIN) {
+        return 0;
+    }
+    hdr = (const struct ip_hdr *)pb->data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    if (!(ntoh16(hdr->offset) & (IP_FLAG_MF | IP_OFFSET_MASK)) && pb->len >= (size_t)hlen + 4) {
+        if (hdr->protocol == IP_PROTOCOL_TCP || hdr->protocol == IP_PROTOCOL_UDP) {
+            ports = (const uint16_t *)(pb->data + hlen);
+            sport = ports[0];
+            dport = ports[1];
+        }
+    }
+    return ip_flow_hash(hdr->src, hdr->dst, sport, dport, hdr->protocol);
+}
+
 int
 ip_init(void)
 {
+    struct ip_reass *reass;
+
+    for (reass = reass_table; reass < tailof(reass_table); reass++) {
+        list_init(&reass->frags);
+        net_timeout_init(&reass->timer, ip_reass_timeout, reass);
+    }
+    if (counters_init(&stats, "ip", stats_names, IP_STATS_NUM) == -1) {
+        errorf("counters_init() failure");
+        return -1;
+    }
+    if (net_stats_register(&stats, NULL) == -1) {
+        errorf("net_stats_register() failure");
+        return -1;
+    }
     if (net_protocol_register("IP", NET_PROTOCOL_TYPE_IP, ip_input) == -1) {
         errorf("net_protocol_register() failure");
         return -1;
     }
+    if (net_protocol_set_flow_hash(NET_PROTOCOL_TYPE_IP, ip_flow_steer) == -1) {
+        errorf("net_protocol_set_flow_hash() failure");
+        return -1;
+    }
+    if (net_protocol_set_gro(NET_PROTOCOL_TYPE_IP, ip_gro) == -1) {
+        errorf("net_protocol_set_gro() failure");
+        return -1;
+    }
     return 0;
 }
@@ -25,6 +25,22 @@
 #define IP_PROTOCOL_TCP  0x06
 #define IP_PROTOCOL_UDP  0x11
 
+/* NOTE: the counters of the module, see net_stats_get() ("ip") */
+#define IP_STATS_IN_RECEIVES        0
+#define IP_STATS_IN_HDR_ERRORS      1 /* too short, bad version or lengths */
+#define IP_STATS_IN_CSUM_ERRORS     2
+#define IP_STATS_IN_ADDR_ERRORS     3 /* no interface, or for other host */
+#define IP_STATS_IN_UNKNOWN_PROTOS  4
+#define IP_STATS_IN_DELIVERS        5
+#define IP_STATS_REASM_REQDS        6 /* fragments received */
+#define IP_STATS_REASM_OKS          7
+#define IP_STATS_REASM_FAILS        8 /* invalid, overlapped, out of memory or timed out */
+#define IP_STATS_OUT_REQUESTS       9
+#define IP_STATS_OUT_NO_ROUTES     10
+#define IP_STATS_OUT_DISCARDS      11
+#define IP_STATS_FRAG_CREATES      12
+#define IP_STATS_NUM               13
+
 typedef uint32_t ip_addr_t;
 
 struct ip_endpoint {
@@ -40,6 +56,15 @@ struct ip_iface {
     ip_addr_t broadcast;
 };
 
+/* NOTE: the route to a destination (and the link address of the next hop once resolved), see ip_path_resolve() */
+struct ip_path {
+    ip_addr_t dst;
+    ip_addr_t nexthop;
+    struct ip_iface *iface;
+    int resolved; /* hwaddr is valid */
+    uint8_t hwaddr[NET_DEVICE_ADDR_LEN];
+};
+
 extern const ip_addr_t IP_ADDR_ANY;
 extern const ip_addr_t IP_ADDR_BROADCAST;
 
@@ -52,6 +77,10 @@ ip_endpoint_pton(const char *p, struct ip_endpoint *n);
 extern char *
 ip_endpoint_ntop(const struct ip_endpoint *n, char *p, size_t size);
 
+extern int
+ip_route_add(const char *network, const char *netmask, const char *nexthop, struct ip_iface *iface);
+extern int
+ip_route_del(const char *network, const char *netmask);
 extern int
 ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway);
 extern struct ip_iface *
@@ -65,10 +94,19 @@ extern struct ip_iface *
 ip_iface_select(ip_addr_t addr);
 
 extern ssize_t
-ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
+ip_output(uint8_t protocol, struct pbuf *pb, ip_addr_t src, ip_addr_t dst);
+extern int
+ip_path_resolve(ip_addr_t dst, struct ip_path *path);
+extern ssize_t
+ip_output_path(uint8_t protocol, struct pbuf *pb, ip_addr_t src, struct ip_path *path);
 
+extern uint32_t
+ip_flow_hash(ip_addr_t src, ip_addr_t dst, uint16_t sport, uint16_t dport, uint8_t protocol);
+
+extern int
+ip_protocol_register(const char *name, uint8_t type, void (*handler)(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
 extern int
-ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
+ip_protocol_set_gro(uint8_t type, int (*gro)(const struct pbuf *head, const struct pbuf *pb, size_t hlen, ip_addr_t src, ip_addr_t dst));
 extern char *
 ip_protocol_name(uint8_t type);
 
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -10,27 +11,40 @@
 
 #include "util.h"
 #include "net.h"
+#include "pbuf.h"
+#include "trace.h"
+
+#define NET_PROTOCOL_QUEUE_SIZE 1024 /* power of two */
+#define NET_PROTOCOL_BATCH 64 /* max number of packets popped (and handed to gro()) at once */
+
+struct net_txq {
+    mutex_t mutex;
+    int num;
+    struct net_txq_entry entries[NET_DEVICE_TXQ_SIZE];
+};
+
+struct net_protocol_queue {
+    struct ring ring;
+    mutex_t lock; /* serializes the producers */
+    uint64_t drops; /* protected by lock */
+    unsigned int hwm; /* written by the consumer */
+};
 
 struct net_protocol {
     struct net_protocol *next;
     char name[16];
     uint16_t type;
-    struct queue_head queue; /* input queue */
-    void (*handler)(const uint8_t *data, size_t len, struct net_device *dev);
-};
-
-/* NOTE: the data follows immediately after the structure */
-struct net_protocol_queue_entry {
-    struct net_device *dev;
-    size_t len;
+    struct net_protocol_queue *queues; /* input queue per worker */
+    uint32_t (*hash)(const struct pbuf *pb); /* flow hash to steer the packets, worker 0 takes all if NULL */
+    int (*gro)(struct pbuf **pbs, int n); /* coalesces the packets before the handler, optional */
+    void (*handler)(struct pbuf *pb, struct net_device *dev);
 };
 
 struct net_timer {
-    struct net_timer *next;
     char name[16];
-    struct timeval interval;
-    struct timeval last;
+    uint64_t interval; /* usec */
     void (*handler)(void);
+    struct net_timeout timeout;
 };
 
 struct net_event {
@@ -39,11 +53,34 @@ struct net_event {
     void *arg;
 };
 
+struct net_stats {
+    struct net_stats *next;
+    struct counters *counters;
+    void (*dump)(FILE *fp); /* dumps the rest of the statistics of the module, optional */
+};
+
+/* NOTE: min-heap of the armed timeouts of a worker */
+struct net_timeout_heap {
+    mutex_t mutex;
+    struct net_timeout **entries; /* 1-origin, entries[1] expires first */
+    size_t num;
+    size_t size;
+    uint64_t programmed; /* expiry the platform timer is armed for, 0 if disarmed */
+};
+
 /* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
 static struct net_device *devices;
 static struct net_protocol *protocols;
-static struct net_timer *timers;
 static struct net_event *events;
+static struct net_stats *stats; /* in the order registered */
+
+static const char * const net_device_stats_names[NET_DEVICE_STATS_NUM] = {
+    "rx_packets", "rx_bytes", "rx_drops", "tx_packets", "tx_bytes", "tx_errors"
+};
+static volatile sig_atomic_t stats_dump_requested;
+
+static unsigned int workers = 1; /* number of softirq worker threads */
+static struct net_timeout_heap heaps[NET_WORKER_MAX];
 
 struct net_device *
 net_device_alloc(void (*setup)(struct net_device *dev))
@@ -67,8 +104,25 @@ net_device_register(struct net_device *dev)
 {
     static unsigned int index = 0;
 
+    if (dev->ops->xmit) {
+        dev->txq = memory_alloc(sizeof(*dev->txq));
+        if (!dev->txq) {
+            errorf("memory_alloc() failure");
+            return -1;
+        }
+        mutex_init(&dev->txq->mutex);
+    }
+    dev->stats = memory_alloc(sizeof(*dev->stats));
+    if (!dev->stats) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
     dev->index = index++;
     snprintf(dev->name, sizeof(dev->name), "net%d", dev->index);
+    if (counters_init(dev->stats, dev->name, net_device_stats_names, NET_DEVICE_STATS_NUM) == -1) {
+        errorf("counters_init() failure");
+        return -1;
+    }
     dev->next = devices;
     devices = dev;
     infof("registered, dev=%s, type=0x%04x", dev->name, dev->type);
@@ -143,61 +197,246 @@ net_device_get_iface(struct net_device *dev, int family)
 }
 
 int
-net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+net_device_output(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
+    size_t len;
+
     if (!NET_DEVICE_IS_UP(dev)) {
         errorf("not opened, dev=%s", dev->name);
         return -1;
     }
-    if (len > dev->mtu) {
-        errorf("too long, dev=%s, mtu=%u, len=%zu", dev->name, dev->mtu, len);
+    if (pb->len > dev->mtu && !(pb->gso_size && dev->features & NET_DEVICE_FEATURE_TSO)) {
+        errorf("too long, dev=%s, mtu=%u, len=%zu", dev->name, dev->mtu, pb->len);
         return -1;
     }
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
-    debugdump(data, len);
-    if (dev->ops->transmit(dev, type, data, len, dst) == -1) {
+    if (pb->flags & PBUF_FLAG_CSUM_PARTIAL && !(dev->features & NET_DEVICE_FEATURE_TXCSUM)) {
+        /* NOTE: the route may have been changed to a device without the offload */
+        pbuf_csum_fill(pb);
+    }
+    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, pb->len);
+    debugdump(pb->data, pb->len);
+    len = pb->len; /* NOTE: the driver may have passed pb on to another thread (e.g. loopback) by the time it returns */
+    if (dev->ops->transmit(dev, type, pb, dst) == -1) {
         errorf("device transmit failure, dev=%s, len=%zu", dev->name, len);
+        counters_add(dev->stats, NET_DEVICE_STATS_TX_ERRORS, 1);
         return -1;
     }
+    counters_add(dev->stats, NET_DEVICE_STATS_TX_PACKETS, 1);
+    counters_add(dev->stats, NET_DEVICE_STATS_TX_BYTES, len);
     return 0;
 }
 
+/*
+ * Transmit Queue
+ *
+ * NOTE: Inside a net_tx_batch_begin()/net_tx_batch_end() scope, frames are queued
+ *       on the device and sent together when the outermost scope ends (or the queue
+ *       fills up). Outside of any scope, they are sent immediately.
+ */
+
+static __thread int tx_batch_depth;
+static const uint8_t tx_zero_pad[NET_DEVICE_PAD_MAX];
+
 int
-net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev)
+net_txq_entry_iov(const struct net_txq_entry *entry, struct iovec *iov)
 {
-    struct net_protocol *proto;
-    struct net_protocol_queue_entry *entry;
+    int n = 0;
 
-    for (proto = protocols; proto; proto = proto->next) {
-        if (proto->type == type) {
-            entry = memory_alloc(sizeof(*entry) + len);
-            if (!entry) {
-                errorf("memory_alloc() failure");
-                return -1;
+    if (entry->hlen) {
+        iov[n].iov_base = (void *)entry->hdr;
+        iov[n++].iov_len = entry->hlen;
+    }
+    iov[n].iov_base = entry->pb->data;
+    iov[n++].iov_len = entry->pb->len;
+    if (entry->pad) {
+        iov[n].iov_base = (void *)tx_zero_pad;
+        iov[n++].iov_len = entry->pad;
+    }
+    return n;
+}
+
+/* NOTE: must be called after txq->mutex locked */
+static void
+net_device_flush(struct net_device *dev)
+{
+    struct net_txq *txq = dev->txq;
+    int n, i;
+
+    if (!txq->num) {
+        return;
+    }
+    n = dev->ops->xmit(dev, txq->entries, txq->num);
+    if (n < txq->num) {
+        errorf("xmit failure, dev=%s, queued=%d, sent=%d", dev->name, txq->num, n < 0 ? 0 : n);
+    }
+    for (i = 0; i < txq->num; i++) {
+        pbuf_free(txq->entries[i].pb);
+    }
+    txq->num = 0;
+}
+
+/* NOTE: pb is borrowed, the queue takes its own reference */
+int
+net_device_xmit(struct net_device *dev, const void *hdr, size_t hlen, struct pbuf *pb, size_t pad)
+{
+    struct net_txq_entry tmp, *entry;
+
+    if (hlen > NET_DEVICE_HDR_MAX || pad > NET_DEVICE_PAD_MAX) {
+        errorf("too long, dev=%s, hlen=%zu, pad=%zu", dev->name, hlen, pad);
+        return -1;
+    }
+    if (!dev->txq || !tx_batch_depth) {
+        entry = &tmp;
+        entry->pb = pb;
+        memcpy(entry->hdr, hdr, hlen);
+        entry->hlen = hlen;
+        entry->pad = pad;
+        return dev->ops->xmit(dev, entry, 1) == 1 ? 0 : -1;
+    }
+    mutex_lock(&dev->txq->mutex);
+    if (dev->txq->num == NET_DEVICE_TXQ_SIZE) {
+        net_device_flush(dev);
+    }
+    entry = &dev->txq->entries[dev->txq->num++];
+    entry->pb = pbuf_ref(pb);
+    memcpy(entry->hdr, hdr, hlen);
+    entry->hlen = hlen;
+    entry->pad = pad;
+    mutex_unlock(&dev->txq->mutex);
+    return 0;
+}
+
+void
+net_tx_batch_begin(void)
+{
+    tx_batch_depth++;
+}
+
+/* NOTE: must not sleep inside a scope, the queued frames would wait until it ends */
+void
+net_tx_batch_end(void)
+{
+    struct net_device *dev;
+
+    if (--tx_batch_depth) {
+        return;
+    }
+    for (dev = devices; dev; dev = dev->next) {
+        if (dev->txq) {
+            mutex_lock(&dev->txq->mutex);
+            net_device_flush(dev);
+            mutex_unlock(&dev->txq->mutex);
+        }
+    }
+}
+
+/* NOTE: receive packets from the device until it runs dry (called from the IRQ handler) */
+int
+net_device_poll(struct net_device *dev)
+{
+    struct pbuf *pbs[NET_DEVICE_POLL_BATCH];
+    int n, i;
+
+    if (!dev->ops->poll) {
+        errorf("not supported, dev=%s", dev->name);
+        return -1;
+    }
+    while ((n = dev->ops->poll(dev, pbs, countof(pbs))) > 0) {
+        net_input_handler_batch(pbs, n, dev);
+        for (i = 0; i < n; i++) {
+            pbuf_free(pbs[i]);
+        }
+    }
+    return n;
+}
+
+/*
+ * NOTE: The input queues take their own references, the caller still owns the pbufs.
+ *       Each packet goes to the worker selected by the flow hash of the protocol,
+ *       and the softirq of each worker is raised once for the whole batch.
+ */
+int
+net_input_handler_batch(struct pbuf **pbs, int n, struct net_device *dev)
+{
+    struct net_protocol *proto = NULL;
+    struct net_protocol_queue *queue = NULL, *next;
+    struct pbuf *pb;
+    uint64_t raised = 0;
+    unsigned int worker;
+    int i, num = 0;
+    size_t bytes = 0;
+
+    for (i = 0; i < n; i++) {
+        pb = pbs[i];
+        pb->dev = dev;
+        if (!proto || proto->type != pb->type) {
+            for (proto = protocols; proto; proto = proto->next) {
+                if (proto->type == pb->type) {
+                    break;
+                }
             }
-            entry->dev = dev;
-            entry->len = len;
-            memcpy(entry+1, data, len);
-            if (!queue_push(&proto->queue, entry)) {
-                errorf("queue_push() failure");
-                memory_free(entry);
-                return -1;
+            if (!proto) {
+                /* unsupported protocol */
+                counters_add(dev->stats, NET_DEVICE_STATS_RX_DROPS, 1);
+                continue;
             }
-            debugf("queue pushed (num:%u), dev=%s, type=%s(0x%04x), len=%zd", proto->queue.num, dev->name, proto->name, type, len);
-            debugdump(data, len);
-            raise_softirq();
-            return 0;
         }
+        worker = proto->hash ? net_worker_select(proto->hash(pb)) : 0;
+        next = &proto->queues[worker];
+        if (next != queue) {
+            if (queue) {
+                mutex_unlock(&queue->lock);
+            }
+            /* NOTE: drivers push from the interrupt thread, but loopback does from any thread */
+            queue = next;
+            mutex_lock(&queue->lock);
+        }
+        /* NOTE: the worker may modify pb as soon as it is pushed, dump it before */
+        debugf("queue push (num:%u), dev=%s, type=%s(0x%04x), len=%zd, worker=%u", ring_count(&queue->ring), dev->name, proto->name, pb->type, pb->len, worker);
+        debugdump(pb->data, pb->len);
+        TRACE_POINT(TRACE_STAGE_ENQUEUE, pb);
+        if (ring_push(&queue->ring, pbuf_ref(pb)) == -1) {
+            /* NOTE: not logged as an error, it floods under the overload, see the drops in the stats */
+            debugf("queue is full, drop, dev=%s, type=%s(0x%04x), worker=%u", dev->name, proto->name, pb->type, worker);
+            queue->drops++;
+            counters_add(dev->stats, NET_DEVICE_STATS_RX_DROPS, 1);
+            pbuf_free(pb);
+            continue;
+        }
+        raised |= (uint64_t)1 << worker;
+        num++;
+        bytes += pb->len;
     }
-    /* unsupported protocol */
-    return 0;
+    if (queue) {
+        mutex_unlock(&queue->lock);
+    }
+    /* NOTE: counted once for the batch, the packets handed to the protocols */
+    if (num) {
+        counters_add(dev->stats, NET_DEVICE_STATS_RX_PACKETS, num);
+        counters_add(dev->stats, NET_DEVICE_STATS_RX_BYTES, bytes);
+    }
+    for (worker = 0; raised; worker++, raised >>= 1) {
+        if (raised & 1) {
+            trace_softirq_raise(worker);
+            raise_softirq(worker);
+        }
+    }
+    return num;
+}
+
+int
+net_input_handler(uint16_t type, struct pbuf *pb, struct net_device *dev)
+{
+    pb->type = type;
+    return net_input_handler_batch(&pb, 1, dev) == 1 ? 0 : -1;
 }
 
 /* NOTE: must not be call after net_run() */
 int
-net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev))
+net_protocol_register(const char *name, uint16_t type, void (*handler)(struct pbuf *pb, struct net_device *dev))
 {
     struct net_protocol *proto;
+    unsigned int i;
 
     for (proto = protocols; proto; proto = proto->next) {
         if (type == proto->type) {
@@ -205,11 +444,23 @@ net_protocol_register(const char *name, uint16_t type, void (*handler)(const uin
             return -1;
         }
     }
-    proto = memory_alloc(sizeof(*proto));
+    proto = memory_alloc(sizeof(*proto) + sizeof(*proto->queues) * workers);
     if (!proto) {
         errorf("memory_alloc() failure");
         return -1;
     }
+    proto->queues = (struct net_protocol_queue *)(proto + 1);
+    for (i = 0; i < workers; i++) {
+        if (ring_init(&proto->queues[i].ring, NET_PROTOCOL_QUEUE_SIZE) == -1) {
+            errorf("ring_init() failure");
+            while (i--) {
+                ring_destroy(&proto->queues[i].ring);
+            }
+            memory_free(proto);
+            return -1;
+        }
+        mutex_init(&proto->queues[i].lock);
+    }
     strncpy(proto->name, name, sizeof(proto->name)-1);
     proto->type = type;
     proto->handler = handler;
@@ -219,6 +470,41 @@ net_protocol_register(const char *name, uint16_t type, void (*handler)(const uin
     return 0;
 }
 
+/* NOTE: the packets of the same flow must have the same hash, must not be call after net_run() */
+int
+net_protocol_set_flow_hash(uint16_t type, uint32_t (*hash)(const struct pbuf *pb))
+{
+    struct net_protocol *proto;
+
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == type) {
+            proto->hash = hash;
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%04x", type);
+    return -1;
+}
+
+/*
+ * NOTE: gro() may replace a run of the packets in pbs[] with a single one (freeing the others),
+ *       it returns the new number of them, in the same order. Must not be call after net_run().
+ */
+int
+net_protocol_set_gro(uint16_t type, int (*gro)(struct pbuf **pbs, int n))
+{
+    struct net_protocol *proto;
+
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == type) {
+            proto->gro = gro;
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%04x", type);
+    return -1;
+}
+
 char *
 net_protocol_name(uint16_t type)
 {
@@ -233,29 +519,273 @@ net_protocol_name(uint16_t type)
 }
 
 int
-net_protocol_handler(void)
+net_protocol_get_stats(uint16_t type, unsigned int worker, struct net_protocol_queue_stats *stats)
 {
     struct net_protocol *proto;
-    struct net_protocol_queue_entry *entry;
-    unsigned int num;
+    struct net_protocol_queue *queue;
 
+    if (worker >= workers) {
+        errorf("invalid worker, worker=%u", worker);
+        return -1;
+    }
     for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == type) {
+            queue = &proto->queues[worker];
+            stats->num = ring_count(&queue->ring);
+            stats->hwm = __atomic_load_n(&queue->hwm, __ATOMIC_RELAXED);
+            mutex_lock(&queue->lock);
+            stats->drops = queue->drops;
+            mutex_unlock(&queue->lock);
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%04x", type);
+    return -1;
+}
+
+/* NOTE: the queues of a worker have a single consumer, its own thread */
+int
+net_protocol_handler(unsigned int worker)
+{
+    struct net_protocol *proto;
+    struct ring *queue;
+    struct pbuf *pbs[NET_PROTOCOL_BATCH];
+    unsigned int count;
+    int n, i;
+
+    trace_softirq_entry(worker);
+    if (!worker && stats_dump_requested) {
+        stats_dump_requested = 0;
+        net_stats_dump(stderr);
+    }
+    net_tx_batch_begin();
+    for (proto = protocols; proto; proto = proto->next) {
+        queue = &proto->queues[worker].ring;
+        count = ring_count(queue);
+        if (count > proto->queues[worker].hwm) {
+            __atomic_store_n(&proto->queues[worker].hwm, count, __ATOMIC_RELAXED);
+        }
         while (1) {
-            entry = queue_pop(&proto->queue);
-            if (!entry) {
+            for (n = 0; n < NET_PROTOCOL_BATCH; n++) {
+                pbs[n] = ring_pop(queue);
+                if (!pbs[n]) {
+                    break;
+                }
+                debugf("queue popped (num:%u), dev=%s, type=0x%04x, len=%zd, worker=%u", ring_count(queue), pbs[n]->dev->name, proto->type, pbs[n]->len, worker);
+                debugdump(pbs[n]->data, pbs[n]->len);
+                TRACE_POINT(TRACE_STAGE_DEQUEUE, pbs[n]);
+            }
+            if (!n) {
                 break;
             }
-            num = proto->queue.num;
-            debugf("queue popped (num:%u), dev=%s, type=0x%04x, len=%zd", num, entry->dev->name, proto->type, entry->len);
-            debugdump((uint8_t *)(entry+1), entry->len);
-            proto->handler((uint8_t *)(entry+1), entry->len, entry->dev);
-            free(entry);
+            if (proto->gro && n > 1) {
+                n = proto->gro(pbs, n);
+            }
+            for (i = 0; i < n; i++) {
+                proto->handler(pbs[i], pbs[i]->dev);
+                pbuf_free(pbs[i]);
+            }
         }
     }
+    net_tx_batch_end();
     return 0;
 }
 
-/* NOTE: must not be call after net_run() */
+static void
+net_timeout_place(struct net_timeout_heap *heap, struct net_timeout *timeout, size_t index)
+{
+    heap->entries[index] = timeout;
+    timeout->index = index;
+}
+
+static void
+net_timeout_sift_up(struct net_timeout_heap *heap, size_t index)
+{
+    struct net_timeout *timeout;
+
+    timeout = heap->entries[index];
+    while (index > 1 && timeout->expire < heap->entries[index/2]->expire) {
+        net_timeout_place(heap, heap->entries[index/2], index);
+        index /= 2;
+    }
+    net_timeout_place(heap, timeout, index);
+}
+
+static void
+net_timeout_sift_down(struct net_timeout_heap *heap, size_t index)
+{
+    struct net_timeout *timeout;
+    size_t child;
+
+    timeout = heap->entries[index];
+    while ((child = index * 2) <= heap->num) {
+        if (child < heap->num && heap->entries[child+1]->expire < heap->entries[child]->expire) {
+            child++;
+        }
+        if (timeout->expire <= heap->entries[child]->expire) {
+            break;
+        }
+        net_timeout_place(heap, heap->entries[child], index);
+        index = child;
+    }
+    net_timeout_place(heap, timeout, index);
+}
+
+static void
+net_timeout_remove_locked(struct net_timeout_heap *heap, struct net_timeout *timeout)
+{
+    size_t index;
+    struct net_timeout *last;
+
+    index = timeout->index;
+    timeout->index = 0;
+    last = heap->entries[heap->num--];
+    if (last == timeout) {
+        return;
+    }
+    heap->entries[index] = last;
+    last->index = index;
+    net_timeout_sift_up(heap, index);
+    net_timeout_sift_down(heap, last->index);
+}
+
+/* NOTE: keep the platform timer armed for the earliest timeout (tickless, nothing runs while no timeout is due) */
+static void
+net_timeout_program_locked(struct net_timeout_heap *heap)
+{
+    uint64_t expire;
+
+    expire = heap->num ? heap->entries[1]->expire : 0;
+    if (expire == heap->programmed) {
+        return;
+    }
+    if (intr_timer_arm(heap - heaps, expire) == -1) {
+        errorf("intr_timer_arm() failure");
+        return;
+    }
+    heap->programmed = expire;
+}
+
+void
+net_timeout_init(struct net_timeout *timeout, void (*handler)(void *arg), void *arg)
+{
+    timeout->expire = 0;
+    timeout->handler = handler;
+    timeout->arg = arg;
+    timeout->index = 0;
+    timeout->worker = 0;
+}
+
+/* NOTE: expire is an absolute clock_usec() time, an armed timeout is moved to the new time */
+int
+net_timeout_arm(struct net_timeout *timeout, uint64_t expire)
+{
+    struct net_timeout_heap *heap;
+    struct net_timeout **tmp;
+    size_t size;
+
+    heap = &heaps[timeout->worker];
+    mutex_lock(&heap->mutex);
+    if (timeout->index) {
+        timeout->expire = expire;
+        net_timeout_sift_up(heap, timeout->index);
+        net_timeout_sift_down(heap, timeout->index);
+    } else {
+        if (heap->num + 1 >= heap->size) {
+            size = heap->size ? heap->size * 2 : 64;
+            tmp = memory_alloc(sizeof(*tmp) * size);
+            if (!tmp) {
+                mutex_unlock(&heap->mutex);
+                errorf("memory_alloc() failure");
+                return -1;
+            }
+            if (heap->entries) {
+                memcpy(tmp, heap->entries, sizeof(*tmp) * (heap->num + 1));
+                memory_free(heap->entries);
+            }
+            heap->entries = tmp;
+            heap->size = size;
+        }
+        timeout->expire = expire;
+        heap->entries[++heap->num] = timeout;
+        net_timeout_sift_up(heap, heap->num);
+    }
+    net_timeout_program_locked(heap);
+    mutex_unlock(&heap->mutex);
+    return 0;
+}
+
+int
+net_timeout_cancel(struct net_timeout *timeout)
+{
+    struct net_timeout_heap *heap;
+
+    heap = &heaps[timeout->worker];
+    mutex_lock(&heap->mutex);
+    if (timeout->index) {
+        net_timeout_remove_locked(heap, timeout);
+        net_timeout_program_locked(heap);
+    }
+    mutex_unlock(&heap->mutex);
+    return 0;
+}
+
+int
+net_timeout_armed(struct net_timeout *timeout)
+{
+    struct net_timeout_heap *heap;
+    int armed;
+
+    heap = &heaps[timeout->worker];
+    mutex_lock(&heap->mutex);
+    armed = timeout->index != 0;
+    mutex_unlock(&heap->mutex);
+    return armed;
+}
+
+/*
+ * NOTE: Move the timeout to the heap of the worker (e.g. the one its flow is steered to),
+ *       an armed timeout keeps its expiry. The owner must serialize it with arm/cancel.
+ */
+int
+net_timeout_bind(struct net_timeout *timeout, unsigned int worker)
+{
+    struct net_timeout_heap *heap;
+    uint64_t expire = 0;
+
+    if (worker >= workers) {
+        errorf("invalid worker, worker=%u, workers=%u", worker, workers);
+        return -1;
+    }
+    if (timeout->worker == worker) {
+        return 0;
+    }
+    heap = &heaps[timeout->worker];
+    mutex_lock(&heap->mutex);
+    if (timeout->index) {
+        expire = timeout->expire;
+        net_timeout_remove_locked(heap, timeout);
+        net_timeout_program_locked(heap);
+    }
+    mutex_unlock(&heap->mutex);
+    timeout->worker = worker;
+    if (expire) {
+        return net_timeout_arm(timeout, expire);
+    }
+    return 0;
+}
+
+static void
+net_timer_expired(void *arg)
+{
+    struct net_timer *timer;
+
+    timer = arg;
+    timer->handler();
+    net_timeout_arm(&timer->timeout, clock_usec() + timer->interval);
+}
+
+/* NOTE: a periodic timer on top of net_timeout, must not be call after net_run() */
 int
 net_timer_register(const char *name, struct timeval interval, void (*handler)(void))
 {
@@ -267,37 +797,151 @@ net_timer_register(const char *name, struct timeval interval, void (*handler)(vo
         return -1;
     }
     strncpy(timer->name, name, sizeof(timer->name)-1);
-    timer->interval = interval;
-    gettimeofday(&timer->last, NULL);
+    timer->interval = (uint64_t)interval.tv_sec * 1000000 + interval.tv_usec;
     timer->handler = handler;
-    timer->next = timers;
-    timers = timer;
+    net_timeout_init(&timer->timeout, net_timer_expired, timer);
+    if (net_timeout_arm(&timer->timeout, clock_usec() + timer->interval) == -1) {
+        memory_free(timer);
+        return -1;
+    }
     infof("registered: %s interval={%ld, %ld}", timer->name, interval.tv_sec, interval.tv_usec);
     return 0;
 }
 
+/* NOTE: runs the expired timeouts only, the cost does not depend on the number of armed ones */
 int
-net_timer_handler(void)
+net_timer_handler(unsigned int worker)
 {
-    struct net_timer *timer;
-    struct timeval now, diff;
-
-    for (timer = timers; timer; timer = timer->next) {
-        gettimeofday(&now, NULL);
-        timersub(&now, &timer->last, &diff);
-        if (timercmp(&timer->interval, &diff, <) != 0) { /* true (!0) or false (0) */
-            timer->handler();
-            timer->last = now;
+    struct net_timeout_heap *heap;
+    struct net_timeout *timeout;
+    void (*handler)(void *arg);
+    void *arg;
+    uint64_t now;
+
+    heap = &heaps[worker];
+    net_tx_batch_begin();
+    mutex_lock(&heap->mutex);
+    /* NOTE: the platform timer is one-shot, it is disarmed once it has fired */
+    heap->programmed = 0;
+    now = clock_usec();
+    while (heap->num && heap->entries[1]->expire <= now) {
+        timeout = heap->entries[1];
+        net_timeout_remove_locked(heap, timeout);
+        handler = timeout->handler;
+        arg = timeout->arg;
+        /*
+         * NOTE: The handler may arm or cancel timeouts (including this one). The owner may also
+         *       cancel and free it meanwhile, so the handler must validate arg by itself.
+         */
+        mutex_unlock(&heap->mutex);
+        handler(arg);
+        mutex_lock(&heap->mutex);
+        now = clock_usec();
+    }
+    net_timeout_program_locked(heap);
+    mutex_unlock(&heap->mutex);
+    net_tx_batch_end();
+    return 0;
+}
+
+/*
+ * Statistics
+ */
+
+/* NOTE: must not be call after net_run() */
+int
+net_stats_register(struct counters *counters, void (*dump)(FILE *fp))
+{
+    struct net_stats *entry, **tail;
+
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    entry->counters = counters;
+    entry->dump = dump;
+    for (tail = &stats; *tail; tail = &(*tail)->next);
+    *tail = entry;
+    return 0;
+}
+
+/* NOTE: a snapshot of the counters named after a device or a module, returns the number of the values */
+int
+net_stats_get(const char *name, uint64_t *values, unsigned int num)
+{
+    struct net_device *dev;
+    struct net_stats *entry;
+    struct counters *counters = NULL;
+
+    for (dev = devices; dev; dev = dev->next) {
+        if (strcmp(dev->stats->name, name) == 0) {
+            counters = dev->stats;
+            break;
+        }
+    }
+    for (entry = stats; entry && !counters; entry = entry->next) {
+        if (entry->counters && strcmp(entry->counters->name, name) == 0) {
+            counters = entry->counters;
         }
     }
+    if (!counters) {
+        errorf("not found, name=%s", name);
+        return -1;
+    }
+    if (num < counters->num) {
+        errorf("too short, num=%u, want=%u", num, counters->num);
+        return -1;
+    }
+    counters_snapshot(counters, values);
+    return counters->num;
+}
+
+void
+net_stats_dump(FILE *fp)
+{
+    struct net_device *dev;
+    struct net_protocol *proto;
+    struct net_protocol_queue_stats qstats;
+    struct net_stats *entry;
+    unsigned int worker;
+
+    for (dev = devices; dev; dev = dev->next) {
+        counters_dump(dev->stats, fp);
+    }
+    for (proto = protocols; proto; proto = proto->next) {
+        for (worker = 0; worker < workers; worker++) {
+            if (net_protocol_get_stats(proto->type, worker, &qstats) == 0) {
+                fprintf(fp, "queue: type=%s, worker=%u, num=%u, hwm=%u, drops=%" PRIu64 "\n",
+                    proto->name, worker, qstats.num, qstats.hwm, qstats.drops);
+            }
+        }
+    }
+    for (entry = stats; entry; entry = entry->next) {
+        if (entry->counters) {
+            counters_dump(entry->counters, fp);
+        }
+        if (entry->dump) {
+            entry->dump(fp);
+        }
+    }
+}
+
+/* NOTE: dumped to stderr by worker 0, may be called from a signal handler (e.g. for SIGQUIT, not SIGUSR1/SIGUSR2 taken by intr.c) */
+int
+net_stats_dump_request(void)
+{
+    stats_dump_requested = 1;
+    raise_softirq(0);
     return 0;
 }
 
 int
 net_interrupt(void)
 {
-    /* getpid(2) and kill(2) are signal safety functions. see signal-safety(7). */
-    return kill(getpid(), SIGUSR2);
+    /* NOTE: may be called from a signal handler, raise_event() is async-signal-safe */
+    raise_event();
+    return 0;
 }
 
 /* NOTE: must not be call after net_run() */
@@ -329,6 +973,29 @@ net_event_handler(void)
     return 0;
 }
 
+/* NOTE: must be called before net_init(), a single worker by default */
+int
+net_worker_setup(unsigned int num)
+{
+    if (protocols) {
+        errorf("already initialized");
+        return -1;
+    }
+    if (!num || num > NET_WORKER_MAX) {
+        errorf("invalid number, num=%u (1-%d)", num, NET_WORKER_MAX);
+        return -1;
+    }
+    workers = num;
+    return 0;
+}
+
+/* NOTE: map a flow hash to a worker, the same flow always goes to the same worker */
+unsigned int
+net_worker_select(uint32_t hash)
+{
+    return workers > 1 ? hash % workers : 0;
+}
+
 int
 net_run(void)
 {
@@ -355,7 +1022,9 @@ net_shutdown(void)
     for (dev = devices; dev; dev = dev->next) {
         net_device_close(dev);
     }
+    memory_dump(stderr);
     debugf("shutdown");
+    log_async_stop();
 }
 
 #include "arp.h"
@@ -363,11 +1032,21 @@ net_shutdown(void)
 #include "icmp.h"
 #include "udp.h"
 #include "tcp.h"
+#include "sock.h"
 
 int
 net_init(void)
 {
-    if (intr_init() == -1) {
+    unsigned int i;
+
+    if (memory_init() == -1) {
+        errorf("memory_init() failure");
+        return -1;
+    }
+    for (i = 0; i < workers; i++) {
+        mutex_init(&heaps[i].mutex);
+    }
+    if (intr_init(workers) == -1) {
         errorf("intr_init() failure");
         return -1;
     }
@@ -391,6 +1070,14 @@ net_init(void)
         errorf("tcp_init() failure");
         return -1;
     }
-    infof("initialized");
+    if (sock_init() == -1) {
+        errorf("sock_init() failure");
+        return -1;
+    }
+    if (trace_init() == -1) {
+        errorf("trace_init() failure");
+        return -1;
+    }
+    infof("initialized, workers=%u", workers);
     return 0;
 }
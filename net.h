@@ -1,9 +1,11 @@
 #ifndef NET_H
 #define NET_H
 
+#include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <signal.h>
 
 #ifndef IFNAMSIZ
@@ -13,6 +15,7 @@
 #define NET_DEVICE_TYPE_NULL      0x0000
 #define NET_DEVICE_TYPE_LOOPBACK  0x0001
 #define NET_DEVICE_TYPE_ETHERNET  0x0002
+#define NET_DEVICE_TYPE_SHMEM     0x0003
 
 #define NET_DEVICE_FLAG_UP        0x0001
 #define NET_DEVICE_FLAG_LOOPBACK  0x0010
@@ -20,7 +23,16 @@
 #define NET_DEVICE_FLAG_P2P       0x0040
 #define NET_DEVICE_FLAG_NEED_ARP  0x0100
 
+#define NET_DEVICE_FEATURE_RXCSUM 0x0001 /* verifies the transport checksums of the received packets */
+#define NET_DEVICE_FEATURE_TXCSUM 0x0002 /* fills the transport checksums left to it (PBUF_FLAG_CSUM_PARTIAL) */
+#define NET_DEVICE_FEATURE_TSO    0x0004 /* cuts the TCP super-segments (pb->gso_size) larger than the MTU */
+#define NET_DEVICE_FEATURE_IPCSUM 0x0008 /* fills and verifies the IP header checksums */
+
 #define NET_DEVICE_ADDR_LEN 16
+#define NET_DEVICE_POLL_BATCH 32 /* max number of packets received by a single poll */
+#define NET_DEVICE_TXQ_SIZE   32 /* max number of frames sent by a single flush */
+#define NET_DEVICE_HDR_MAX    16 /* max length of a link header */
+#define NET_DEVICE_PAD_MAX    64 /* max length of a zero padding */
 
 #define NET_DEVICE_IS_UP(x) ((x)->flags & NET_DEVICE_FLAG_UP)
 #define NET_DEVICE_STATE(x) (NET_DEVICE_IS_UP(x) ? "up" : "down")
@@ -37,7 +49,27 @@
 
 #define NET_IRQ_SHARED 0x0001
 
+#define NET_WORKER_MAX 64 /* max number of softirq worker threads */
+
+/* NOTE: the readiness of the transport endpoints, reported by tcp_poll()/udp_poll() */
+#define NET_POLLIN  0x0001 /* readable (data, a connection to accept, or the end of the stream) */
+#define NET_POLLOUT 0x0004 /* writable */
+#define NET_POLLERR 0x0008 /* an error (e.g. the connection reset) */
+#define NET_POLLHUP 0x0010 /* no longer connected */
+
+/* NOTE: the counters of a device, see net_stats_get() (named after the device) */
+#define NET_DEVICE_STATS_RX_PACKETS 0
+#define NET_DEVICE_STATS_RX_BYTES   1
+#define NET_DEVICE_STATS_RX_DROPS   2 /* unsupported protocol, or the input queue is full */
+#define NET_DEVICE_STATS_TX_PACKETS 3
+#define NET_DEVICE_STATS_TX_BYTES   4
+#define NET_DEVICE_STATS_TX_ERRORS  5
+#define NET_DEVICE_STATS_NUM        6
+
 struct net_device; /* forward declaration */
+struct pbuf; /* forward declaration */
+struct net_txq; /* forward declaration */
+struct counters; /* forward declaration */
 
 struct net_iface {
     struct net_iface *next;
@@ -46,11 +78,35 @@ struct net_iface {
     /* depends on implementation of protocols. */
 };
 
+/*
+ * NOTE: A frame to be transmitted. The link header is kept apart from the payload,
+ *       so the pbuf is not written by the link layer (and no headroom is needed).
+ */
+struct net_txq_entry {
+    struct pbuf *pb;
+    uint8_t hdr[NET_DEVICE_HDR_MAX];
+    uint16_t hlen;
+    uint16_t pad; /* length of the zero padding after the payload */
+};
+
+/*
+ * NOTE: A one-shot timeout, kept in a min-heap ordered by the expiry time (clock_usec()).
+ *       The owner embeds it and must cancel it before the memory goes away.
+ */
+struct net_timeout {
+    uint64_t expire;
+    void (*handler)(void *arg);
+    void *arg;
+    size_t index; /* position in the heap (1-origin), 0 if not armed */
+    unsigned int worker; /* the heap (and the thread running the handler) it belongs to */
+};
+
 struct net_device_ops {
     int (*open)(struct net_device *dev);
     int (*close)(struct net_device *dev);
-    int (*transmit)(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
-    int (*poll)(struct net_device *dev);
+    int (*transmit)(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst);
+    int (*poll)(struct net_device *dev, struct pbuf **pbs, int max); /* receive up to max packets (link header pulled, type set) */
+    int (*xmit)(struct net_device *dev, struct net_txq_entry *entries, int n); /* send n frames, returns the number of frames sent */
 };
 
 struct net_device {
@@ -61,6 +117,7 @@ struct net_device {
     uint16_t type;
     uint16_t mtu;
     uint16_t flags;
+    uint16_t features; /* offloads (NET_DEVICE_FEATURE_*), the driver may change them in open() */
     uint16_t hlen; /* header length */
     uint16_t alen; /* address length */
     uint8_t addr[NET_DEVICE_ADDR_LEN];
@@ -69,9 +126,18 @@ struct net_device {
         uint8_t broadcast[NET_DEVICE_ADDR_LEN];
     };
     struct net_device_ops *ops;
+    struct net_txq *txq; /* only for devices providing ops->xmit */
+    struct counters *stats; /* NET_DEVICE_STATS_XXX */
     void *priv;
 };
 
+/* NOTE: the state of the input queue of a protocol for a worker */
+struct net_protocol_queue_stats {
+    unsigned int num; /* packets queued at the moment */
+    unsigned int hwm; /* high-water mark, the most packets ever found queued by the worker */
+    uint64_t drops; /* packets dropped for the queue overflow */
+};
+
 extern struct net_device *
 net_device_alloc(void (*setup)(struct net_device *dev));
 extern int
@@ -81,28 +147,71 @@ net_device_add_iface(struct net_device *dev, struct net_iface *iface);
 extern struct net_iface *
 net_device_get_iface(struct net_device *dev, int family);
 extern int
-net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+net_device_output(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst);
+extern int
+net_device_poll(struct net_device *dev);
+extern int
+net_device_xmit(struct net_device *dev, const void *hdr, size_t hlen, struct pbuf *pb, size_t pad);
+extern int
+net_txq_entry_iov(const struct net_txq_entry *entry, struct iovec *iov);
+extern void
+net_tx_batch_begin(void);
+extern void
+net_tx_batch_end(void);
 
 extern int
-net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev);
+net_input_handler(uint16_t type, struct pbuf *pb, struct net_device *dev);
+extern int
+net_input_handler_batch(struct pbuf **pbs, int n, struct net_device *dev);
 
 extern int
-net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev));
+net_protocol_register(const char *name, uint16_t type, void (*handler)(struct pbuf *pb, struct net_device *dev));
+extern int
+net_protocol_set_flow_hash(uint16_t type, uint32_t (*hash)(const struct pbuf *pb));
+extern int
+net_protocol_set_gro(uint16_t type, int (*gro)(struct pbuf **pbs, int n));
 extern char *
 net_protocol_name(uint16_t type);
 extern int
-net_protocol_handler(void);
+net_protocol_get_stats(uint16_t type, unsigned int worker, struct net_protocol_queue_stats *stats);
+extern int
+net_protocol_handler(unsigned int worker);
 
 extern int
 net_timer_register(const char *name, struct timeval interval, void (*handler)(void));
 extern int
-net_timer_handler(void);
+net_timer_handler(unsigned int worker);
+
+extern void
+net_timeout_init(struct net_timeout *timeout, void (*handler)(void *arg), void *arg);
+extern int
+net_timeout_arm(struct net_timeout *timeout, uint64_t expire);
+extern int
+net_timeout_cancel(struct net_timeout *timeout);
+extern int
+net_timeout_armed(struct net_timeout *timeout);
+extern int
+net_timeout_bind(struct net_timeout *timeout, unsigned int worker);
+
+extern int
+net_worker_setup(unsigned int num);
+extern unsigned int
+net_worker_select(uint32_t hash);
 
 extern int
 net_event_subscribe(void (*handler)(void *arg), void *arg);
 extern int
 net_event_handler(void);
 
+extern int
+net_stats_register(struct counters *counters, void (*dump)(FILE *fp));
+extern int
+net_stats_get(const char *name, uint64_t *values, unsigned int num);
+extern void
+net_stats_dump(FILE *fp);
+extern int
+net_stats_dump_request(void);
+
 extern int
 net_interrupt(void);
 extern int
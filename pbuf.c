@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "pbuf.h"
+
+struct pbuf *
+pbuf_alloc(size_t headroom, size_t len)
+{
+    struct pbuf *pb;
+
+    pb = memory_alloc_raw(sizeof(*pb) + headroom + len);
+    if (!pb) {
+        errorf("memory_alloc_raw() failure");
+        return NULL;
+    }
+    /* NOTE: only the header is initialized, the data area is left as is */
+    pb->ref = 1;
+    pb->dev = NULL;
+    pb->type = 0;
+    pb->flags = 0;
+    pb->gso_size = 0;
+    pb->trace_ts = 0;
+    pb->head = pb->buf;
+    pb->data = pb->buf + headroom;
+    pb->len = len;
+    pb->size = headroom + len;
+    pb->release = NULL;
+    pb->arg = NULL;
+    return pb;
+}
+
+/* NOTE: wrap the memory without copying, release() is called when the last reference is dropped */
+struct pbuf *
+pbuf_alloc_external(uint8_t *buf, size_t size, void (*release)(struct pbuf *pb), void *arg)
+{
+    struct pbuf *pb;
+
+    pb = memory_alloc_raw(sizeof(*pb));
+    if (!pb) {
+        errorf("memory_alloc_raw() failure");
+        return NULL;
+    }
+    pb->ref = 1;
+    pb->dev = NULL;
+    pb->type = 0;
+    pb->flags = 0;
+    pb->gso_size = 0;
+    pb->trace_ts = 0;
+    pb->head = buf;
+    pb->data = buf;
+    pb->len = size;
+    pb->size = size;
+    pb->release = release;
+    pb->arg = arg;
+    return pb;
+}
+
+struct pbuf *
+pbuf_ref(struct pbuf *pb)
+{
+    __atomic_add_fetch(&pb->ref, 1, __ATOMIC_RELAXED);
+    return pb;
+}
+
+void
+pbuf_free(struct pbuf *pb)
+{
+    if (!pb) {
+        return;
+    }
+    if (__atomic_sub_fetch(&pb->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (pb->release) {
+            pb->release(pb);
+        }
+        memory_free(pb);
+    }
+}
+
+/* NOTE: a reference to pb itself, or to a private copy of its data if pb wraps external memory */
+struct pbuf *
+pbuf_own(struct pbuf *pb)
+{
+    struct pbuf *copy;
+
+    if (!PBUF_IS_EXTERNAL(pb)) {
+        return pbuf_ref(pb);
+    }
+    copy = pbuf_alloc(pbuf_headroom(pb), pb->len);
+    if (!copy) {
+        errorf("pbuf_alloc() failure");
+        return NULL;
+    }
+    copy->dev = pb->dev;
+    copy->type = pb->type;
+    copy->flags = pb->flags;
+    copy->csum_start = pb->csum_start;
+    copy->csum_offset = pb->csum_offset;
+    copy->gso_size = pb->gso_size;
+    copy->trace_id = pb->trace_id;
+    copy->trace_ts = pb->trace_ts;
+    memcpy(copy->data, pb->data, pb->len);
+    return copy;
+}
+
+/* NOTE: fill the checksum left to the device (PBUF_FLAG_CSUM_PARTIAL) by software instead */
+void
+pbuf_csum_fill(struct pbuf *pb)
+{
+    uint8_t *start;
+    uint16_t sum;
+
+    if (!(pb->flags & PBUF_FLAG_CSUM_PARTIAL)) {
+        return;
+    }
+    start = pb->head + pb->csum_start;
+    sum = cksum16_fold(cksum16_partial(start, pb->data + pb->len - start, 0));
+    memcpy(start + pb->csum_offset, &sum, sizeof(sum));
+    pb->flags &= ~PBUF_FLAG_CSUM_PARTIAL;
+}
+
+/* prepend len bytes (e.g. a protocol header) in front of the data */
+uint8_t *
+pbuf_push(struct pbuf *pb, size_t len)
+{
+    if (pbuf_headroom(pb) < len) {
+        errorf("no headroom, headroom=%zu, len=%zu", pbuf_headroom(pb), len);
+        return NULL;
+    }
+    pb->data -= len;
+    pb->len += len;
+    return pb->data;
+}
+
+/* remove len bytes (e.g. a protocol header) from the front of the data */
+uint8_t *
+pbuf_pull(struct pbuf *pb, size_t len)
+{
+    if (pb->len < len) {
+        errorf("too short, len=%zu, want=%zu", pb->len, len);
+        return NULL;
+    }
+    pb->data += len;
+    pb->len -= len;
+    return pb->data;
+}
+
+/* append len bytes at the tail of the data, returns the start of the appended area */
+uint8_t *
+pbuf_put(struct pbuf *pb, size_t len)
+{
+    uint8_t *tail;
+
+    if (pbuf_tailroom(pb) < len) {
+        return NULL;
+    }
+    tail = pb->data + pb->len;
+    pb->len += len;
+    return tail;
+}
+
+/* cut the data down to len bytes (e.g. drop link layer padding) */
+int
+pbuf_trim(struct pbuf *pb, size_t len)
+{
+    if (pb->len < len) {
+        return -1;
+    }
+    pb->len = len;
+    return 0;
+}
+
+/* make the buffer look freshly allocated again (e.g. to reuse it for the next receive) */
+int
+pbuf_reset(struct pbuf *pb, size_t headroom, size_t len)
+{
+    if (pb->size < headroom + len) {
+        return -1;
+    }
+    pb->data = pb->head + headroom;
+    pb->len = len;
+    pb->flags = 0;
+    pb->gso_size = 0;
+    pb->trace_ts = 0;
+    return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef PBUF_H
+#define PBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PBUF_HEADROOM 128 /* enough for link + IP + transport headers */
+
+#define PBUF_FLAG_CSUM_VALID   0x0001 /* rx: the transport checksum has been verified (e.g. by the device) */
+#define PBUF_FLAG_CSUM_PARTIAL 0x0002 /* tx: the transport checksum is left to the device, see csum_start */
+
+struct net_device; /* forward declaration */
+
+/*
+ * Packet Buffer
+ *
+ * NOTE: A pbuf passed to a function is only borrowed for the duration of the call.
+ *       If the callee needs to keep it (e.g. to put it on a queue), it must take
+ *       its own reference with pbuf_ref() and drop it with pbuf_free() later.
+ *       A pbuf may wrap external memory (e.g. a driver's receive ring), which must
+ *       be given back soon, so holders for an indefinite time use pbuf_own() instead.
+ */
+struct pbuf {
+    int ref;
+    struct net_device *dev; /* input device */
+    uint16_t type; /* protocol type of the data (e.g. NET_PROTOCOL_TYPE_IP) */
+    uint16_t flags;
+    /*
+     * NOTE: With PBUF_FLAG_CSUM_PARTIAL, the checksum field at csum_start + csum_offset holds the sum of
+     *       the pseudo header, the one's complement of the sum from csum_start to the end goes there.
+     *       csum_start is an offset from head, so that it stays while the headers are pushed.
+     */
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t gso_size; /* tx: the payload of a segment cut by the device, rx: of the segments coalesced */
+    uint32_t trace_id; /* rx: the packet in the trace ring, see trace.h */
+    uint64_t trace_ts; /* rx: clock_nsec() of the last tracepoint passed, 0 if none */
+    uint8_t *head; /* start of the buffer (buf, or external memory) */
+    uint8_t *data; /* start of valid data */
+    size_t len; /* length of valid data */
+    size_t size; /* size of the buffer */
+    void (*release)(struct pbuf *pb); /* only for external memory, called on the last pbuf_free() */
+    void *arg; /* for release */
+    uint8_t buf[] __attribute__((aligned(8)));
+};
+
+#define PBUF_IS_EXTERNAL(x) ((x)->release != NULL)
+
+static inline size_t
+pbuf_headroom(const struct pbuf *pb)
+{
+    return pb->data - pb->head;
+}
+
+static inline size_t
+pbuf_tailroom(const struct pbuf *pb)
+{
+    return pb->size - pbuf_headroom(pb) - pb->len;
+}
+
+extern struct pbuf *
+pbuf_alloc(size_t headroom, size_t len);
+extern struct pbuf *
+pbuf_alloc_external(uint8_t *buf, size_t size, void (*release)(struct pbuf *pb), void *arg);
+extern struct pbuf *
+pbuf_ref(struct pbuf *pb);
+extern struct pbuf *
+pbuf_own(struct pbuf *pb);
+extern void
+pbuf_free(struct pbuf *pb);
+extern void
+pbuf_csum_fill(struct pbuf *pb);
+
+extern uint8_t *
+pbuf_push(struct pbuf *pb, size_t len);
+extern uint8_t *
+pbuf_pull(struct pbuf *pb, size_t len);
+extern uint8_t *
+pbuf_put(struct pbuf *pb, size_t len);
+extern int
+pbuf_trim(struct pbuf *pb, size_t len);
+extern int
+pbuf_reset(struct pbuf *pb, size_t headroom, size_t len);
+
+#endif
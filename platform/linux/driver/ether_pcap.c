@@ -1,4 +1,4 @@
-#define _GNU_SOURCE /* for F_SETSIG */
+#define _GNU_SOURCE /* for recvmmsg/sendmmsg */
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -9,7 +9,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
-#include <sys/poll.h>
+#include <sys/mman.h>
 #include <linux/if.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
@@ -18,16 +18,51 @@
 
 #include "util.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ether.h"
 
 #include "driver/ether_pcap.h"
 
 #define ETHER_PCAP_IRQ (SIGRTMIN+3)
 
+/* PACKET_MMAP (TPACKET_V3) rings, see ETHER_PCAP_FLAG_MMAP */
+#define ETHER_PCAP_RING_BLOCK_SIZE (1 << 16)
+#define ETHER_PCAP_RING_FRAME_SIZE 2048
+#define ETHER_PCAP_RX_BLOCK_NUM 64
+#define ETHER_PCAP_TX_BLOCK_NUM 16
+#define ETHER_PCAP_TX_FRAME_NUM (ETHER_PCAP_TX_BLOCK_NUM * (ETHER_PCAP_RING_BLOCK_SIZE / ETHER_PCAP_RING_FRAME_SIZE))
+#define ETHER_PCAP_RX_TIMEOUT 1 /* ms, a partially filled block is handed over after this */
+#define ETHER_PCAP_TX_DATA_OFFSET TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+struct ether_pcap_ring; /* forward declaration */
+
+struct ether_pcap_block {
+    struct ether_pcap_ring *ring;
+    struct tpacket_block_desc *desc;
+    int ref; /* the received frames still in use (and the walker) */
+};
+
+/* NOTE: outlives the socket while the stack still holds received frames pointing into it */
+struct ether_pcap_ring {
+    uint8_t *map; /* RX ring followed by TX ring */
+    size_t size;
+    int ref; /* the device while opened, and each received frame still in use */
+    struct ether_pcap_block blocks[ETHER_PCAP_RX_BLOCK_NUM];
+};
+
 struct ether_pcap {
     char name[IFNAMSIZ];
     int fd;
     unsigned int irq;
+    int flags;
+    /* for ETHER_PCAP_FLAG_MMAP */
+    struct ether_pcap_ring *ring;
+    unsigned int rx_block; /* the block being walked */
+    struct tpacket3_hdr *rx_frame; /* next frame in the block */
+    uint32_t rx_remain; /* frames left in the block */
+    uint8_t *tx_ring;
+    unsigned int tx_frame; /* next slot to fill */
+    mutex_t tx_mutex;
 };
 
 #define PRIV(x) ((struct ether_pcap *)x->priv)
@@ -43,7 +78,7 @@ ether_pcap_addr(struct net_device *dev) {
         return -1;
     }
     ifr.ifr_addr.sa_family = AF_INET;
-    strncpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)-1);
+    memcpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)); /* NOTE: both are IFNAMSIZ, NUL-terminated by ether_pcap_init() */
     if (ioctl(soc, SIOCGIFHWADDR, &ifr) == -1) {
         errorf("ioctl(SIOCGIFHWADDR): %s, dev=%s", strerror(errno), dev->name);
         close(soc);
@@ -54,6 +89,65 @@ ether_pcap_addr(struct net_device *dev) {
     return 0;
 }
 
+static int
+ether_pcap_ring_setup(struct net_device *dev)
+{
+    struct ether_pcap *pcap;
+    int version = TPACKET_V3;
+    struct tpacket_req3 req = {};
+    struct ether_pcap_ring *ring;
+    unsigned int i;
+
+    pcap = PRIV(dev);
+    if (setsockopt(pcap->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+        errorf("setsockopt(PACKET_VERSION): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    req.tp_block_size = ETHER_PCAP_RING_BLOCK_SIZE;
+    req.tp_block_nr = ETHER_PCAP_RX_BLOCK_NUM;
+    req.tp_frame_size = ETHER_PCAP_RING_FRAME_SIZE;
+    req.tp_frame_nr = ETHER_PCAP_RX_BLOCK_NUM * (ETHER_PCAP_RING_BLOCK_SIZE / ETHER_PCAP_RING_FRAME_SIZE);
+    req.tp_retire_blk_tov = ETHER_PCAP_RX_TIMEOUT;
+    if (setsockopt(pcap->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+        errorf("setsockopt(PACKET_RX_RING): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = ETHER_PCAP_RING_BLOCK_SIZE;
+    req.tp_block_nr = ETHER_PCAP_TX_BLOCK_NUM;
+    req.tp_frame_size = ETHER_PCAP_RING_FRAME_SIZE;
+    req.tp_frame_nr = ETHER_PCAP_TX_FRAME_NUM;
+    if (setsockopt(pcap->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) == -1) {
+        errorf("setsockopt(PACKET_TX_RING): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    ring = memory_alloc(sizeof(*ring));
+    if (!ring) {
+        errorf("memory_alloc() failure, dev=%s", dev->name);
+        return -1;
+    }
+    ring->size = (size_t)ETHER_PCAP_RING_BLOCK_SIZE * (ETHER_PCAP_RX_BLOCK_NUM + ETHER_PCAP_TX_BLOCK_NUM);
+    ring->map = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pcap->fd, 0);
+    if (ring->map == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        memory_free(ring);
+        return -1;
+    }
+    ring->ref = 1;
+    for (i = 0; i < ETHER_PCAP_RX_BLOCK_NUM; i++) {
+        ring->blocks[i].ring = ring;
+        ring->blocks[i].desc = (struct tpacket_block_desc *)(ring->map + ETHER_PCAP_RING_BLOCK_SIZE * i);
+        ring->blocks[i].ref = 0;
+    }
+    pcap->ring = ring;
+    pcap->rx_block = 0;
+    pcap->rx_frame = NULL;
+    pcap->rx_remain = 0;
+    pcap->tx_ring = ring->map + ETHER_PCAP_RING_BLOCK_SIZE * ETHER_PCAP_RX_BLOCK_NUM;
+    pcap->tx_frame = 0;
+    return 0;
+}
+
 static int
 ether_pcap_open(struct net_device *dev)
 {
@@ -68,7 +162,7 @@ ether_pcap_open(struct net_device *dev)
         errorf("socket: %s, dev=%s", strerror(errno), dev->name);
         return -1;
     }
-    strncpy(ifr.ifr_name, pcap->name, sizeof(ifr.ifr_name)-1);
+    memcpy(ifr.ifr_name, pcap->name, sizeof(ifr.ifr_name)); /* NOTE: both are IFNAMSIZ, NUL-terminated by ether_pcap_init() */
     if (ioctl(pcap->fd, SIOCGIFINDEX, &ifr) == -1) {
         errorf("ioctl(SIOCGIFINDEX): %s, dev=%s", strerror(errno), dev->name);
         close(pcap->fd);
@@ -93,21 +187,16 @@ ether_pcap_open(struct net_device *dev)
         close(pcap->fd);
         return -1;
     }
-    /* Set Asynchronous I/O signal delivery destination */
-    if (fcntl(pcap->fd, F_SETOWN, getpid()) == -1) {
-        errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
-        return -1;
-    }
-    /* Enable Asynchronous I/O */
-    if (fcntl(pcap->fd, F_SETFL, O_ASYNC) == -1) {
-        errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
-        return -1;
+    if (pcap->flags & ETHER_PCAP_FLAG_MMAP) {
+        if (ether_pcap_ring_setup(dev) == -1) {
+            errorf("ether_pcap_ring_setup() failure, dev=%s", dev->name);
+            close(pcap->fd);
+            return -1;
+        }
     }
-    /* Use other signal instead of SIGIO */
-    if (fcntl(pcap->fd, F_SETSIG, pcap->irq) == -1) {
-        errorf("fcntl(F_SETSIG): %s, dev=%s", strerror(errno), dev->name);
+    /* Deliver the readiness of the fd as an IRQ */
+    if (intr_attach_fd(pcap->irq, pcap->fd) == -1) {
+        errorf("intr_attach_fd() failure, dev=%s", dev->name);
         close(pcap->fd);
         return -1;
     }
@@ -121,63 +210,235 @@ ether_pcap_open(struct net_device *dev)
     return 0;
 };
 
+static void
+ether_pcap_ring_put(struct ether_pcap_ring *ring)
+{
+    if (__atomic_sub_fetch(&ring->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap(ring->map, ring->size);
+        memory_free(ring);
+    }
+}
+
 static int
 ether_pcap_close(struct net_device *dev)
 {
-    close(PRIV(dev)->fd);
+    struct ether_pcap *pcap;
+
+    pcap = PRIV(dev);
+    /* NOTE: the frames still referenced by the stack keep pointing into the ring, it is unmapped by the last of them */
+    if (pcap->ring) {
+        ether_pcap_ring_put(pcap->ring);
+        pcap->ring = NULL;
+    }
+    close(pcap->fd);
     return 0;
 }
 
-static ssize_t
-ether_pcap_write(struct net_device *dev, const uint8_t *frame, size_t flen)
+int
+ether_pcap_transmit(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
-    return write(PRIV(dev)->fd, frame, flen);
+    return ether_transmit_helper(dev, type, pb, dst);
 }
 
-int
-ether_pcap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+static int
+ether_pcap_xmit(struct net_device *dev, struct net_txq_entry *entries, int n)
 {
-    return ether_transmit_helper(dev, type, buf, len, dst, ether_pcap_write);
+    struct mmsghdr msgs[NET_DEVICE_TXQ_SIZE] = {};
+    struct iovec iovs[NET_DEVICE_TXQ_SIZE][3];
+    int ret, i, sent = 0;
+
+    n = MIN(n, (int)countof(msgs));
+    for (i = 0; i < n; i++) {
+        msgs[i].msg_hdr.msg_iov = iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = net_txq_entry_iov(&entries[i], iovs[i]);
+    }
+    while (sent < n) {
+        ret = sendmmsg(PRIV(dev)->fd, msgs + sent, n - sent, 0);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errorf("sendmmsg: %s, dev=%s", strerror(errno), dev->name);
+            break;
+        }
+        sent += ret;
+    }
+    return sent;
 }
 
-static ssize_t
-ether_pcap_read(struct net_device *dev, uint8_t *buf, size_t size)
+static int
+ether_pcap_recv(struct net_device *dev, struct pbuf **pbs, int n)
 {
-    ssize_t len;
+    struct mmsghdr msgs[NET_DEVICE_POLL_BATCH] = {};
+    struct iovec iovs[NET_DEVICE_POLL_BATCH];
+    int ret, i;
 
-    len = read(PRIV(dev)->fd, buf, size);
-    if (len <= 0) {
-        if (len == -1 && errno != EINTR) {
-            errorf("read: %s, dev=%s", strerror(errno), dev->name);
+    n = MIN(n, (int)countof(msgs));
+    for (i = 0; i < n; i++) {
+        iovs[i].iov_base = pbs[i]->data;
+        iovs[i].iov_len = pbs[i]->len;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    ret = recvmmsg(PRIV(dev)->fd, msgs, n, MSG_DONTWAIT, NULL);
+    if (ret == -1) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
         }
+        errorf("recvmmsg: %s, dev=%s", strerror(errno), dev->name);
         return -1;
     }
-    return len;
+    for (i = 0; i < ret; i++) {
+        pbuf_trim(pbs[i], msgs[i].msg_len);
+    }
+    return ret;
 }
 
 static int
-ether_pcap_isr(unsigned int irq, void *id)
+ether_pcap_poll(struct net_device *dev, struct pbuf **pbs, int max)
 {
-    struct net_device *dev = (struct net_device *)id;
-    struct pollfd pfd;
-    int ret;
-
-    pfd.fd = PRIV(dev)->fd;
-    pfd.events = POLLIN;
-    while (1) {
-        ret = poll(&pfd, 1, 0);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                continue;
+    return ether_poll_helper(dev, pbs, max, ether_pcap_recv);
+}
+
+/*
+ * PACKET_MMAP (TPACKET_V3)
+ *
+ * NOTE: The received frames are handed to the stack in place, and a block goes back
+ *       to the kernel when all of its frames have been released by pbuf_free().
+ */
+
+static void
+ether_pcap_block_release(struct ether_pcap_block *block)
+{
+    if (__atomic_sub_fetch(&block->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_store_n(&block->desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    }
+}
+
+static void
+ether_pcap_frame_release(struct pbuf *pb)
+{
+    struct ether_pcap_block *block;
+
+    block = (struct ether_pcap_block *)pb->arg;
+    ether_pcap_block_release(block);
+    ether_pcap_ring_put(block->ring);
+}
+
+static int
+ether_pcap_ring_recv(struct net_device *dev, struct pbuf **pbs, int max)
+{
+    struct ether_pcap *pcap;
+    struct ether_pcap_block *block;
+    struct tpacket3_hdr *frame;
+    struct pbuf *pb;
+    int n = 0;
+
+    pcap = PRIV(dev);
+    while (n < max) {
+        block = &pcap->ring->blocks[pcap->rx_block];
+        if (!pcap->rx_frame) {
+            if (!(__atomic_load_n(&block->desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+                break;
             }
-            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
-            return -1;
+            block->ref = 1; /* held by the walker until the last frame */
+            pcap->rx_remain = block->desc->hdr.bh1.num_pkts;
+            pcap->rx_frame = (struct tpacket3_hdr *)((uint8_t *)block->desc + block->desc->hdr.bh1.offset_to_first_pkt);
+        }
+        if (pcap->rx_remain) {
+            frame = pcap->rx_frame;
+            pb = pbuf_alloc_external((uint8_t *)frame + frame->tp_mac, frame->tp_snaplen, ether_pcap_frame_release, block);
+            if (!pb) {
+                errorf("pbuf_alloc_external() failure, dev=%s", dev->name);
+                break;
+            }
+            __atomic_add_fetch(&block->ref, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&pcap->ring->ref, 1, __ATOMIC_RELAXED);
+            pbs[n++] = pb;
+            pcap->rx_frame = (struct tpacket3_hdr *)((uint8_t *)frame + frame->tp_next_offset);
+            pcap->rx_remain--;
+        }
+        if (!pcap->rx_remain) {
+            ether_pcap_block_release(block);
+            pcap->rx_frame = NULL;
+            pcap->rx_block = (pcap->rx_block + 1) % ETHER_PCAP_RX_BLOCK_NUM;
+        }
+    }
+    return n;
+}
+
+static int
+ether_pcap_ring_poll(struct net_device *dev, struct pbuf **pbs, int max)
+{
+    int n, num, i;
+
+    while ((n = ether_pcap_ring_recv(dev, pbs, max)) > 0) {
+        num = ether_input_helper(dev, pbs, n);
+        for (i = num; i < n; i++) {
+            pbuf_free(pbs[i]);
+        }
+        if (num) {
+            return num;
+        }
+    }
+    return n;
+}
+
+static int
+ether_pcap_ring_xmit(struct net_device *dev, struct net_txq_entry *entries, int n)
+{
+    struct ether_pcap *pcap;
+    struct tpacket3_hdr *frame;
+    struct iovec iov[3];
+    uint8_t *data;
+    size_t len;
+    int i, j, cnt;
+
+    pcap = PRIV(dev);
+    mutex_lock(&pcap->tx_mutex);
+    for (i = 0; i < n; i++) {
+        frame = (struct tpacket3_hdr *)(pcap->tx_ring + ETHER_PCAP_RING_FRAME_SIZE * pcap->tx_frame);
+        if (__atomic_load_n(&frame->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+            /* the ring is full, wait for the kernel to send out the pending frames */
+            if (send(pcap->fd, NULL, 0, 0) == -1) {
+                errorf("send: %s, dev=%s", strerror(errno), dev->name);
+                break;
+            }
+            if (__atomic_load_n(&frame->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+                errorf("tx ring is full, dev=%s", dev->name);
+                break;
+            }
+        }
+        data = (uint8_t *)frame + ETHER_PCAP_TX_DATA_OFFSET;
+        len = 0;
+        cnt = net_txq_entry_iov(&entries[i], iov);
+        for (j = 0; j < cnt; j++) {
+            if (len + iov[j].iov_len > ETHER_PCAP_RING_FRAME_SIZE - ETHER_PCAP_TX_DATA_OFFSET) {
+                break;
+            }
+            memcpy(data + len, iov[j].iov_base, iov[j].iov_len);
+            len += iov[j].iov_len;
         }
-        if (ret == 0) {
+        if (j < cnt) {
+            errorf("too long, dev=%s", dev->name);
             break;
         }
-        ether_poll_helper(dev, ether_pcap_read);
+        frame->tp_len = len;
+        frame->tp_next_offset = 0;
+        __atomic_store_n(&frame->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+        pcap->tx_frame = (pcap->tx_frame + 1) % ETHER_PCAP_TX_FRAME_NUM;
+    }
+    if (i && send(pcap->fd, NULL, 0, MSG_DONTWAIT) == -1 && errno != EAGAIN) {
+        errorf("send: %s, dev=%s", strerror(errno), dev->name);
     }
+    mutex_unlock(&pcap->tx_mutex);
+    return i;
+}
+
+static int
+ether_pcap_isr(unsigned int irq, void *id)
+{
+    net_device_poll((struct net_device *)id);
     return 0;
 }
 
@@ -185,10 +446,20 @@ static struct net_device_ops ether_pcap_ops = {
     .open = ether_pcap_open,
     .close = ether_pcap_close,
     .transmit = ether_pcap_transmit,
+    .poll = ether_pcap_poll,
+    .xmit = ether_pcap_xmit,
+};
+
+static struct net_device_ops ether_pcap_mmap_ops = {
+    .open = ether_pcap_open,
+    .close = ether_pcap_close,
+    .transmit = ether_pcap_transmit,
+    .poll = ether_pcap_ring_poll,
+    .xmit = ether_pcap_ring_xmit,
 };
 
 struct net_device *
-ether_pcap_init(const char *name, const char *addr)
+ether_pcap_init(const char *name, const char *addr, int flags)
 {
     struct net_device *dev;
     struct ether_pcap *pcap;
@@ -204,7 +475,7 @@ ether_pcap_init(const char *name, const char *addr)
             return NULL;
         }
     }
-    dev->ops = &ether_pcap_ops;
+    dev->ops = (flags & ETHER_PCAP_FLAG_MMAP) ? &ether_pcap_mmap_ops : &ether_pcap_ops;
     pcap = memory_alloc(sizeof(*pcap));
     if (!pcap) {
         errorf("memory_alloc() failure");
@@ -213,6 +484,8 @@ ether_pcap_init(const char *name, const char *addr)
     strncpy(pcap->name, name, sizeof(pcap->name)-1);
     pcap->fd = -1;
     pcap->irq = ETHER_PCAP_IRQ;
+    pcap->flags = flags;
+    mutex_init(&pcap->tx_mutex);
     dev->priv = pcap;
     if (net_device_register(dev) == -1) {
         errorf("net_device_register() failure");
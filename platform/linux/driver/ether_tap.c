@@ -1,4 +1,3 @@
-#define _GNU_SOURCE /* for F_SETSIG */
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -9,14 +8,16 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
-#include <sys/poll.h>
+#include <sys/uio.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 
 #include "platform.h"
 
 #include "util.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ether.h"
 
 #include "driver/ether_tap.h"
@@ -25,10 +26,14 @@
 
 #define ETHER_TAP_IRQ (SIGRTMIN+2)
 
+#define ETHER_TAP_SPILL_SIZE 65536 /* the rest of a frame coalesced by the kernel (GSO) beyond a receive buffer */
+
 struct ether_tap {
     char name[IFNAMSIZ];
     int fd;
     unsigned int irq;
+    int vnet; /* frames are preceded by struct virtio_net_hdr (IFF_VNET_HDR) */
+    uint8_t *spill;
 };
 
 #define PRIV(x) ((struct ether_tap *)x->priv)
@@ -44,7 +49,7 @@ ether_tap_addr(struct net_device *dev) {
         return -1;
     }
     ifr.ifr_addr.sa_family = AF_INET;
-    strncpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)-1);
+    memcpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)); /* NOTE: both are IFNAMSIZ, NUL-terminated by ether_tap_init() */
     if (ioctl(soc, SIOCGIFHWADDR, &ifr) == -1) {
         errorf("ioctl(SIOCGIFHWADDR): %s, dev=%s", strerror(errno), dev->name);
         close(soc);
@@ -62,33 +67,52 @@ ether_tap_open(struct net_device *dev)
     struct ifreq ifr = {};
 
     tap = PRIV(dev);
+    /* NOTE: the offloads depend on what this open negotiates, not on the previous one */
+    dev->features &= ~(NET_DEVICE_FEATURE_TXCSUM | NET_DEVICE_FEATURE_TSO | NET_DEVICE_FEATURE_RXCSUM);
     tap->fd = open(CLONE_DEVICE, O_RDWR);
     if (tap->fd == -1) {
         errorf("open: %s, dev=%s", strerror(errno), dev->name);
         return -1;
     }
-    strncpy(ifr.ifr_name, tap->name, sizeof(ifr.ifr_name)-1);
-    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    memcpy(ifr.ifr_name, tap->name, sizeof(ifr.ifr_name)); /* NOTE: both are IFNAMSIZ, NUL-terminated by ether_tap_init() */
+    /* NOTE: the virtio-net header carries the checksum and segmentation offloads, a plain TAP is used without it */
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+    tap->vnet = 1;
     if (ioctl(tap->fd, TUNSETIFF, &ifr) == -1) {
-        errorf("ioctl(TUNSETIFF): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
-        return -1;
+        warnf("ioctl(TUNSETIFF, IFF_VNET_HDR): %s, dev=%s", strerror(errno), dev->name);
+        ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+        tap->vnet = 0;
+        if (ioctl(tap->fd, TUNSETIFF, &ifr) == -1) {
+            errorf("ioctl(TUNSETIFF): %s, dev=%s", strerror(errno), dev->name);
+            close(tap->fd);
+            return -1;
+        }
     }
-    /* Set Asynchronous I/O signal delivery destination */
-    if (fcntl(tap->fd, F_SETOWN, getpid()) == -1) {
-        errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
-        return -1;
+    if (tap->vnet) {
+        /* NOTE: the frames we send may leave the checksum and the segmentation to the kernel anyway */
+        dev->features |= NET_DEVICE_FEATURE_TXCSUM | NET_DEVICE_FEATURE_TSO;
+        /* NOTE: the kernel may send us large TCP segments with the checksum left unsummed (it is never corrupted) */
+        if (ioctl(tap->fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4) == -1) {
+            warnf("ioctl(TUNSETOFFLOAD): %s, dev=%s", strerror(errno), dev->name);
+        } else {
+            dev->features |= NET_DEVICE_FEATURE_RXCSUM;
+        }
+        tap->spill = memory_alloc_raw(ETHER_TAP_SPILL_SIZE);
+        if (!tap->spill) {
+            errorf("memory_alloc_raw() failure, dev=%s", dev->name);
+            close(tap->fd);
+            return -1;
+        }
     }
-    /* Enable Asynchronous I/O */
-    if (fcntl(tap->fd, F_SETFL, O_ASYNC) == -1) {
+    /* Non-blocking, so that the receive loop can drain the queue */
+    if (fcntl(tap->fd, F_SETFL, fcntl(tap->fd, F_GETFL) | O_NONBLOCK) == -1) {
         errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), dev->name);
         close(tap->fd);
         return -1;
     }
-    /* Use other signal instead of SIGIO */
-    if (fcntl(tap->fd, F_SETSIG, tap->irq) == -1) {
-        errorf("fcntl(F_SETSIG): %s, dev=%s", strerror(errno), dev->name);
+    /* Deliver the readiness of the fd as an IRQ */
+    if (intr_attach_fd(tap->irq, tap->fd) == -1) {
+        errorf("intr_attach_fd() failure, dev=%s", dev->name);
         close(tap->fd);
         return -1;
     }
@@ -106,59 +130,144 @@ static int
 ether_tap_close(struct net_device *dev)
 {
     close(PRIV(dev)->fd);
+    memory_free(PRIV(dev)->spill);
+    PRIV(dev)->spill = NULL;
     return 0;
 }
 
-static ssize_t
-ether_tap_write(struct net_device *dev, const uint8_t *frame, size_t flen)
+int
+ether_tap_transmit(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
-    return write(PRIV(dev)->fd, frame, flen);
+    return ether_transmit_helper(dev, type, pb, dst);
 }
 
-int
-ether_tap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+/* NOTE: tell the kernel what is left to it, the checksum from csum_start and the segmentation by gso_size */
+static void
+ether_tap_vnet_hdr(const struct net_txq_entry *entry, struct virtio_net_hdr *vnet)
 {
-    return ether_transmit_helper(dev, type, buf, len, dst, ether_tap_write);
+    const struct pbuf *pb = entry->pb;
+    const uint8_t *start;
+
+    memset(vnet, 0, sizeof(*vnet));
+    if (pb->flags & PBUF_FLAG_CSUM_PARTIAL) {
+        start = pb->head + pb->csum_start;
+        vnet->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vnet->csum_start = entry->hlen + (start - pb->data);
+        vnet->csum_offset = pb->csum_offset;
+        if (pb->gso_size) {
+            /* NOTE: only TCP sets gso_size, hdr_len covers the link/IP/TCP headers copied to each segment */
+            vnet->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            vnet->gso_size = pb->gso_size;
+            vnet->hdr_len = vnet->csum_start + ((start[12] >> 4) << 2);
+        }
+    }
 }
 
+/* NOTE: TAP has no batch write, but writev() still avoids assembling the frame */
+static int
+ether_tap_xmit(struct net_device *dev, struct net_txq_entry *entries, int n)
+{
+    struct virtio_net_hdr vnet;
+    struct iovec iov[4];
+    int i, cnt;
+
+    for (i = 0; i < n; i++) {
+        cnt = 0;
+        if (PRIV(dev)->vnet) {
+            ether_tap_vnet_hdr(&entries[i], &vnet);
+            iov[0].iov_base = &vnet;
+            iov[0].iov_len = sizeof(vnet);
+            cnt++;
+        }
+        cnt += net_txq_entry_iov(&entries[i], iov + cnt);
+        if (writev(PRIV(dev)->fd, iov, cnt) == -1) {
+            errorf("writev: %s, dev=%s", strerror(errno), dev->name);
+            break;
+        }
+    }
+    return i;
+}
+
+/* NOTE: a frame longer than the buffer (coalesced by the kernel) is read into the spill area and moved to a larger one */
 static ssize_t
-ether_tap_read(struct net_device *dev, uint8_t *buf, size_t size)
+ether_tap_read(struct net_device *dev, struct pbuf **pb)
 {
+    struct ether_tap *tap = PRIV(dev);
+    struct virtio_net_hdr vnet;
+    struct iovec iov[3];
+    struct pbuf *large;
     ssize_t len;
 
-    len = read(PRIV(dev)->fd, buf, size);
+    if (!tap->vnet) {
+        return read(tap->fd, (*pb)->data, (*pb)->len);
+    }
+    iov[0].iov_base = &vnet;
+    iov[0].iov_len = sizeof(vnet);
+    iov[1].iov_base = (*pb)->data;
+    iov[1].iov_len = (*pb)->len;
+    iov[2].iov_base = tap->spill;
+    iov[2].iov_len = ETHER_TAP_SPILL_SIZE;
+AGAIN:
+    len = readv(tap->fd, iov, countof(iov));
     if (len <= 0) {
-        if (len == -1 && errno != EINTR) {
-            errorf("read: %s, dev=%s", strerror(errno), dev->name);
+        return len;
+    }
+    if ((size_t)len < sizeof(vnet)) {
+        errorf("too short, len=%zd, dev=%s", len, dev->name);
+        goto AGAIN;
+    }
+    len -= sizeof(vnet);
+    if ((size_t)len > (*pb)->len) {
+        large = pbuf_alloc(pbuf_headroom(*pb), len);
+        if (!large) {
+            errorf("pbuf_alloc() failure, drop, dev=%s", dev->name);
+            goto AGAIN;
         }
-        return -1;
+        memcpy(large->data, (*pb)->data, (*pb)->len);
+        memcpy(large->data + (*pb)->len, tap->spill, len - (*pb)->len);
+        pbuf_free(*pb);
+        *pb = large;
+    }
+    if (vnet.flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID)) {
+        (*pb)->flags |= PBUF_FLAG_CSUM_VALID;
+    }
+    if ((vnet.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_TCPV4) {
+        (*pb)->gso_size = vnet.gso_size;
     }
     return len;
 }
 
+/* NOTE: the fd is non-blocking, so this reads until the kernel queue runs dry */
 static int
-ether_tap_isr(unsigned int irq, void *id)
+ether_tap_recv(struct net_device *dev, struct pbuf **pbs, int n)
 {
-    struct net_device *dev = (struct net_device *)id;
-    struct pollfd pfd;
-    int ret;
-
-    pfd.fd = PRIV(dev)->fd;
-    pfd.events = POLLIN;
-    while (1) {
-        ret = poll(&pfd, 1, 0);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                continue;
+    ssize_t len;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        len = ether_tap_read(dev, &pbs[i]);
+        if (len <= 0) {
+            if (len == -1 && errno != EAGAIN && errno != EINTR) {
+                errorf("read: %s, dev=%s", strerror(errno), dev->name);
+                return i ? i : -1;
             }
-            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
-            return -1;
-        }
-        if (ret == 0) {
             break;
         }
-        ether_poll_helper(dev, ether_tap_read);
+        pbuf_trim(pbs[i], len);
     }
+    return i;
+}
+
+static int
+ether_tap_poll(struct net_device *dev, struct pbuf **pbs, int max)
+{
+    return ether_poll_helper(dev, pbs, max, ether_tap_recv);
+}
+
+static int
+ether_tap_isr(unsigned int irq, void *id)
+{
+    net_device_poll((struct net_device *)id);
     return 0;
 }
 
@@ -166,6 +275,8 @@ static struct net_device_ops ether_tap_ops = {
     .open = ether_tap_open,
     .close = ether_tap_close,
     .transmit = ether_tap_transmit,
+    .poll = ether_tap_poll,
+    .xmit = ether_tap_xmit,
 };
 
 struct net_device *
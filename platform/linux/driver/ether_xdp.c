@@ -0,0 +1,622 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "pbuf.h"
+#include "ether.h"
+
+#include "driver/ether_xdp.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+#define ETHER_XDP_IRQ (SIGRTMIN+4)
+
+#define ETHER_XDP_FRAME_SIZE 2048 /* XSK_UMEM__DEFAULT_FRAME_SIZE */
+#define ETHER_XDP_FRAME_NUM  4096
+#define ETHER_XDP_RING_SIZE  2048 /* power of two, for all of the four rings */
+#define ETHER_XDP_XSKMAP_SIZE 64 /* max queue id + 1 */
+
+#define ETHER_XDP_BUSY_POLL_USEC   20
+#define ETHER_XDP_BUSY_POLL_BUDGET 64
+
+struct ether_xdp_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *desc; /* uint64_t (fill/completion) or struct xdp_desc (rx/tx) */
+    uint32_t mask;
+    void *map;
+    size_t map_size;
+};
+
+struct ether_xdp {
+    char name[IFNAMSIZ];
+    unsigned int queue;
+    int flags;
+    int fd;
+    unsigned int irq;
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    uint8_t *umem;
+    struct ether_xdp_ring fill;
+    struct ether_xdp_ring comp;
+    struct ether_xdp_ring rx;
+    struct ether_xdp_ring tx;
+    /* free UMEM frames (offset of the frame) */
+    mutex_t mutex;
+    uint64_t frames[ETHER_XDP_FRAME_NUM];
+    unsigned int nframes;
+    uint8_t held[ETHER_XDP_FRAME_NUM]; /* the received frames still referenced by the stack */
+    mutex_t tx_mutex; /* serializes the tx and completion rings */
+};
+
+#define PRIV(x) ((struct ether_xdp *)x->priv)
+
+static int
+ether_xdp_addr(struct net_device *dev) {
+    int soc;
+    struct ifreq ifr = {};
+
+    soc = socket(AF_INET, SOCK_DGRAM, 0);
+    if (soc == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    ifr.ifr_addr.sa_family = AF_INET;
+    memcpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)); /* NOTE: both are IFNAMSIZ, NUL-terminated by ether_xdp_init() */
+    if (ioctl(soc, SIOCGIFHWADDR, &ifr) == -1) {
+        errorf("ioctl(SIOCGIFHWADDR): %s, dev=%s", strerror(errno), dev->name);
+        close(soc);
+        return -1;
+    }
+    memcpy(dev->addr, ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
+    close(soc);
+    return 0;
+}
+
+/*
+ * UMEM Frames
+ */
+
+static uint64_t
+ether_xdp_frame_get(struct ether_xdp *xdp)
+{
+    uint64_t addr = UINT64_MAX;
+
+    mutex_lock(&xdp->mutex);
+    if (xdp->nframes) {
+        addr = xdp->frames[--xdp->nframes];
+    }
+    mutex_unlock(&xdp->mutex);
+    return addr;
+}
+
+static void
+ether_xdp_frame_put(struct ether_xdp *xdp, uint64_t addr)
+{
+    mutex_lock(&xdp->mutex);
+    xdp->frames[xdp->nframes++] = addr & ~((uint64_t)ETHER_XDP_FRAME_SIZE - 1);
+    mutex_unlock(&xdp->mutex);
+}
+
+/* NOTE: called by pbuf_free() of a received frame, in whatever thread that is */
+static void
+ether_xdp_frame_release(struct pbuf *pb)
+{
+    struct ether_xdp *xdp;
+    uint64_t addr;
+
+    xdp = (struct ether_xdp *)pb->arg;
+    addr = pb->head - xdp->umem;
+    mutex_lock(&xdp->mutex);
+    xdp->held[addr / ETHER_XDP_FRAME_SIZE] = 0;
+    xdp->frames[xdp->nframes++] = addr;
+    mutex_unlock(&xdp->mutex);
+}
+
+/*
+ * Rings (single producer/single consumer, shared with the kernel)
+ */
+
+static uint32_t
+ether_xdp_ring_free(struct ether_xdp_ring *ring)
+{
+    return ETHER_XDP_RING_SIZE - (*ring->producer - __atomic_load_n(ring->consumer, __ATOMIC_ACQUIRE));
+}
+
+static uint32_t
+ether_xdp_ring_avail(struct ether_xdp_ring *ring)
+{
+    return __atomic_load_n(ring->producer, __ATOMIC_ACQUIRE) - *ring->consumer;
+}
+
+static int
+ether_xdp_ring_map(struct net_device *dev, struct ether_xdp_ring *ring, struct xdp_ring_offset *off, size_t dsize, off_t pgoff)
+{
+    struct ether_xdp *xdp;
+    uint8_t *map;
+
+    xdp = PRIV(dev);
+    ring->map_size = off->desc + ETHER_XDP_RING_SIZE * dsize;
+    map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xdp->fd, pgoff);
+    if (map == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    ring->map = map;
+    ring->producer = (uint32_t *)(map + off->producer);
+    ring->consumer = (uint32_t *)(map + off->consumer);
+    ring->flags = (uint32_t *)(map + off->flags);
+    ring->desc = map + off->desc;
+    ring->mask = ETHER_XDP_RING_SIZE - 1;
+    return 0;
+}
+
+/* NOTE: give free frames to the kernel for receiving */
+static void
+ether_xdp_fill(struct ether_xdp *xdp)
+{
+    uint32_t n, i, prod;
+    uint64_t addr;
+
+    n = ether_xdp_ring_free(&xdp->fill);
+    prod = *xdp->fill.producer;
+    for (i = 0; i < n; i++) {
+        addr = ether_xdp_frame_get(xdp);
+        if (addr == UINT64_MAX) {
+            break;
+        }
+        ((uint64_t *)xdp->fill.desc)[(prod + i) & xdp->fill.mask] = addr;
+    }
+    __atomic_store_n(xdp->fill.producer, prod + i, __ATOMIC_RELEASE);
+}
+
+/* NOTE: take back the frames the kernel has finished sending, must be called after tx_mutex locked */
+static void
+ether_xdp_complete(struct ether_xdp *xdp)
+{
+    uint32_t n, i, cons;
+
+    n = ether_xdp_ring_avail(&xdp->comp);
+    cons = *xdp->comp.consumer;
+    for (i = 0; i < n; i++) {
+        ether_xdp_frame_put(xdp, ((uint64_t *)xdp->comp.desc)[(cons + i) & xdp->comp.mask]);
+    }
+    __atomic_store_n(xdp->comp.consumer, cons + n, __ATOMIC_RELEASE);
+}
+
+/*
+ * XDP Program
+ *
+ * NOTE: Redirect every frame on the queue to the socket bound to it (or pass it to
+ *       the kernel if there is none). It is tiny enough to be written by hand, so we
+ *       don't depend on libbpf/libxdp.
+ */
+
+static int
+ether_xdp_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int
+ether_xdp_prog_attach(struct net_device *dev, int ifindex)
+{
+    struct ether_xdp *xdp;
+    union bpf_attr attr;
+    int key;
+    char license[] = "GPL";
+    struct bpf_insn insns[] = {
+        /* r2 = ctx->rx_queue_index */
+        {.code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = offsetof(struct xdp_md, rx_queue_index)},
+        /* r1 = xskmap */
+        {.code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD},
+        {0},
+        /* r3 = XDP_PASS (the action when the lookup fails) */
+        {.code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS},
+        /* return bpf_redirect_map(r1, r2, r3) */
+        {.code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map},
+        {.code = BPF_JMP | BPF_EXIT},
+    };
+
+    xdp = PRIV(dev);
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = ETHER_XDP_XSKMAP_SIZE;
+    xdp->map_fd = ether_xdp_bpf(BPF_MAP_CREATE, &attr);
+    if (xdp->map_fd == -1) {
+        errorf("bpf(BPF_MAP_CREATE): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    key = xdp->queue;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xdp->map_fd;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)&xdp->fd;
+    if (ether_xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+        errorf("bpf(BPF_MAP_UPDATE_ELEM): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    insns[1].imm = xdp->map_fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t)insns;
+    attr.insn_cnt = countof(insns);
+    attr.license = (uintptr_t)license;
+    xdp->prog_fd = ether_xdp_bpf(BPF_PROG_LOAD, &attr);
+    if (xdp->prog_fd == -1) {
+        errorf("bpf(BPF_PROG_LOAD): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    /* NOTE: the program is detached when the link fd is closed (also on exit) */
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = xdp->prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = (xdp->flags & ETHER_XDP_FLAG_SKB_MODE) ? XDP_FLAGS_SKB_MODE : 0;
+    xdp->link_fd = ether_xdp_bpf(BPF_LINK_CREATE, &attr);
+    if (xdp->link_fd == -1) {
+        errorf("bpf(BPF_LINK_CREATE): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Device Operations
+ */
+
+static int
+ether_xdp_setup(struct net_device *dev)
+{
+    struct ether_xdp *xdp;
+    struct xdp_umem_reg reg = {};
+    struct xdp_mmap_offsets off;
+    socklen_t optlen;
+    int size = ETHER_XDP_RING_SIZE, opt;
+    struct sockaddr_xdp addr = {};
+    unsigned int i;
+
+    xdp = PRIV(dev);
+    /* NOTE: kept across close/open, the frames received before may still be referenced by the stack */
+    if (!xdp->umem) {
+        xdp->umem = mmap(NULL, (size_t)ETHER_XDP_FRAME_SIZE * ETHER_XDP_FRAME_NUM, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (xdp->umem == MAP_FAILED) {
+            errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+            xdp->umem = NULL;
+            return -1;
+        }
+    }
+    reg.addr = (uintptr_t)xdp->umem;
+    reg.len = (uint64_t)ETHER_XDP_FRAME_SIZE * ETHER_XDP_FRAME_NUM;
+    reg.chunk_size = ETHER_XDP_FRAME_SIZE;
+    if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1) {
+        errorf("setsockopt(XDP_UMEM_REG): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) == -1 ||
+        setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) == -1 ||
+        setsockopt(xdp->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) == -1 ||
+        setsockopt(xdp->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) == -1) {
+        errorf("setsockopt(XDP_*_RING): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    optlen = sizeof(off);
+    if (getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1) {
+        errorf("getsockopt(XDP_MMAP_OFFSETS): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (ether_xdp_ring_map(dev, &xdp->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) == -1 ||
+        ether_xdp_ring_map(dev, &xdp->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) == -1 ||
+        ether_xdp_ring_map(dev, &xdp->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) == -1 ||
+        ether_xdp_ring_map(dev, &xdp->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) == -1) {
+        return -1;
+    }
+    /* NOTE: the held ones go back to the free list when released */
+    mutex_lock(&xdp->mutex);
+    xdp->nframes = 0;
+    for (i = 0; i < ETHER_XDP_FRAME_NUM; i++) {
+        if (!xdp->held[i]) {
+            xdp->frames[xdp->nframes++] = (uint64_t)i * ETHER_XDP_FRAME_SIZE;
+        }
+    }
+    mutex_unlock(&xdp->mutex);
+    ether_xdp_fill(xdp);
+    if (xdp->flags & ETHER_XDP_FLAG_BUSY_POLL) {
+        opt = 1;
+        setsockopt(xdp->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &opt, sizeof(opt));
+        opt = ETHER_XDP_BUSY_POLL_USEC;
+        setsockopt(xdp->fd, SOL_SOCKET, SO_BUSY_POLL, &opt, sizeof(opt));
+        opt = ETHER_XDP_BUSY_POLL_BUDGET;
+        if (setsockopt(xdp->fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &opt, sizeof(opt)) == -1) {
+            warnf("busy polling is not available: %s, dev=%s", strerror(errno), dev->name);
+        }
+    }
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = if_nametoindex(xdp->name);
+    addr.sxdp_queue_id = xdp->queue;
+    addr.sxdp_flags = XDP_USE_NEED_WAKEUP | ((xdp->flags & ETHER_XDP_FLAG_ZEROCOPY) ? XDP_ZEROCOPY : XDP_COPY);
+    if (bind(xdp->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        errorf("bind: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    return ether_xdp_prog_attach(dev, addr.sxdp_ifindex);
+}
+
+static void
+ether_xdp_cleanup(struct ether_xdp *xdp)
+{
+    struct ether_xdp_ring *rings[] = {&xdp->fill, &xdp->comp, &xdp->rx, &xdp->tx};
+    unsigned int i;
+
+    if (xdp->link_fd != -1) {
+        close(xdp->link_fd);
+        xdp->link_fd = -1;
+    }
+    if (xdp->prog_fd != -1) {
+        close(xdp->prog_fd);
+        xdp->prog_fd = -1;
+    }
+    if (xdp->map_fd != -1) {
+        close(xdp->map_fd);
+        xdp->map_fd = -1;
+    }
+    for (i = 0; i < countof(rings); i++) {
+        if (rings[i]->map) {
+            munmap(rings[i]->map, rings[i]->map_size);
+            rings[i]->map = NULL;
+        }
+    }
+    close(xdp->fd);
+    xdp->fd = -1;
+    /* NOTE: the UMEM is kept, received frames still referenced by the stack point into it */
+}
+
+static int
+ether_xdp_open(struct net_device *dev)
+{
+    struct ether_xdp *xdp;
+
+    xdp = PRIV(dev);
+    if (!if_nametoindex(xdp->name)) {
+        errorf("no such interface, dev=%s, name=%s", dev->name, xdp->name);
+        return -1;
+    }
+    xdp->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xdp->fd == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (ether_xdp_setup(dev) == -1) {
+        errorf("ether_xdp_setup() failure, dev=%s", dev->name);
+        ether_xdp_cleanup(xdp);
+        return -1;
+    }
+    /* Deliver the readiness of the fd as an IRQ */
+    if (intr_attach_fd(xdp->irq, xdp->fd) == -1) {
+        errorf("intr_attach_fd() failure, dev=%s", dev->name);
+        ether_xdp_cleanup(xdp);
+        return -1;
+    }
+    if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
+        if (ether_xdp_addr(dev) == -1) {
+            errorf("ether_xdp_addr() failure, dev=%s", dev->name);
+            ether_xdp_cleanup(xdp);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+ether_xdp_close(struct net_device *dev)
+{
+    ether_xdp_cleanup(PRIV(dev));
+    return 0;
+}
+
+int
+ether_xdp_transmit(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
+{
+    return ether_transmit_helper(dev, type, pb, dst);
+}
+
+static int
+ether_xdp_xmit(struct net_device *dev, struct net_txq_entry *entries, int n)
+{
+    struct ether_xdp *xdp;
+    struct xdp_desc *desc;
+    struct iovec iov[3];
+    uint32_t prod;
+    uint64_t addr;
+    size_t len;
+    int i, j, cnt;
+
+    xdp = PRIV(dev);
+    mutex_lock(&xdp->tx_mutex);
+    ether_xdp_complete(xdp);
+    n = MIN(n, (int)ether_xdp_ring_free(&xdp->tx));
+    prod = *xdp->tx.producer;
+    for (i = 0; i < n; i++) {
+        len = 0;
+        cnt = net_txq_entry_iov(&entries[i], iov);
+        for (j = 0; j < cnt; j++) {
+            len += iov[j].iov_len;
+        }
+        if (len > ETHER_XDP_FRAME_SIZE) {
+            errorf("too long, dev=%s, len=%zu", dev->name, len);
+            break;
+        }
+        addr = ether_xdp_frame_get(xdp);
+        if (addr == UINT64_MAX) {
+            errorf("no free frame, dev=%s", dev->name);
+            break;
+        }
+        /* NOTE: the payload is not in the UMEM, so this is the one copy on transmit */
+        len = 0;
+        for (j = 0; j < cnt; j++) {
+            memcpy(xdp->umem + addr + len, iov[j].iov_base, iov[j].iov_len);
+            len += iov[j].iov_len;
+        }
+        desc = &((struct xdp_desc *)xdp->tx.desc)[(prod + i) & xdp->tx.mask];
+        desc->addr = addr;
+        desc->len = len;
+        desc->options = 0;
+    }
+    __atomic_store_n(xdp->tx.producer, prod + i, __ATOMIC_RELEASE);
+    if (i && ((xdp->flags & ETHER_XDP_FLAG_BUSY_POLL) || (__atomic_load_n(xdp->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP))) {
+        if (sendto(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1 && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+            errorf("sendto: %s, dev=%s", strerror(errno), dev->name);
+        }
+    }
+    mutex_unlock(&xdp->tx_mutex);
+    return i;
+}
+
+static int
+ether_xdp_recv(struct net_device *dev, struct pbuf **pbs, int max)
+{
+    struct ether_xdp *xdp;
+    struct xdp_desc *desc;
+    uint32_t n, i, cons;
+
+    xdp = PRIV(dev);
+    n = MIN((uint32_t)max, ether_xdp_ring_avail(&xdp->rx));
+    cons = *xdp->rx.consumer;
+    for (i = 0; i < n; i++) {
+        desc = &((struct xdp_desc *)xdp->rx.desc)[(cons + i) & xdp->rx.mask];
+        /* NOTE: zero copy, the frame goes back to the free list when the pbuf is released */
+        pbs[i] = pbuf_alloc_external(xdp->umem + desc->addr, desc->len, ether_xdp_frame_release, xdp);
+        if (!pbs[i]) {
+            errorf("pbuf_alloc_external() failure, dev=%s", dev->name);
+            break;
+        }
+        /* NOTE: the kernel may leave headroom in front of the frame, give it to the pbuf */
+        pbs[i]->head = xdp->umem + (desc->addr & ~((uint64_t)ETHER_XDP_FRAME_SIZE - 1));
+        pbs[i]->size = ETHER_XDP_FRAME_SIZE;
+        mutex_lock(&xdp->mutex);
+        xdp->held[desc->addr / ETHER_XDP_FRAME_SIZE] = 1;
+        mutex_unlock(&xdp->mutex);
+    }
+    __atomic_store_n(xdp->rx.consumer, cons + i, __ATOMIC_RELEASE);
+    return i;
+}
+
+static int
+ether_xdp_poll(struct net_device *dev, struct pbuf **pbs, int max)
+{
+    struct ether_xdp *xdp;
+    int n, num, i;
+
+    xdp = PRIV(dev);
+    ether_xdp_fill(xdp);
+    while ((n = ether_xdp_recv(dev, pbs, max)) > 0) {
+        num = ether_input_helper(dev, pbs, n);
+        for (i = num; i < n; i++) {
+            pbuf_free(pbs[i]);
+        }
+        if (num) {
+            return num;
+        }
+    }
+    if ((xdp->flags & ETHER_XDP_FLAG_BUSY_POLL) || (__atomic_load_n(xdp->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)) {
+        /* NOTE: drive the NIC queue (busy poll), or tell the kernel that the fill ring has frames */
+        recvfrom(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+    return n;
+}
+
+static int
+ether_xdp_isr(unsigned int irq, void *id)
+{
+    net_device_poll((struct net_device *)id);
+    return 0;
+}
+
+static struct net_device_ops ether_xdp_ops = {
+    .open = ether_xdp_open,
+    .close = ether_xdp_close,
+    .transmit = ether_xdp_transmit,
+    .poll = ether_xdp_poll,
+    .xmit = ether_xdp_xmit,
+};
+
+struct net_device *
+ether_xdp_init(const char *name, const char *addr, unsigned int queue, int flags)
+{
+    struct net_device *dev;
+    struct ether_xdp *xdp;
+
+    if (queue >= ETHER_XDP_XSKMAP_SIZE) {
+        errorf("invalid queue, queue=%u", queue);
+        return NULL;
+    }
+    dev = net_device_alloc(ether_setup_helper);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->addr) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            return NULL;
+        }
+    }
+    dev->ops = &ether_xdp_ops;
+    /* NOTE: a frame must fit in a chunk of the UMEM, the segmentation is never left to the device */
+    dev->features &= ~NET_DEVICE_FEATURE_TSO;
+    xdp = memory_alloc(sizeof(*xdp));
+    if (!xdp) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    strncpy(xdp->name, name, sizeof(xdp->name)-1);
+    xdp->queue = queue;
+    xdp->flags = flags;
+    xdp->fd = -1;
+    xdp->irq = ETHER_XDP_IRQ;
+    xdp->map_fd = -1;
+    xdp->prog_fd = -1;
+    xdp->link_fd = -1;
+    mutex_init(&xdp->mutex);
+    mutex_init(&xdp->tx_mutex);
+    dev->priv = xdp;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(xdp);
+        return NULL;
+    }
+    intr_request_irq(xdp->irq, ether_xdp_isr, NET_IRQ_SHARED, dev->name, dev);
+    debugf("ethernet device initialized, dev=%s", dev->name);
+    return dev;
+}
@@ -0,0 +1,627 @@
+#define _GNU_SOURCE /* for memfd_create() and accept4() */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "pbuf.h"
+
+#include "driver/shmem.h"
+
+#define SHMEM_IRQ (SIGRTMIN+5)
+
+#define SHMEM_MAGIC     0x6d707368 /* "mpsh" */
+#define SHMEM_VERSION   1
+#define SHMEM_MTU       16384
+#define SHMEM_RING_SIZE 256 /* power of two, slots in each direction */
+#define SHMEM_CACHELINE 64
+
+#define SHMEM_ATTACH_TIMEOUT 5 /* seconds to wait for the memfd from the peer */
+
+#define SHMEM_SLOT_FLAG_CSUM_PARTIAL 0x0001 /* the transport checksum was left to the device (like VIRTIO_NET_HDR_F_DATA_VALID) */
+
+struct shmem_slot {
+    uint32_t len;
+    uint16_t type;
+    uint16_t flags;
+    uint8_t data[SHMEM_MTU];
+};
+
+/*
+ * NOTE: A single producer/single consumer ring, the indexes are free running and on their own cache lines.
+ *       The consumer sets waiting before it sleeps on the doorbell, and the producer rings it only then.
+ */
+struct shmem_ring {
+    uint32_t head __attribute__((aligned(SHMEM_CACHELINE))); /* written by the consumer */
+    uint32_t waiting;
+    uint32_t tail __attribute__((aligned(SHMEM_CACHELINE))); /* written by the producer */
+    struct shmem_slot slots[SHMEM_RING_SIZE] __attribute__((aligned(SHMEM_CACHELINE)));
+};
+
+/* NOTE: the layout of the memfd, rings[0] is sent by the process that created it */
+struct shmem_region {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t mtu;
+    uint32_t ring_size;
+    struct shmem_ring rings[2];
+};
+
+struct shmem {
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    unsigned int irq;
+    int memfd;
+    int listen_fd; /* only by the creator, until the peer connects */
+    int conn_fd; /* the doorbell of both directions, -1 while not connected */
+    int kicked; /* the peer has been told to look at the ring once connected */
+    struct shmem_region *region;
+    struct shmem_ring *tx; /* NULL once the peer has gone and the path could not be listened on again */
+    struct shmem_ring *rx;
+    mutex_t mutex; /* NOTE: the threads of this process are serialized into the single producer, it also guards the fds */
+};
+
+#define PRIV(x) ((struct shmem *)x->priv)
+
+/*
+ * Doorbell (a byte over the unix domain socket, its readiness is the IRQ)
+ */
+
+/* NOTE: must be called after shm->mutex locked, the fd is closed only under it (and may be reused after) */
+static void
+shmem_doorbell_ring(struct shmem *shm)
+{
+    uint8_t v = 1;
+    int fd;
+
+    fd = __atomic_load_n(&shm->conn_fd, __ATOMIC_ACQUIRE);
+    if (fd == -1) {
+        return;
+    }
+    /* NOTE: EAGAIN means the doorbell has been rung many times already */
+    if (send(fd, &v, sizeof(v), MSG_DONTWAIT | MSG_NOSIGNAL) == -1 && errno != EAGAIN) {
+        errorf("send: %s", strerror(errno));
+    }
+}
+
+/* NOTE: returns the number of the rings, or -1 if the peer has gone */
+static ssize_t
+shmem_doorbell_clear(struct shmem *shm)
+{
+    uint8_t buf[64];
+    ssize_t n, total = 0;
+
+    while ((n = recv(shm->conn_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        total += n;
+    }
+    if (n == 0 || errno != EAGAIN) {
+        return -1;
+    }
+    return total;
+}
+
+/* NOTE: called after a slot is produced (shm->mutex still locked), the fence pairs with the one in shmem_poll() */
+static void
+shmem_notify(struct shmem *shm)
+{
+    struct shmem_ring *ring = shm->tx;
+
+    if (__atomic_load_n(&shm->conn_fd, __ATOMIC_ACQUIRE) == -1) {
+        /* NOTE: kicked once the peer connects */
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_RELAXED)) {
+        shmem_doorbell_ring(shm);
+    }
+}
+
+/*
+ * Rendezvous (the creator passes the memfd to the peer over the socket)
+ */
+
+static int
+shmem_send_fd(int soc, int fd)
+{
+    struct msghdr msg = {};
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    uint8_t v = 0, buf[CMSG_SPACE(sizeof(fd))] = {};
+
+    iov.iov_base = &v;
+    iov.iov_len = sizeof(v);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+    if (sendmsg(soc, &msg, MSG_NOSIGNAL) == -1) {
+        errorf("sendmsg: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int
+shmem_recv_fd(int soc)
+{
+    struct msghdr msg = {};
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    uint8_t v, buf[CMSG_SPACE(sizeof(int))];
+    ssize_t n;
+    int fd;
+
+    /* NOTE: read only the byte carrying the fd, the doorbells after it are left to the ISR */
+    iov.iov_base = &v;
+    iov.iov_len = sizeof(v);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+    n = recvmsg(soc, &msg, MSG_CMSG_CLOEXEC);
+    if (n != 1) {
+        errorf("recvmsg: %s", n == 0 ? "closed by the peer" : strerror(errno));
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fd))) {
+        errorf("no fd passed");
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    return fd;
+}
+
+static int
+shmem_map(struct net_device *dev)
+{
+    struct shmem *shm;
+
+    shm = PRIV(dev);
+    shm->region = mmap(NULL, sizeof(*shm->region), PROT_READ | PROT_WRITE, MAP_SHARED, shm->memfd, 0);
+    if (shm->region == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        shm->region = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+shmem_create(struct net_device *dev, struct sockaddr_un *addr)
+{
+    struct shmem *shm;
+
+    shm = PRIV(dev);
+    shm->memfd = memfd_create("microps-shmem", MFD_CLOEXEC);
+    if (shm->memfd == -1) {
+        errorf("memfd_create: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (ftruncate(shm->memfd, sizeof(*shm->region)) == -1) {
+        errorf("ftruncate: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (shmem_map(dev) == -1) {
+        return -1;
+    }
+    /* NOTE: the memfd is zero-filled, both rings are empty */
+    shm->region->magic = SHMEM_MAGIC;
+    shm->region->version = SHMEM_VERSION;
+    shm->region->mtu = SHMEM_MTU;
+    shm->region->ring_size = SHMEM_RING_SIZE;
+    shm->region->rings[0].waiting = 1;
+    shm->region->rings[1].waiting = 1;
+    shm->tx = &shm->region->rings[0];
+    shm->rx = &shm->region->rings[1];
+    shm->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (shm->listen_fd == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    unlink(shm->path); /* left by a dead creator */
+    if (bind(shm->listen_fd, (struct sockaddr *)addr, sizeof(*addr)) == -1) {
+        errorf("bind: %s, dev=%s, path=%s", strerror(errno), dev->name, shm->path);
+        return -1;
+    }
+    if (listen(shm->listen_fd, 1) == -1) {
+        errorf("listen: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (intr_attach_fd(shm->irq, shm->listen_fd) == -1) {
+        errorf("intr_attach_fd() failure, dev=%s", dev->name);
+        return -1;
+    }
+    infof("waiting for the peer, dev=%s, path=%s", dev->name, shm->path);
+    return 0;
+}
+
+static int
+shmem_attach(struct net_device *dev, int soc)
+{
+    struct shmem *shm;
+    struct timeval tv = {SHMEM_ATTACH_TIMEOUT, 0};
+
+    shm = PRIV(dev);
+    if (setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1) {
+        errorf("setsockopt(SO_RCVTIMEO): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    shm->memfd = shmem_recv_fd(soc);
+    if (shm->memfd == -1) {
+        errorf("shmem_recv_fd() failure, dev=%s", dev->name);
+        return -1;
+    }
+    if (shmem_map(dev) == -1) {
+        return -1;
+    }
+    if (shm->region->magic != SHMEM_MAGIC || shm->region->version != SHMEM_VERSION ||
+        shm->region->mtu != SHMEM_MTU || shm->region->ring_size != SHMEM_RING_SIZE) {
+        errorf("incompatible peer, dev=%s, magic=0x%08x, version=%u", dev->name, shm->region->magic, shm->region->version);
+        return -1;
+    }
+    shm->tx = &shm->region->rings[1];
+    shm->rx = &shm->region->rings[0];
+    if (fcntl(soc, F_SETFL, fcntl(soc, F_GETFL) | O_NONBLOCK) == -1) {
+        errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (intr_attach_fd(shm->irq, soc) == -1) {
+        errorf("intr_attach_fd() failure, dev=%s", dev->name);
+        return -1;
+    }
+    mutex_lock(&shm->mutex);
+    __atomic_store_n(&shm->conn_fd, soc, __ATOMIC_RELEASE);
+    /* NOTE: ready to be rung, make the creator look at its ring and kick us back */
+    shm->kicked = 1;
+    shmem_doorbell_ring(shm);
+    mutex_unlock(&shm->mutex);
+    infof("connected, dev=%s, path=%s", dev->name, shm->path);
+    return 0;
+}
+
+/* NOTE: called by the ISR of the creator, only the first peer is accepted */
+static void
+shmem_accept(struct net_device *dev)
+{
+    struct shmem *shm;
+    int soc;
+
+    shm = PRIV(dev);
+    soc = accept4(shm->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (soc == -1) {
+        if (errno != EAGAIN) {
+            errorf("accept4: %s, dev=%s", strerror(errno), dev->name);
+        }
+        return;
+    }
+    if (shmem_send_fd(soc, shm->memfd) == -1) {
+        errorf("shmem_send_fd() failure, dev=%s", dev->name);
+        close(soc);
+        return;
+    }
+    close(shm->listen_fd);
+    shm->listen_fd = -1;
+    unlink(shm->path);
+    if (intr_attach_fd(shm->irq, soc) == -1) {
+        errorf("intr_attach_fd() failure, dev=%s", dev->name);
+        close(soc);
+        return;
+    }
+    mutex_lock(&shm->mutex);
+    __atomic_store_n(&shm->conn_fd, soc, __ATOMIC_RELEASE);
+    mutex_unlock(&shm->mutex);
+    infof("connected, dev=%s, path=%s", dev->name, shm->path);
+}
+
+/* NOTE: must be called after shm->mutex locked, unless the device is not opened yet */
+static void
+shmem_cleanup(struct shmem *shm)
+{
+    int fd;
+
+    fd = __atomic_exchange_n(&shm->conn_fd, -1, __ATOMIC_ACQ_REL);
+    if (fd != -1) {
+        close(fd);
+    }
+    if (shm->listen_fd != -1) {
+        close(shm->listen_fd);
+        shm->listen_fd = -1;
+        unlink(shm->path);
+    }
+    if (shm->region) {
+        munmap(shm->region, sizeof(*shm->region));
+        shm->region = NULL;
+    }
+    shm->tx = NULL;
+    shm->rx = NULL;
+    shm->kicked = 0;
+    if (shm->memfd != -1) {
+        close(shm->memfd);
+        shm->memfd = -1;
+    }
+}
+
+/*
+ * Device Operations
+ */
+
+/* NOTE: the peer is the process listening on the path, or it becomes one */
+static int
+shmem_open(struct net_device *dev)
+{
+    struct shmem *shm;
+    struct sockaddr_un addr = {};
+    int soc;
+
+    shm = PRIV(dev);
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, shm->path, sizeof(addr.sun_path)); /* NOTE: the same size, NUL-terminated by shmem_init() */
+    soc = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (soc == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (connect(soc, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        if (shmem_attach(dev, soc) == -1) {
+            errorf("shmem_attach() failure, dev=%s", dev->name);
+            close(soc);
+            shmem_cleanup(shm);
+            return -1;
+        }
+        return 0;
+    }
+    close(soc);
+    if (errno != ENOENT && errno != ECONNREFUSED) {
+        errorf("connect: %s, dev=%s, path=%s", strerror(errno), dev->name, shm->path);
+        return -1;
+    }
+    if (shmem_create(dev, &addr) == -1) {
+        errorf("shmem_create() failure, dev=%s", dev->name);
+        shmem_cleanup(shm);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * NOTE: called by the ISR once the peer has gone, the region is given up (the peer may still have it
+ *       mapped) and a new one is offered on the path to the next peer, like shmem_open() does.
+ */
+static void
+shmem_relisten(struct net_device *dev)
+{
+    struct shmem *shm;
+    struct sockaddr_un addr = {};
+
+    shm = PRIV(dev);
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, shm->path, sizeof(addr.sun_path)); /* NOTE: the same size, NUL-terminated by shmem_init() */
+    mutex_lock(&shm->mutex);
+    shmem_cleanup(shm);
+    if (shmem_create(dev, &addr) == -1) {
+        errorf("shmem_create() failure, the frames are dropped from now on, dev=%s", dev->name);
+        shmem_cleanup(shm);
+    }
+    mutex_unlock(&shm->mutex);
+}
+
+static int
+shmem_close(struct net_device *dev)
+{
+    struct shmem *shm;
+
+    shm = PRIV(dev);
+    mutex_lock(&shm->mutex);
+    shmem_cleanup(shm);
+    mutex_unlock(&shm->mutex);
+    return 0;
+}
+
+/* NOTE: frames are queued even before the peer connects (and while waiting for the next one), until the ring is full */
+static int
+shmem_transmit(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
+{
+    struct shmem *shm;
+    struct shmem_ring *ring;
+    struct shmem_slot *slot;
+    uint32_t tail;
+
+    shm = PRIV(dev);
+    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, pb->len);
+    debugdump(pb->data, pb->len);
+    mutex_lock(&shm->mutex);
+    ring = shm->tx;
+    if (!ring) {
+        mutex_unlock(&shm->mutex);
+        debugf("disconnected, drop, dev=%s", dev->name);
+        counters_add(dev->stats, NET_DEVICE_STATS_TX_ERRORS, 1);
+        return 0;
+    }
+    tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == SHMEM_RING_SIZE) {
+        mutex_unlock(&shm->mutex);
+        /* NOTE: dropped like by the input queue of loopback, the sender (e.g. UDP) does not fail for it */
+        debugf("ring is full, drop, dev=%s", dev->name);
+        counters_add(dev->stats, NET_DEVICE_STATS_TX_ERRORS, 1);
+        return 0;
+    }
+    slot = &ring->slots[tail & (SHMEM_RING_SIZE - 1)];
+    slot->len = pb->len;
+    slot->type = type;
+    slot->flags = (pb->flags & PBUF_FLAG_CSUM_PARTIAL) ? SHMEM_SLOT_FLAG_CSUM_PARTIAL : 0;
+    memcpy(slot->data, pb->data, pb->len); /* NOTE: the one copy on transmit */
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    shmem_notify(shm);
+    mutex_unlock(&shm->mutex);
+    return 0;
+}
+
+/*
+ * NOTE: The frames are copied out of the slots, the stack may keep a pbuf (e.g. an out-of-order
+ *       segment) much longer than the others and the slots can only be given back in order.
+ */
+static int
+shmem_recv(struct net_device *dev, struct pbuf **pbs, int max)
+{
+    struct shmem_ring *ring;
+    struct shmem_slot *slot;
+    uint32_t head, n, i, len;
+    uint16_t type, flags;
+    int num = 0;
+
+    ring = PRIV(dev)->rx;
+    head = ring->head;
+    n = MIN((uint32_t)max, __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head);
+    for (i = 0; i < n; i++) {
+        slot = &ring->slots[(head + i) & (SHMEM_RING_SIZE - 1)];
+        /* NOTE: the peer can rewrite the slot at any time, the header is read once and only the copy is trusted */
+        len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+        type = __atomic_load_n(&slot->type, __ATOMIC_RELAXED);
+        flags = __atomic_load_n(&slot->flags, __ATOMIC_RELAXED);
+        if (len > SHMEM_MTU) {
+            errorf("invalid length, drop, len=%u, dev=%s", len, dev->name);
+            counters_add(dev->stats, NET_DEVICE_STATS_RX_DROPS, 1);
+            continue;
+        }
+        pbs[num] = pbuf_alloc(0, len);
+        if (!pbs[num]) {
+            errorf("pbuf_alloc() failure, dev=%s", dev->name);
+            break;
+        }
+        memcpy(pbs[num]->data, slot->data, len);
+        pbs[num]->type = type;
+        if (flags & SHMEM_SLOT_FLAG_CSUM_PARTIAL) {
+            pbs[num]->flags |= PBUF_FLAG_CSUM_VALID;
+        }
+        num++;
+    }
+    __atomic_store_n(&ring->head, head + i, __ATOMIC_RELEASE);
+    return num;
+}
+
+static int
+shmem_poll(struct net_device *dev, struct pbuf **pbs, int max)
+{
+    struct shmem_ring *ring;
+    int n;
+
+    ring = PRIV(dev)->rx;
+    n = shmem_recv(dev, pbs, max);
+    if (n) {
+        return n;
+    }
+    /* NOTE: going to sleep on the doorbell, look at the ring again for a producer that missed the flag */
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    n = shmem_recv(dev, pbs, max);
+    if (n) {
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+static int
+shmem_isr(unsigned int irq, void *id)
+{
+    struct net_device *dev;
+    struct shmem *shm;
+    ssize_t rings;
+
+    dev = (struct net_device *)id;
+    shm = PRIV(dev);
+    if (shm->listen_fd != -1) {
+        shmem_accept(dev);
+    }
+    if (shm->conn_fd == -1) {
+        return 0;
+    }
+    rings = shmem_doorbell_clear(shm);
+    if (rings == -1) {
+        warnf("disconnected, dev=%s", dev->name);
+        shmem_relisten(dev);
+        return 0;
+    }
+    if (rings && !shm->kicked) {
+        /* NOTE: the peer is ready to be rung (see shmem_attach()), for the frames queued before it connected */
+        mutex_lock(&shm->mutex);
+        shm->kicked = 1;
+        shmem_doorbell_ring(shm);
+        mutex_unlock(&shm->mutex);
+    }
+    net_device_poll(dev);
+    return 0;
+}
+
+static struct net_device_ops shmem_ops = {
+    .open = shmem_open,
+    .close = shmem_close,
+    .transmit = shmem_transmit,
+    .poll = shmem_poll,
+};
+
+static void
+shmem_setup(struct net_device *dev)
+{
+    dev->type = NET_DEVICE_TYPE_SHMEM;
+    dev->mtu = SHMEM_MTU;
+    dev->hlen = 0; /* non header */
+    dev->alen = 0; /* non address */
+    dev->flags = NET_DEVICE_FLAG_P2P;
+    /* NOTE: the memory never corrupts the frames, the checksums left to the device are passed as verified */
+    dev->features = NET_DEVICE_FEATURE_RXCSUM | NET_DEVICE_FEATURE_TXCSUM;
+    dev->ops = &shmem_ops;
+}
+
+/* NOTE: two processes given the same path (a unix domain socket) are connected to each other */
+struct net_device *
+shmem_init(const char *path)
+{
+    struct net_device *dev;
+    struct shmem *shm;
+
+    if (strlen(path) >= sizeof(shm->path)) {
+        errorf("too long path, path=%s", path);
+        return NULL;
+    }
+    dev = net_device_alloc(shmem_setup);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    shm = memory_alloc(sizeof(*shm));
+    if (!shm) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    strncpy(shm->path, path, sizeof(shm->path)-1);
+    shm->irq = SHMEM_IRQ;
+    shm->memfd = -1;
+    shm->listen_fd = -1;
+    shm->conn_fd = -1;
+    mutex_init(&shm->mutex);
+    dev->priv = shm;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(shm);
+        return NULL;
+    }
+    intr_request_irq(shm->irq, shmem_isr, NET_IRQ_SHARED, dev->name, dev);
+    debugf("initialized, dev=%s, path=%s", dev->name, path);
+    return dev;
+}
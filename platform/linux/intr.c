@@ -1,14 +1,18 @@
+#define _GNU_SOURCE /* for F_SETSIG */
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
 #include <signal.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "platform.h"
 
 #include "util.h"
 #include "net.h"
+#include "trace.h"
 
 struct irq_entry {
     struct irq_entry *next;
@@ -52,16 +56,53 @@ intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *dev),
     return 0;
 }
 
-static int
-intr_timer_setup(struct itimerspec *interval)
+/* NOTE: the fd raises the IRQ (a realtime signal) when it becomes readable */
+int
+intr_attach_fd(unsigned int irq, int fd)
 {
-    timer_t id;
-
-    if (timer_create(CLOCK_REALTIME, NULL, &id) == -1) {
-        errorf("timer_create: %s", strerror(errno));
+    /* Set Asynchronous I/O signal delivery destination */
+    if (fcntl(fd, F_SETOWN, getpid()) == -1) {
+        errorf("fcntl(F_SETOWN): %s, fd=%d", strerror(errno), fd);
+        return -1;
+    }
+    /* Enable Asynchronous I/O (keep the other flags, e.g. O_NONBLOCK) */
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC) == -1) {
+        errorf("fcntl(F_SETFL): %s, fd=%d", strerror(errno), fd);
+        return -1;
+    }
+    /* Use other signal instead of SIGIO */
+    if (fcntl(fd, F_SETSIG, irq) == -1) {
+        errorf("fcntl(F_SETSIG): %s, fd=%d", strerror(errno), fd);
         return -1;
     }
-    if (timer_settime(id, 0, interval, NULL) == -1) {
+    return 0;
+}
+
+/* NOTE: a single worker only, the signals are process-wide */
+void
+raise_softirq(unsigned int worker)
+{
+    kill(getpid(), SIGUSR1);
+}
+
+void
+raise_event(void)
+{
+    kill(getpid(), SIGUSR2);
+}
+
+static timer_t timer_id;
+
+int
+intr_timer_arm(unsigned int worker, uint64_t expire)
+{
+    struct itimerspec its = {};
+
+    if (expire) {
+        its.it_value.tv_sec = expire / 1000000;
+        its.it_value.tv_nsec = (expire % 1000000) * 1000;
+    }
+    if (timer_settime(timer_id, TIMER_ABSTIME, &its, NULL) == -1) {
         errorf("timer_settime: %s", strerror(errno));
         return -1;
     }
@@ -71,14 +112,9 @@ intr_timer_setup(struct itimerspec *interval)
 static void *
 intr_thread(void *arg)
 {
-    struct timespec ts = {0, 1000000}; // 1ms
-    struct itimerspec interval = {ts, ts};
     int sig, err;
     struct irq_entry *entry;
 
-    if (intr_timer_setup(&interval) == -1) {
-        return NULL;
-    }
     while (1) {
         err = sigwait(&sigmask, &sig);
         if (err) {
@@ -87,19 +123,21 @@ intr_thread(void *arg)
         }
         switch (sig) {
         case SIGUSR1:
-            net_protocol_handler();
+            net_protocol_handler(0);
             break;
         case SIGUSR2:
             net_event_handler();
             break;
         case SIGALRM:
-            net_timer_handler();
+            net_timer_handler(0);
             break;
         default:
             for (entry = irq_vec; entry; entry = entry->next) {
                 if (entry->irq == (unsigned int)sig) {
                     debugf("irq=%d, name=%s", entry->irq, entry->name);
+                    trace_irq_enter();
                     entry->handler(entry->irq, entry->dev);
+                    trace_irq_exit();
                 }
             }
             break;
@@ -129,11 +167,20 @@ intr_run(void)
 }
 
 int
-intr_init(void)
+intr_init(unsigned int workers)
 {
+    if (workers != 1) {
+        errorf("not supported, workers=%u (use the epoll backend)", workers);
+        return -1;
+    }
     sigemptyset(&sigmask);
     sigaddset(&sigmask, SIGUSR1);
     sigaddset(&sigmask, SIGUSR2);
     sigaddset(&sigmask, SIGALRM);
+    /* NOTE: raises SIGALRM when it expires, armed for the next timeout only (see intr_timer_arm()) */
+    if (timer_create(CLOCK_MONOTONIC, NULL, &timer_id) == -1) {
+        errorf("timer_create: %s", strerror(errno));
+        return -1;
+    }
     return 0;
 }
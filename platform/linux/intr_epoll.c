@@ -0,0 +1,305 @@
+#define _GNU_SOURCE /* for pthread_setaffinity_np() */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "trace.h"
+
+/*
+ * Interrupt (epoll backend)
+ *
+ * NOTE: Device fds, the softirq, the event and the timer are all multiplexed
+ *       by epoll in intr_thread() instead of being delivered as signals.
+ *       Each worker runs its own thread with its own softirq and timer,
+ *       the device fds and the event are handled by worker 0.
+ */
+
+#define INTR_EVENT_MAX 16
+
+/* NOTE: epoll_event.data of the non-IRQ sources (IRQ numbers never exceed 32 bits) */
+#define INTR_SRC_SOFTIRQ ((uint64_t)1 << 32)
+#define INTR_SRC_EVENT   ((uint64_t)2 << 32)
+#define INTR_SRC_TIMER   ((uint64_t)3 << 32)
+
+struct irq_entry {
+    struct irq_entry *next;
+    unsigned int irq;
+    int (*handler)(unsigned int irq, void *dev);
+    int flags;
+    char name[16];
+    void *dev;
+};
+
+struct intr_worker {
+    int epfd;
+    int softirq_fd;
+    int timer_fd;
+    int softirq_pending;
+    pthread_t tid;
+};
+
+static struct irq_entry *irq_vec;
+
+static struct intr_worker workers[NET_WORKER_MAX];
+static unsigned int workers_num;
+static int event_fd = -1;
+
+int
+intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *dev), int flags, const char *name, void *dev)
+{
+    struct irq_entry *entry;
+
+    debugf("irq=%u, handler=%p, flags=%d, name=%s, dev=%p", irq, handler, flags, name, dev);
+    for (entry = irq_vec; entry; entry = entry->next) {
+        if (entry->irq == irq) {
+            if (entry->flags ^ NET_IRQ_SHARED || flags ^ NET_IRQ_SHARED) {
+                errorf("conflicts with already registered IRQs");
+                return -1;
+            }
+        }
+    }
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    entry->irq = irq;
+    entry->handler = handler;
+    entry->flags = flags;
+    strncpy(entry->name, name, sizeof(entry->name)-1);
+    entry->dev = dev;
+    entry->next = irq_vec;
+    irq_vec = entry;
+    debugf("registered: irq=%u, name=%s", irq, name);
+    return 0;
+}
+
+static int
+intr_epoll_add(struct intr_worker *worker, int fd, uint64_t src)
+{
+    struct epoll_event ev = {};
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = src;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        errorf("epoll_ctl: %s, fd=%d", strerror(errno), fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* NOTE: the fd raises the IRQ while it is readable (level-triggered), the handler must drain it */
+int
+intr_attach_fd(unsigned int irq, int fd)
+{
+    return intr_epoll_add(&workers[0], fd, irq);
+}
+
+void
+raise_softirq(unsigned int worker)
+{
+    struct intr_worker *w = &workers[worker];
+    uint64_t v = 1;
+
+    /* NOTE: skip the syscall while the previous one has not been handled yet */
+    if (__atomic_exchange_n(&w->softirq_pending, 1, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    if (write(w->softirq_fd, &v, sizeof(v)) == -1) {
+        /* EAGAIN means the counter is saturated, the handler runs anyway */
+    }
+}
+
+void
+raise_event(void)
+{
+    uint64_t v = 1;
+
+    if (write(event_fd, &v, sizeof(v)) == -1) {
+        /* see raise_softirq() */
+    }
+}
+
+static void
+intr_fd_clear(int fd)
+{
+    uint64_t v;
+
+    if (read(fd, &v, sizeof(v)) == -1) {
+        /* EAGAIN if someone else has already cleared it */
+    }
+}
+
+static void
+intr_dispatch(struct intr_worker *worker, uint64_t src)
+{
+    struct irq_entry *entry;
+
+    switch (src) {
+    case INTR_SRC_SOFTIRQ:
+        /* NOTE: clear the flag before draining the queues, not after */
+        __atomic_store_n(&worker->softirq_pending, 0, __ATOMIC_SEQ_CST);
+        intr_fd_clear(worker->softirq_fd);
+        net_protocol_handler(worker - workers);
+        break;
+    case INTR_SRC_EVENT:
+        intr_fd_clear(event_fd);
+        net_event_handler();
+        break;
+    case INTR_SRC_TIMER:
+        intr_fd_clear(worker->timer_fd);
+        net_timer_handler(worker - workers);
+        break;
+    default:
+        for (entry = irq_vec; entry; entry = entry->next) {
+            if (entry->irq == (unsigned int)src) {
+                debugf("irq=%d, name=%s", entry->irq, entry->name);
+                trace_irq_enter();
+                entry->handler(entry->irq, entry->dev);
+                trace_irq_exit();
+            }
+        }
+        break;
+    }
+}
+
+static void *
+intr_thread(void *arg)
+{
+    struct intr_worker *worker = arg;
+    struct epoll_event events[INTR_EVENT_MAX];
+    int n, i;
+
+    while (1) {
+        n = epoll_wait(worker->epfd, events, countof(events), -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errorf("epoll_wait: %s", strerror(errno));
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            intr_dispatch(worker, events[i].data.u64);
+        }
+    }
+    return NULL;
+}
+
+int
+intr_timer_arm(unsigned int worker, uint64_t expire)
+{
+    struct itimerspec its = {};
+
+    /* NOTE: one-shot at an absolute time, a zero it_value disarms the timer */
+    if (expire) {
+        its.it_value.tv_sec = expire / 1000000;
+        its.it_value.tv_nsec = (expire % 1000000) * 1000;
+    }
+    if (timerfd_settime(workers[worker].timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+        errorf("timerfd_settime: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* NOTE: pin each worker to its own core, a single worker is left to the scheduler */
+static void
+intr_worker_pin(struct intr_worker *worker)
+{
+    cpu_set_t set;
+    long ncpu;
+    int err;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers_num == 1 || ncpu < 1) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET((worker - workers) % ncpu, &set);
+    err = pthread_setaffinity_np(worker->tid, sizeof(set), &set);
+    if (err) {
+        warnf("pthread_setaffinity_np() %s, worker=%td", strerror(err), worker - workers);
+    }
+}
+
+int
+intr_run(void)
+{
+    unsigned int i;
+    int err;
+
+    for (i = 0; i < workers_num; i++) {
+        err = pthread_create(&workers[i].tid, NULL, intr_thread, &workers[i]);
+        if (err) {
+            errorf("pthread_create() %s", strerror(err));
+            return -1;
+        }
+        intr_worker_pin(&workers[i]);
+    }
+    return 0;
+}
+
+static int
+intr_worker_init(struct intr_worker *worker)
+{
+    worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker->epfd == -1) {
+        errorf("epoll_create1: %s", strerror(errno));
+        return -1;
+    }
+    worker->softirq_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->softirq_fd == -1) {
+        errorf("eventfd: %s", strerror(errno));
+        return -1;
+    }
+    /* NOTE: no periodic tick, the timer is armed for the next timeout only (see intr_timer_arm()) */
+    worker->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (worker->timer_fd == -1) {
+        errorf("timerfd_create: %s", strerror(errno));
+        return -1;
+    }
+    if (intr_epoll_add(worker, worker->softirq_fd, INTR_SRC_SOFTIRQ) == -1
+        || intr_epoll_add(worker, worker->timer_fd, INTR_SRC_TIMER) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+int
+intr_init(unsigned int num)
+{
+    unsigned int i;
+
+    if (!num || num > NET_WORKER_MAX) {
+        errorf("invalid number of workers, num=%u", num);
+        return -1;
+    }
+    for (i = 0; i < num; i++) {
+        if (intr_worker_init(&workers[i]) == -1) {
+            return -1;
+        }
+    }
+    workers_num = num;
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1) {
+        errorf("eventfd: %s", strerror(errno));
+        return -1;
+    }
+    if (intr_epoll_add(&workers[0], event_fd, INTR_SRC_EVENT) == -1) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "platform.h"
+
+#include "util.h"
+
+#define MEMORY_CLASS_NUM 12
+#define MEMORY_CLASS_LARGE UINT32_MAX /* not from a pool, falls back to malloc() */
+
+#define MEMORY_CACHE_BATCH 32 /* max number of blocks moved between a cache and its pool at once */
+#define MEMORY_CACHE_BYTES (64 * 1024) /* limits the batch of the larger classes */
+
+/* NOTE: a thread cache holds at most twice the batch of each class */
+#define MEMORY_BATCH(pool) MIN(MEMORY_CACHE_BATCH, MAX(1, MEMORY_CACHE_BYTES / (pool)->size))
+
+/* NOTE: 16 bytes to keep the returned pointer 16-byte aligned like malloc() */
+struct memory_hdr {
+    struct memory_hdr *next; /* valid only while on a free list */
+    uint32_t cls;
+    uint32_t reserved;
+};
+
+struct memory_pool {
+    mutex_t mutex;
+    size_t size; /* usable size of a block */
+    size_t prealloc; /* number of blocks allocated at memory_init() */
+    struct memory_hdr *free;
+    size_t nfree;
+    size_t total; /* number of blocks owned by the pool */
+    /* statistics (updated atomically) */
+    size_t used;
+    size_t high; /* high-water mark of used */
+    size_t failure;
+};
+
+struct memory_cache {
+    struct memory_hdr *head;
+    size_t count;
+};
+
+static struct memory_pool pools[MEMORY_CLASS_NUM] = {
+    {.mutex = MUTEX_INITIALIZER, .size =    32, .prealloc = 512},
+    {.mutex = MUTEX_INITIALIZER, .size =    64, .prealloc = 512},
+    {.mutex = MUTEX_INITIALIZER, .size =   128, .prealloc = 256},
+    {.mutex = MUTEX_INITIALIZER, .size =   256, .prealloc = 128},
+    {.mutex = MUTEX_INITIALIZER, .size =   512, .prealloc = 128},
+    {.mutex = MUTEX_INITIALIZER, .size =  1024, .prealloc =  64},
+    {.mutex = MUTEX_INITIALIZER, .size =  2048, .prealloc = 512}, /* ethernet frames */
+    {.mutex = MUTEX_INITIALIZER, .size =  4096, .prealloc =  64},
+    {.mutex = MUTEX_INITIALIZER, .size =  8192, .prealloc =  16},
+    {.mutex = MUTEX_INITIALIZER, .size = 16384, .prealloc =  16},
+    {.mutex = MUTEX_INITIALIZER, .size = 32768, .prealloc =   8},
+    {.mutex = MUTEX_INITIALIZER, .size = 65536, .prealloc =   8},
+};
+static struct {
+    size_t used;
+    size_t high;
+    size_t failure;
+} large;
+
+static __thread struct memory_cache caches[MEMORY_CLASS_NUM];
+static __thread int cache_registered;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void
+memory_stat_inc(size_t *used, size_t *high)
+{
+    size_t n, h;
+
+    n = __atomic_add_fetch(used, 1, __ATOMIC_RELAXED);
+    h = __atomic_load_n(high, __ATOMIC_RELAXED);
+    while (n > h) {
+        if (__atomic_compare_exchange_n(high, &h, n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+static uint32_t
+memory_class(size_t size)
+{
+    uint32_t cls;
+
+    for (cls = 0; cls < MEMORY_CLASS_NUM; cls++) {
+        if (size <= pools[cls].size) {
+            return cls;
+        }
+    }
+    return MEMORY_CLASS_LARGE;
+}
+
+/* NOTE: must be called with the pool locked */
+static int
+memory_pool_grow(struct memory_pool *pool, uint32_t cls, size_t num)
+{
+    uint8_t *chunk;
+    struct memory_hdr *hdr;
+    size_t bsize, i;
+
+    bsize = sizeof(*hdr) + pool->size;
+    chunk = malloc(bsize * num);
+    if (!chunk) {
+        return -1;
+    }
+    /* NOTE: the chunk is never released, its blocks live on the free lists */
+    for (i = 0; i < num; i++) {
+        hdr = (struct memory_hdr *)(chunk + bsize * i);
+        hdr->cls = cls;
+        hdr->next = pool->free;
+        pool->free = hdr;
+    }
+    pool->nfree += num;
+    pool->total += num;
+    return 0;
+}
+
+static void
+memory_cache_drain(struct memory_cache *cache, uint32_t cls, size_t num)
+{
+    struct memory_pool *pool;
+    struct memory_hdr *hdr;
+
+    pool = &pools[cls];
+    mutex_lock(&pool->mutex);
+    while (num-- && cache->head) {
+        hdr = cache->head;
+        cache->head = hdr->next;
+        cache->count--;
+        hdr->next = pool->free;
+        pool->free = hdr;
+        pool->nfree++;
+    }
+    mutex_unlock(&pool->mutex);
+}
+
+static void
+memory_cache_destructor(void *arg)
+{
+    uint32_t cls;
+
+    for (cls = 0; cls < MEMORY_CLASS_NUM; cls++) {
+        memory_cache_drain(&caches[cls], cls, caches[cls].count);
+    }
+}
+
+static void
+memory_cache_key_create(void)
+{
+    pthread_key_create(&cache_key, memory_cache_destructor);
+}
+
+/* return the cached blocks to the pools when the thread exits */
+static void
+memory_cache_register(void)
+{
+    pthread_once(&cache_once, memory_cache_key_create);
+    pthread_setspecific(cache_key, caches);
+    cache_registered = 1;
+}
+
+static int
+memory_cache_refill(struct memory_cache *cache, uint32_t cls)
+{
+    struct memory_pool *pool;
+    struct memory_hdr *hdr;
+    size_t num;
+
+    if (!cache_registered) {
+        memory_cache_register();
+    }
+    pool = &pools[cls];
+    mutex_lock(&pool->mutex);
+    if (!pool->nfree && memory_pool_grow(pool, cls, MEMORY_BATCH(pool)) == -1) {
+        mutex_unlock(&pool->mutex);
+        return -1;
+    }
+    for (num = 0; num < MEMORY_BATCH(pool) && pool->free; num++) {
+        hdr = pool->free;
+        pool->free = hdr->next;
+        pool->nfree--;
+        hdr->next = cache->head;
+        cache->head = hdr;
+        cache->count++;
+    }
+    mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+/* NOTE: unlike memory_alloc(), the returned memory is not zero-filled */
+void *
+memory_alloc_raw(size_t size)
+{
+    uint32_t cls;
+    struct memory_hdr *hdr;
+    struct memory_cache *cache;
+
+    cls = memory_class(size);
+    if (cls == MEMORY_CLASS_LARGE) {
+        hdr = malloc(sizeof(*hdr) + size);
+        if (!hdr) {
+            __atomic_add_fetch(&large.failure, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        hdr->cls = cls;
+        memory_stat_inc(&large.used, &large.high);
+        return hdr + 1;
+    }
+    cache = &caches[cls];
+    if (!cache->head && memory_cache_refill(cache, cls) == -1) {
+        __atomic_add_fetch(&pools[cls].failure, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    hdr = cache->head;
+    cache->head = hdr->next;
+    cache->count--;
+    memory_stat_inc(&pools[cls].used, &pools[cls].high);
+    return hdr + 1;
+}
+
+void *
+memory_alloc(size_t size)
+{
+    void *ptr;
+
+    ptr = memory_alloc_raw(size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+void
+memory_free(void *ptr)
+{
+    struct memory_hdr *hdr;
+    struct memory_cache *cache;
+
+    if (!ptr) {
+        return;
+    }
+    hdr = (struct memory_hdr *)ptr - 1;
+    if (hdr->cls == MEMORY_CLASS_LARGE) {
+        __atomic_sub_fetch(&large.used, 1, __ATOMIC_RELAXED);
+        free(hdr);
+        return;
+    }
+    __atomic_sub_fetch(&pools[hdr->cls].used, 1, __ATOMIC_RELAXED);
+    if (!cache_registered) {
+        memory_cache_register();
+    }
+    cache = &caches[hdr->cls];
+    hdr->next = cache->head;
+    cache->head = hdr;
+    cache->count++;
+    if (cache->count > MEMORY_BATCH(&pools[hdr->cls]) * 2) {
+        memory_cache_drain(cache, hdr->cls, MEMORY_BATCH(&pools[hdr->cls]));
+    }
+}
+
+void
+memory_dump(FILE *fp)
+{
+    struct memory_pool *pool;
+    uint32_t cls;
+
+    flockfile(fp);
+    for (cls = 0; cls < MEMORY_CLASS_NUM; cls++) {
+        pool = &pools[cls];
+        mutex_lock(&pool->mutex);
+        fprintf(fp, "memory: size=%5zu, total=%zu, free=%zu, used=%zu, high=%zu, failure=%zu\n",
+            pool->size, pool->total, pool->nfree,
+            __atomic_load_n(&pool->used, __ATOMIC_RELAXED),
+            __atomic_load_n(&pool->high, __ATOMIC_RELAXED),
+            __atomic_load_n(&pool->failure, __ATOMIC_RELAXED));
+        mutex_unlock(&pool->mutex);
+    }
+    fprintf(fp, "memory: size=large, used=%zu, high=%zu, failure=%zu\n",
+        __atomic_load_n(&large.used, __ATOMIC_RELAXED),
+        __atomic_load_n(&large.high, __ATOMIC_RELAXED),
+        __atomic_load_n(&large.failure, __ATOMIC_RELAXED));
+    funlockfile(fp);
+}
+
+int
+memory_init(void)
+{
+    struct memory_pool *pool;
+    uint32_t cls;
+
+    for (cls = 0; cls < MEMORY_CLASS_NUM; cls++) {
+        pool = &pools[cls];
+        mutex_lock(&pool->mutex);
+        if (pool->total < pool->prealloc && memory_pool_grow(pool, cls, pool->prealloc - pool->total) == -1) {
+            mutex_unlock(&pool->mutex);
+            errorf("memory_pool_grow() failure, size=%zu", pool->size);
+            return -1;
+        }
+        mutex_unlock(&pool->mutex);
+    }
+    return 0;
+}
@@ -1,6 +1,8 @@
 #ifndef PLATFORM_H
 #define PLATFORM_H
 
+#include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <time.h>
@@ -12,17 +14,17 @@
  * Memory
  */
 
-static inline void *
-memory_alloc(size_t size)
-{
-    return calloc(1, size);
-}
-
-static inline void
-memory_free(void *ptr)
-{
-    free(ptr);
-}
+/* NOTE: size-class pools with per-thread caches, larger requests fall back to malloc() */
+extern void *
+memory_alloc(size_t size);
+extern void *
+memory_alloc_raw(size_t size);
+extern void
+memory_free(void *ptr);
+extern void
+memory_dump(FILE *fp);
+extern int
+memory_init(void);
 
 /*
  * Mutex
@@ -50,6 +52,30 @@ mutex_unlock(mutex_t *mutex)
     return pthread_mutex_unlock(mutex);
 }
 
+/*
+ * Clock
+ */
+
+/* NOTE: CLOCK_MONOTONIC in microseconds, it does not jump when the wall clock is changed */
+static inline uint64_t
+clock_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* NOTE: the same clock in nanoseconds, read through the vDSO (i.e. the TSC on x86) without a system call */
+static inline uint64_t
+clock_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 /*
  * Scheduler
  */
@@ -58,9 +84,10 @@ struct sched_ctx {
     pthread_cond_t cond;
     int interrupted;
     int wc; /* wait count */
+    uint64_t wakeup; /* clock_nsec() of sched_wakeup() while tracing, see trace.h */
 };
 
-#define SCHED_CTX_INITIALIZER {PTHREAD_COND_INITIALIZER, 0, 0}
+#define SCHED_CTX_INITIALIZER {PTHREAD_COND_INITIALIZER, 0, 0, 0}
 
 extern int
 sched_ctx_init(struct sched_ctx *ctx);
@@ -80,14 +107,24 @@ sched_interrupt(struct sched_ctx *ctx);
 extern int
 intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *id), int flags, const char *name, void *dev);
 extern int
+intr_attach_fd(unsigned int irq, int fd);
+extern int
+intr_timer_arm(unsigned int worker, uint64_t expire);
+extern int
 intr_run(void);
 extern int
-intr_init(void);
+intr_init(unsigned int workers);
 
-static inline void
-raise_softirq(void)
-{
-    kill(getpid(), SIGUSR1);
-}
+/*
+ * NOTE: Each worker has its own softirq and timer, net_protocol_handler(worker) and
+ *       net_timer_handler(worker) run on its thread. Worker 0 also handles the IRQs and the event.
+ *       intr_timer_arm() takes an absolute clock_usec() time (0 disarms), the handler is called once it passes.
+ */
+
+/* NOTE: both are async-signal-safe */
+extern void
+raise_softirq(unsigned int worker);
+extern void
+raise_event(void);
 
 #endif
@@ -4,19 +4,26 @@
 
 #include "platform.h"
 
+#include "trace.h"
+
 int
 sched_ctx_init(struct sched_ctx *ctx)
 {
     pthread_cond_init(&ctx->cond, NULL);
     ctx->interrupted = 0;
     ctx->wc = 0;
+    ctx->wakeup = 0;
     return 0;
 }
 
+/* NOTE: fails while someone sleeps on it, the caller wakes them up to let the last one leaving finish the job */
 int
 sched_ctx_destroy(struct sched_ctx *ctx)
 {
-    return pthread_cond_destroy(&ctx->cond);
+    if (ctx->wc) {
+        return -1;
+    }
+    return pthread_cond_destroy(&ctx->cond) == 0 ? 0 : -1;
 }
 
 int
@@ -35,6 +42,13 @@ sched_sleep(struct sched_ctx *ctx, mutex_t *mutex, const struct timespec *abstim
         ret = pthread_cond_wait(&ctx->cond, mutex);
     }
     ctx->wc--;
+    if (ctx->wakeup) {
+        /* NOTE: the mutex is held again, all the sleepers woken together take the same start */
+        trace_span(TRACE_STAGE_WAKEUP, ctx->wakeup);
+        if (!ctx->wc) {
+            ctx->wakeup = 0;
+        }
+    }
     if (ctx->interrupted) {
         if (!ctx->wc) {
             ctx->interrupted = 0;
@@ -48,6 +62,10 @@ sched_sleep(struct sched_ctx *ctx, mutex_t *mutex, const struct timespec *abstim
 int
 sched_wakeup(struct sched_ctx *ctx)
 {
+    /* NOTE: called with the mutex of sched_sleep() held, as are the others */
+    if (ctx->wc && !ctx->wakeup && TRACE_ENABLED()) {
+        ctx->wakeup = clock_nsec();
+    }
     return pthread_cond_broadcast(&ctx->cond);
 }
 
@@ -1,6 +1,10 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "platform.h"
 
 #include "util.h"
 #include "net.h"
@@ -10,7 +14,97 @@
 
 #include "sock.h"
 
-static struct sock socks[128];
+#define SOCK_MAX 16384 /* default limit, see sock_set_max() */
+#define SOCK_MMSG_BATCH 64 /* max number of datagrams per sock_recvmmsg()/sock_sendmmsg() */
+#define SOCK_EPOLL_MAX 1024
+#define SOCK_EPOLL_BATCH 64 /* max number of sockets polled per round of sock_epoll_wait() */
+#define SOCK_URING_MAX 64
+#define SOCK_URING_ENTRIES_MAX 4096 /* of the submission queue, the completion queue has twice */
+#define SOCK_URING_FILE_HASH_SIZE 64
+#define SOCK_URING_BATCH 64 /* max number of socks run per round of the completion */
+
+struct sock {
+    int id;
+    int used;
+    int family;
+    int type;
+    int desc;
+    mutex_t mutex; /* protects watchers */
+    struct list_head watchers; /* items of the epolls watching this */
+};
+
+struct sock_epoll {
+    int id;
+    int used;
+    mutex_t mutex; /* protects everything else */
+    int closing;
+    int users; /* threads in sock_epoll_wait(), the last one frees the epoll closed */
+    struct sched_ctx ctx;
+    struct list_head items;
+    struct list_head ready; /* items to be polled, some of them may turn out not to be ready */
+    void (*kick)(void *arg); /* called when an item gets queued (an internal one, see sock_uring) */
+    void *kick_arg;
+};
+
+struct sock_epoll_item {
+    struct sock_epoll *ep;
+    struct sock *s;
+    uint32_t events;
+    epoll_data_t data;
+    int dead; /* removed from the both lists (written with the both locks held) */
+    int closed; /* the sock has gone, it is queued once more to report POLLNVAL (internal epolls only) */
+    int ref; /* held by sock_epoll_wait() while polling out of the lock, and by ready if closed */
+    struct list_head entry; /* linked to items of the epoll */
+    struct list_head ready_entry; /* linked to ready of the epoll (or the list of sock_epoll_wait()) */
+    struct list_head sock_entry; /* linked to watchers of the sock */
+};
+
+struct sock_uring_op {
+    struct list_head entry; /* linked to rx or tx of the file */
+    struct sock_uring_sqe sqe;
+};
+
+/* NOTE: the operations pending on a sock, in the order of the submission */
+struct sock_uring_file {
+    struct list_head entry; /* linked to the hash bucket (or orphans of the uring once the sock has gone) */
+    int fd;
+    uint32_t events; /* registered to the epoll of the uring, 0 if not */
+    struct list_head rx; /* RECV and ACCEPT */
+    struct list_head tx; /* SEND */
+};
+
+struct sock_uring {
+    int id;
+    int used;
+    int ref; /* protected by the table mutex */
+    mutex_t mutex; /* protects everything else */
+    int closing; /* written with the table mutex held as well */
+    int epfd; /* an internal epoll watching the socks with the operations pending */
+    struct net_timeout timeout; /* armed by the epoll to run the completion on a worker */
+    struct sched_ctx ctx; /* for the reapers */
+    unsigned int want; /* the least number of the completions the reapers sleep for */
+    unsigned int entries; /* of sq (power of two), cq has twice */
+    struct sock_uring_sqe *sq;
+    unsigned int sq_head; /* free-running, consumed by sock_uring_submit() */
+    unsigned int sq_tail; /* free-running, published by sock_uring_submit() up to sq_next */
+    unsigned int sq_next; /* free-running, advanced by sock_uring_get_sqe() */
+    struct sock_uring_cqe *cq;
+    unsigned int cq_head; /* free-running, consumed by sock_uring_wait() */
+    unsigned int cq_tail; /* free-running, advanced by the completion */
+    unsigned int inflight; /* submitted and not completed yet */
+    struct list_head files[SOCK_URING_FILE_HASH_SIZE];
+    struct list_head orphans; /* the files waiting for the report of the sock gone (POLLNVAL) */
+};
+
+/*
+ * NOTE: Lock ordering is uring -> transport (PCB) -> sock -> epoll. The transport calls sock_notify()
+ *       with its lock held, so the sock and epoll locks are never held while calling into it.
+ *       The table mutex is taken alone, before an epoll lock, or after a uring lock.
+ */
+static mutex_t mutex = MUTEX_INITIALIZER; /* protects allocations of socks and epolls */
+static struct table socks = TABLE_INITIALIZER(struct sock, SOCK_MAX);
+static struct table epolls = TABLE_INITIALIZER(struct sock_epoll, SOCK_EPOLL_MAX);
+static struct table urings = TABLE_INITIALIZER(struct sock_uring, SOCK_URING_MAX);
 
 int
 sockaddr_pton(const char *p, struct sockaddr *n, size_t size)
@@ -50,41 +144,108 @@ static struct sock *
 sock_alloc(void)
 {
     struct sock *entry;
+    int id;
 
-    for (entry = socks; entry < tailof(socks); entry++) {
-        if (!entry->used) {
-            entry->used = 1;
-            return entry;
-        }
+    mutex_lock(&mutex);
+    entry = table_alloc(&socks, &id);
+    if (entry) {
+        entry->used = 1;
+        entry->id = id;
+        mutex_init(&entry->mutex);
+        list_init(&entry->watchers);
     }
-    return NULL;
+    mutex_unlock(&mutex);
+    return entry;
 }
 
 static int
 sock_free(struct sock *s)
 {
+    int id;
+
+    mutex_lock(&mutex);
+    id = s->id;
     memset(s, 0, sizeof(*s));
+    table_free(&socks, id);
+    mutex_unlock(&mutex);
     return 0;
 }
 
 static struct sock *
 sock_get(int id)
 {
-    if (id < 0 || id >= (int)countof(socks)) {
-        /* out of range */
-        return NULL;
+    return table_get(&socks, id);
+}
+
+static void sock_notify(void *arg);
+static void sock_unwatch(struct sock *s);
+static struct sock_uring *sock_uring_get(int id);
+static void sock_uring_put(struct sock_uring *ring);
+
+static void
+event_handler(void *arg)
+{
+    struct sock_epoll *ep;
+    struct sock_uring *ring;
+    int id;
+
+    (void)arg;
+    mutex_lock(&mutex);
+    for (id = 0; id < table_size(&epolls); id++) {
+        ep = table_get(&epolls, id);
+        if (!ep) {
+            continue;
+        }
+        mutex_lock(&ep->mutex);
+        sched_interrupt(&ep->ctx);
+        mutex_unlock(&ep->mutex);
+    }
+    mutex_unlock(&mutex);
+    for (id = 0; id < table_size(&urings); id++) {
+        ring = sock_uring_get(id);
+        if (!ring) {
+            continue;
+        }
+        mutex_lock(&ring->mutex);
+        sched_interrupt(&ring->ctx);
+        mutex_unlock(&ring->mutex);
+        sock_uring_put(ring);
+    }
+}
+
+/* NOTE: must not be call after net_run() */
+int
+sock_init(void)
+{
+    if (net_event_subscribe(event_handler, NULL) == -1) {
+        errorf("net_event_subscribe() failure");
+        return -1;
     }
-    return &socks[id];
+    return 0;
+}
+
+int
+sock_set_max(size_t max)
+{
+    int ret;
+
+    mutex_lock(&mutex);
+    ret = table_set_max(&socks, max);
+    mutex_unlock(&mutex);
+    return ret;
 }
 
 int
 sock_open(int domain, int type, int protocol)
 {
     struct sock *s;
+    int nonblock;
 
     if (domain != AF_INET) {
         return -1;
     }
+    nonblock = type & SOCK_NONBLOCK;
+    type &= ~SOCK_NONBLOCK;
     if (type != SOCK_STREAM && type != SOCK_DGRAM) {
         return -1;
     }
@@ -100,15 +261,25 @@ sock_open(int domain, int type, int protocol)
     switch (s->type) {
     case SOCK_STREAM:
         s->desc = tcp_open();
+        if (s->desc != -1) {
+            tcp_set_notify(s->desc, sock_notify, s);
+        }
         break;
     case SOCK_DGRAM:
         s->desc = udp_open();
+        if (s->desc != -1) {
+            udp_set_notify(s->desc, sock_notify, s);
+        }
         break;
     }
     if (s->desc == -1) {
+        sock_free(s);
         return -1;
     }
-    return indexof(socks, s);
+    if (nonblock) {
+        sock_set_nonblock(s->id, 1);
+    }
+    return s->id;
 }
 
 int
@@ -120,11 +291,16 @@ sock_close(int id)
     if (!s) {
         return -1;
     }
+    /* NOTE: stop the notification first, no one refers to the sock after detaching the watchers */
     switch (s->type) {
     case SOCK_STREAM:
+        tcp_set_notify(s->desc, NULL, NULL);
+        sock_unwatch(s);
         tcp_close(s->desc);
         break;    
     case SOCK_DGRAM:
+        udp_set_notify(s->desc, NULL, NULL);
+        sock_unwatch(s);
         udp_close(s->desc);
         break;
     default:
@@ -159,6 +335,47 @@ sock_recvfrom(int id, void *buf, size_t n, struct sockaddr *addr, int *addrlen)
     return -1;
 }
 
+/* NOTE: receive up to vlen datagrams at once, blocking until the first one, returns the number of them */
+int
+sock_recvmmsg(int id, struct mmsghdr *msgvec, unsigned int vlen)
+{
+    struct sock *s;
+    struct udp_msg msgs[SOCK_MMSG_BATCH];
+    unsigned int i;
+    ssize_t ret;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->type != SOCK_DGRAM) {
+        return -1;
+    }
+    switch (s->family) {
+    case AF_INET:
+        vlen = MIN(vlen, SOCK_MMSG_BATCH);
+        for (i = 0; i < vlen; i++) {
+            msgs[i].buf = msgvec[i].msg_buf;
+            msgs[i].size = msgvec[i].msg_size;
+        }
+        ret = udp_recvfrom_batch(s->desc, msgs, vlen);
+        if (ret == -1) {
+            return -1;
+        }
+        for (i = 0; i < (unsigned int)ret; i++) {
+            msgvec[i].msg_len = msgs[i].len;
+            if (msgvec[i].msg_name) {
+                ((struct sockaddr_in *)msgvec[i].msg_name)->sin_family = AF_INET;
+                ((struct sockaddr_in *)msgvec[i].msg_name)->sin_addr = msgs[i].foreign.addr;
+                ((struct sockaddr_in *)msgvec[i].msg_name)->sin_port = msgs[i].foreign.port;
+                msgvec[i].msg_namelen = sizeof(struct sockaddr_in);
+            }
+        }
+        return ret;
+    }
+    return -1;
+}
+
 ssize_t
 sock_sendto(int id, const void *buf, size_t n, const struct sockaddr *addr, int addrlen)
 {
@@ -181,6 +398,47 @@ sock_sendto(int id, const void *buf, size_t n, const struct sockaddr *addr, int
     return -1;
 }
 
+/* NOTE: send msg_size bytes of msg_buf to msg_name each, returns the number of datagrams sent */
+int
+sock_sendmmsg(int id, struct mmsghdr *msgvec, unsigned int vlen)
+{
+    struct sock *s;
+    struct udp_msg msgs[SOCK_MMSG_BATCH];
+    unsigned int i;
+    ssize_t ret;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->type != SOCK_DGRAM) {
+        return -1;
+    }
+    switch (s->family) {
+    case AF_INET:
+        vlen = MIN(vlen, SOCK_MMSG_BATCH);
+        for (i = 0; i < vlen; i++) {
+            if (!msgvec[i].msg_name) {
+                errorf("no destination, index=%u", i);
+                return -1;
+            }
+            msgs[i].buf = msgvec[i].msg_buf;
+            msgs[i].len = msgvec[i].msg_size;
+            msgs[i].foreign.addr = ((struct sockaddr_in *)msgvec[i].msg_name)->sin_addr;
+            msgs[i].foreign.port = ((struct sockaddr_in *)msgvec[i].msg_name)->sin_port;
+        }
+        ret = udp_sendto_batch(s->desc, msgs, vlen);
+        if (ret == -1) {
+            return -1;
+        }
+        for (i = 0; i < (unsigned int)ret; i++) {
+            msgvec[i].msg_len = msgs[i].len;
+        }
+        return ret;
+    }
+    return -1;
+}
+
 int
 sock_bind(int id, const struct sockaddr *addr, int addrlen)
 {
@@ -231,8 +489,8 @@ sock_listen(int id, int backlog)
     return -1;
 }
 
-int
-sock_accept(int id, struct sockaddr *addr, int *addrlen)
+static int
+sock_accept_core(int id, struct sockaddr *addr, int *addrlen, int nowait)
 {
     struct sock *s, *new_s;
     struct ip_endpoint ep;
@@ -247,22 +505,35 @@ sock_accept(int id, struct sockaddr *addr, int *addrlen)
     }
     switch (s->family) {
     case AF_INET:
-        ret = tcp_accept(s->desc, &ep);
+        ret = nowait ? tcp_accept_nowait(s->desc, &ep) : tcp_accept(s->desc, &ep);
         if (ret == -1) {
             return -1;
         }
-        ((struct sockaddr_in *)addr)->sin_family = s->family;
-        ((struct sockaddr_in *)addr)->sin_addr = ep.addr;
-        ((struct sockaddr_in *)addr)->sin_port = ep.port;
+        if (addr) {
+            ((struct sockaddr_in *)addr)->sin_family = s->family;
+            ((struct sockaddr_in *)addr)->sin_addr = ep.addr;
+            ((struct sockaddr_in *)addr)->sin_port = ep.port;
+        }
         new_s = sock_alloc();
+        if (!new_s) {
+            tcp_close(ret);
+            return -1;
+        }
         new_s->family = s->family;
         new_s->type = s->type;
         new_s->desc = ret;
-        return indexof(socks, new_s);
+        tcp_set_notify(new_s->desc, sock_notify, new_s);
+        return new_s->id;
     }
     return -1;
 }
 
+int
+sock_accept(int id, struct sockaddr *addr, int *addrlen)
+{
+    return sock_accept_core(id, addr, addrlen, 0);
+}
+
 int
 sock_connect(int id, const struct sockaddr *addr, int addrlen)
 {
@@ -304,6 +575,44 @@ sock_recv(int id, void *buf, size_t n)
     return -1;
 }
 
+ssize_t
+sock_peek(int id, struct iovec iov[2])
+{
+    struct sock *s;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->type != SOCK_STREAM) {
+        return -1;
+    }
+    switch (s->family) {
+    case AF_INET:
+        return tcp_peek(s->desc, iov);
+    }
+    return -1;
+}
+
+ssize_t
+sock_consume(int id, size_t n)
+{
+    struct sock *s;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->type != SOCK_STREAM) {
+        return -1;
+    }
+    switch (s->family) {
+    case AF_INET:
+        return tcp_consume(s->desc, n);
+    }
+    return -1;
+}
+
 ssize_t
 sock_send(int id, const void *buf, size_t n)
 {
@@ -322,3 +631,1081 @@ sock_send(int id, const void *buf, size_t n)
     }
     return -1;
 }
+
+int
+sock_setsockopt(int id, int level, int optname, const void *optval, int optlen)
+{
+    struct sock *s;
+    char name[16];
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->family == AF_INET && s->type == SOCK_DGRAM && level == SOL_SOCKET) {
+        switch (optname) {
+        case SO_RCVBUF:
+            if (optlen != sizeof(int) || *(const int *)optval <= 0) {
+                errorf("invalid value, optlen=%d", optlen);
+                return -1;
+            }
+            return udp_set_rcvbuf(s->desc, *(const int *)optval);
+        }
+        errorf("unsupported option, optname=%d", optname);
+        return -1;
+    }
+    if (s->family != AF_INET || s->type != SOCK_STREAM || level != SOL_TCP) {
+        errorf("unsupported level, level=%d", level);
+        return -1;
+    }
+    switch (optname) {
+    case TCP_CONGESTION:
+        if (optlen <= 0 || (size_t)optlen >= sizeof(name)) {
+            errorf("invalid length, optlen=%d", optlen);
+            return -1;
+        }
+        memcpy(name, optval, optlen);
+        name[optlen] = '\0';
+        return tcp_set_congestion(s->desc, name);
+    case TCP_NODELAY:
+    case TCP_CORK:
+    case TCP_QUICKACK:
+        if (optlen != sizeof(int)) {
+            errorf("invalid length, optlen=%d", optlen);
+            return -1;
+        }
+        switch (optname) {
+        case TCP_NODELAY:
+            return tcp_set_nodelay(s->desc, *(const int *)optval);
+        case TCP_CORK:
+            return tcp_set_cork(s->desc, *(const int *)optval);
+        default:
+            return tcp_set_quickack(s->desc, *(const int *)optval);
+        }
+    }
+    errorf("unsupported option, optname=%d", optname);
+    return -1;
+}
+
+int
+sock_getsockopt(int id, int level, int optname, void *optval, int *optlen)
+{
+    struct sock *s;
+    size_t size;
+    int ret;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->family == AF_INET && s->type == SOCK_DGRAM && level == SOL_SOCKET) {
+        switch (optname) {
+        case SO_RCVBUF:
+            if (*optlen < (int)sizeof(int)) {
+                errorf("invalid length, optlen=%d", *optlen);
+                return -1;
+            }
+            if (udp_get_rcvbuf(s->desc, &size) == -1) {
+                return -1;
+            }
+            *(int *)optval = size;
+            *optlen = sizeof(int);
+            return 0;
+        case SO_RXQ_OVFL:
+            if (*optlen < (int)sizeof(uint32_t)) {
+                errorf("invalid length, optlen=%d", *optlen);
+                return -1;
+            }
+            if (udp_get_drops(s->desc, optval) == -1) {
+                return -1;
+            }
+            *optlen = sizeof(uint32_t);
+            return 0;
+        }
+        errorf("unsupported option, optname=%d", optname);
+        return -1;
+    }
+    if (s->family != AF_INET || s->type != SOCK_STREAM || level != SOL_TCP) {
+        errorf("unsupported level, level=%d", level);
+        return -1;
+    }
+    switch (optname) {
+    case TCP_CONGESTION:
+        if (*optlen <= 0 || tcp_get_congestion(s->desc, optval, *optlen) == -1) {
+            return -1;
+        }
+        *optlen = strlen(optval);
+        return 0;
+    case TCP_NODELAY:
+    case TCP_CORK:
+    case TCP_QUICKACK:
+        if (*optlen < (int)sizeof(int)) {
+            errorf("invalid length, optlen=%d", *optlen);
+            return -1;
+        }
+        switch (optname) {
+        case TCP_NODELAY:
+            ret = tcp_get_nodelay(s->desc, optval);
+            break;
+        case TCP_CORK:
+            ret = tcp_get_cork(s->desc, optval);
+            break;
+        default:
+            ret = tcp_get_quickack(s->desc, optval);
+            break;
+        }
+        if (ret == -1) {
+            return -1;
+        }
+        *optlen = sizeof(int);
+        return 0;
+    case TCP_INFO:
+        if (*optlen < (int)sizeof(struct tcp_info)) {
+            errorf("invalid length, optlen=%d", *optlen);
+            return -1;
+        }
+        if (tcp_get_info(s->desc, optval) == -1) {
+            return -1;
+        }
+        *optlen = sizeof(struct tcp_info);
+        return 0;
+    }
+    errorf("unsupported option, optname=%d", optname);
+    return -1;
+}
+
+int
+sock_set_nonblock(int id, int on)
+{
+    struct sock *s;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    switch (s->type) {
+    case SOCK_STREAM:
+        return tcp_set_nonblock(s->desc, on);
+    case SOCK_DGRAM:
+        return udp_set_nonblock(s->desc, on);
+    }
+    return -1;
+}
+
+/*
+ * Readiness Notification (poll/epoll)
+ *
+ * NOTE: The transport calls sock_notify() when the readiness may have changed, which queues
+ *       the items watching the sock to the ready list of their epolls. sock_epoll_wait() polls
+ *       the queued ones (tcp_poll()/udp_poll()) to find which events are actually ready, and
+ *       keeps the items still ready queued (level-triggered) unless EPOLLET is requested.
+ */
+
+static int
+sock_poll_events(struct sock *s)
+{
+    switch (s->type) {
+    case SOCK_STREAM:
+        return tcp_poll(s->desc);
+    case SOCK_DGRAM:
+        return udp_poll(s->desc);
+    }
+    return POLLERR | POLLHUP;
+}
+
+/* NOTE: must be called after the epoll locked */
+static void
+sock_epoll_item_queue(struct sock_epoll_item *item)
+{
+    if (list_empty(&item->ready_entry)) {
+        list_add_tail(&item->ready_entry, &item->ep->ready);
+        sched_wakeup(&item->ep->ctx);
+        if (item->ep->kick) {
+            item->ep->kick(item->ep->kick_arg);
+        }
+    }
+}
+
+/* NOTE: must be called after the both of the sock and the epoll locked */
+static void
+sock_epoll_item_detach(struct sock_epoll_item *item)
+{
+    if (!item->dead) {
+        list_del(&item->sock_entry);
+        list_del(&item->entry);
+        list_del(&item->ready_entry);
+        item->dead = 1;
+    }
+    if (!item->ref) {
+        memory_free(item);
+    }
+}
+
+/* NOTE: must be called after the both of the sock and the epoll locked */
+static struct sock_epoll_item *
+sock_epoll_item_lookup(struct sock *s, struct sock_epoll *ep)
+{
+    struct list_head *entry;
+    struct sock_epoll_item *item;
+
+    list_foreach(entry, &s->watchers) {
+        item = list_entry(entry, struct sock_epoll_item, sock_entry);
+        if (item->ep == ep) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+/* NOTE: called by the transport with its lock held */
+static void
+sock_notify(void *arg)
+{
+    struct sock *s;
+    struct list_head *entry;
+    struct sock_epoll_item *item;
+
+    s = arg;
+    mutex_lock(&s->mutex);
+    list_foreach(entry, &s->watchers) {
+        item = list_entry(entry, struct sock_epoll_item, sock_entry);
+        mutex_lock(&item->ep->mutex);
+        sock_epoll_item_queue(item);
+        mutex_unlock(&item->ep->mutex);
+    }
+    mutex_unlock(&s->mutex);
+}
+
+/* NOTE: must be called after the notification of the transport stopped */
+static void
+sock_unwatch(struct sock *s)
+{
+    struct list_head *entry;
+    struct sock_epoll_item *item;
+    struct sock_epoll *ep;
+
+    mutex_lock(&s->mutex);
+    while ((entry = list_first(&s->watchers)) != NULL) {
+        item = list_entry(entry, struct sock_epoll_item, sock_entry);
+        ep = item->ep;
+        mutex_lock(&ep->mutex);
+        if (ep->kick) {
+            /* NOTE: an internal watcher has to know the sock gone, the operations on it are pending */
+            item->closed = 1;
+            item->ref++;
+            sock_epoll_item_detach(item);
+            sock_epoll_item_queue(item);
+        } else {
+            sock_epoll_item_detach(item);
+        }
+        mutex_unlock(&ep->mutex);
+    }
+    mutex_unlock(&s->mutex);
+}
+
+static void
+sock_epoll_free(struct sock_epoll *ep)
+{
+    struct list_head *entry;
+    int id;
+
+    /* NOTE: only the items of the socks closed can be left (queued to report POLLNVAL) */
+    while ((entry = list_pop(&ep->ready)) != NULL) {
+        memory_free(list_entry(entry, struct sock_epoll_item, ready_entry));
+    }
+    sched_ctx_destroy(&ep->ctx);
+    mutex_lock(&mutex);
+    id = ep->id;
+    memset(ep, 0, sizeof(*ep));
+    table_free(&epolls, id);
+    mutex_unlock(&mutex);
+}
+
+static int
+sock_epoll_alloc(void (*kick)(void *arg), void *arg)
+{
+    struct sock_epoll *ep;
+    int id;
+
+    mutex_lock(&mutex);
+    ep = table_alloc(&epolls, &id);
+    if (!ep) {
+        mutex_unlock(&mutex);
+        errorf("table_alloc() failure");
+        return -1;
+    }
+    ep->id = id;
+    ep->used = 1;
+    mutex_init(&ep->mutex);
+    sched_ctx_init(&ep->ctx);
+    list_init(&ep->items);
+    list_init(&ep->ready);
+    ep->kick = kick;
+    ep->kick_arg = arg;
+    mutex_unlock(&mutex);
+    return id;
+}
+
+/* NOTE: returns the id of the epoll, which is not a sock id (they are numbered separately) */
+int
+sock_epoll_create(void)
+{
+    return sock_epoll_alloc(NULL, NULL);
+}
+
+int
+sock_epoll_ctl(int epfd, int op, int id, struct epoll_event *event)
+{
+    struct sock_epoll *ep;
+    struct sock *s;
+    struct sock_epoll_item *item;
+    int ret = 0;
+
+    ep = table_get(&epolls, epfd);
+    if (!ep) {
+        errorf("epoll not found, epfd=%d", epfd);
+        return -1;
+    }
+    s = sock_get(id);
+    if (!s) {
+        errorf("sock not found, id=%d", id);
+        return -1;
+    }
+    if (op != EPOLL_CTL_DEL && !event) {
+        errorf("no event");
+        return -1;
+    }
+    mutex_lock(&s->mutex);
+    mutex_lock(&ep->mutex);
+    if (ep->closing) {
+        errorf("closing, epfd=%d", epfd);
+        mutex_unlock(&ep->mutex);
+        mutex_unlock(&s->mutex);
+        return -1;
+    }
+    item = sock_epoll_item_lookup(s, ep);
+    switch (op) {
+    case EPOLL_CTL_ADD:
+        if (item) {
+            errorf("already added, id=%d", id);
+            errno = EEXIST;
+            ret = -1;
+            break;
+        }
+        item = memory_alloc(sizeof(*item));
+        if (!item) {
+            errorf("memory_alloc() failure");
+            ret = -1;
+            break;
+        }
+        item->ep = ep;
+        item->s = s;
+        list_init(&item->ready_entry);
+        list_add_tail(&item->entry, &ep->items);
+        list_add_tail(&item->sock_entry, &s->watchers);
+        /* fall through */
+    case EPOLL_CTL_MOD:
+        if (!item) {
+            errorf("not added, id=%d", id);
+            errno = ENOENT;
+            ret = -1;
+            break;
+        }
+        item->events = event->events;
+        item->data = event->data;
+        /* NOTE: the current readiness is reported without waiting for the next notification */
+        sock_epoll_item_queue(item);
+        break;
+    case EPOLL_CTL_DEL:
+        if (!item) {
+            errorf("not added, id=%d", id);
+            errno = ENOENT;
+            ret = -1;
+            break;
+        }
+        sock_epoll_item_detach(item);
+        break;
+    default:
+        errorf("invalid op, op=%d", op);
+        ret = -1;
+        break;
+    }
+    mutex_unlock(&ep->mutex);
+    mutex_unlock(&s->mutex);
+    return ret;
+}
+
+/*
+ * NOTE: Wait for the events of the socks added, up to timeout milli seconds (-1: infinite, 0: just poll),
+ *       returns the number of the events stored in events[], 0 on timeout, or -1 (errno is EINTR if interrupted).
+ */
+int
+sock_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    struct sock_epoll *ep;
+    struct sock_epoll_item *items[SOCK_EPOLL_BATCH], *item;
+    uint32_t revents[SOCK_EPOLL_BATCH];
+    struct list_head again, *entry;
+    struct timespec abstime;
+    int num, i, err, ret = 0;
+
+    if (maxevents <= 0) {
+        errorf("invalid maxevents, maxevents=%d", maxevents);
+        return -1;
+    }
+    ep = table_get(&epolls, epfd);
+    if (!ep) {
+        errorf("epoll not found, epfd=%d", epfd);
+        return -1;
+    }
+    if (timeout > 0) {
+        clock_gettime(CLOCK_REALTIME, &abstime);
+        abstime.tv_sec += timeout / 1000;
+        abstime.tv_nsec += (timeout % 1000) * 1000000;
+        if (abstime.tv_nsec >= 1000000000) {
+            abstime.tv_sec++;
+            abstime.tv_nsec -= 1000000000;
+        }
+    }
+    list_init(&again);
+    mutex_lock(&ep->mutex);
+    ep->users++;
+    for (;;) {
+        if (ep->closing) {
+            debugf("closed");
+            ret = -1;
+            break;
+        }
+        while (ret < maxevents && !list_empty(&ep->ready)) {
+            for (num = 0; num < SOCK_EPOLL_BATCH && num < maxevents - ret; num++) {
+                entry = list_pop(&ep->ready);
+                if (!entry) {
+                    break;
+                }
+                items[num] = list_entry(entry, struct sock_epoll_item, ready_entry);
+                if (items[num]->closed) {
+                    revents[num] = POLLNVAL; /* NOTE: the reference of ready is handed over */
+                } else {
+                    revents[num] = 0;
+                    items[num]->ref++;
+                }
+            }
+            /* NOTE: poll out of the lock, the notification may queue the items again meanwhile */
+            mutex_unlock(&ep->mutex);
+            for (i = 0; i < num; i++) {
+                if (!revents[i]) {
+                    revents[i] = sock_poll_events(items[i]->s) & (items[i]->events | POLLERR | POLLHUP);
+                }
+            }
+            mutex_lock(&ep->mutex);
+            for (i = 0; i < num; i++) {
+                item = items[i];
+                item->ref--;
+                if (item->dead) {
+                    if (revents[i] == POLLNVAL) {
+                        events[ret].events = POLLNVAL;
+                        events[ret].data = item->data;
+                        ret++;
+                    }
+                    if (!item->ref) {
+                        memory_free(item);
+                    }
+                    continue;
+                }
+                if (!revents[i]) {
+                    continue;
+                }
+                events[ret].events = revents[i];
+                events[ret].data = item->data;
+                ret++;
+                if (!(item->events & EPOLLET) && list_empty(&item->ready_entry)) {
+                    /* NOTE: queued again after this round, otherwise it would be polled twice */
+                    list_add_tail(&item->ready_entry, &again);
+                }
+            }
+        }
+        if (ret || !timeout) {
+            break;
+        }
+        err = sched_sleep(&ep->ctx, &ep->mutex, timeout > 0 ? &abstime : NULL);
+        if (err == -1) {
+            debugf("interrupted");
+            errno = EINTR;
+            ret = -1;
+            break;
+        }
+        if (err == ETIMEDOUT) {
+            break;
+        }
+    }
+    while ((entry = list_pop(&again)) != NULL) {
+        list_add_tail(entry, &ep->ready);
+    }
+    ep->users--;
+    if (ep->closing && !ep->users) {
+        mutex_unlock(&ep->mutex);
+        sock_epoll_free(ep);
+        return ret;
+    }
+    mutex_unlock(&ep->mutex);
+    return ret;
+}
+
+int
+sock_epoll_close(int epfd)
+{
+    struct sock_epoll *ep;
+    struct sock_epoll_item *item;
+    struct list_head *entry;
+    struct sock *s;
+
+    ep = table_get(&epolls, epfd);
+    if (!ep) {
+        errorf("epoll not found, epfd=%d", epfd);
+        return -1;
+    }
+    mutex_lock(&ep->mutex);
+    if (ep->closing) {
+        errorf("already closed, epfd=%d", epfd);
+        mutex_unlock(&ep->mutex);
+        return -1;
+    }
+    ep->closing = 1;
+    while ((entry = list_first(&ep->items)) != NULL) {
+        item = list_entry(entry, struct sock_epoll_item, entry);
+        s = item->s;
+        /* NOTE: the lock of the sock comes first, the item is referenced while relocking */
+        item->ref++;
+        mutex_unlock(&ep->mutex);
+        mutex_lock(&s->mutex);
+        mutex_lock(&ep->mutex);
+        item->ref--;
+        sock_epoll_item_detach(item);
+        mutex_unlock(&s->mutex);
+    }
+    if (ep->users) {
+        /* NOTE: the last one leaving sock_epoll_wait() frees it */
+        sched_wakeup(&ep->ctx);
+        mutex_unlock(&ep->mutex);
+        return 0;
+    }
+    mutex_unlock(&ep->mutex);
+    sock_epoll_free(ep);
+    return 0;
+}
+
+/* NOTE: built on a temporary epoll, fds[].fd < 0 are ignored, returns the number of fds with revents set */
+int
+sock_poll(struct pollfd *fds, unsigned int nfds, int timeout)
+{
+    struct epoll_event ev, *events;
+    unsigned int i;
+    int epfd, invalid = 0, ret, err;
+
+    epfd = sock_epoll_create();
+    if (epfd == -1) {
+        errorf("sock_epoll_create() failure");
+        return -1;
+    }
+    events = memory_alloc(sizeof(*events) * MAX(nfds, 1));
+    if (!events) {
+        errorf("memory_alloc() failure");
+        sock_epoll_close(epfd);
+        return -1;
+    }
+    for (i = 0; i < nfds; i++) {
+        fds[i].revents = 0;
+        if (fds[i].fd < 0) {
+            continue;
+        }
+        ev.events = (uint16_t)fds[i].events;
+        ev.data.u32 = i;
+        if (sock_epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i].fd, &ev) == -1) {
+            fds[i].revents = POLLNVAL;
+            invalid++;
+        }
+    }
+    ret = sock_epoll_wait(epfd, events, MAX(nfds, 1), invalid ? 0 : timeout);
+    err = errno;
+    if (ret != -1) {
+        for (i = 0; i < (unsigned int)ret; i++) {
+            fds[events[i].data.u32].revents = events[i].events;
+        }
+        ret += invalid;
+    }
+    memory_free(events);
+    sock_epoll_close(epfd);
+    errno = err;
+    return ret;
+}
+
+/*
+ * Asynchronous Operation (uring)
+ *
+ * NOTE: The operations submitted are tried at once, and those which would block are left
+ *       pending on the per-sock queues. The socks having them are watched by an internal
+ *       epoll (edge-triggered), its notification arms the timeout of the uring, and the
+ *       handler completes them on the worker (in the softirq context, with no thread
+ *       sleeping for each of them). The reapers are woken up once for the completions they wait for.
+ */
+
+static struct sock_uring *
+sock_uring_get(int id)
+{
+    struct sock_uring *ring;
+
+    mutex_lock(&mutex);
+    ring = table_get(&urings, id);
+    if (!ring || ring->closing) {
+        mutex_unlock(&mutex);
+        return NULL;
+    }
+    ring->ref++;
+    mutex_unlock(&mutex);
+    return ring;
+}
+
+/* NOTE: must be called after the uring unlocked, the last one frees it */
+static void
+sock_uring_put(struct sock_uring *ring)
+{
+    struct list_head *entry, *op;
+    int i, id, last;
+
+    mutex_lock(&mutex);
+    last = --ring->ref == 0;
+    mutex_unlock(&mutex);
+    if (!last) {
+        return;
+    }
+    if (ring->epfd != -1) {
+        sock_epoll_close(ring->epfd);
+    }
+    net_timeout_cancel(&ring->timeout);
+    while ((entry = list_pop(&ring->orphans)) != NULL) {
+        list_add_tail(entry, &ring->files[0]); /* freed along with the others */
+    }
+    for (i = 0; i < SOCK_URING_FILE_HASH_SIZE; i++) {
+        while ((entry = list_pop(&ring->files[i])) != NULL) {
+            while ((op = list_pop(&list_entry(entry, struct sock_uring_file, entry)->rx)) != NULL) {
+                memory_free(list_entry(op, struct sock_uring_op, entry));
+            }
+            while ((op = list_pop(&list_entry(entry, struct sock_uring_file, entry)->tx)) != NULL) {
+                memory_free(list_entry(op, struct sock_uring_op, entry));
+            }
+            memory_free(list_entry(entry, struct sock_uring_file, entry));
+        }
+    }
+    memory_free(ring->sq);
+    memory_free(ring->cq);
+    sched_ctx_destroy(&ring->ctx);
+    mutex_lock(&mutex);
+    id = ring->id;
+    memset(ring, 0, sizeof(*ring));
+    table_free(&urings, id);
+    mutex_unlock(&mutex);
+}
+
+/* NOTE: called by the epoll with its lock held (and maybe the transport one) */
+static void
+sock_uring_kick(void *arg)
+{
+    struct sock_uring *ring;
+
+    ring = arg;
+    net_timeout_arm(&ring->timeout, clock_usec());
+}
+
+/* NOTE: must be called after the uring locked */
+static void
+sock_uring_complete(struct sock_uring *ring, struct sock_uring_op *op, ssize_t res)
+{
+    struct sock_uring_cqe *cqe;
+
+    cqe = &ring->cq[ring->cq_tail++ & (ring->entries * 2 - 1)];
+    cqe->user_data = op->sqe.user_data;
+    cqe->res = res;
+    ring->inflight--;
+    memory_free(op);
+    if (ring->cq_tail - ring->cq_head >= ring->want) {
+        ring->want = UINT32_MAX;
+        sched_wakeup(&ring->ctx);
+    }
+}
+
+/* NOTE: never sleeps, returns -EAGAIN if it would */
+static ssize_t
+sock_uring_exec(struct sock_uring_sqe *sqe)
+{
+    struct sock *s;
+    struct ip_endpoint ep;
+    ssize_t ret = -1;
+
+    s = sock_get(sqe->fd);
+    if (!s) {
+        return -EBADF;
+    }
+    errno = 0;
+    switch (sqe->opcode) {
+    case SOCK_URING_OP_RECV:
+        switch (s->type) {
+        case SOCK_STREAM:
+            ret = tcp_receive_nowait(s->desc, sqe->buf, sqe->len);
+            break;
+        case SOCK_DGRAM:
+            ret = udp_recvfrom_nowait(s->desc, sqe->buf, sqe->len, &ep);
+            if (ret != -1 && sqe->addr) {
+                ((struct sockaddr_in *)sqe->addr)->sin_family = AF_INET;
+                ((struct sockaddr_in *)sqe->addr)->sin_addr = ep.addr;
+                ((struct sockaddr_in *)sqe->addr)->sin_port = ep.port;
+            }
+            break;
+        }
+        break;
+    case SOCK_URING_OP_SEND:
+        switch (s->type) {
+        case SOCK_STREAM:
+            ret = tcp_send_nowait(s->desc, sqe->buf, sqe->len);
+            break;
+        case SOCK_DGRAM:
+            if (!sqe->addr) {
+                return -EDESTADDRREQ;
+            }
+            ep.addr = ((struct sockaddr_in *)sqe->addr)->sin_addr;
+            ep.port = ((struct sockaddr_in *)sqe->addr)->sin_port;
+            ret = udp_sendto(s->desc, sqe->buf, sqe->len, &ep);
+            break;
+        }
+        break;
+    case SOCK_URING_OP_ACCEPT:
+        ret = sock_accept_core(sqe->fd, sqe->addr, NULL, 1);
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (ret == -1) {
+        return errno ? -errno : -EIO;
+    }
+    return ret;
+}
+
+/* NOTE: must be called after the uring locked */
+static void
+sock_uring_queue_run(struct sock_uring *ring, struct list_head *queue)
+{
+    struct list_head *entry;
+    struct sock_uring_op *op;
+    ssize_t res;
+
+    while ((entry = list_first(queue)) != NULL) {
+        op = list_entry(entry, struct sock_uring_op, entry);
+        res = sock_uring_exec(&op->sqe);
+        if (res == -EAGAIN) {
+            break;
+        }
+        list_del(entry);
+        sock_uring_complete(ring, op, res);
+    }
+}
+
+/* NOTE: must be called after the uring locked, the file is kept (to be freed on the report) but not found anymore */
+static void
+sock_uring_file_orphan(struct sock_uring *ring, struct sock_uring_file *file)
+{
+    list_del(&file->entry);
+    list_add_tail(&file->entry, &ring->orphans);
+}
+
+/* NOTE: must be called after the uring locked, the file may be freed by this */
+static void
+sock_uring_file_run(struct sock_uring *ring, struct sock_uring_file *file, int closed)
+{
+    struct list_head *entry;
+    struct epoll_event ev;
+
+    if (!closed) {
+        sock_uring_queue_run(ring, &file->rx);
+        sock_uring_queue_run(ring, &file->tx);
+        ev.events = EPOLLET;
+        if (!list_empty(&file->rx)) {
+            ev.events |= EPOLLIN;
+        }
+        if (!list_empty(&file->tx)) {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.ptr = file;
+        if (ev.events == EPOLLET) {
+            if (!file->events || sock_epoll_ctl(ring->epfd, EPOLL_CTL_DEL, file->fd, NULL) == 0) {
+                list_del(&file->entry);
+                memory_free(file);
+                return;
+            }
+            /* NOTE: the sock has gone, the file is freed on the report of it (POLLNVAL) */
+            sock_uring_file_orphan(ring, file);
+            return;
+        }
+        if (ev.events == file->events) {
+            return;
+        }
+        if (sock_epoll_ctl(ring->epfd, file->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, file->fd, &ev) == 0) {
+            file->events = ev.events;
+            return;
+        }
+        if (file->events) {
+            /* NOTE: the sock has gone, the rest is cancelled on the report of it (POLLNVAL) */
+            sock_uring_file_orphan(ring, file);
+            return;
+        }
+    }
+    while ((entry = list_pop(&file->rx)) != NULL || (entry = list_pop(&file->tx)) != NULL) {
+        sock_uring_complete(ring, list_entry(entry, struct sock_uring_op, entry), -EBADF);
+    }
+    list_del(&file->entry);
+    memory_free(file);
+}
+
+/* NOTE: must be called after the uring locked */
+static struct sock_uring_file *
+sock_uring_file_get(struct sock_uring *ring, int fd)
+{
+    struct list_head *bucket, *entry;
+    struct sock_uring_file *file;
+
+    bucket = &ring->files[(unsigned int)fd % SOCK_URING_FILE_HASH_SIZE];
+    list_foreach(entry, bucket) {
+        file = list_entry(entry, struct sock_uring_file, entry);
+        if (file->fd == fd) {
+            return file;
+        }
+    }
+    file = memory_alloc(sizeof(*file));
+    if (!file) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    file->fd = fd;
+    list_init(&file->rx);
+    list_init(&file->tx);
+    list_add_tail(&file->entry, bucket);
+    return file;
+}
+
+static void
+sock_uring_timeout(void *arg)
+{
+    struct sock_uring *ring;
+    struct epoll_event events[SOCK_URING_BATCH];
+    int n, i;
+
+    ring = sock_uring_get((intptr_t)arg);
+    if (!ring) {
+        return;
+    }
+    mutex_lock(&ring->mutex);
+    while ((n = sock_epoll_wait(ring->epfd, events, SOCK_URING_BATCH, 0)) > 0) {
+        for (i = 0; i < n; i++) {
+            sock_uring_file_run(ring, events[i].data.ptr, events[i].events & POLLNVAL);
+        }
+    }
+    mutex_unlock(&ring->mutex);
+    sock_uring_put(ring);
+}
+
+/* NOTE: entries is the depth of the submission queue (rounded up to a power of two) */
+int
+sock_uring_create(unsigned int entries)
+{
+    struct sock_uring *ring;
+    int id, i;
+
+    if (!entries || entries > SOCK_URING_ENTRIES_MAX) {
+        errorf("invalid entries, entries=%u", entries);
+        return -1;
+    }
+    mutex_lock(&mutex);
+    ring = table_alloc(&urings, &id);
+    if (!ring) {
+        mutex_unlock(&mutex);
+        errorf("table_alloc() failure");
+        return -1;
+    }
+    ring->id = id;
+    ring->used = 1;
+    ring->ref = 1; /* dropped by sock_uring_close() */
+    ring->epfd = -1;
+    mutex_init(&ring->mutex);
+    sched_ctx_init(&ring->ctx);
+    ring->want = UINT32_MAX;
+    ring->entries = 1;
+    while (ring->entries < entries) {
+        ring->entries <<= 1;
+    }
+    for (i = 0; i < SOCK_URING_FILE_HASH_SIZE; i++) {
+        list_init(&ring->files[i]);
+    }
+    list_init(&ring->orphans);
+    net_timeout_init(&ring->timeout, sock_uring_timeout, (void *)(intptr_t)id);
+    net_timeout_bind(&ring->timeout, net_worker_select(id));
+    mutex_unlock(&mutex);
+    ring->sq = memory_alloc(sizeof(*ring->sq) * ring->entries);
+    ring->cq = memory_alloc(sizeof(*ring->cq) * ring->entries * 2);
+    if (ring->sq && ring->cq) {
+        ring->epfd = sock_epoll_alloc(sock_uring_kick, ring);
+    }
+    if (ring->epfd == -1) {
+        errorf("failed to set up, id=%d", id);
+        sock_uring_put(ring);
+        return -1;
+    }
+    return id;
+}
+
+/*
+ * NOTE: Returns the next entry to fill (zero-filled), or NULL if the submission queue is full.
+ *       It is handed to the stack by the next sock_uring_submit(), which must follow the filling.
+ */
+struct sock_uring_sqe *
+sock_uring_get_sqe(int id)
+{
+    struct sock_uring *ring;
+    struct sock_uring_sqe *sqe = NULL;
+
+    ring = sock_uring_get(id);
+    if (!ring) {
+        errorf("uring not found, id=%d", id);
+        return NULL;
+    }
+    mutex_lock(&ring->mutex);
+    if (ring->sq_next - ring->sq_head < ring->entries) {
+        sqe = &ring->sq[ring->sq_next++ & (ring->entries - 1)];
+        memset(sqe, 0, sizeof(*sqe));
+    }
+    mutex_unlock(&ring->mutex);
+    sock_uring_put(ring);
+    return sqe;
+}
+
+/*
+ * NOTE: Hand the entries filled to the stack, returns the number of them taken.
+ *       Those beyond the room of the completion queue are left until the completions reaped.
+ */
+int
+sock_uring_submit(int id)
+{
+    struct sock_uring *ring;
+    struct sock_uring_sqe *sqe;
+    struct sock_uring_op *op;
+    struct sock_uring_file *file;
+    int num;
+
+    ring = sock_uring_get(id);
+    if (!ring) {
+        errorf("uring not found, id=%d", id);
+        return -1;
+    }
+    mutex_lock(&ring->mutex);
+    ring->sq_tail = ring->sq_next; /* NOTE: the entries got so far are filled now */
+    for (num = 0; ring->sq_head != ring->sq_tail; num++) {
+        if (ring->inflight + (ring->cq_tail - ring->cq_head) >= ring->entries * 2) {
+            break;
+        }
+        op = memory_alloc(sizeof(*op));
+        if (!op) {
+            errorf("memory_alloc() failure");
+            break;
+        }
+        sqe = &ring->sq[ring->sq_head++ & (ring->entries - 1)];
+        op->sqe = *sqe;
+        ring->inflight++;
+        file = sock_uring_file_get(ring, sqe->fd);
+        if (!file) {
+            sock_uring_complete(ring, op, -ENOMEM);
+            continue;
+        }
+        list_add_tail(&op->entry, sqe->opcode == SOCK_URING_OP_SEND ? &file->tx : &file->rx);
+        /* NOTE: the operation completes here if it can, or waits behind the ones pending */
+        sock_uring_file_run(ring, file, 0);
+    }
+    mutex_unlock(&ring->mutex);
+    sock_uring_put(ring);
+    return num;
+}
+
+/*
+ * NOTE: Reap up to n completions, waiting for min of them up to timeout milli seconds (-1: infinite),
+ *       returns the number of them stored in cqes[], or -1 (errno is EINTR if interrupted).
+ */
+int
+sock_uring_wait(int id, struct sock_uring_cqe *cqes, unsigned int n, unsigned int min, int timeout)
+{
+    struct sock_uring *ring;
+    struct timespec abstime;
+    unsigned int num;
+    int err, ret = 0;
+
+    ring = sock_uring_get(id);
+    if (!ring) {
+        errorf("uring not found, id=%d", id);
+        return -1;
+    }
+    if (timeout > 0) {
+        clock_gettime(CLOCK_REALTIME, &abstime);
+        abstime.tv_sec += timeout / 1000;
+        abstime.tv_nsec += (timeout % 1000) * 1000000;
+        if (abstime.tv_nsec >= 1000000000) {
+            abstime.tv_sec++;
+            abstime.tv_nsec -= 1000000000;
+        }
+    }
+    min = MIN(min, n);
+    mutex_lock(&ring->mutex);
+    while (ring->cq_tail - ring->cq_head < min && timeout) {
+        if (ring->closing) {
+            debugf("closed");
+            ret = -1;
+            break;
+        }
+        ring->want = MIN(ring->want, min);
+        err = sched_sleep(&ring->ctx, &ring->mutex, timeout > 0 ? &abstime : NULL);
+        if (err == -1) {
+            debugf("interrupted");
+            errno = EINTR;
+            ret = -1;
+            break;
+        }
+        if (err == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (ret != -1) {
+        for (num = 0; num < n && ring->cq_head != ring->cq_tail; num++) {
+            cqes[num] = ring->cq[ring->cq_head++ & (ring->entries * 2 - 1)];
+        }
+        ret = num;
+    }
+    mutex_unlock(&ring->mutex);
+    sock_uring_put(ring);
+    return ret;
+}
+
+/* NOTE: the operations pending are discarded without the completions */
+int
+sock_uring_close(int id)
+{
+    struct sock_uring *ring;
+
+    ring = sock_uring_get(id);
+    if (!ring) {
+        errorf("uring not found, id=%d", id);
+        return -1;
+    }
+    mutex_lock(&ring->mutex);
+    mutex_lock(&mutex);
+    ring->closing = 1;
+    mutex_unlock(&mutex);
+    sched_wakeup(&ring->ctx);
+    mutex_unlock(&ring->mutex);
+    sock_uring_put(ring);
+    sock_uring_put(ring); /* the one of sock_uring_create() */
+    return 0;
+}
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "ip.h"
 
@@ -19,19 +20,26 @@
 #define SOCK_STREAM 1
 #define SOCK_DGRAM  2
 
+#define SOCK_NONBLOCK 04000 /* or'ed into the type of sock_open() */
+
 #define IPPROTO_TCP 0
 #define IPPROTO_UDP 0
 
 #define INADDR_ANY ((ip_addr_t)0)
 
-#define SOCKADDR_STR_LEN IP_ENDPOINT_STR_LEN
+#define SOL_SOCKET 1
+#define SOL_TCP    6
 
-struct sock {
-    int used;
-    int family;
-    int type;
-    int desc;
-};
+#define SO_RCVBUF    8 /* int, bytes the receive queue may hold (SOCK_DGRAM) */
+#define SO_RXQ_OVFL 40 /* uint32_t (get only), datagrams dropped for the receive queue overflow (SOCK_DGRAM) */
+
+#define TCP_NODELAY     1 /* int, send partial segments without waiting for the ACK (Nagle's algorithm is disabled) */
+#define TCP_CORK        3 /* int, hold partial segments until full (or 200ms), clearing it sends them */
+#define TCP_INFO       11 /* struct tcp_info of tcp.h (get only), the RTT, the window and the counters */
+#define TCP_QUICKACK   12 /* int, ACK every segment immediately instead of delaying the ACK */
+#define TCP_CONGESTION 13 /* char[], the name of the congestion control algorithm */
+
+#define SOCKADDR_STR_LEN IP_ENDPOINT_STR_LEN
 
 struct sockaddr {
     unsigned short sa_family;
@@ -44,6 +52,69 @@ struct sockaddr_in {
     ip_addr_t sin_addr;
 };
 
+/* NOTE: a simplified one, a single buffer per datagram instead of struct msghdr */
+struct mmsghdr {
+    void *msg_buf;
+    size_t msg_size; /* of msg_buf, the length of the datagram to send */
+    struct sockaddr *msg_name; /* the source (optional) or the destination */
+    int msg_namelen;
+    size_t msg_len; /* bytes received or sent */
+};
+
+#define POLLIN   NET_POLLIN
+#define POLLOUT  NET_POLLOUT
+#define POLLERR  NET_POLLERR
+#define POLLHUP  NET_POLLHUP
+#define POLLNVAL 0x0020 /* not a socket (sock_poll() only) */
+
+struct pollfd {
+    int fd;
+    short events;
+    short revents;
+};
+
+#define EPOLLIN  POLLIN
+#define EPOLLOUT POLLOUT
+#define EPOLLERR POLLERR
+#define EPOLLHUP POLLHUP
+#define EPOLLET  (1U << 31) /* reported once per change instead of while ready */
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+typedef union epoll_data {
+    void *ptr;
+    int fd;
+    uint32_t u32;
+    uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event {
+    uint32_t events;
+    epoll_data_t data;
+};
+
+#define SOCK_URING_OP_RECV   1 /* sock_recv(), or sock_recvfrom() for SOCK_DGRAM (the source to addr if set) */
+#define SOCK_URING_OP_SEND   2 /* sock_send(), or sock_sendto() for SOCK_DGRAM (addr is the destination) */
+#define SOCK_URING_OP_ACCEPT 3 /* sock_accept() (the foreign to addr if set), res is the new sock id */
+
+/* NOTE: an operation submitted, fd is the sock id and buf must be kept until the completion */
+struct sock_uring_sqe {
+    int opcode;
+    int fd;
+    void *buf;
+    size_t len;
+    struct sockaddr *addr;
+    int addrlen;
+    uint64_t user_data; /* passed through to the completion */
+};
+
+struct sock_uring_cqe {
+    uint64_t user_data;
+    ssize_t res; /* what the synchronous call returns, or -errno on failure */
+};
+
 #define IFNAMSIZ 16
 
 extern int
@@ -51,15 +122,24 @@ sockaddr_pton(const char *p, struct sockaddr *n, size_t size);
 extern char *
 sockaddr_ntop(const struct sockaddr *n, char *p, size_t size);
 
+extern int
+sock_init(void);
+extern int
+sock_set_max(size_t max);
+
 extern int
 sock_open(int domain, int type, int protocol);
 extern int
 sock_close(int id);
 extern ssize_t
 sock_recvfrom(int id, void *buf, size_t n, struct sockaddr *addr, int *addrlen);
+extern int
+sock_recvmmsg(int id, struct mmsghdr *msgvec, unsigned int vlen);
 extern ssize_t
 sock_sendto(int id, const void *buf, size_t n, const struct sockaddr *addr, int addrlen);
 extern int
+sock_sendmmsg(int id, struct mmsghdr *msgvec, unsigned int vlen);
+extern int
 sock_bind(int id, const struct sockaddr *addr, int addrlen);
 extern int
 sock_listen(int id, int backlog);
@@ -70,6 +150,38 @@ sock_connect(int id, const struct sockaddr *addr, int addrlen);
 extern ssize_t
 sock_recv(int id, void *buf, size_t n);
 extern ssize_t
+sock_peek(int id, struct iovec iov[2]);
+extern ssize_t
+sock_consume(int id, size_t n);
+extern ssize_t
 sock_send(int id, const void *buf, size_t n);
+extern int
+sock_setsockopt(int id, int level, int optname, const void *optval, int optlen);
+extern int
+sock_getsockopt(int id, int level, int optname, void *optval, int *optlen);
+extern int
+sock_set_nonblock(int id, int on);
+
+extern int
+sock_poll(struct pollfd *fds, unsigned int nfds, int timeout);
+extern int
+sock_epoll_create(void);
+extern int
+sock_epoll_ctl(int epfd, int op, int id, struct epoll_event *event);
+extern int
+sock_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+extern int
+sock_epoll_close(int epfd);
+
+extern int
+sock_uring_create(unsigned int entries);
+extern struct sock_uring_sqe *
+sock_uring_get_sqe(int id);
+extern int
+sock_uring_submit(int id);
+extern int
+sock_uring_wait(int id, struct sock_uring_cqe *cqes, unsigned int n, unsigned int min, int timeout);
+extern int
+sock_uring_close(int id);
 
 #endif
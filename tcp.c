@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -9,8 +11,10 @@
 
 #include "util.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ip.h"
 #include "tcp.h"
+#include "trace.h"
 
 #define TCP_FLG_FIN 0x01
 #define TCP_FLG_SYN 0x02
@@ -22,7 +26,36 @@
 #define TCP_FLG_IS(x, y) ((x & 0x3f) == (y))
 #define TCP_FLG_ISSET(x, y) ((x & 0x3f) & (y) ? 1 : 0)
 
-#define TCP_PCB_SIZE 16
+#define TCP_OPT_EOL            0
+#define TCP_OPT_NOP            1
+#define TCP_OPT_MSS            2
+#define TCP_OPT_WSCALE         3 /* rfc7323 */
+#define TCP_OPT_SACK_PERMITTED 4 /* rfc2018 */
+#define TCP_OPT_SACK           5 /* rfc2018 */
+#define TCP_OPT_TIMESTAMP      8 /* rfc7323 */
+
+#define TCP_OPT_LEN_MAX 40
+#define TCP_OPT_TIMESTAMP_LEN 12 /* including the leading NOPs */
+#define TCP_OPT_WSCALE_MAX 14
+#define TCP_OPT_SACK_BLOCKS_MAX 4
+
+#define TCP_PCB_OPT_WSCALE 0x01
+#define TCP_PCB_OPT_SACK   0x02
+#define TCP_PCB_OPT_TS     0x04
+
+/* NOTE: sequence number comparison (modulo 2^32) */
+#define TCP_SEQ_LT(x, y) ((int32_t)((x) - (y)) < 0)
+#define TCP_SEQ_LEQ(x, y) ((int32_t)((x) - (y)) <= 0)
+
+#define TCP_PCB_MAX 16384 /* default limit, see tcp_set_pcb_max() */
+#define TCP_RCVBUF_SIZE 262144 /* power of two, the window is limited to TCP_RCVBUF_SIZE-1 */
+#define TCP_RCV_WSCALE 2 /* the shift makes TCP_RCVBUF_SIZE-1 fit in the 16 bits window field */
+#define TCP_SNDBUF_SIZE 262144 /* power of two, the data written by tcp_send() and not acknowledged yet */
+#define TCP_DEFAULT_MSS 536
+#define TCP_RANGE_MAX 32 /* distinct ranges kept per list (out of order data, SACKed data) */
+
+#define TCP_EHASH_SIZE 4096 /* power of two, connections (bound to both of the endpoints) */
+#define TCP_LHASH_SIZE 64 /* power of two, listeners (bound to the local endpoint only) */
 
 #define TCP_PCB_MODE_RFC793 1
 #define TCP_PCB_MODE_SOCKET 2
@@ -40,9 +73,25 @@
 #define TCP_PCB_STATE_CLOSE_WAIT  10
 #define TCP_PCB_STATE_LAST_ACK    11
 
-#define TCP_DEFAULT_RTO 200000 /* micro seconds */
-#define TCP_RETRANSMIT_DEADLINE 12 /* seconds */
+#define TCP_CLOCK_G 10000 /* micro seconds, the clock granularity (G) of rfc6298 */
+#define TCP_RTO_INIT 1000000 /* micro seconds, rfc6298 - 2.1 */
+#define TCP_RTO_MIN (TCP_DELACK_TIMEOUT + TCP_CLOCK_G) /* NOTE: must not expire while the peer delays the ACK */
+#define TCP_RTO_MAX 60000000 /* micro seconds, rfc6298 - 2.5 */
+#define TCP_RETRANSMIT_DEADLINE 12000000 /* micro seconds */
 #define TCP_TIMEWAIT_SEC 30 /* substitute for 2MSL */
+#define TCP_DELACK_TIMEOUT 40000 /* micro seconds, rfc1122 - 4.2.3.2: less than 0.5 seconds */
+#define TCP_DELACK_SEGS 2 /* rfc1122 - 4.2.3.2: ACK at least every second segment */
+#define TCP_CORK_TIMEOUT 200000 /* micro seconds, a partial segment is not held by TCP_CORK longer than this */
+
+#define TCP_CC_DEFAULT "newreno"
+#define TCP_CC_DUPACK_THRESH 3
+
+#define TCP_CC_STATE_OPEN     0
+#define TCP_CC_STATE_RECOVERY 1 /* fast recovery (rfc6582) */
+#define TCP_CC_STATE_LOSS     2 /* after a retransmission timeout, until the data outstanding at that time is ACKed */
+
+/* NOTE: the earlier of two clock_usec() times, 0 stands for none */
+#define TCP_TIMER_EARLIER(x, y) (!(x) ? (y) : !(y) ? (x) : MIN((x), (y)))
 
 #define TCP_SOURCE_PORT_MIN 49152
 #define TCP_SOURCE_PORT_MAX 65535
@@ -67,15 +116,56 @@ struct tcp_hdr {
     uint16_t up;
 };
 
+struct tcp_options {
+    uint16_t mss; /* 0 if not present */
+    int wscale; /* -1 if not present */
+    int sack_permitted;
+    int ts; /* tsval/tsecr are present */
+    uint32_t tsval;
+    uint32_t tsecr;
+    int nsack;
+    struct {
+        uint32_t left;
+        uint32_t right;
+    } sack[TCP_OPT_SACK_BLOCKS_MAX];
+};
+
 struct tcp_segment_info {
     uint32_t seq;
     uint32_t ack;
     uint16_t len;
-    uint16_t wnd;
+    uint32_t wnd; /* scaled already */
     uint16_t up;
+    uint16_t segs; /* coalesced by GRO, 1 otherwise */
+    struct tcp_options opt;
+};
+
+struct tcp_pcb;
+
+/*
+ * NOTE: A congestion control algorithm only decides the window growth and the reaction to a loss,
+ *       loss detection, fast retransmit/recovery and the retransmission timeout are common.
+ */
+struct tcp_cc_ops {
+    const char *name;
+    void (*init)(struct tcp_pcb *pcb); /* cwnd/ssthresh are already set to the initial values */
+    void (*ack)(struct tcp_pcb *pcb, uint32_t acked); /* new data has been ACKed (not in recovery) */
+    uint32_t (*ssthresh)(struct tcp_pcb *pcb); /* a loss has been detected, returns the new ssthresh */
+};
+
+struct tcp_cubic {
+    double w_max; /* segments */
+    double k; /* seconds */
+    double origin; /* segments */
+    double w_est; /* segments, the window an AIMD flow would have (TCP friendly region) */
+    uint64_t epoch; /* clock_usec() */
+    int epoch_started;
 };
 
 struct tcp_pcb {
+    int id;
+    int ref; /* protected by the table mutex */
+    mutex_t mutex; /* protects everything else in the PCB */
     int state;
     int mode; /* user command mode */
     struct ip_endpoint local;
@@ -83,47 +173,155 @@ struct tcp_pcb {
     struct {
         uint32_t nxt;
         uint32_t una;
-        uint16_t wnd;
+        uint32_t wnd;
         uint16_t up;
         uint32_t wl1;
         uint32_t wl2;
+        uint32_t sack_high; /* the highest sequence number SACKed by the peer */
     } snd;
     uint32_t iss;
     struct {
         uint32_t nxt;
-        uint16_t wnd;
+        uint32_t wnd;
         uint16_t up;
+        uint32_t adv; /* right edge of the window last advertised */
+        uint32_t sack_recent; /* the out of order data received last (reported in the first SACK block) */
     } rcv;
     uint32_t irs;
     uint16_t mtu;
-    uint16_t mss;
-    uint8_t buf[65535]; /* receive buffer */
+    uint16_t mss; /* negotiated, without the options */
+    struct {
+        int flags; /* TCP_PCB_OPT_XXX, offered until the SYN of the peer arrives, then agreed */
+        uint8_t snd_wscale; /* the shift for the window of the peer */
+        uint8_t rcv_wscale; /* the shift for our window */
+        uint32_t ts_recent; /* rfc7323 - 4.3: TS.Recent */
+        uint32_t last_ack; /* rfc7323 - 4.3: Last.ACK.sent */
+    } opt;
+    struct {
+        uint32_t srtt; /* micro seconds, 0 until the first measurement */
+        uint32_t rttvar; /* micro seconds */
+        uint32_t rto; /* micro seconds, backed off on every expiration */
+        int timing; /* a segment is being timed (rfc6298 - 3: only one at a time) */
+        uint32_t seq; /* the ACK for this sequence number completes the measurement */
+        uint64_t start; /* clock_usec() */
+    } rtt;
+    struct {
+        const struct tcp_cc_ops *ops;
+        uint32_t cwnd; /* bytes */
+        uint32_t ssthresh; /* bytes */
+        int state;
+        int dupacks;
+        uint32_t recover; /* the recovery ends when this is ACKed */
+        union {
+            struct tcp_cubic cubic;
+        } priv;
+    } cc;
+    struct {
+        uint8_t *buf; /* TCP_RCVBUF_SIZE bytes, allocated only while it holds data */
+        uint32_t head; /* free-running, advanced by the application */
+        uint32_t tail; /* free-running, advanced by the segment arrival */
+        int peeking; /* a view returned by tcp_peek() is outstanding (written under the table mutex as well) */
+    } rcvbuf;
+    struct {
+        uint8_t *buf; /* TCP_SNDBUF_SIZE bytes, allocated only while it holds data */
+        uint32_t end; /* the sequence number next to the data written by tcp_send() (ISS+1 if none) */
+        int nodelay; /* TCP_NODELAY, Nagle's algorithm is disabled */
+        int cork; /* TCP_CORK, only full segments are sent */
+        uint64_t cork_expire; /* clock_usec(), a partial segment held by TCP_CORK is sent by then (0 if none) */
+        int fin; /* closed by the user, the FIN is sent after the data buffered */
+    } sndbuf;
+    struct list_head ooo; /* out of order ranges (already written into rcvbuf beyond the tail), sorted by seq */
+    int ooo_num;
     struct sched_ctx ctx;
-    struct queue_head queue; /* retransmit queue */
-    struct timeval tw_timer;
-    struct tcp_pcb *parent;
-    struct queue_head backlog;
+    int nonblock; /* the user commands fail with EAGAIN instead of sleeping */
+    void (*notify)(void *arg); /* called on every wakeup, see tcp_set_notify() */
+    void *notify_arg;
+    struct {
+        uint64_t first; /* clock_usec() of the first transmission of the data outstanding (or SND.UNA advanced) */
+        uint64_t last; /* clock_usec(), the retransmission timer runs from here */
+        uint32_t high; /* the data below this has been retransmitted in the current recovery */
+    } rtx;
+    struct list_head sacked; /* ranges above SND.UNA SACKed by the peer, sorted by seq */
+    int sacked_num;
+    uint64_t tw_expire; /* clock_usec() */
+    uint64_t persist; /* clock_usec() of the next zero window probe, 0 while the window is open */
+    struct {
+        int quick; /* TCP_QUICKACK, ACK every segment immediately */
+        int segs; /* segments received but not ACKed yet, cleared by any segment we send */
+        uint64_t expire; /* clock_usec(), the ACK is sent by then (meaningful while segs is set) */
+    } delack;
+    struct net_timeout timer; /* armed for the earliest of the above, the retransmission and the deadline */
+    struct {
+        uint64_t segs_in;
+        uint64_t segs_out;
+        uint64_t bytes_acked;
+        uint64_t bytes_received;
+        uint32_t retrans_segs;
+        uint32_t timeouts;
+        uint32_t fast_retrans;
+    } stats; /* see tcp_get_info() */
+    struct tcp_pcb *parent; /* holds a reference to the parent */
+    mutex_t backlog_mutex; /* protects backlog, backlog_closed and accept_ctx */
+    struct list_head backlog;
+    int backlog_closed;
+    struct sched_ctx accept_ctx;
+    struct list_head backlog_entry; /* linked to the backlog of the parent */
+    struct list_head hash_entry; /* linked to ehash or lhash, protected by the table mutex */
 };
 
-struct tcp_queue_entry {
-    struct timeval first;
-    struct timeval last;
-    unsigned int rto; /* micro seconds */
+/* NOTE: the range [seq, end) of the sequence space (e.g. the data received ahead of rcv.nxt) */
+struct tcp_range {
+    struct list_head entry;
     uint32_t seq;
-    uint8_t flg;
-    size_t len;
+    uint32_t end;
 };
 
-static mutex_t mutex = MUTEX_INITIALIZER;
-static struct tcp_pcb pcbs[TCP_PCB_SIZE];
+/*
+ * NOTE: Lock ordering is parent PCB -> child PCB -> backlog_mutex -> table mutex.
+ *       The notify callback runs with the PCB lock or the backlog_mutex held, so it may only
+ *       take locks of its own (never a PCB lock or the table mutex).
+ *       The table mutex protects the PCB table, the hash tables and the reference counts,
+ *       and may be taken alone. A PCB lock must never be acquired with the table mutex held.
+ */
+static mutex_t mutex = MUTEX_INITIALIZER; /* table mutex */
+static struct table pcbs = TABLE_INITIALIZER(struct tcp_pcb, TCP_PCB_MAX);
+static struct list_head ehash[TCP_EHASH_SIZE];
+static struct list_head lhash[TCP_LHASH_SIZE];
+static uint32_t hash_seed;
+static uint32_t port_refs[TCP_SOURCE_PORT_MAX + 1]; /* the hashed PCBs using each local port, in either table */
+static uint16_t port_cursor; /* where the search of the next ephemeral port starts */
+
+static struct counters stats;
+static const char * const stats_names[TCP_STATS_NUM] = {
+    "in_segs", "in_errors", "csum_errors", "no_pcbs", "out_segs", "out_rsts",
+    "retrans_segs", "timeouts", "fast_retrans", "active_opens", "passive_opens", "aborts"
+};
 
 static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign);
+tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *opt, size_t optlen, uint8_t *data, size_t len, size_t gso, struct ip_endpoint *local, struct ip_endpoint *foreign);
+static ssize_t
+tcp_output_seq(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, uint8_t *data, size_t len);
+static void
+tcp_timer(void *arg);
+static void
+tcp_timer_update(struct tcp_pcb *pcb);
+static void
+tcp_cc_timeout(struct tcp_pcb *pcb);
+static void
+tcp_pcb_info(struct tcp_pcb *pcb, struct tcp_info *info);
+static ssize_t
+tcp_output(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len);
+static size_t
+tcp_options_data_mss(struct tcp_pcb *pcb);
+static size_t
+tcp_sndbuf_offset(struct tcp_pcb *pcb, uint32_t seq);
+static size_t
+tcp_sndbuf_count(struct tcp_pcb *pcb);
 
 static char *
 tcp_flg_ntoa(uint8_t flg)
 {
-    static char str[9];
+    static __thread char str[9]; /* NOTE: called without a common lock */
 
     snprintf(str, sizeof(str), "--%c%c%c%c%c%c",
         TCP_FLG_ISSET(flg, TCP_FLG_URG) ? 'U' : '-',
@@ -140,6 +338,10 @@ tcp_dump(const uint8_t *data, size_t len)
 {
     struct tcp_hdr *hdr;
 
+    if (!LOG_ENABLED(LOG_LEVEL_DEBUG)) {
+        return;
+    }
+
     flockfile(stderr);
     hdr = (struct tcp_hdr *)data;
     fprintf(stderr, "        src: %u\n", ntoh16(hdr->src));
@@ -160,82 +362,184 @@ tcp_dump(const uint8_t *data, size_t len)
 /*
  * TCP Protocol Control Block (PCB)
  *
- * NOTE: TCP PCB functions must be called after mutex locked
+ * NOTE: A PCB is returned locked and referenced by tcp_pcb_alloc()/tcp_pcb_get(), and must be
+ *       given back by tcp_pcb_unlock(). tcp_pcb_release() only detaches it, the slot is recycled
+ *       when the last reference is dropped, so a PCB never disappears under a thread holding it.
  */
 
 static struct tcp_pcb *
 tcp_pcb_alloc(void)
 {
     struct tcp_pcb *pcb;
+    int id;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == TCP_PCB_STATE_FREE) {
-            pcb->state = TCP_PCB_STATE_CLOSED;
-            sched_ctx_init(&pcb->ctx);
-            return pcb;
-        }
+    mutex_lock(&mutex);
+    pcb = table_alloc(&pcbs, &id);
+    if (!pcb) {
+        mutex_unlock(&mutex);
+        return NULL;
+    }
+    pcb->id = id;
+    pcb->ref = 2; /* one for being alive (dropped by tcp_pcb_release()), one for the caller */
+    mutex_init(&pcb->mutex);
+    mutex_init(&pcb->backlog_mutex);
+    pcb->state = TCP_PCB_STATE_CLOSED;
+    pcb->rtt.rto = TCP_RTO_INIT;
+    net_timeout_init(&pcb->timer, tcp_timer, (void *)(intptr_t)id);
+    sched_ctx_init(&pcb->ctx);
+    sched_ctx_init(&pcb->accept_ctx);
+    list_init(&pcb->sacked);
+    list_init(&pcb->ooo);
+    list_init(&pcb->backlog);
+    list_init(&pcb->backlog_entry);
+    list_init(&pcb->hash_entry);
+    mutex_unlock(&mutex);
+    mutex_lock(&pcb->mutex);
+    return pcb;
+}
+
+/* NOTE: must be called after the table mutex locked */
+static void
+tcp_pcb_put_locked(struct tcp_pcb *pcb)
+{
+    struct tcp_pcb *parent;
+    int id;
+
+    while (pcb && --pcb->ref == 0) {
+        parent = pcb->parent;
+        net_timeout_cancel(&pcb->timer);
+        memory_free(pcb->rcvbuf.buf);
+        sched_ctx_destroy(&pcb->ctx);
+        sched_ctx_destroy(&pcb->accept_ctx);
+        id = pcb->id;
+        memset(pcb, 0, sizeof(*pcb));
+        table_free(&pcbs, id);
+        pcb = parent;
+    }
+}
+
+static void
+tcp_pcb_hold(struct tcp_pcb *pcb)
+{
+    mutex_lock(&mutex);
+    pcb->ref++;
+    mutex_unlock(&mutex);
+}
+
+/* NOTE: drop the reference of the caller (who has already unlocked the PCB) */
+static void
+tcp_pcb_put(struct tcp_pcb *pcb)
+{
+    mutex_lock(&mutex);
+    tcp_pcb_put_locked(pcb);
+    mutex_unlock(&mutex);
+}
+
+/* NOTE: unlock the PCB and drop the reference of the caller */
+static void
+tcp_pcb_unlock(struct tcp_pcb *pcb)
+{
+    mutex_unlock(&pcb->mutex);
+    tcp_pcb_put(pcb);
+}
+
+/* NOTE: must be called after the PCB locked, wakes up the sleepers and notifies the watcher */
+static void
+tcp_pcb_wakeup(struct tcp_pcb *pcb)
+{
+    sched_wakeup(&pcb->ctx);
+    if (pcb->notify) {
+        pcb->notify(pcb->notify_arg);
+    }
+}
+
+/* NOTE: must be called after the table mutex locked */
+static void
+tcp_pcb_unhash(struct tcp_pcb *pcb)
+{
+    if (!list_empty(&pcb->hash_entry)) {
+        port_refs[ntoh16(pcb->local.port)]--;
+        list_del(&pcb->hash_entry);
     }
-    return NULL;
 }
 
+/* NOTE: must be called after the PCB locked, it stays locked (and referenced by the caller) */
 static void
 tcp_pcb_release(struct tcp_pcb *pcb)
 {
-    struct queue_entry *entry;
+    struct list_head *entry;
     struct tcp_pcb *est;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
-    if (sched_ctx_destroy(&pcb->ctx) == -1) {
-        sched_wakeup(&pcb->ctx);
+    if (pcb->state == TCP_PCB_STATE_FREE) {
+        /* already released */
         return;
     }
-    while ((entry = queue_pop(&pcb->queue)) != NULL) {
-        memory_free(entry);
-    }
-    while ((est = queue_pop(&pcb->backlog)) != NULL) {
+    pcb->state = TCP_PCB_STATE_FREE;
+    net_timeout_cancel(&pcb->timer);
+    while ((entry = list_pop(&pcb->sacked)) != NULL) {
+        memory_free(list_entry(entry, struct tcp_range, entry));
+    }
+    pcb->sacked_num = 0;
+    while ((entry = list_pop(&pcb->ooo)) != NULL) {
+        memory_free(list_entry(entry, struct tcp_range, entry));
+    }
+    pcb->ooo_num = 0;
+    if (!pcb->rcvbuf.peeking) {
+        memory_free(pcb->rcvbuf.buf);
+        pcb->rcvbuf.buf = NULL;
+    }
+    memory_free(pcb->sndbuf.buf);
+    pcb->sndbuf.buf = NULL;
+    pcb->sndbuf.fin = 0;
+    /* the connections not accepted yet are released along with the listener */
+    mutex_lock(&pcb->backlog_mutex);
+    pcb->backlog_closed = 1;
+    while ((entry = list_pop(&pcb->backlog)) != NULL) {
+        est = list_entry(entry, struct tcp_pcb, backlog_entry);
+        tcp_pcb_hold(est);
+        mutex_unlock(&pcb->backlog_mutex);
+        mutex_lock(&est->mutex);
         tcp_pcb_release(est);
-    }
+        tcp_pcb_unlock(est);
+        mutex_lock(&pcb->backlog_mutex);
+    }
+    sched_wakeup(&pcb->accept_ctx);
+    mutex_unlock(&pcb->backlog_mutex);
+    if (pcb->parent) {
+        mutex_lock(&pcb->parent->backlog_mutex);
+        list_del(&pcb->backlog_entry);
+        mutex_unlock(&pcb->parent->backlog_mutex);
+    }
+    /* wake up the threads sleeping on the PCB, they find it released */
+    tcp_pcb_wakeup(pcb);
     debugf("released, local=%s, foreign=%s",
         ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
-    memset(pcb, 0, sizeof(*pcb));
-}
-
-static struct tcp_pcb *
-tcp_pcb_select(struct ip_endpoint *local, struct ip_endpoint *foreign)
-{
-    struct tcp_pcb *pcb, *listen_pcb = NULL;
-
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == local->addr) && pcb->local.port == local->port) {
-            if (!foreign) {
-                return pcb;
-            }
-            if (pcb->foreign.addr == foreign->addr && pcb->foreign.port == foreign->port) {
-                return pcb;
-            }
-            if (pcb->state == TCP_PCB_STATE_LISTEN) {
-                if (pcb->foreign.addr == IP_ADDR_ANY && pcb->foreign.port == 0) {
-                    /* LISTENed with wildcard foreign address/port */
-                    listen_pcb = pcb;
-                }
-            }
-        }
-    }
-    return listen_pcb;
+    mutex_lock(&mutex);
+    tcp_pcb_unhash(pcb);
+    tcp_pcb_put_locked(pcb); /* the caller still holds one */
+    mutex_unlock(&mutex);
 }
 
+/* NOTE: the PCB is returned locked, see tcp_pcb_unlock() */
 static struct tcp_pcb *
 tcp_pcb_get(int id)
 {
     struct tcp_pcb *pcb;
 
-    if (id < 0 || id >= (int)countof(pcbs)) {
-        /* out of range */
+    mutex_lock(&mutex);
+    pcb = table_get(&pcbs, id);
+    if (!pcb || pcb->state == TCP_PCB_STATE_FREE) {
+        mutex_unlock(&mutex);
         return NULL;
     }
-    pcb = &pcbs[id];
+    pcb->ref++;
+    mutex_unlock(&mutex);
+    mutex_lock(&pcb->mutex);
     if (pcb->state == TCP_PCB_STATE_FREE) {
+        /* released while waiting for the lock */
+        tcp_pcb_unlock(pcb);
         return NULL;
     }
     return pcb;
@@ -244,719 +548,2405 @@ tcp_pcb_get(int id)
 static int
 tcp_pcb_id(struct tcp_pcb *pcb)
 {
-    return indexof(pcbs, pcb);
+    return pcb->id;
 }
 
 /*
- * TCP Retransmit
+ * TCP PCB Hash Tables
  *
- * NOTE: TCP Retransmit functions must be called after mutex locked
+ * NOTE: A PCB is linked to ehash once the foreign endpoint is set, otherwise to lhash
+ *       once the local endpoint is set. Lookups read the endpoints with only the table mutex
+ *       held, so they must be written through tcp_pcb_hash() (with the PCB locked as well).
+ *       Hash functions must be called after the table mutex locked, except tcp_pcb_hash().
  */
 
-static int
-tcp_retransmit_queue_add(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, uint8_t *data, size_t len)
+static uint32_t
+tcp_hash_mix(uint32_t h)
 {
-    struct tcp_queue_entry *entry;
+    /* MurmurHash3 finalizer */
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
 
-    entry = memory_alloc(sizeof(*entry) + len);
-    if (!entry) {
-        errorf("memory_alloc() failure");
-        return -1;
+static struct list_head *
+tcp_ehash_bucket(const struct ip_endpoint *local, const struct ip_endpoint *foreign)
+{
+    uint32_t h;
+
+    h = tcp_hash_mix(foreign->addr ^ hash_seed);
+    h = tcp_hash_mix(h ^ local->addr ^ (((uint32_t)local->port << 16) | foreign->port));
+    return &ehash[h & (TCP_EHASH_SIZE - 1)];
+}
+
+static struct list_head *
+tcp_lhash_bucket(ip_addr_t addr, uint16_t port)
+{
+    return &lhash[tcp_hash_mix(addr ^ hash_seed ^ port) & (TCP_LHASH_SIZE - 1)];
+}
+
+static void
+tcp_pcb_rehash(struct tcp_pcb *pcb, const struct ip_endpoint *local, const struct ip_endpoint *foreign)
+{
+    tcp_pcb_unhash(pcb);
+    if (local) {
+        pcb->local = *local;
     }
-    entry->rto = TCP_DEFAULT_RTO;
-    entry->seq = seq;
-    entry->flg = flg;
-    entry->len = len;
-    memcpy(entry + 1, data, entry->len);
-    gettimeofday(&entry->first, NULL);
-    entry->last = entry->first;
-    if (!queue_push(&pcb->queue, entry)) {
-        errorf("queue_push() failure");
-        memory_free(entry);
-        return -1;
+    if (foreign) {
+        pcb->foreign = *foreign;
+    }
+    if (pcb->foreign.port) {
+        list_add_tail(&pcb->hash_entry, tcp_ehash_bucket(&pcb->local, &pcb->foreign));
+        /* NOTE: run the timer on the worker which the segments of the connection are steered to */
+        net_timeout_bind(&pcb->timer, net_worker_select(ip_flow_hash(pcb->foreign.addr, pcb->local.addr,
+            pcb->foreign.port, pcb->local.port, IP_PROTOCOL_TCP)));
+    } else if (pcb->local.port) {
+        list_add_tail(&pcb->hash_entry, tcp_lhash_bucket(pcb->local.addr, pcb->local.port));
+    }
+    if (!list_empty(&pcb->hash_entry)) {
+        port_refs[ntoh16(pcb->local.port)]++;
     }
-    return 0;
 }
 
 static void
-tcp_retransmit_queue_cleanup(struct tcp_pcb *pcb)
+tcp_pcb_hash(struct tcp_pcb *pcb, const struct ip_endpoint *local, const struct ip_endpoint *foreign)
 {
-    struct tcp_queue_entry *entry;
+    mutex_lock(&mutex);
+    tcp_pcb_rehash(pcb, local, foreign);
+    mutex_unlock(&mutex);
+}
 
-    while ((entry = queue_peek(&pcb->queue))) {
-        if (entry->seq >= pcb->snd.una) {
-            break;
+static struct tcp_pcb *
+tcp_ehash_lookup(const struct ip_endpoint *local, const struct ip_endpoint *foreign)
+{
+    struct list_head *bucket, *entry;
+    struct tcp_pcb *pcb;
+
+    bucket = tcp_ehash_bucket(local, foreign);
+    list_foreach(entry, bucket) {
+        pcb = list_entry(entry, struct tcp_pcb, hash_entry);
+        if (pcb->local.addr == local->addr && pcb->local.port == local->port &&
+            pcb->foreign.addr == foreign->addr && pcb->foreign.port == foreign->port) {
+            return pcb;
         }
-        entry = queue_pop(&pcb->queue);
-        debugf("remove, seq=%u, flags=%s, len=%zu", entry->seq, tcp_flg_ntoa(entry->flg), entry->len);
-        memory_free(entry);
     }
-    return;
+    return NULL;
 }
 
-static void
-tcp_retransmit_queue_emit(void *arg, void *data)
+static struct tcp_pcb *
+tcp_lhash_lookup(ip_addr_t addr, uint16_t port)
 {
+    struct list_head *bucket, *entry;
     struct tcp_pcb *pcb;
-    struct tcp_queue_entry *entry;
-    struct timeval now, diff, timeout;
-
-    pcb = (struct tcp_pcb *)arg;
-    entry = (struct tcp_queue_entry *)data;
-    gettimeofday(&now, NULL);
-    timersub(&now, &entry->first, &diff);
-    if (diff.tv_sec >= TCP_RETRANSMIT_DEADLINE) {
-        pcb->state = TCP_PCB_STATE_CLOSED;
-        sched_wakeup(&pcb->ctx);
-        return;
+
+    bucket = tcp_lhash_bucket(addr, port);
+    list_foreach(entry, bucket) {
+        pcb = list_entry(entry, struct tcp_pcb, hash_entry);
+        if (pcb->local.addr == addr && pcb->local.port == port) {
+            return pcb;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * NOTE: the exact connection first, then the one bound to the address, then the one bound to the
+ *       wildcard address (the caller has to check whether it is LISTENing, see tcp_input())
+ */
+static struct tcp_pcb *
+tcp_pcb_select(struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct tcp_pcb *pcb;
+
+    if (foreign) {
+        pcb = tcp_ehash_lookup(local, foreign);
+        if (pcb) {
+            return pcb;
+        }
     }
-    timeout = entry->last;
-    timeval_add_usec(&timeout, entry->rto);
-    if (timercmp(&now, &timeout, >)) {
-        tcp_output_segment(entry->seq, pcb->rcv.nxt, entry->flg, pcb->rcv.wnd, (uint8_t *)(entry+1), entry->len, &pcb->local, &pcb->foreign);
-        entry->last = now;
-        entry->rto *= 2;
+    pcb = tcp_lhash_lookup(local->addr, local->port);
+    if (!pcb && local->addr != IP_ADDR_ANY) {
+        pcb = tcp_lhash_lookup(IP_ADDR_ANY, local->port);
     }
+    return pcb;
 }
 
-static void
-tcp_set_timewait_timer(struct tcp_pcb *pcb)
+/*
+ * TCP Receive Buffer (ring)
+ *
+ * NOTE: TCP Receive Buffer functions must be called after the PCB locked
+ */
+
+static size_t
+tcp_rcvbuf_count(struct tcp_pcb *pcb)
 {
-    gettimeofday(&pcb->tw_timer, NULL);
-    pcb->tw_timer.tv_sec += TCP_TIMEWAIT_SEC;
-    debugf("start time_wait timer: %d seconds", TCP_TIMEWAIT_SEC);
+    return pcb->rcvbuf.tail - pcb->rcvbuf.head;
 }
 
-static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+/* NOTE: copy the data to the position off bytes ahead of the tail */
+static int
+tcp_rcvbuf_copy(struct tcp_pcb *pcb, size_t off, const uint8_t *data, size_t len)
 {
-    uint8_t buf[IP_PAYLOAD_SIZE_MAX] = {};
-    struct tcp_hdr *hdr;
-    struct pseudo_hdr pseudo;
-    uint16_t psum;
-    uint16_t total;
-    char ep1[IP_ENDPOINT_STR_LEN];
-    char ep2[IP_ENDPOINT_STR_LEN];
+    size_t n;
 
-    hdr = (struct tcp_hdr *)buf;
-    hdr->src = local->port;
-    hdr->dst = foreign->port;
-    hdr->seq = hton32(seq);
-    hdr->ack = hton32(ack);
-    hdr->off = (sizeof(*hdr) >> 2) << 4;
-    hdr->flg = flg;
-    hdr->wnd = hton16(wnd);
-    hdr->sum = 0;
-    hdr->up = 0;
-    memcpy(hdr + 1, data, len);
-    pseudo.src = local->addr;
-    pseudo.dst = foreign->addr;
-    pseudo.zero = 0;
-    pseudo.protocol = IP_PROTOCOL_TCP;
-    total = sizeof(*hdr) + len;
-    pseudo.len = hton16(total);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    hdr->sum = cksum16((uint16_t *)hdr, total, psum);
-    debugf("%s => %s, len=%u (payload=%zu)",
-        ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)), total, len);
-    tcp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_TCP, (uint8_t *)hdr, total, local->addr, foreign->addr) == -1) {
-        return -1;
+    if (!pcb->rcvbuf.buf) {
+        pcb->rcvbuf.buf = memory_alloc_raw(TCP_RCVBUF_SIZE);
+        if (!pcb->rcvbuf.buf) {
+            errorf("memory_alloc_raw() failure");
+            return -1;
+        }
     }
-    return len;
+    off = (pcb->rcvbuf.tail + off) & (TCP_RCVBUF_SIZE - 1);
+    n = MIN(len, TCP_RCVBUF_SIZE - off);
+    memcpy(pcb->rcvbuf.buf + off, data, n);
+    memcpy(pcb->rcvbuf.buf, data + n, len - n);
+    return 0;
 }
 
-static ssize_t
-tcp_output(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len)
+/* NOTE: the range [seq, end) is merged with the overlapping (or adjacent) ones of the sorted list */
+static int
+tcp_range_add(struct list_head *ranges, int *num, uint32_t seq, uint32_t end)
 {
-    uint32_t seq;
+    struct list_head *pos, *n;
+    struct tcp_range *entry, *merged = NULL;
 
-    seq = pcb->snd.nxt;
-    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
-        seq = pcb->iss;
+    list_foreach_safe(pos, n, ranges) {
+        entry = list_entry(pos, struct tcp_range, entry);
+        if (TCP_SEQ_LT(entry->end, seq)) {
+            continue;
+        }
+        if (TCP_SEQ_LT(end, entry->seq)) {
+            break;
+        }
+        if (!merged) {
+            merged = entry;
+            if (TCP_SEQ_LT(seq, entry->seq)) {
+                entry->seq = seq;
+            }
+            if (TCP_SEQ_LT(entry->end, end)) {
+                entry->end = end;
+            }
+            continue;
+        }
+        if (TCP_SEQ_LT(merged->end, entry->end)) {
+            merged->end = entry->end;
+        }
+        list_del(&entry->entry);
+        memory_free(entry);
+        (*num)--;
     }
-    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN) || len) {
-        tcp_retransmit_queue_add(pcb, seq, flg, data, len);
+    if (merged) {
+        return 0;
     }
-    return tcp_output_segment(seq, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign);
+    if (*num >= TCP_RANGE_MAX) {
+        debugf("too many ranges, drop");
+        return -1;
+    }
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    entry->seq = seq;
+    entry->end = end;
+    list_add_tail(&entry->entry, pos); /* in front of the first range after it (or at the end) */
+    (*num)++;
+    return 0;
 }
 
-/* rfc793 - section 3.9 [Event Processing > SEGMENT ARRIVES] */
+/* NOTE: advance the tail by len bytes, then take in the out of order ranges which became contiguous */
 static void
-tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+tcp_rcvbuf_advance(struct tcp_pcb *pcb, size_t len)
 {
-    struct tcp_pcb *pcb, *new_pcb;
-    int acceptable = 0;
-
-    pcb = tcp_pcb_select(local, foreign);
-    if (!pcb || pcb->state == TCP_PCB_STATE_CLOSED) {
-        if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
-            return;
+    struct list_head *entry;
+    struct tcp_range *ooo;
+
+    for (;;) {
+        pcb->rcvbuf.tail += len;
+        pcb->rcv.nxt += len;
+        pcb->rcv.wnd -= len;
+        pcb->stats.bytes_received += len;
+        entry = list_first(&pcb->ooo);
+        if (!entry) {
+            break;
         }
-        if (!TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, local, foreign);
-        } else {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+        ooo = list_entry(entry, struct tcp_range, entry);
+        if (TCP_SEQ_LT(pcb->rcv.nxt, ooo->seq)) {
+            break;
         }
-        return;
+        len = TCP_SEQ_LT(pcb->rcv.nxt, ooo->end) ? ooo->end - pcb->rcv.nxt : 0;
+        list_del(entry);
+        memory_free(ooo);
+        pcb->ooo_num--;
     }
-    switch(pcb->state) {
-    case TCP_PCB_STATE_LISTEN:
-        /*
-         * first check for an RST
-         */
-        if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
-            return;
-        }
-        /*
-         * second check for an ACK
-         */
-        if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
-            return;
+}
+
+/*
+ * NOTE: the text is trimmed to the window and written to its place in the ring. The data beyond rcv.nxt
+ *       is kept as an out of order range, and rcv.nxt/rcv.wnd are advanced when the data is contiguous.
+ */
+static int
+tcp_rcvbuf_write(struct tcp_pcb *pcb, uint32_t seq, const uint8_t *data, size_t len)
+{
+    size_t off;
+
+    if (TCP_SEQ_LT(seq, pcb->rcv.nxt)) {
+        /* NOTE: skip the part already received (partially retransmitted segment) */
+        off = pcb->rcv.nxt - seq;
+        if (off >= len) {
+            return 0;
         }
-        /*
-         * third check for an SYN
-         */
-        if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
-            /* ignore: security/compartment check */
-            /* ignore: precedence check */
-            if (pcb->mode == TCP_PCB_MODE_SOCKET) {
-                new_pcb = tcp_pcb_alloc();
-                if (!new_pcb) {
-                    errorf("tcp_pcb_alloc() failure");
-                    return;
-                }
-                new_pcb->mode = TCP_PCB_MODE_SOCKET;
-                new_pcb->parent = pcb;
-                pcb = new_pcb;
-            }
-            pcb->local = *local;
-            pcb->foreign = *foreign;
-            pcb->rcv.wnd = sizeof(pcb->buf);
-            pcb->rcv.nxt = seg->seq + 1;
-            pcb->irs = seg->seq;
-            pcb->iss = random();
-            tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
-            pcb->snd.nxt = pcb->iss + 1;
-            pcb->snd.una = pcb->iss;
-            pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
-            /* ignore: Note that any other incoming control or data (combined with SYN) will be processed
-                        in the SYN-RECEIVED state, but processing of SYN and ACK  should not be repeated */
-            return;
+        seq += off;
+        data += off;
+        len -= off;
+    }
+    off = seq - pcb->rcv.nxt;
+    if (off >= pcb->rcv.wnd) {
+        return 0;
+    }
+    len = MIN(len, pcb->rcv.wnd - off);
+    if (off) {
+        if (tcp_range_add(&pcb->ooo, &pcb->ooo_num, seq, seq + len) == -1) {
+            return -1;
         }
-        /*
-         * fourth other text or control
-         */
-        /* drop segment */
+        pcb->rcv.sack_recent = seq;
+    }
+    if (tcp_rcvbuf_copy(pcb, off, data, len) == -1) {
+        return -1;
+    }
+    if (!off) {
+        tcp_rcvbuf_advance(pcb, len);
+    }
+    return 0;
+}
+
+/* NOTE: the readable data as (at most) two contiguous regions, returns the total length */
+static size_t
+tcp_rcvbuf_iov(struct tcp_pcb *pcb, struct iovec iov[2])
+{
+    size_t count, off, n;
+
+    count = tcp_rcvbuf_count(pcb);
+    off = pcb->rcvbuf.head & (TCP_RCVBUF_SIZE - 1);
+    n = MIN(count, TCP_RCVBUF_SIZE - off);
+    iov[0].iov_base = pcb->rcvbuf.buf + off;
+    iov[0].iov_len = n;
+    iov[1].iov_base = pcb->rcvbuf.buf;
+    iov[1].iov_len = count - n;
+    return count;
+}
+
+static void
+tcp_rcvbuf_consume(struct tcp_pcb *pcb, size_t len)
+{
+    uint32_t edge;
+
+    pcb->rcvbuf.head += len;
+    if (!tcp_rcvbuf_count(pcb) && !pcb->rcvbuf.peeking && list_empty(&pcb->ooo)) {
+        /* NOTE: don't keep the buffer while idle */
+        memory_free(pcb->rcvbuf.buf);
+        pcb->rcvbuf.buf = NULL;
+        pcb->rcvbuf.head = pcb->rcvbuf.tail = 0;
+    }
+    if (pcb->state == TCP_PCB_STATE_FREE) {
         return;
-    case TCP_PCB_STATE_SYN_SENT:
-        /*
-         * first check the ACK bit
-         */
-        if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            if (seg->ack <= pcb->iss || seg->ack > pcb->snd.nxt) {
-                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
-                return;
-            }
-            if (pcb->snd.una <= seg->ack && seg->ack <= pcb->snd.nxt) {
-                acceptable = 1;
-            }
-        }
-        /*
-         * second check the RST bit
-         */
-        if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
-            if (acceptable) {
-                errorf("connection reset");
-                pcb->state = TCP_PCB_STATE_CLOSED;
-                tcp_pcb_release(pcb);
+    }
+    pcb->rcv.wnd = (TCP_RCVBUF_SIZE - 1) - tcp_rcvbuf_count(pcb);
+    /* rfc1122 - 4.2.3.3 (receiver's SWS avoidance): update the window once it opens enough */
+    edge = pcb->rcv.nxt + pcb->rcv.wnd;
+    if (edge - pcb->rcv.adv >= MIN(TCP_RCVBUF_SIZE / 2, pcb->mss ? pcb->mss : TCP_DEFAULT_MSS)) {
+        tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+    }
+}
+
+/*
+ * TCP Retransmit
+ *
+ * NOTE: TCP Retransmit functions must be called after mutex locked
+ */
+
+/* rfc6298 - 2.2, 2.3: update SRTT/RTTVAR with the measurement r and derive the RTO from them */
+static void
+tcp_rtt_update(struct tcp_pcb *pcb, uint32_t r)
+{
+    uint32_t delta, rto;
+
+    if (!pcb->rtt.srtt) {
+        pcb->rtt.srtt = MAX(r, 1);
+        pcb->rtt.rttvar = r / 2;
+    } else {
+        delta = pcb->rtt.srtt > r ? pcb->rtt.srtt - r : r - pcb->rtt.srtt;
+        pcb->rtt.rttvar = (3 * pcb->rtt.rttvar + delta) / 4;
+        pcb->rtt.srtt = MAX((7 * pcb->rtt.srtt + r) / 8, 1);
+    }
+    rto = pcb->rtt.srtt + MAX(TCP_CLOCK_G, 4 * pcb->rtt.rttvar);
+    pcb->rtt.rto = MIN(MAX(rto, TCP_RTO_MIN), TCP_RTO_MAX);
+    debugf("rtt=%u, srtt=%u, rttvar=%u, rto=%u", r, pcb->rtt.srtt, pcb->rtt.rttvar, pcb->rtt.rto);
+}
+
+/* NOTE: the outstanding data starts at SND.UNA, nothing has to be queued since tcp_send() keeps it in sndbuf */
+static void
+tcp_retransmit_start(struct tcp_pcb *pcb, uint32_t seq, uint32_t end)
+{
+    uint64_t now;
+
+    now = clock_usec();
+    if (pcb->snd.una == pcb->snd.nxt) {
+        pcb->rtx.first = pcb->rtx.last = now;
+    }
+    if (!pcb->rtt.timing) {
+        pcb->rtt.timing = 1;
+        pcb->rtt.seq = end;
+        pcb->rtt.start = now;
+    }
+}
+
+/* NOTE: drop the SACKed ranges below SND.UNA */
+static void
+tcp_retransmit_sacked_prune(struct tcp_pcb *pcb)
+{
+    struct list_head *pos, *n;
+    struct tcp_range *range;
+
+    list_foreach_safe(pos, n, &pcb->sacked) {
+        range = list_entry(pos, struct tcp_range, entry);
+        if (TCP_SEQ_LT(pcb->snd.una, range->end)) {
+            if (TCP_SEQ_LT(range->seq, pcb->snd.una)) {
+                range->seq = pcb->snd.una;
             }
-            /* drop segment */
-            return;
+            break;
         }
-        /*
-         * ignore: third check security and precedence
-         */
-        /*
-         * fourth check the SYN bit
-         */
-        if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
-            pcb->rcv.nxt = seg->seq + 1;
-            pcb->irs = seg->seq;
-            if (acceptable) {
-                pcb->snd.una = seg->ack;
-                tcp_retransmit_queue_cleanup(pcb);
-            }
-            if (pcb->snd.una > pcb->iss) {
-                pcb->state = TCP_PCB_STATE_ESTABLISHED;
-                tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
-                /* NOTE: not specified in the RFC793, but send window initialization required */
-                pcb->snd.wnd = seg->wnd;
-                pcb->snd.wl1 = seg->seq;
-                pcb->snd.wl2 = seg->ack;
-                sched_wakeup(&pcb->ctx);
-                /* ignore: continue processing at the sixth step below where the URG bit is checked */
-                return;
-            } else {
-                pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
-                tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
-                /* ignore: If there are other controls or text in the segment, queue them for processing after the ESTABLISHED state has been reached */
-                return;
-            }
+        list_del(&range->entry);
+        memory_free(range);
+        pcb->sacked_num--;
+    }
+}
+
+/* NOTE: must be called when SND.UNA has advanced, the acknowledged data is released by the move itself */
+static void
+tcp_retransmit_cleanup(struct tcp_pcb *pcb)
+{
+    uint64_t now;
+
+    now = clock_usec();
+    if (pcb->rtt.timing && TCP_SEQ_LEQ(pcb->rtt.seq, pcb->snd.una)) {
+        pcb->rtt.timing = 0;
+        tcp_rtt_update(pcb, now - pcb->rtt.start);
+    }
+    tcp_retransmit_sacked_prune(pcb);
+    if (TCP_SEQ_LT(pcb->rtx.high, pcb->snd.una)) {
+        pcb->rtx.high = pcb->snd.una;
+    }
+    /* rfc6298 - 5.3: restart the timer for the rest of the data */
+    pcb->rtx.first = pcb->rtx.last = now;
+    if (!tcp_sndbuf_count(pcb)) {
+        /* NOTE: don't keep the buffer while idle */
+        memory_free(pcb->sndbuf.buf);
+        pcb->sndbuf.buf = NULL;
+    }
+}
+
+/*
+ * NOTE: Send the outstanding sequence space from seq again as a single segment, cut at end or the MSS.
+ *       The segments are rebuilt from sndbuf, so the original boundaries do not matter (and the FIN
+ *       rides on the last data). Returns the sequence number next to the segment.
+ */
+static uint32_t
+tcp_retransmit_segment(struct tcp_pcb *pcb, uint32_t seq, uint32_t end)
+{
+    size_t off, len;
+    uint8_t flg;
+
+    /* NOTE: Karn's algorithm, the ACK would be ambiguous */
+    pcb->rtt.timing = 0;
+    pcb->stats.retrans_segs++;
+    counters_add(&stats, TCP_STATS_RETRANS_SEGS, 1);
+    if (seq == pcb->iss) {
+        flg = TCP_FLG_SYN | (pcb->state == TCP_PCB_STATE_SYN_RECEIVED ? TCP_FLG_ACK : 0);
+        tcp_output_seq(pcb, seq, flg, NULL, 0);
+        return seq + 1;
+    }
+    off = tcp_sndbuf_offset(pcb, seq);
+    len = TCP_SEQ_LT(seq, pcb->sndbuf.end) ? pcb->sndbuf.end - seq : 0;
+    len = MIN(MIN(len, end - seq), MIN(tcp_options_data_mss(pcb), TCP_SNDBUF_SIZE - off));
+    flg = TCP_FLG_ACK;
+    if (seq + len == pcb->sndbuf.end) {
+        flg |= len ? TCP_FLG_PSH : 0;
+        if (TCP_SEQ_LT(pcb->sndbuf.end, pcb->snd.nxt) && TCP_SEQ_LT(pcb->sndbuf.end, end)) {
+            /* NOTE: the FIN has been sent after the data */
+            flg |= TCP_FLG_FIN;
         }
-        /*
-         * fifth, if neither of the SYN or RST bits is set then drop the segment and return
-         */
-        /* drop segment */
+    }
+    tcp_output_seq(pcb, seq, flg, len ? pcb->sndbuf.buf + off : NULL, len);
+    return seq + len + TCP_FLG_ISSET(flg, TCP_FLG_FIN);
+}
+
+/* NOTE: send the oldest unacknowledged segment again (and restart the timer) */
+static void
+tcp_retransmit_resend(struct tcp_pcb *pcb)
+{
+    uint32_t end;
+
+    if (pcb->snd.una == pcb->snd.nxt) {
         return;
     }
-    /*
-     * Otherwise
-     */
-    /*
-     * first check sequence number
-     */
-    switch (pcb->state) {
-    case TCP_PCB_STATE_SYN_RECEIVED:
-    case TCP_PCB_STATE_ESTABLISHED:
-    case TCP_PCB_STATE_FIN_WAIT1:
-    case TCP_PCB_STATE_FIN_WAIT2:
-    case TCP_PCB_STATE_CLOSE_WAIT:
-    case TCP_PCB_STATE_CLOSING:
-    case TCP_PCB_STATE_LAST_ACK:
-    case TCP_PCB_STATE_TIME_WAIT:
-        if (!seg->len) {
-            if (!pcb->rcv.wnd) {
-                if (seg->seq == pcb->rcv.nxt) {
-                    acceptable = 1;
-                }
-            } else {
-                if (pcb->rcv.nxt <= seg->seq && seg->seq < pcb->rcv.nxt + pcb->rcv.wnd) {
-                    acceptable = 1;
-                }
-            }
-        } else {
-            if (!pcb->rcv.wnd) {
-                /* not acceptable */
-            } else {
-                if ((pcb->rcv.nxt <= seg->seq && seg->seq < pcb->rcv.nxt + pcb->rcv.wnd) ||
-                    (pcb->rcv.nxt <= seg->seq + seg->len - 1 && seg->seq + seg->len - 1 < pcb->rcv.nxt + pcb->rcv.wnd)) {
-                    acceptable = 1;
-                }
-            }
+    end = tcp_retransmit_segment(pcb, pcb->snd.una, pcb->snd.nxt);
+    if (TCP_SEQ_LT(pcb->rtx.high, end)) {
+        pcb->rtx.high = end;
+    }
+    pcb->rtx.last = clock_usec();
+}
+
+/*
+ * NOTE: send the next hole again, i.e. the data neither SACKed nor retransmitted in this recovery
+ *       below the highest SACKed one. Without SACK, it is always the oldest one.
+ */
+static void
+tcp_retransmit_resend_hole(struct tcp_pcb *pcb)
+{
+    struct list_head *pos;
+    struct tcp_range *range;
+    uint32_t seq;
+
+    if (!(pcb->opt.flags & TCP_PCB_OPT_SACK) || TCP_SEQ_LEQ(pcb->rtx.high, pcb->snd.una)) {
+        /* NOTE: the oldest one is lost for sure if we got here */
+        tcp_retransmit_resend(pcb);
+        return;
+    }
+    seq = pcb->rtx.high;
+    list_foreach(pos, &pcb->sacked) {
+        range = list_entry(pos, struct tcp_range, entry);
+        if (TCP_SEQ_LEQ(range->end, seq)) {
+            continue;
         }
-        if (!acceptable) {
-            if (!TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
-                tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
-            }
-            return;
+        if (TCP_SEQ_LEQ(range->seq, seq)) {
+            seq = range->end;
+            continue;
         }
-        /*
-         * In the following it is assumed that the segment is the idealized
-         * segment that begins at RCV.NXT and does not exceed the window.
-         * One could tailor actual segments to fit this assumption by
-         * trimming off any portions that lie outside the window (including
-         * SYN and FIN), and only processing further if the segment then
-         * begins at RCV.NXT.  Segments with higher begining sequence
-         * numbers may be held for later processing.
-         */
+        pcb->rtx.high = tcp_retransmit_segment(pcb, seq, range->seq);
+        return;
     }
-    /*
-     * second check the RST bit
-     */
-    switch (pcb->state) {
-    case TCP_PCB_STATE_SYN_RECEIVED:
-        if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
-            pcb->state = TCP_PCB_STATE_CLOSED;
-            tcp_pcb_release(pcb);
-            return;
+}
+
+/* NOTE: a new recovery starts, anything may be retransmitted again */
+static void
+tcp_retransmit_reset(struct tcp_pcb *pcb)
+{
+    pcb->rtx.high = pcb->snd.una;
+}
+
+/* rfc2018 - 5: record the ranges covered by the SACK blocks */
+static void
+tcp_retransmit_sack(struct tcp_pcb *pcb, struct tcp_options *opt)
+{
+    uint32_t left;
+    int i;
+
+    for (i = 0; i < opt->nsack; i++) {
+        if (!TCP_SEQ_LT(pcb->snd.una, opt->sack[i].right) || TCP_SEQ_LT(pcb->snd.nxt, opt->sack[i].right) ||
+            !TCP_SEQ_LT(opt->sack[i].left, opt->sack[i].right)) {
+            /* NOTE: old (D-SACK) or bogus block */
+            continue;
         }
-        break;
-    case TCP_PCB_STATE_ESTABLISHED:
-    case TCP_PCB_STATE_FIN_WAIT1:
-    case TCP_PCB_STATE_FIN_WAIT2:
-    case TCP_PCB_STATE_CLOSE_WAIT:
-        if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
-            errorf("connection reset");
-            pcb->state = TCP_PCB_STATE_CLOSED;
-            tcp_pcb_release(pcb);
-            return;
+        left = TCP_SEQ_LT(opt->sack[i].left, pcb->snd.una) ? pcb->snd.una : opt->sack[i].left;
+        tcp_range_add(&pcb->sacked, &pcb->sacked_num, left, opt->sack[i].right);
+        if (TCP_SEQ_LT(pcb->snd.sack_high, opt->sack[i].right)) {
+            pcb->snd.sack_high = opt->sack[i].right;
         }
-        break;
-    case TCP_PCB_STATE_CLOSING:
-    case TCP_PCB_STATE_LAST_ACK:
-    case TCP_PCB_STATE_TIME_WAIT:
-        if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
-            pcb->state = TCP_PCB_STATE_CLOSED;
-            tcp_pcb_release(pcb);
-            return;
+    }
+}
+
+/* NOTE: the timer covers the oldest unacknowledged segment only (rfc6298 - 5) */
+static void
+tcp_retransmit_emit(struct tcp_pcb *pcb, uint64_t now)
+{
+    struct list_head *pos;
+
+    if (pcb->snd.una == pcb->snd.nxt) {
+        return;
+    }
+    if (now >= pcb->rtx.first + TCP_RETRANSMIT_DEADLINE) {
+        counters_add(&stats, TCP_STATS_ABORTS, 1);
+        pcb->state = TCP_PCB_STATE_CLOSED;
+        /* NOTE: give up the data, otherwise the deadline would keep the timer firing */
+        pcb->snd.una = pcb->snd.nxt;
+        while ((pos = list_pop(&pcb->sacked)) != NULL) {
+            memory_free(list_entry(pos, struct tcp_range, entry));
         }
-        break;
+        pcb->sacked_num = 0;
+        tcp_pcb_wakeup(pcb);
+        return;
     }
-    /*
-     * ignore: third check security and precedence
-     */
-    /*
-     * fourth check the SYN bit
-     */
-    switch (pcb->state) {
-    case TCP_PCB_STATE_SYN_RECEIVED:
-    case TCP_PCB_STATE_ESTABLISHED:
-    case TCP_PCB_STATE_FIN_WAIT1:
-    case TCP_PCB_STATE_FIN_WAIT2:
-    case TCP_PCB_STATE_CLOSE_WAIT:
-    case TCP_PCB_STATE_CLOSING:
-    case TCP_PCB_STATE_LAST_ACK:
-    case TCP_PCB_STATE_TIME_WAIT:
-        if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
-            tcp_output(pcb, TCP_FLG_RST, NULL, 0);
-            errorf("connection reset");
-            pcb->state = TCP_PCB_STATE_CLOSED;
-            tcp_pcb_release(pcb);
-            return;
-        }
+    if (now >= pcb->rtx.last + pcb->rtt.rto) {
+        pcb->stats.timeouts++;
+        counters_add(&stats, TCP_STATS_TIMEOUTS, 1);
+        tcp_cc_timeout(pcb);
+        tcp_retransmit_resend(pcb);
+        /* rfc6298 - 5.5: back off the timer */
+        pcb->rtt.rto = MIN(pcb->rtt.rto * 2, TCP_RTO_MAX);
     }
-    /*
-     * fifth check the ACK field
-     */
-    if (!TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-        /* drop segment */
+}
+
+/*
+ * TCP Congestion Control
+ *
+ * NOTE: TCP Congestion Control functions must be called after the PCB locked
+ */
+
+static uint32_t
+tcp_cc_flight(struct tcp_pcb *pcb)
+{
+    return pcb->snd.nxt - pcb->snd.una;
+}
+
+/* rfc5681 - 3.1: equation (4) */
+static uint32_t
+tcp_newreno_ssthresh(struct tcp_pcb *pcb)
+{
+    return MAX(tcp_cc_flight(pcb) / 2, 2 * (uint32_t)pcb->mss);
+}
+
+static void
+tcp_newreno_ack(struct tcp_pcb *pcb, uint32_t acked)
+{
+    if (pcb->cc.cwnd < pcb->cc.ssthresh) {
+        /* slow start */
+        pcb->cc.cwnd += MIN(acked, pcb->mss);
         return;
     }
-    switch (pcb->state) {
-    case TCP_PCB_STATE_SYN_RECEIVED:
-        if (pcb->snd.una <= seg->ack && seg->ack <= pcb->snd.nxt) {
-            pcb->state = TCP_PCB_STATE_ESTABLISHED;
-            sched_wakeup(&pcb->ctx);
-            if (pcb->parent) {
-                queue_push(&pcb->parent->backlog, pcb);
-                sched_wakeup(&pcb->parent->ctx);
-            }
+    /* congestion avoidance, about one segment per RTT */
+    pcb->cc.cwnd += MAX((uint32_t)pcb->mss * pcb->mss / pcb->cc.cwnd, 1);
+}
+
+static const struct tcp_cc_ops tcp_newreno = {
+    .name = "newreno",
+    .ack = tcp_newreno_ack,
+    .ssthresh = tcp_newreno_ssthresh,
+};
+
+#define TCP_CUBIC_C 0.4
+#define TCP_CUBIC_BETA 0.7
+
+/* NOTE: Newton's method, to avoid depending on libm */
+static double
+tcp_cubic_cbrt(double x)
+{
+    double y;
+    int i;
+
+    if (x <= 0.0) {
+        return 0.0;
+    }
+    y = x > 1.0 ? x / 3.0 : 1.0;
+    for (i = 0; i < 64; i++) {
+        y = (2.0 * y + x / (y * y)) / 3.0;
+    }
+    return y;
+}
+
+static void
+tcp_cubic_init(struct tcp_pcb *pcb)
+{
+    memset(&pcb->cc.priv.cubic, 0, sizeof(pcb->cc.priv.cubic));
+}
+
+/* rfc9438 - 4.6, 4.7: multiplicative decrease with fast convergence */
+static uint32_t
+tcp_cubic_ssthresh(struct tcp_pcb *pcb)
+{
+    struct tcp_cubic *cubic = &pcb->cc.priv.cubic;
+    double cwnd;
+
+    cwnd = (double)pcb->cc.cwnd / pcb->mss;
+    if (cwnd < cubic->w_max) {
+        cubic->w_max = cwnd * (1.0 + TCP_CUBIC_BETA) / 2.0;
+    } else {
+        cubic->w_max = cwnd;
+    }
+    cubic->epoch_started = 0;
+    return MAX((uint32_t)(pcb->cc.cwnd * TCP_CUBIC_BETA), 2 * (uint32_t)pcb->mss);
+}
+
+/* rfc9438 - 4.2 ~ 4.5 */
+static void
+tcp_cubic_ack(struct tcp_pcb *pcb, uint32_t acked)
+{
+    struct tcp_cubic *cubic = &pcb->cc.priv.cubic;
+    uint64_t now;
+    double cwnd, t, target;
+
+    if (pcb->cc.cwnd < pcb->cc.ssthresh) {
+        /* slow start */
+        pcb->cc.cwnd += MIN(acked, pcb->mss);
+        return;
+    }
+    cwnd = (double)pcb->cc.cwnd / pcb->mss;
+    now = clock_usec();
+    if (!cubic->epoch_started) {
+        cubic->epoch_started = 1;
+        cubic->epoch = now;
+        if (cwnd < cubic->w_max) {
+            cubic->k = tcp_cubic_cbrt((cubic->w_max - cwnd) / TCP_CUBIC_C);
+            cubic->origin = cubic->w_max;
         } else {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
-            return;
+            cubic->k = 0.0;
+            cubic->origin = cwnd;
         }
-        /* fall through */
-    case TCP_PCB_STATE_ESTABLISHED:
-    case TCP_PCB_STATE_FIN_WAIT1:
-    case TCP_PCB_STATE_FIN_WAIT2:
-    case TCP_PCB_STATE_CLOSE_WAIT:
-    case TCP_PCB_STATE_CLOSING:
-        if (pcb->snd.una < seg->ack && seg->ack <= pcb->snd.nxt) {
-            pcb->snd.una = seg->ack;
-            tcp_retransmit_queue_cleanup(pcb);
-            /* ignore: Users should receive positive acknowledgments for buffers
-                        which have been SENT and fully acknowledged (i.e., SEND buffer should be returned with "ok" response) */
-            if (pcb->snd.wl1 < seg->seq || (pcb->snd.wl1 == seg->seq && pcb->snd.wl2 <= seg->ack)) {
-                pcb->snd.wnd = seg->wnd;
-                pcb->snd.wl1 = seg->seq;
-                pcb->snd.wl2 = seg->ack;
-            }
-        } else if (seg->ack < pcb->snd.una) {
-            /* ignore */
-        } else if (seg->ack > pcb->snd.nxt) {
-            tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+        cubic->w_est = cwnd;
+    }
+    t = (now - cubic->epoch) / 1000000.0 + pcb->rtt.srtt / 1000000.0 - cubic->k;
+    target = cubic->origin + TCP_CUBIC_C * t * t * t;
+    target = MIN(MAX(target, cwnd), cwnd * 1.5);
+    cubic->w_est += 3.0 * (1.0 - TCP_CUBIC_BETA) / (1.0 + TCP_CUBIC_BETA) * acked / pcb->cc.cwnd;
+    if (target < cubic->w_est) {
+        /* TCP friendly region */
+        target = cubic->w_est;
+    }
+    pcb->cc.cwnd += MAX((uint32_t)((target - cwnd) / cwnd * acked), 1);
+}
+
+static const struct tcp_cc_ops tcp_cubic = {
+    .name = "cubic",
+    .init = tcp_cubic_init,
+    .ack = tcp_cubic_ack,
+    .ssthresh = tcp_cubic_ssthresh,
+};
+
+static const struct tcp_cc_ops *tcp_cc_list[] = {
+    &tcp_newreno,
+    &tcp_cubic,
+};
+
+static const struct tcp_cc_ops *
+tcp_cc_lookup(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < countof(tcp_cc_list); i++) {
+        if (strcmp(tcp_cc_list[i]->name, name) == 0) {
+            return tcp_cc_list[i];
+        }
+    }
+    return NULL;
+}
+
+/* NOTE: must be called when the connection is established (or the algorithm is changed) */
+static void
+tcp_cc_setup(struct tcp_pcb *pcb)
+{
+    struct ip_iface *iface;
+
+    if (!pcb->cc.ops) {
+        pcb->cc.ops = tcp_cc_lookup(TCP_CC_DEFAULT);
+    }
+    if (!pcb->mss) {
+        iface = ip_route_get_iface(pcb->local.addr);
+        pcb->mss = iface ? NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr)) : TCP_DEFAULT_MSS;
+    }
+    /* rfc5681 - 3.1: initial window */
+    if (pcb->mss > 2190) {
+        pcb->cc.cwnd = 2 * pcb->mss;
+    } else if (pcb->mss > 1095) {
+        pcb->cc.cwnd = 3 * pcb->mss;
+    } else {
+        pcb->cc.cwnd = 4 * pcb->mss;
+    }
+    pcb->cc.ssthresh = UINT32_MAX;
+    pcb->cc.state = TCP_CC_STATE_OPEN;
+    pcb->cc.dupacks = 0;
+    pcb->cc.recover = pcb->snd.una;
+    if (pcb->cc.ops->init) {
+        pcb->cc.ops->init(pcb);
+    }
+    debugf("%s, mss=%u, cwnd=%u", pcb->cc.ops->name, pcb->mss, pcb->cc.cwnd);
+}
+
+/* NOTE: SND.UNA has advanced by acked bytes */
+static void
+tcp_cc_ack(struct tcp_pcb *pcb, uint32_t acked)
+{
+    pcb->cc.dupacks = 0;
+    switch (pcb->cc.state) {
+    case TCP_CC_STATE_RECOVERY:
+        if (TCP_SEQ_LEQ(pcb->cc.recover, pcb->snd.una)) {
+            /* rfc6582 - 3.2 (3): full acknowledgment, deflate the window */
+            pcb->cc.cwnd = MIN(pcb->cc.ssthresh, MAX(tcp_cc_flight(pcb), pcb->mss) + pcb->mss);
+            pcb->cc.state = TCP_CC_STATE_OPEN;
             return;
         }
-        switch (pcb->state) {
-        case TCP_PCB_STATE_FIN_WAIT1:
-            if (seg->ack == pcb->snd.nxt) {
-                pcb->state = TCP_PCB_STATE_FIN_WAIT2;
+        /* rfc6582 - 3.2 (3): partial acknowledgment, the next hole is retransmitted right away */
+        tcp_retransmit_resend_hole(pcb);
+        pcb->cc.cwnd -= MIN(acked, pcb->cc.cwnd - pcb->mss);
+        if (acked >= pcb->mss) {
+            pcb->cc.cwnd += pcb->mss;
+        }
+        return;
+    case TCP_CC_STATE_LOSS:
+        if (TCP_SEQ_LEQ(pcb->cc.recover, pcb->snd.una)) {
+            pcb->cc.state = TCP_CC_STATE_OPEN;
+        } else {
+            /* NOTE: the segments after the one retransmitted by the timer are likely to be lost too */
+            tcp_retransmit_resend_hole(pcb);
+        }
+        break;
+    }
+    pcb->cc.ops->ack(pcb, acked);
+    /* NOTE: the flight never exceeds sndbuf, a window grown beyond it only runs toward the overflow */
+    pcb->cc.cwnd = MIN(pcb->cc.cwnd, TCP_SNDBUF_SIZE);
+}
+
+/* NOTE: an ACK without data which does not move SND.UNA nor the window while the data is outstanding */
+static void
+tcp_cc_dupack(struct tcp_pcb *pcb)
+{
+    if (pcb->cc.state == TCP_CC_STATE_RECOVERY) {
+        /* rfc6582 - 3.2 (4): inflate the window for the segment left the network */
+        pcb->cc.cwnd += pcb->mss;
+        if (pcb->opt.flags & TCP_PCB_OPT_SACK) {
+            /* NOTE: SACK tells the other holes, they need not wait for the partial ACKs one by one */
+            tcp_retransmit_resend_hole(pcb);
+        }
+        return;
+    }
+    if (++pcb->cc.dupacks != TCP_CC_DUPACK_THRESH) {
+        return;
+    }
+    if (pcb->cc.state == TCP_CC_STATE_LOSS && TCP_SEQ_LT(pcb->snd.una, pcb->cc.recover)) {
+        /* rfc6582 - 3.2 (1): the duplicate ACKs may be caused by the retransmission */
+        return;
+    }
+    /* rfc6582 - 3.2 (2): fast retransmit, and enter fast recovery */
+    pcb->cc.ssthresh = pcb->cc.ops->ssthresh(pcb);
+    pcb->cc.recover = pcb->snd.nxt;
+    pcb->cc.state = TCP_CC_STATE_RECOVERY;
+    debugf("fast retransmit, seq=%u, ssthresh=%u", pcb->snd.una, pcb->cc.ssthresh);
+    pcb->stats.fast_retrans++;
+    counters_add(&stats, TCP_STATS_FAST_RETRANS, 1);
+    tcp_retransmit_reset(pcb);
+    tcp_retransmit_resend_hole(pcb);
+    pcb->cc.cwnd = pcb->cc.ssthresh + TCP_CC_DUPACK_THRESH * pcb->mss;
+}
+
+/* rfc5681 - 3.1: the retransmission timer has expired */
+static void
+tcp_cc_timeout(struct tcp_pcb *pcb)
+{
+    if (!pcb->cc.ops) {
+        /* NOTE: not established yet (SYN/SYN-ACK) */
+        return;
+    }
+    if (pcb->cc.state != TCP_CC_STATE_LOSS) {
+        pcb->cc.ssthresh = pcb->cc.ops->ssthresh(pcb);
+    }
+    pcb->cc.cwnd = pcb->mss;
+    pcb->cc.dupacks = 0;
+    pcb->cc.recover = pcb->snd.nxt;
+    pcb->cc.state = TCP_CC_STATE_LOSS;
+    tcp_retransmit_reset(pcb);
+    debugf("timeout, ssthresh=%u", pcb->cc.ssthresh);
+}
+
+static void
+tcp_set_timewait_timer(struct tcp_pcb *pcb)
+{
+    pcb->tw_expire = clock_usec() + (uint64_t)TCP_TIMEWAIT_SEC * 1000000;
+    debugf("start time_wait timer: %d seconds", TCP_TIMEWAIT_SEC);
+}
+
+/*
+ * TCP Options
+ */
+
+static uint32_t
+tcp_ts_now(void)
+{
+    /* NOTE: 1 ms per tick (rfc7323 - 5.4) */
+    return (uint32_t)(clock_usec() / 1000);
+}
+
+static int
+tcp_options_parse(const uint8_t *p, size_t len, struct tcp_options *opt)
+{
+    size_t i, olen;
+    int n;
+
+    memset(opt, 0, sizeof(*opt));
+    opt->wscale = -1;
+    for (i = 0; i < len; i += olen) {
+        if (p[i] == TCP_OPT_EOL) {
+            break;
+        }
+        if (p[i] == TCP_OPT_NOP) {
+            olen = 1;
+            continue;
+        }
+        if (i + 1 >= len || p[i+1] < 2 || i + p[i+1] > len) {
+            errorf("bad option, kind=%u", p[i]);
+            return -1;
+        }
+        olen = p[i+1];
+        switch (p[i]) {
+        case TCP_OPT_MSS:
+            if (olen == 4) {
+                opt->mss = ntoh16(*(uint16_t *)(p + i + 2));
             }
             break;
-        case TCP_PCB_STATE_FIN_WAIT2:
-            /* do not delete the TCB */
+        case TCP_OPT_WSCALE:
+            if (olen == 3) {
+                opt->wscale = MIN(p[i+2], TCP_OPT_WSCALE_MAX);
+            }
             break;
-        case TCP_PCB_STATE_CLOSE_WAIT:
-            /* do nothing */
+        case TCP_OPT_SACK_PERMITTED:
+            if (olen == 2) {
+                opt->sack_permitted = 1;
+            }
             break;
-        case TCP_PCB_STATE_CLOSING:
-            if (seg->ack == pcb->snd.nxt) {
-                pcb->state = TCP_PCB_STATE_TIME_WAIT;
-                /* NOTE: set 2MSL timer, although it is not explicitly stated in the RFC */
-                tcp_set_timewait_timer(pcb);
-                sched_wakeup(&pcb->ctx);
+        case TCP_OPT_SACK:
+            for (n = 0; n < TCP_OPT_SACK_BLOCKS_MAX && 2 + (n + 1) * 8 <= (int)olen; n++) {
+                opt->sack[n].left = ntoh32(*(uint32_t *)(p + i + 2 + n * 8));
+                opt->sack[n].right = ntoh32(*(uint32_t *)(p + i + 6 + n * 8));
+            }
+            opt->nsack = n;
+            break;
+        case TCP_OPT_TIMESTAMP:
+            if (olen == 10) {
+                opt->ts = 1;
+                opt->tsval = ntoh32(*(uint32_t *)(p + i + 2));
+                opt->tsecr = ntoh32(*(uint32_t *)(p + i + 6));
             }
             break;
+        default:
+            /* ignore unknown options */
+            break;
         }
-        break;
-    case TCP_PCB_STATE_LAST_ACK:
-        if (seg->ack == pcb->snd.nxt) {
+    }
+    return 0;
+}
+
+/* NOTE: the options of the segment about to be sent, returns the length (a multiple of 4) */
+static size_t
+tcp_options_build(struct tcp_pcb *pcb, uint8_t flg, size_t len, uint8_t *p)
+{
+    struct list_head *pos;
+    struct tcp_range *ooo, *blocks[TCP_OPT_SACK_BLOCKS_MAX];
+    size_t n = 0;
+    int i, num = 0, max;
+
+    if (TCP_FLG_ISSET(flg, TCP_FLG_RST)) {
+        return 0;
+    }
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        p[n++] = TCP_OPT_MSS;
+        p[n++] = 4;
+        *(uint16_t *)(p + n) = hton16(pcb->mss);
+        n += 2;
+        if (pcb->opt.flags & TCP_PCB_OPT_WSCALE) {
+            p[n++] = TCP_OPT_NOP;
+            p[n++] = TCP_OPT_WSCALE;
+            p[n++] = 3;
+            p[n++] = pcb->opt.rcv_wscale;
+        }
+        if (pcb->opt.flags & TCP_PCB_OPT_SACK) {
+            p[n++] = TCP_OPT_NOP;
+            p[n++] = TCP_OPT_NOP;
+            p[n++] = TCP_OPT_SACK_PERMITTED;
+            p[n++] = 2;
+        }
+    }
+    if (pcb->opt.flags & TCP_PCB_OPT_TS) {
+        p[n++] = TCP_OPT_NOP;
+        p[n++] = TCP_OPT_NOP;
+        p[n++] = TCP_OPT_TIMESTAMP;
+        p[n++] = 10;
+        *(uint32_t *)(p + n) = hton32(tcp_ts_now());
+        /* NOTE: TSecr is zero in the initial SYN (rfc7323 - 3.2) */
+        *(uint32_t *)(p + n + 4) = TCP_FLG_ISSET(flg, TCP_FLG_ACK) ? hton32(pcb->opt.ts_recent) : 0;
+        n += 8;
+    }
+    if ((pcb->opt.flags & TCP_PCB_OPT_SACK) && !TCP_FLG_ISSET(flg, TCP_FLG_SYN) && !len && !list_empty(&pcb->ooo)) {
+        /* rfc2018 - 4: the block with the most recently received data first, then the others */
+        max = MIN((TCP_OPT_LEN_MAX - n - 2) / 8, TCP_OPT_SACK_BLOCKS_MAX);
+        list_foreach(pos, &pcb->ooo) {
+            ooo = list_entry(pos, struct tcp_range, entry);
+            if (TCP_SEQ_LEQ(ooo->seq, pcb->rcv.sack_recent) && TCP_SEQ_LT(pcb->rcv.sack_recent, ooo->end)) {
+                blocks[num++] = ooo;
+                break;
+            }
+        }
+        list_foreach(pos, &pcb->ooo) {
+            ooo = list_entry(pos, struct tcp_range, entry);
+            if (num >= max) {
+                break;
+            }
+            if (num && blocks[0] == ooo) {
+                continue;
+            }
+            blocks[num++] = ooo;
+        }
+        p[n++] = TCP_OPT_NOP;
+        p[n++] = TCP_OPT_NOP;
+        p[n++] = TCP_OPT_SACK;
+        p[n++] = 2 + num * 8;
+        for (i = 0; i < num; i++) {
+            *(uint32_t *)(p + n) = hton32(blocks[i]->seq);
+            *(uint32_t *)(p + n + 4) = hton32(blocks[i]->end);
+            n += 8;
+        }
+    }
+    return n;
+}
+
+/*
+ * NOTE: opt is NULL to offer all the options (active open), or the options in the SYN of the peer
+ *       to agree on the ones both sides support (passive open after offering, or SYN-ACK).
+ */
+static void
+tcp_options_negotiate(struct tcp_pcb *pcb, const struct tcp_options *opt)
+{
+    struct ip_iface *iface;
+    uint16_t mss;
+
+    iface = ip_route_get_iface(pcb->foreign.addr);
+    mss = iface ? NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr)) : TCP_DEFAULT_MSS;
+    if (!opt) {
+        pcb->opt.flags = TCP_PCB_OPT_WSCALE | TCP_PCB_OPT_SACK | TCP_PCB_OPT_TS;
+        pcb->opt.rcv_wscale = TCP_RCV_WSCALE;
+        pcb->opt.snd_wscale = 0;
+        pcb->mss = mss;
+        return;
+    }
+    if (opt->wscale < 0) {
+        /* rfc7323 - 2.2: both sides must send the option to enable scaling */
+        pcb->opt.flags &= ~TCP_PCB_OPT_WSCALE;
+        pcb->opt.rcv_wscale = 0;
+    } else {
+        pcb->opt.snd_wscale = opt->wscale;
+    }
+    if (!opt->sack_permitted) {
+        pcb->opt.flags &= ~TCP_PCB_OPT_SACK;
+    }
+    if (!opt->ts) {
+        pcb->opt.flags &= ~TCP_PCB_OPT_TS;
+    } else {
+        pcb->opt.ts_recent = opt->tsval;
+    }
+    /* rfc9293 - 3.7.1: 536 unless the peer tells */
+    pcb->mss = MIN(opt->mss ? opt->mss : TCP_DEFAULT_MSS, mss);
+    debugf("mss=%u, wscale=%d/%d, sack=%d, ts=%d", pcb->mss,
+        (pcb->opt.flags & TCP_PCB_OPT_WSCALE) ? pcb->opt.snd_wscale : -1,
+        (pcb->opt.flags & TCP_PCB_OPT_WSCALE) ? pcb->opt.rcv_wscale : -1,
+        (pcb->opt.flags & TCP_PCB_OPT_SACK) ? 1 : 0, (pcb->opt.flags & TCP_PCB_OPT_TS) ? 1 : 0);
+}
+
+/* NOTE: the largest payload of a segment, excluding the options sent with the data (rfc6691) */
+static size_t
+tcp_options_data_mss(struct tcp_pcb *pcb)
+{
+    return pcb->mss - ((pcb->opt.flags & TCP_PCB_OPT_TS) ? TCP_OPT_TIMESTAMP_LEN : 0);
+}
+
+/* NOTE: a payload longer than gso is left to the device to be cut into segments of gso bytes (TSO) */
+static ssize_t
+tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *opt, size_t optlen, uint8_t *data, size_t len, size_t gso, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct pbuf *pb;
+    struct tcp_hdr *hdr;
+    struct pseudo_hdr pseudo;
+    struct ip_iface *iface;
+    uint32_t sum;
+    uint16_t total;
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
+    ssize_t ret;
+
+    if (len > IP_PAYLOAD_SIZE_MAX - sizeof(*hdr) - optlen) {
+        errorf("too long");
+        return -1;
+    }
+    pb = pbuf_alloc(PBUF_HEADROOM, sizeof(*hdr) + optlen + len);
+    if (!pb) {
+        errorf("pbuf_alloc() failure");
+        return -1;
+    }
+    hdr = (struct tcp_hdr *)pb->data;
+    hdr->src = local->port;
+    hdr->dst = foreign->port;
+    hdr->seq = hton32(seq);
+    hdr->ack = hton32(ack);
+    hdr->off = ((sizeof(*hdr) + optlen) >> 2) << 4;
+    hdr->flg = flg;
+    hdr->wnd = hton16(wnd);
+    hdr->sum = 0;
+    hdr->up = 0;
+    memcpy(hdr + 1, opt, optlen);
+    pseudo.src = local->addr;
+    pseudo.dst = foreign->addr;
+    pseudo.zero = 0;
+    pseudo.protocol = IP_PROTOCOL_TCP;
+    total = sizeof(*hdr) + optlen + len;
+    pseudo.len = hton16(total);
+    iface = ip_route_get_iface(foreign->addr);
+    if (iface && NET_IFACE(iface)->dev->features & NET_DEVICE_FEATURE_TXCSUM) {
+        /* NOTE: the device sums the segment, only the pseudo header is left in the field */
+        memcpy((uint8_t *)(hdr + 1) + optlen, data, len);
+        hdr->sum = ~cksum16_fold(cksum16_partial(&pseudo, sizeof(pseudo), 0));
+        pb->flags |= PBUF_FLAG_CSUM_PARTIAL;
+        pb->csum_start = (uint8_t *)hdr - pb->head;
+        pb->csum_offset = offsetof(struct tcp_hdr, sum);
+    } else {
+        /* NOTE: the payload is summed while being copied, it is read only once */
+        sum = cksum16_copy((uint8_t *)(hdr + 1) + optlen, data, len, 0);
+        sum = cksum16_partial(&pseudo, sizeof(pseudo), sum);
+        hdr->sum = cksum16_fold(cksum16_partial(hdr, sizeof(*hdr) + optlen, sum));
+    }
+    if (gso && len > gso) {
+        pb->gso_size = gso;
+    }
+    debugf("%s => %s, len=%u (payload=%zu, gso=%u)",
+        ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)), total, len, pb->gso_size);
+    tcp_dump((uint8_t *)hdr, total);
+    ret = ip_output(IP_PROTOCOL_TCP, pb, local->addr, foreign->addr);
+    pbuf_free(pb);
+    if (ret == -1) {
+        return -1;
+    }
+    counters_add(&stats, TCP_STATS_OUT_SEGS, 1);
+    if (TCP_FLG_ISSET(flg, TCP_FLG_RST)) {
+        counters_add(&stats, TCP_STATS_OUT_RSTS, 1);
+    }
+    return len;
+}
+
+/* NOTE: send a segment of the connection with the current ACK, window and options */
+static ssize_t
+tcp_output_seq(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, uint8_t *data, size_t len)
+{
+    uint8_t opt[TCP_OPT_LEN_MAX];
+    size_t optlen;
+    uint32_t wnd;
+
+    optlen = tcp_options_build(pcb, flg, len, opt);
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        /* rfc7323 - 2.2: the window in a SYN is never scaled */
+        wnd = MIN(pcb->rcv.wnd, UINT16_MAX);
+    } else {
+        wnd = MIN(pcb->rcv.wnd >> pcb->opt.rcv_wscale, UINT16_MAX);
+    }
+    pcb->rcv.adv = pcb->rcv.nxt + (TCP_FLG_ISSET(flg, TCP_FLG_SYN) ? wnd : wnd << pcb->opt.rcv_wscale);
+    pcb->opt.last_ack = pcb->rcv.nxt;
+    /* NOTE: the ACK is piggybacked, nothing is left to be delayed */
+    pcb->delack.segs = 0;
+    pcb->stats.segs_out++;
+    return tcp_output_segment(seq, pcb->rcv.nxt, flg, wnd, opt, optlen, data, len, tcp_options_data_mss(pcb), &pcb->local, &pcb->foreign);
+}
+
+static ssize_t
+tcp_output(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len)
+{
+    uint32_t seq, end;
+    ssize_t ret;
+
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        pcb->snd.una = pcb->snd.nxt = pcb->iss;
+        pcb->sndbuf.end = pcb->iss + 1;
+        if (!TCP_FLG_ISSET(flg, TCP_FLG_ACK)) {
+            counters_add(&stats, TCP_STATS_ACTIVE_OPENS, 1);
+        }
+    }
+    seq = pcb->snd.nxt;
+    ret = tcp_output_seq(pcb, seq, flg, data, len);
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN) || len) {
+        /* NOTE: the sequence space is consumed here, the data itself stays in sndbuf until acknowledged */
+        end = seq + len + TCP_FLG_ISSET(flg, TCP_FLG_SYN) + TCP_FLG_ISSET(flg, TCP_FLG_FIN);
+        tcp_retransmit_start(pcb, seq, end);
+        pcb->snd.nxt = end;
+        tcp_timer_update(pcb);
+    }
+    return ret;
+}
+
+/*
+ * TCP Send Buffer (ring)
+ *
+ * NOTE: TCP Send Buffer functions must be called after the PCB locked
+ */
+
+/*
+ * NOTE: The buffer is addressed by the sequence number, the data from max(SND.UNA, ISS+1) to
+ *       sndbuf.end is kept until acknowledged, and the data below SND.NXT is in flight.
+ */
+static size_t
+tcp_sndbuf_offset(struct tcp_pcb *pcb, uint32_t seq)
+{
+    return (seq - (pcb->iss + 1)) & (TCP_SNDBUF_SIZE - 1);
+}
+
+/* NOTE: the data not acknowledged yet */
+static size_t
+tcp_sndbuf_count(struct tcp_pcb *pcb)
+{
+    uint32_t start;
+
+    /* NOTE: compare with ISS itself, SND.UNA is 2^31 ahead of ISS + 1 after 2GB and TCP_SEQ_LT() flips */
+    start = pcb->snd.una == pcb->iss ? pcb->iss + 1 : pcb->snd.una;
+    return TCP_SEQ_LT(start, pcb->sndbuf.end) ? pcb->sndbuf.end - start : 0;
+}
+
+/* NOTE: the data not sent yet */
+static size_t
+tcp_sndbuf_unsent(struct tcp_pcb *pcb)
+{
+    return TCP_SEQ_LT(pcb->snd.nxt, pcb->sndbuf.end) ? pcb->sndbuf.end - pcb->snd.nxt : 0;
+}
+
+static int
+tcp_sndbuf_write(struct tcp_pcb *pcb, const uint8_t *data, size_t len)
+{
+    size_t off, n;
+
+    if (!pcb->sndbuf.buf) {
+        pcb->sndbuf.buf = memory_alloc_raw(TCP_SNDBUF_SIZE);
+        if (!pcb->sndbuf.buf) {
+            errorf("memory_alloc_raw() failure");
+            return -1;
+        }
+    }
+    off = tcp_sndbuf_offset(pcb, pcb->sndbuf.end);
+    n = MIN(len, TCP_SNDBUF_SIZE - off);
+    memcpy(pcb->sndbuf.buf + off, data, n);
+    memcpy(pcb->sndbuf.buf, data + n, len - n);
+    pcb->sndbuf.end += len;
+    return 0;
+}
+
+/*
+ * NOTE: Send the buffered data as far as the window allows, then the FIN queued behind it.
+ *       A partial segment waits for the ACK of the data in flight (rfc896: Nagle's algorithm)
+ *       or, with TCP_CORK, for more data. force sends it anyway (e.g. TCP_CORK cleared).
+ */
+static int
+tcp_sndbuf_flush(struct tcp_pcb *pcb, int force)
+{
+    size_t mss, max, wnd, flight, cap, count, off, slen;
+    struct ip_iface *iface;
+
+    switch (pcb->state) {
+    case TCP_PCB_STATE_ESTABLISHED:
+    case TCP_PCB_STATE_CLOSE_WAIT:
+    case TCP_PCB_STATE_FIN_WAIT1:
+    case TCP_PCB_STATE_LAST_ACK:
+        break;
+    default:
+        return 0;
+    }
+    mss = max = tcp_options_data_mss(pcb);
+    iface = ip_route_get_iface(pcb->foreign.addr);
+    if (iface && NET_IFACE(iface)->dev->features & NET_DEVICE_FEATURE_TSO) {
+        /* NOTE: as many full segments as a datagram can carry, the device cuts them (see tcp_output_segment()) */
+        max = (IP_PAYLOAD_SIZE_MAX - sizeof(struct tcp_hdr) - TCP_OPT_LEN_MAX) / mss * mss;
+    }
+    while ((count = tcp_sndbuf_unsent(pcb)) > 0) {
+        /* NOTE: the window may have shrunk below the data in flight (e.g. reordered window updates, a loss) */
+        wnd = MIN(pcb->snd.wnd, pcb->cc.cwnd);
+        flight = pcb->snd.nxt - pcb->snd.una;
+        cap = flight < wnd ? wnd - flight : 0;
+        off = tcp_sndbuf_offset(pcb, pcb->snd.nxt);
+        slen = MIN(MIN(max, count), TCP_SNDBUF_SIZE - off); /* NOTE: a segment does not wrap around */
+        if (slen > mss && cap < slen) {
+            /* NOTE: a large segment is cut down to the full segments fitting in the window */
+            slen = MAX(cap - cap % mss, mss);
+        }
+        if (cap < slen) {
+            /* rfc1122 - 4.2.3.4: sender's SWS avoidance, a small segment only if nothing is in flight */
+            if (!cap || flight) {
+                break;
+            }
+            slen = cap;
+        }
+        if (slen < mss && slen == count && !force) {
+            if (pcb->sndbuf.cork) {
+                if (!pcb->sndbuf.cork_expire) {
+                    pcb->sndbuf.cork_expire = clock_usec() + TCP_CORK_TIMEOUT;
+                }
+                break;
+            }
+            if (!pcb->sndbuf.nodelay && flight) {
+                break;
+            }
+        }
+        if (tcp_output(pcb, TCP_FLG_ACK | (slen == count ? TCP_FLG_PSH : 0), pcb->sndbuf.buf + off, slen) == -1) {
+            errorf("tcp_output() failure");
+            return -1;
+        }
+        pcb->sndbuf.cork_expire = 0;
+    }
+    if (!count && pcb->sndbuf.fin) {
+        pcb->sndbuf.fin = 0;
+        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0);
+    }
+    tcp_timer_update(pcb);
+    return 0;
+}
+
+/*
+ * TCP Delayed ACK
+ *
+ * NOTE: TCP Delayed ACK functions must be called after the PCB locked
+ */
+
+/* NOTE: in-order data has arrived, ACK it now or hope to piggyback it on the data sent by then */
+static void
+tcp_delack(struct tcp_pcb *pcb, uint16_t segs)
+{
+    pcb->delack.segs += segs;
+    if (pcb->delack.quick || pcb->delack.segs >= TCP_DELACK_SEGS) {
+        tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+        return;
+    }
+    if (pcb->delack.segs == segs) {
+        pcb->delack.expire = clock_usec() + TCP_DELACK_TIMEOUT;
+    }
+}
+
+/*
+ * rfc793 - section 3.9 [Event Processing > SEGMENT ARRIVES]
+ *
+ * NOTE: pcb is the one selected for the segment (locked), or NULL
+ */
+static void
+tcp_segment_arrives(struct tcp_pcb *pcb, struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct tcp_pcb *new_pcb = NULL;
+    int acceptable = 0, gap;
+    uint32_t nxt, acked;
+
+    if (!pcb || pcb->state == TCP_PCB_STATE_CLOSED) {
+        counters_add(&stats, TCP_STATS_NO_PCBS, 1);
+        if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
+            return;
+        }
+        if (!TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
+            tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, NULL, 0, 0, local, foreign);
+        } else {
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign);
+        }
+        return;
+    }
+    switch(pcb->state) {
+    case TCP_PCB_STATE_LISTEN:
+        /*
+         * first check for an RST
+         */
+        if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
+            return;
+        }
+        /*
+         * second check for an ACK
+         */
+        if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign);
+            return;
+        }
+        /*
+         * third check for an SYN
+         */
+        if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
+            /* ignore: security/compartment check */
+            /* ignore: precedence check */
+            if (pcb->mode == TCP_PCB_MODE_SOCKET) {
+                new_pcb = tcp_pcb_alloc();
+                if (!new_pcb) {
+                    errorf("tcp_pcb_alloc() failure");
+                    return;
+                }
+                new_pcb->mode = TCP_PCB_MODE_SOCKET;
+                new_pcb->cc.ops = pcb->cc.ops; /* inherit the congestion control of the listener */
+                new_pcb->delack.quick = pcb->delack.quick;
+                new_pcb->sndbuf.nodelay = pcb->sndbuf.nodelay;
+                new_pcb->sndbuf.cork = pcb->sndbuf.cork;
+                new_pcb->parent = pcb;
+                tcp_pcb_hold(pcb);
+                pcb = new_pcb;
+            }
+            tcp_pcb_hash(pcb, local, foreign);
+            pcb->rcv.wnd = TCP_RCVBUF_SIZE - 1;
+            pcb->rcv.nxt = seg->seq + 1;
+            pcb->irs = seg->seq;
+            /* NOTE: SND.WL1 is compared in sequence space, the window is taken from the ACK of the handshake */
+            pcb->snd.wl1 = seg->seq;
+            pcb->iss = random();
+            tcp_options_negotiate(pcb, NULL);
+            tcp_options_negotiate(pcb, &seg->opt);
+            tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+            pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
+            counters_add(&stats, TCP_STATS_PASSIVE_OPENS, 1);
+            /* ignore: Note that any other incoming control or data (combined with SYN) will be processed
+                        in the SYN-RECEIVED state, but processing of SYN and ACK  should not be repeated */
+            if (new_pcb) {
+                tcp_pcb_unlock(new_pcb);
+            }
+            return;
+        }
+        /*
+         * fourth other text or control
+         */
+        /* drop segment */
+        return;
+    case TCP_PCB_STATE_SYN_SENT:
+        /*
+         * first check the ACK bit
+         */
+        if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
+            if (TCP_SEQ_LEQ(seg->ack, pcb->iss) || TCP_SEQ_LT(pcb->snd.nxt, seg->ack)) {
+                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign);
+                return;
+            }
+            if (TCP_SEQ_LEQ(pcb->snd.una, seg->ack) && TCP_SEQ_LEQ(seg->ack, pcb->snd.nxt)) {
+                acceptable = 1;
+            }
+        }
+        /*
+         * second check the RST bit
+         */
+        if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
+            if (acceptable) {
+                errorf("connection reset");
+                pcb->state = TCP_PCB_STATE_CLOSED;
+                tcp_pcb_release(pcb);
+            }
+            /* drop segment */
+            return;
+        }
+        /*
+         * ignore: third check security and precedence
+         */
+        /*
+         * fourth check the SYN bit
+         */
+        if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
+            pcb->rcv.nxt = seg->seq + 1;
+            pcb->irs = seg->seq;
+            tcp_options_negotiate(pcb, &seg->opt);
+            if (acceptable) {
+                pcb->snd.una = seg->ack;
+                tcp_retransmit_cleanup(pcb);
+            }
+            if (TCP_SEQ_LT(pcb->iss, pcb->snd.una)) {
+                pcb->state = TCP_PCB_STATE_ESTABLISHED;
+                tcp_cc_setup(pcb);
+                tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+                /* NOTE: not specified in the RFC793, but send window initialization required */
+                pcb->snd.wnd = seg->wnd;
+                pcb->snd.wl1 = seg->seq;
+                pcb->snd.wl2 = seg->ack;
+                tcp_pcb_wakeup(pcb);
+                /* ignore: continue processing at the sixth step below where the URG bit is checked */
+                return;
+            } else {
+                pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
+                pcb->snd.wl1 = seg->seq;
+                tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+                /* ignore: If there are other controls or text in the segment, queue them for processing after the ESTABLISHED state has been reached */
+                return;
+            }
+        }
+        /*
+         * fifth, if neither of the SYN or RST bits is set then drop the segment and return
+         */
+        /* drop segment */
+        return;
+    }
+    /*
+     * Otherwise
+     */
+    /*
+     * first check sequence number
+     */
+    switch (pcb->state) {
+    case TCP_PCB_STATE_SYN_RECEIVED:
+    case TCP_PCB_STATE_ESTABLISHED:
+    case TCP_PCB_STATE_FIN_WAIT1:
+    case TCP_PCB_STATE_FIN_WAIT2:
+    case TCP_PCB_STATE_CLOSE_WAIT:
+    case TCP_PCB_STATE_CLOSING:
+    case TCP_PCB_STATE_LAST_ACK:
+    case TCP_PCB_STATE_TIME_WAIT:
+        if ((pcb->opt.flags & TCP_PCB_OPT_TS) && seg->opt.ts && !TCP_FLG_ISSET(flags, TCP_FLG_RST) &&
+            TCP_SEQ_LT(seg->opt.tsval, pcb->opt.ts_recent)) {
+            /* rfc7323 - 5.3: PAWS, an old duplicate segment */
+            tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+            return;
+        }
+        if (!seg->len) {
+            if (!pcb->rcv.wnd) {
+                if (seg->seq == pcb->rcv.nxt) {
+                    acceptable = 1;
+                }
+            } else {
+                if (TCP_SEQ_LEQ(pcb->rcv.nxt, seg->seq) && TCP_SEQ_LT(seg->seq, pcb->rcv.nxt + pcb->rcv.wnd)) {
+                    acceptable = 1;
+                }
+            }
+        } else {
+            if (!pcb->rcv.wnd) {
+                /* not acceptable */
+            } else {
+                if ((TCP_SEQ_LEQ(pcb->rcv.nxt, seg->seq) && TCP_SEQ_LT(seg->seq, pcb->rcv.nxt + pcb->rcv.wnd)) ||
+                    (TCP_SEQ_LEQ(pcb->rcv.nxt, seg->seq + seg->len - 1) && TCP_SEQ_LT(seg->seq + seg->len - 1, pcb->rcv.nxt + pcb->rcv.wnd))) {
+                    acceptable = 1;
+                }
+            }
+        }
+        if (!acceptable) {
+            if (!TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
+                tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+            }
+            return;
+        }
+        if ((pcb->opt.flags & TCP_PCB_OPT_TS) && seg->opt.ts && TCP_SEQ_LEQ(seg->seq, pcb->opt.last_ack)) {
+            /* rfc7323 - 4.3 (2): TSval >= TS.Recent is assured by the PAWS check above */
+            pcb->opt.ts_recent = seg->opt.tsval;
+        }
+        /*
+         * In the following it is assumed that the segment is the idealized
+         * segment that begins at RCV.NXT and does not exceed the window.
+         * One could tailor actual segments to fit this assumption by
+         * trimming off any portions that lie outside the window (including
+         * SYN and FIN), and only processing further if the segment then
+         * begins at RCV.NXT.  Segments with higher begining sequence
+         * numbers may be held for later processing.
+         */
+    }
+    /*
+     * second check the RST bit
+     */
+    switch (pcb->state) {
+    case TCP_PCB_STATE_SYN_RECEIVED:
+        if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
+            pcb->state = TCP_PCB_STATE_CLOSED;
+            tcp_pcb_release(pcb);
+            return;
+        }
+        break;
+    case TCP_PCB_STATE_ESTABLISHED:
+    case TCP_PCB_STATE_FIN_WAIT1:
+    case TCP_PCB_STATE_FIN_WAIT2:
+    case TCP_PCB_STATE_CLOSE_WAIT:
+        if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
+            errorf("connection reset");
+            pcb->state = TCP_PCB_STATE_CLOSED;
+            tcp_pcb_release(pcb);
+            return;
+        }
+        break;
+    case TCP_PCB_STATE_CLOSING:
+    case TCP_PCB_STATE_LAST_ACK:
+    case TCP_PCB_STATE_TIME_WAIT:
+        if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
+            pcb->state = TCP_PCB_STATE_CLOSED;
+            tcp_pcb_release(pcb);
+            return;
+        }
+        break;
+    }
+    /*
+     * ignore: third check security and precedence
+     */
+    /*
+     * fourth check the SYN bit
+     */
+    switch (pcb->state) {
+    case TCP_PCB_STATE_SYN_RECEIVED:
+    case TCP_PCB_STATE_ESTABLISHED:
+    case TCP_PCB_STATE_FIN_WAIT1:
+    case TCP_PCB_STATE_FIN_WAIT2:
+    case TCP_PCB_STATE_CLOSE_WAIT:
+    case TCP_PCB_STATE_CLOSING:
+    case TCP_PCB_STATE_LAST_ACK:
+    case TCP_PCB_STATE_TIME_WAIT:
+        if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
+            tcp_output(pcb, TCP_FLG_RST, NULL, 0);
+            errorf("connection reset");
+            pcb->state = TCP_PCB_STATE_CLOSED;
+            tcp_pcb_release(pcb);
+            return;
+        }
+    }
+    /*
+     * fifth check the ACK field
+     */
+    if (!TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
+        /* drop segment */
+        return;
+    }
+    switch (pcb->state) {
+    case TCP_PCB_STATE_SYN_RECEIVED:
+        if (TCP_SEQ_LEQ(pcb->snd.una, seg->ack) && TCP_SEQ_LEQ(seg->ack, pcb->snd.nxt)) {
+            pcb->state = TCP_PCB_STATE_ESTABLISHED;
+            tcp_cc_setup(pcb);
+            tcp_pcb_wakeup(pcb);
+            if (pcb->parent) {
+                mutex_lock(&pcb->parent->backlog_mutex);
+                if (pcb->parent->backlog_closed) {
+                    /* the listener has gone away in the meantime */
+                    mutex_unlock(&pcb->parent->backlog_mutex);
+                    tcp_output(pcb, TCP_FLG_RST, NULL, 0);
+                    tcp_pcb_release(pcb);
+                    return;
+                }
+                list_add_tail(&pcb->backlog_entry, &pcb->parent->backlog);
+                sched_wakeup(&pcb->parent->accept_ctx);
+                if (pcb->parent->notify) {
+                    pcb->parent->notify(pcb->parent->notify_arg);
+                }
+                mutex_unlock(&pcb->parent->backlog_mutex);
+            }
+        } else {
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign);
+            return;
+        }
+        /* fall through */
+    case TCP_PCB_STATE_ESTABLISHED:
+    case TCP_PCB_STATE_FIN_WAIT1:
+    case TCP_PCB_STATE_FIN_WAIT2:
+    case TCP_PCB_STATE_CLOSE_WAIT:
+    case TCP_PCB_STATE_CLOSING:
+    case TCP_PCB_STATE_LAST_ACK:
+        /* NOTE: LAST_ACK too, the data and the FIN behind it may still be in sndbuf */
+        if (TCP_SEQ_LEQ(pcb->snd.una, seg->ack) && TCP_SEQ_LEQ(seg->ack, pcb->snd.nxt)) {
+            if ((pcb->opt.flags & TCP_PCB_OPT_SACK) && seg->opt.nsack) {
+                tcp_retransmit_sack(pcb, &seg->opt);
+            }
+            if (TCP_SEQ_LT(pcb->snd.una, seg->ack)) {
+                acked = seg->ack - pcb->snd.una;
+                pcb->snd.una = seg->ack;
+                pcb->stats.bytes_acked += acked;
+                if ((pcb->opt.flags & TCP_PCB_OPT_TS) && seg->opt.ts && seg->opt.tsecr && !pcb->rtt.timing) {
+                    /* rfc7323 - 4.1: the echoed timestamp measures the RTT even for retransmitted data */
+                    tcp_rtt_update(pcb, (tcp_ts_now() - seg->opt.tsecr) * 1000);
+                }
+                tcp_retransmit_cleanup(pcb);
+                tcp_cc_ack(pcb, acked);
+                /* ignore: Users should receive positive acknowledgments for buffers
+                            which have been SENT and fully acknowledged (i.e., SEND buffer should be returned with "ok" response) */
+            } else if (!len && seg->wnd == pcb->snd.wnd && pcb->snd.una != pcb->snd.nxt &&
+                       !TCP_FLG_ISSET(flags, TCP_FLG_SYN | TCP_FLG_FIN)) {
+                /* rfc5681 - 2: duplicate acknowledgment */
+                tcp_cc_dupack(pcb);
+            }
+            /* NOTE: a pure window update carries the same ACK, so the window is checked even if SND.UNA did not move */
+            if (TCP_SEQ_LT(pcb->snd.wl1, seg->seq) || (pcb->snd.wl1 == seg->seq && TCP_SEQ_LEQ(pcb->snd.wl2, seg->ack))) {
+                pcb->snd.wnd = seg->wnd;
+                pcb->snd.wl1 = seg->seq;
+                pcb->snd.wl2 = seg->ack;
+            }
+            tcp_pcb_wakeup(pcb); /* tcp_send() may be waiting for the window */
+        } else if (TCP_SEQ_LT(seg->ack, pcb->snd.una)) {
+            /* ignore */
+        } else if (TCP_SEQ_LT(pcb->snd.nxt, seg->ack)) {
+            tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+            return;
+        }
+        switch (pcb->state) {
+        case TCP_PCB_STATE_FIN_WAIT1:
+            if (seg->ack == pcb->snd.nxt && !pcb->sndbuf.fin) {
+                pcb->state = TCP_PCB_STATE_FIN_WAIT2;
+            }
+            break;
+        case TCP_PCB_STATE_FIN_WAIT2:
+            /* do not delete the TCB */
+            break;
+        case TCP_PCB_STATE_CLOSE_WAIT:
+            /* do nothing */
+            break;
+        case TCP_PCB_STATE_CLOSING:
+            if (seg->ack == pcb->snd.nxt && !pcb->sndbuf.fin) {
+                pcb->state = TCP_PCB_STATE_TIME_WAIT;
+                /* NOTE: set 2MSL timer, although it is not explicitly stated in the RFC */
+                tcp_set_timewait_timer(pcb);
+                tcp_pcb_wakeup(pcb);
+            }
+            break;
+        case TCP_PCB_STATE_LAST_ACK:
+            if (seg->ack == pcb->snd.nxt && !pcb->sndbuf.fin) {
+                pcb->state = TCP_PCB_STATE_CLOSED;
+                tcp_pcb_release(pcb);
+                return;
+            }
+            break;
+        }
+        break;
+    case TCP_PCB_STATE_TIME_WAIT:
+        if (TCP_FLG_ISSET(flags, TCP_FLG_FIN)) {
+            tcp_set_timewait_timer(pcb); /* restart time-wait timer */
+        }
+        break;
+    }
+    /*
+     * ignore: sixth, check the URG bit
+     */
+    /*
+     * seventh, process the segment text
+     */
+    switch (pcb->state) {
+    case TCP_PCB_STATE_ESTABLISHED:
+    case TCP_PCB_STATE_FIN_WAIT1:
+    case TCP_PCB_STATE_FIN_WAIT2:
+        if (len) {
+            nxt = pcb->rcv.nxt;
+            gap = !list_empty(&pcb->ooo);
+            if (tcp_rcvbuf_write(pcb, seg->seq, data, len) == -1) {
+                /* NOTE: drop the segment without ACK, it will be retransmitted */
+                return;
+            }
+            if (TCP_SEQ_LT(nxt, seg->seq) || gap) {
+                /* rfc5681 - 4.2: an out of order segment (the duplicate ACK tells the peer about the gap) or one filling a gap is ACKed immediately */
+                tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+            } else {
+                tcp_delack(pcb, seg->segs);
+            }
+            if (TCP_SEQ_LT(nxt, seg->seq)) {
+                /* NOTE: queued ahead of rcv.nxt, a FIN on it will be retransmitted */
+                return;
+            }
+            if (pcb->rcv.nxt != nxt) {
+                tcp_pcb_wakeup(pcb);
+            }
+        }
+        break;
+    case TCP_PCB_STATE_CLOSE_WAIT:
+    case TCP_PCB_STATE_CLOSING:
+    case TCP_PCB_STATE_LAST_ACK:
+    case TCP_PCB_STATE_TIME_WAIT:
+        /* ignore segment text */
+        break;
+    }
+
+    /*
+     * eighth, check the FIN bit
+     */
+    if (TCP_FLG_ISSET(flags, TCP_FLG_FIN)) {
+        switch (pcb->state) {
+        case TCP_PCB_STATE_CLOSED:
+        case TCP_PCB_STATE_LISTEN:
+        case TCP_PCB_STATE_SYN_SENT:
+            /* drop segment */
+            return;
+        }
+        if (seg->seq + seg->len - 1 != pcb->rcv.nxt) {
+            /* NOTE: not all of the text before the FIN has been accepted (e.g. out of the window) */
+            return;
+        }
+        pcb->rcv.nxt++;
+        tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+        switch (pcb->state) {
+        case TCP_PCB_STATE_SYN_RECEIVED:
+        case TCP_PCB_STATE_ESTABLISHED:
+            pcb->state = TCP_PCB_STATE_CLOSE_WAIT;
+            tcp_pcb_wakeup(pcb);
+            break;
+        case TCP_PCB_STATE_FIN_WAIT1:
+            if (seg->ack == pcb->snd.nxt && !pcb->sndbuf.fin) {
+                pcb->state = TCP_PCB_STATE_TIME_WAIT;
+                tcp_set_timewait_timer(pcb);
+            } else {
+                pcb->state = TCP_PCB_STATE_CLOSING;
+            }
+            break;
+        case TCP_PCB_STATE_FIN_WAIT2:
+            pcb->state = TCP_PCB_STATE_TIME_WAIT;
+            tcp_set_timewait_timer(pcb);
+            break;
+        case TCP_PCB_STATE_CLOSE_WAIT:
+            /* Remain in the CLOSE-WAIT state */
+            break;
+        case TCP_PCB_STATE_CLOSING:
+            /* Remain in the CLOSING state */
+            break;
+        case TCP_PCB_STATE_LAST_ACK:
+            /* Remain in the LAST-ACK state */
+            break;
+        case TCP_PCB_STATE_TIME_WAIT:
+            /* Remain in the TIME-WAIT state */
+            tcp_set_timewait_timer(pcb); /* restart time-wait timer */
+            break;
+        }
+    }
+    return;
+}
+
+static int
+tcp_verify(const struct tcp_hdr *hdr, size_t len, ip_addr_t src, ip_addr_t dst)
+{
+    struct pseudo_hdr pseudo;
+    uint16_t psum;
+
+    pseudo.src = src;
+    pseudo.dst = dst;
+    pseudo.zero = 0;
+    pseudo.protocol = IP_PROTOCOL_TCP;
+    pseudo.len = hton16(len);
+    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+    if (cksum16((uint16_t *)hdr, len, psum) != 0) {
+        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
+        return -1;
+    }
+    return 0;
+}
+
+/* NOTE: a segment looped back with the checksum left to the device (PBUF_FLAG_CSUM_PARTIAL) is never corrupted */
+#define TCP_CSUM_TRUSTED(pb) ((pb)->flags & (PBUF_FLAG_CSUM_VALID | PBUF_FLAG_CSUM_PARTIAL))
+
+/* NOTE: see ip_protocol_set_gro(), only pure ACKs carrying data in sequence with the same options are coalesced */
+static int
+tcp_gro(const struct pbuf *head, const struct pbuf *pb, size_t hlen, ip_addr_t src, ip_addr_t dst)
+{
+    const struct tcp_hdr *h1, *h2;
+    size_t len1, len2, off, mss;
+
+    len1 = head->len - hlen;
+    len2 = pb->len - hlen;
+    if (len1 < sizeof(*h1) || len2 < sizeof(*h2)) {
+        return 0;
+    }
+    h1 = (const struct tcp_hdr *)(head->data + hlen);
+    h2 = (const struct tcp_hdr *)(pb->data + hlen);
+    if (h1->src != h2->src || h1->dst != h2->dst) {
+        return -1;
+    }
+    off = (h1->off >> 4) << 2;
+    if (off < sizeof(*h1) || off >= len1 || off >= len2 || h1->off != h2->off) {
+        /* NOTE: the one without payload (e.g. a window update) is not coalesced */
+        return 0;
+    }
+    if (h1->flg != TCP_FLG_ACK || (h2->flg & ~TCP_FLG_PSH) != TCP_FLG_ACK) {
+        return 0;
+    }
+    if (h1->ack != h2->ack || h1->wnd != h2->wnd || memcmp(h1 + 1, h2 + 1, off - sizeof(*h1)) != 0) {
+        /* NOTE: the options (e.g. timestamps) of pb would be lost */
+        return 0;
+    }
+    if (ntoh32(h2->seq) != ntoh32(h1->seq) + len1 - off) {
+        return 0;
+    }
+    /* NOTE: the segments coalesced are all of the same size but the last one */
+    mss = head->gso_size ? head->gso_size : len1 - off;
+    if (len2 - off > mss || (len1 - off) % mss) {
+        return 0;
+    }
+    if (!TCP_CSUM_TRUSTED(head) && tcp_verify(h1, len1, src, dst) == -1) {
+        return 0;
+    }
+    if (!TCP_CSUM_TRUSTED(pb) && tcp_verify(h2, len2, src, dst) == -1) {
+        return 0;
+    }
+    return off;
+}
+
+static void
+tcp_input(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+{
+    const uint8_t *data = pb->data;
+    size_t len = pb->len;
+    struct tcp_hdr *hdr;
+    uint16_t hlen;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+    struct ip_endpoint local, foreign;
+    struct tcp_segment_info seg;
+    struct tcp_pcb *pcb;
+
+    TRACE_POINT(TRACE_STAGE_TCP_INPUT, pb);
+    if (len < sizeof(*hdr)) {
+        errorf("too short");
+        counters_add(&stats, TCP_STATS_IN_ERRORS, 1);
+        return;
+    }
+    hdr = (struct tcp_hdr *)data;
+    if (!TCP_CSUM_TRUSTED(pb) && tcp_verify(hdr, len, src, dst) == -1) {
+        counters_add(&stats, TCP_STATS_CSUM_ERRORS, 1);
+        return;
+    }
+    if (src == IP_ADDR_BROADCAST || src == iface->broadcast || dst == IP_ADDR_BROADCAST || dst == iface->broadcast) {
+        errorf("only supports unicast, src=%s, dst=%s",
+            ip_addr_ntop(src, addr1, sizeof(addr1)), ip_addr_ntop(dst, addr2, sizeof(addr2)));
+        counters_add(&stats, TCP_STATS_IN_ERRORS, 1);
+        return;
+    }
+    debugf("%s:%d => %s:%d, len=%zu (payload=%zu)",
+        ip_addr_ntop(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
+        ip_addr_ntop(dst, addr2, sizeof(addr2)), ntoh16(hdr->dst),
+        len, len - sizeof(*hdr));
+    tcp_dump(data, len);
+    local.addr = dst;
+    local.port = hdr->dst;
+    foreign.addr = src;
+    foreign.port = hdr->src;
+    hlen = (hdr->off >> 4) << 2;
+    if (hlen < sizeof(*hdr) || hlen > len) {
+        errorf("bad header length, hlen=%u, len=%zu", hlen, len);
+        counters_add(&stats, TCP_STATS_IN_ERRORS, 1);
+        return;
+    }
+    if (tcp_options_parse((uint8_t *)(hdr + 1), hlen - sizeof(*hdr), &seg.opt) == -1) {
+        counters_add(&stats, TCP_STATS_IN_ERRORS, 1);
+        return;
+    }
+    seg.seq = ntoh32(hdr->seq);
+    seg.ack = ntoh32(hdr->ack);
+    seg.len = len - hlen;
+    seg.segs = pb->gso_size ? (len - hlen + pb->gso_size - 1) / pb->gso_size : 1;
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+        seg.len++; /* SYN flag consumes one sequence number */
+    }
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN)) {
+        seg.len++; /* FIN flag consumes one sequence number */
+    }
+    seg.wnd = ntoh16(hdr->wnd);
+    seg.up = ntoh16(hdr->up);
+    counters_add(&stats, TCP_STATS_IN_SEGS, seg.segs);
+    mutex_lock(&mutex);
+    pcb = tcp_pcb_select(&local, &foreign);
+    if (pcb) {
+        pcb->ref++;
+    }
+    mutex_unlock(&mutex);
+    if (pcb) {
+        mutex_lock(&pcb->mutex);
+        if (pcb->state == TCP_PCB_STATE_FREE || (!pcb->foreign.port && pcb->state != TCP_PCB_STATE_LISTEN)) {
+            /* released in the meantime, or bound but not LISTENed yet */
+            tcp_pcb_unlock(pcb);
+            pcb = NULL;
+        } else {
+            pcb->stats.segs_in += seg.segs;
+            if (!TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+                seg.wnd <<= pcb->opt.snd_wscale;
+            }
+        }
+    }
+    tcp_segment_arrives(pcb, &seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
+    if (pcb) {
+        /* NOTE: the ACK may have opened the window (or acknowledged the data Nagle's algorithm waits for) */
+        tcp_sndbuf_flush(pcb, 0);
+        tcp_timer_update(pcb);
+        tcp_pcb_unlock(pcb);
+    }
+    return;
+}
+
+/*
+ * TCP Timer
+ *
+ * NOTE: A PCB has a single timeout armed for the earliest of its deadlines, it is updated after
+ *       the retransmit queue, the window, the delayed ACK, TCP_CORK or the state may have changed.
+ *       TCP Timer functions must be called after the PCB locked
+ */
+
+static void
+tcp_timer_update(struct tcp_pcb *pcb)
+{
+    uint64_t expire = 0;
+
+    if (pcb->state == TCP_PCB_STATE_FREE) {
+        return;
+    }
+    if (pcb->state == TCP_PCB_STATE_TIME_WAIT) {
+        expire = pcb->tw_expire;
+    }
+    if (pcb->snd.una != pcb->snd.nxt) {
+        pcb->persist = 0;
+        expire = TCP_TIMER_EARLIER(expire, MIN(pcb->rtx.last + pcb->rtt.rto, pcb->rtx.first + TCP_RETRANSMIT_DEADLINE));
+    } else if (!pcb->snd.wnd && (pcb->state == TCP_PCB_STATE_ESTABLISHED || pcb->state == TCP_PCB_STATE_CLOSE_WAIT)) {
+        if (!pcb->persist) {
+            pcb->persist = clock_usec() + pcb->rtt.rto;
+        }
+        expire = TCP_TIMER_EARLIER(expire, pcb->persist);
+    } else {
+        pcb->persist = 0;
+    }
+    if (pcb->delack.segs) {
+        expire = TCP_TIMER_EARLIER(expire, pcb->delack.expire);
+    }
+    if (pcb->sndbuf.cork_expire) {
+        expire = TCP_TIMER_EARLIER(expire, pcb->sndbuf.cork_expire);
+    }
+    if (!expire) {
+        net_timeout_cancel(&pcb->timer);
+        return;
+    }
+    if (expire != pcb->timer.expire || !net_timeout_armed(&pcb->timer)) {
+        net_timeout_arm(&pcb->timer, expire);
+    }
+}
+
+/* NOTE: arg is the ID of the PCB, the slot may have been recycled since the timeout was armed */
+static void
+tcp_timer(void *arg)
+{
+    struct tcp_pcb *pcb;
+    uint64_t now;
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
+
+    pcb = tcp_pcb_get((intptr_t)arg);
+    if (!pcb) {
+        return;
+    }
+    now = clock_usec();
+    if (pcb->state == TCP_PCB_STATE_TIME_WAIT && now >= pcb->tw_expire) {
+        debugf("timewait has elapsed, local=%s, foreign=%s",
+            ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
+        tcp_pcb_release(pcb);
+        tcp_pcb_unlock(pcb);
+        return;
+    }
+    if (pcb->delack.segs && now >= pcb->delack.expire) {
+        tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+    }
+    if (pcb->sndbuf.cork_expire && now >= pcb->sndbuf.cork_expire) {
+        tcp_sndbuf_flush(pcb, 1);
+    }
+    tcp_retransmit_emit(pcb, now);
+    if (pcb->persist && now >= pcb->persist) {
+        /* NOTE: zero window probe, an out of window sequence number makes the peer ACK with its current window
+                 (otherwise a lost window update would leave tcp_send() waiting forever) */
+        tcp_output_seq(pcb, pcb->snd.nxt - 1, TCP_FLG_ACK, NULL, 0);
+        pcb->persist = now + pcb->rtt.rto;
+    }
+    tcp_timer_update(pcb);
+    tcp_pcb_unlock(pcb);
+}
+
+static void
+event_handler(void *arg)
+{
+    struct tcp_pcb *pcb;
+    int id;
+
+    for (id = 0; id < table_size(&pcbs); id++) {
+        pcb = tcp_pcb_get(id);
+        if (!pcb) {
+            continue;
+        }
+        sched_interrupt(&pcb->ctx);
+        mutex_lock(&pcb->backlog_mutex);
+        sched_interrupt(&pcb->accept_ctx);
+        mutex_unlock(&pcb->backlog_mutex);
+        tcp_pcb_unlock(pcb);
+    }
+}
+
+/* NOTE: a line per connection (the listeners are left out) */
+static void
+tcp_stats_dump(FILE *fp)
+{
+    struct tcp_info info;
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
+    struct tcp_pcb *pcb;
+    int id;
+
+    for (id = 0; id < table_size(&pcbs); id++) {
+        pcb = tcp_pcb_get(id);
+        if (!pcb) {
+            continue;
+        }
+        if (pcb->state == TCP_PCB_STATE_LISTEN || pcb->state == TCP_PCB_STATE_CLOSED) {
+            tcp_pcb_unlock(pcb);
+            continue;
+        }
+        tcp_pcb_info(pcb, &info);
+        ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1));
+        ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2));
+        tcp_pcb_unlock(pcb);
+        fprintf(fp, "tcp: id=%d, local=%s, foreign=%s, state=%d, srtt=%u, rttvar=%u, rto=%u, cwnd=%u, ssthresh=%u, unacked=%u, "
+            "segs_in=%" PRIu64 ", segs_out=%" PRIu64 ", retrans_segs=%u, timeouts=%u, fast_retrans=%u\n",
+            id, ep1, ep2, info.state, info.srtt, info.rttvar, info.rto, info.snd_cwnd, info.snd_ssthresh, info.unacked,
+            info.segs_in, info.segs_out, info.retrans_segs, info.timeouts, info.fast_retrans);
+    }
+}
+
+int
+tcp_init(void)
+{
+    size_t i;
+
+    for (i = 0; i < countof(ehash); i++) {
+        list_init(&ehash[i]);
+    }
+    for (i = 0; i < countof(lhash); i++) {
+        list_init(&lhash[i]);
+    }
+    hash_seed = random();
+    port_cursor = random();
+    if (counters_init(&stats, "tcp", stats_names, TCP_STATS_NUM) == -1) {
+        errorf("counters_init() failure");
+        return -1;
+    }
+    if (net_stats_register(&stats, tcp_stats_dump) == -1) {
+        errorf("net_stats_register() failure");
+        return -1;
+    }
+    if (ip_protocol_register("TCP", IP_PROTOCOL_TCP, tcp_input) == -1) {
+        errorf("ip_protocol_register() failure");
+        return -1;
+    }
+    if (ip_protocol_set_gro(IP_PROTOCOL_TCP, tcp_gro) == -1) {
+        errorf("ip_protocol_set_gro() failure");
+        return -1;
+    }
+    net_event_subscribe(event_handler, NULL);
+    return 0;
+}
+
+int
+tcp_set_pcb_max(size_t max)
+{
+    int ret;
+
+    mutex_lock(&mutex);
+    ret = table_set_max(&pcbs, max);
+    mutex_unlock(&mutex);
+    return ret;
+}
+
+/*
+ * TCP User Command (RFC793)
+ */
+
+int
+tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int active)
+{
+    struct tcp_pcb *pcb;
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
+    int state, id;
+
+    pcb = tcp_pcb_alloc();
+    if (!pcb) {
+        errorf("tcp_pcb_alloc() failure");
+        return -1;
+    }
+    pcb->mode = TCP_PCB_MODE_RFC793;
+    if (!active) {
+        debugf("passive open: local=%s, waiting for connection...", ip_endpoint_ntop(local, ep1, sizeof(ep1)));
+        tcp_pcb_hash(pcb, local, foreign);
+        pcb->state = TCP_PCB_STATE_LISTEN;
+    } else {
+        debugf("active open: local=%s, foreign=%s, connecting...",
+            ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)));
+        tcp_pcb_hash(pcb, local, foreign);
+        pcb->rcv.wnd = TCP_RCVBUF_SIZE - 1;
+        pcb->iss = random();
+        tcp_options_negotiate(pcb, NULL);
+        if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0) == -1) {
+            errorf("tcp_output() failure");
+            pcb->state = TCP_PCB_STATE_CLOSED;
+            tcp_pcb_release(pcb);
+            tcp_pcb_unlock(pcb);
+            return -1;
+        }
+        pcb->state = TCP_PCB_STATE_SYN_SENT;
+    }
+AGAIN:
+    state = pcb->state;
+    /* waiting for state changed */
+    while (pcb->state == state) {
+        if (sched_sleep(&pcb->ctx, &pcb->mutex, NULL) == -1) {
+            debugf("interrupted");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
+            tcp_pcb_unlock(pcb);
+            errno = EINTR;
+            return -1;
         }
-        return;
-    case TCP_PCB_STATE_TIME_WAIT:
-        if (TCP_FLG_ISSET(flags, TCP_FLG_FIN)) {
-            tcp_set_timewait_timer(pcb); /* restart time-wait timer */
+    }
+    if (pcb->state != TCP_PCB_STATE_ESTABLISHED) {
+        if (pcb->state == TCP_PCB_STATE_SYN_RECEIVED) {
+            goto AGAIN;
         }
-        break;
+        errorf("open error: %d", pcb->state);
+        pcb->state = TCP_PCB_STATE_CLOSED;
+        tcp_pcb_release(pcb);
+        tcp_pcb_unlock(pcb);
+        return -1;
     }
-    /*
-     * ignore: sixth, check the URG bit
-     */
-    /*
-     * seventh, process the segment text
-     */
+    id = tcp_pcb_id(pcb);
+    debugf("connection established: local=%s, foreign=%s",
+        ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
+    tcp_pcb_unlock(pcb);
+    return id;
+}
+
+/* NOTE: select the congestion control algorithm by name ("newreno" or "cubic") */
+int
+tcp_set_congestion(int id, const char *name)
+{
+    struct tcp_pcb *pcb;
+    const struct tcp_cc_ops *ops;
+
+    ops = tcp_cc_lookup(name);
+    if (!ops) {
+        errorf("unknown algorithm, name=%s", name);
+        return -1;
+    }
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    pcb->cc.ops = ops;
     switch (pcb->state) {
     case TCP_PCB_STATE_ESTABLISHED:
-    case TCP_PCB_STATE_FIN_WAIT1:
-    case TCP_PCB_STATE_FIN_WAIT2:
-        if (len) {
-            memcpy(pcb->buf + (sizeof(pcb->buf) - pcb->rcv.wnd), data, len);
-            pcb->rcv.nxt = seg->seq + seg->len;
-            pcb->rcv.wnd -= len;
-            tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
-            sched_wakeup(&pcb->ctx);
-        }
-        break;
     case TCP_PCB_STATE_CLOSE_WAIT:
-    case TCP_PCB_STATE_CLOSING:
-    case TCP_PCB_STATE_LAST_ACK:
-    case TCP_PCB_STATE_TIME_WAIT:
-        /* ignore segment text */
+        /* NOTE: start over with the new algorithm, it does not know the state of the old one */
+        tcp_cc_setup(pcb);
         break;
     }
+    tcp_pcb_unlock(pcb);
+    return 0;
+}
 
-    /*
-     * eighth, check the FIN bit
-     */
-    if (TCP_FLG_ISSET(flags, TCP_FLG_FIN)) {
-        switch (pcb->state) {
-        case TCP_PCB_STATE_CLOSED:
-        case TCP_PCB_STATE_LISTEN:
-        case TCP_PCB_STATE_SYN_SENT:
-            /* drop segment */
-            return;
-        }
-        pcb->rcv.nxt = seg->seq + 1;
+int
+tcp_get_congestion(int id, char *name, size_t size)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    snprintf(name, size, "%s", pcb->cc.ops ? pcb->cc.ops->name : TCP_CC_DEFAULT);
+    tcp_pcb_unlock(pcb);
+    return 0;
+}
+
+int
+tcp_set_quickack(int id, int on)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    pcb->delack.quick = !!on;
+    if (pcb->delack.quick && pcb->delack.segs) {
+        /* NOTE: don't keep the pending one waiting for the timer */
         tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
-        switch (pcb->state) {
-        case TCP_PCB_STATE_SYN_RECEIVED:
-        case TCP_PCB_STATE_ESTABLISHED:
-            pcb->state = TCP_PCB_STATE_CLOSE_WAIT;
-            sched_wakeup(&pcb->ctx);
-            break;
-        case TCP_PCB_STATE_FIN_WAIT1:
-            if (seg->ack == pcb->snd.nxt) {
-                pcb->state = TCP_PCB_STATE_TIME_WAIT;
-                tcp_set_timewait_timer(pcb);
-            } else {
-                pcb->state = TCP_PCB_STATE_CLOSING;
-            }
-            break;
-        case TCP_PCB_STATE_FIN_WAIT2:
-            pcb->state = TCP_PCB_STATE_TIME_WAIT;
-            tcp_set_timewait_timer(pcb);
-            break;
-        case TCP_PCB_STATE_CLOSE_WAIT:
-            /* Remain in the CLOSE-WAIT state */
-            break;
-        case TCP_PCB_STATE_CLOSING:
-            /* Remain in the CLOSING state */
-            break;
-        case TCP_PCB_STATE_LAST_ACK:
-            /* Remain in the LAST-ACK state */
-            break;
-        case TCP_PCB_STATE_TIME_WAIT:
-            /* Remain in the TIME-WAIT state */
-            tcp_set_timewait_timer(pcb); /* restart time-wait timer */
-            break;
-        }
     }
-    return;
+    tcp_pcb_unlock(pcb);
+    return 0;
 }
 
-static void
-tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+int
+tcp_get_quickack(int id, int *on)
 {
-    struct tcp_hdr *hdr;
-    struct pseudo_hdr pseudo;
-    uint16_t psum, hlen;
-    char addr1[IP_ADDR_STR_LEN];
-    char addr2[IP_ADDR_STR_LEN];
-    struct ip_endpoint local, foreign;
-    struct tcp_segment_info seg;
+    struct tcp_pcb *pcb;
 
-    if (len < sizeof(*hdr)) {
-        errorf("too short");
-        return;
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
     }
-    hdr = (struct tcp_hdr *)data;
-    pseudo.src = src;
-    pseudo.dst = dst;
-    pseudo.zero = 0;
-    pseudo.protocol = IP_PROTOCOL_TCP;
-    pseudo.len = hton16(len);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    if (cksum16((uint16_t *)hdr, len, psum) != 0) {
-        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
-        return;
+    *on = pcb->delack.quick;
+    tcp_pcb_unlock(pcb);
+    return 0;
+}
+
+int
+tcp_set_nodelay(int id, int on)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
     }
-    if (src == IP_ADDR_BROADCAST || src == iface->broadcast || dst == IP_ADDR_BROADCAST || dst == iface->broadcast) {
-        errorf("only supports unicast, src=%s, dst=%s",
-            ip_addr_ntop(src, addr1, sizeof(addr1)), ip_addr_ntop(dst, addr2, sizeof(addr2)));
-        return;
+    pcb->sndbuf.nodelay = !!on;
+    if (pcb->sndbuf.nodelay) {
+        net_tx_batch_begin();
+        tcp_sndbuf_flush(pcb, 0);
+        net_tx_batch_end();
     }
-    debugf("%s:%d => %s:%d, len=%zu (payload=%zu)",
-        ip_addr_ntop(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
-        ip_addr_ntop(dst, addr2, sizeof(addr2)), ntoh16(hdr->dst),
-        len, len - sizeof(*hdr));
-    tcp_dump(data, len);
-    local.addr = dst;
-    local.port = hdr->dst;
-    foreign.addr = src;
-    foreign.port = hdr->src;
-    hlen = (hdr->off >> 4) << 2;
-    seg.seq = ntoh32(hdr->seq);
-    seg.ack = ntoh32(hdr->ack);
-    seg.len = len - hlen;
-    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
-        seg.len++; /* SYN flag consumes one sequence number */
+    tcp_pcb_unlock(pcb);
+    return 0;
+}
+
+int
+tcp_get_nodelay(int id, int *on)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
     }
-    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_FIN)) {
-        seg.len++; /* FIN flag consumes one sequence number */
+    *on = pcb->sndbuf.nodelay;
+    tcp_pcb_unlock(pcb);
+    return 0;
+}
+
+int
+tcp_set_cork(int id, int on)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
     }
-    seg.wnd = ntoh16(hdr->wnd);
-    seg.up = ntoh16(hdr->up);
-    mutex_lock(&mutex);
-    tcp_segment_arrives(&seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
-    mutex_unlock(&mutex);
-    return;
+    pcb->sndbuf.cork = !!on;
+    if (!pcb->sndbuf.cork) {
+        /* NOTE: the partial segment held so far goes out now */
+        pcb->sndbuf.cork_expire = 0;
+        net_tx_batch_begin();
+        tcp_sndbuf_flush(pcb, 1);
+        net_tx_batch_end();
+    }
+    tcp_pcb_unlock(pcb);
+    return 0;
 }
 
-static void
-tcp_timer(void)
+int
+tcp_get_cork(int id, int *on)
 {
     struct tcp_pcb *pcb;
-    struct timeval now;
-    char ep1[IP_ENDPOINT_STR_LEN];
-    char ep2[IP_ENDPOINT_STR_LEN];
 
-    mutex_lock(&mutex);
-    gettimeofday(&now, NULL);
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == TCP_PCB_STATE_FREE) {
-            continue;
-        }
-        if (pcb->state == TCP_PCB_STATE_TIME_WAIT) {
-            if (timercmp(&now, &pcb->tw_timer, >) != 0) {
-                debugf("timewait has elapsed, local=%s, foreign=%s",
-                    ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
-                tcp_pcb_release(pcb);
-                continue;
-            }
-        }
-        queue_foreach(&pcb->queue, tcp_retransmit_queue_emit, pcb);
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
     }
-    mutex_unlock(&mutex);
+    *on = pcb->sndbuf.cork;
+    tcp_pcb_unlock(pcb);
+    return 0;
 }
 
-static void
-event_handler(void *arg)
+int
+tcp_set_nonblock(int id, int on)
 {
     struct tcp_pcb *pcb;
 
-    mutex_lock(&mutex);
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state != TCP_PCB_STATE_FREE) {
-            sched_interrupt(&pcb->ctx);
-        }
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
     }
-    mutex_unlock(&mutex);
+    pcb->nonblock = !!on;
+    tcp_pcb_unlock(pcb);
+    return 0;
 }
 
+/* NOTE: notify(arg) is called on every change of the readiness (see tcp_poll()), NULL to stop it */
 int
-tcp_init(void)
+tcp_set_notify(int id, void (*notify)(void *arg), void *arg)
 {
-    struct timeval interval = {0,100000};
+    struct tcp_pcb *pcb;
 
-    if (ip_protocol_register("TCP", IP_PROTOCOL_TCP, tcp_input) == -1) {
-        errorf("ip_protocol_register() failure");
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
         return -1;
     }
-    if (net_timer_register("TCP Timer", interval, tcp_timer) == -1) {
-        errorf("net_timer_register() failure");
+    mutex_lock(&pcb->backlog_mutex);
+    pcb->notify = notify;
+    pcb->notify_arg = arg;
+    mutex_unlock(&pcb->backlog_mutex);
+    tcp_pcb_unlock(pcb);
+    return 0;
+}
+
+/* NOTE: must be called after the PCB locked */
+static void
+tcp_pcb_info(struct tcp_pcb *pcb, struct tcp_info *info)
+{
+    info->state = pcb->state; /* NOTE: TCP_PCB_STATE_XXX have the same values as TCP_STATE_XXX */
+    info->mss = pcb->mss;
+    info->rto = pcb->rtt.rto;
+    info->srtt = pcb->rtt.srtt;
+    info->rttvar = pcb->rtt.rttvar;
+    info->snd_cwnd = pcb->cc.cwnd;
+    info->snd_ssthresh = pcb->cc.ssthresh;
+    info->snd_wnd = pcb->snd.wnd;
+    info->rcv_wnd = pcb->rcv.wnd;
+    info->unacked = pcb->snd.nxt - pcb->snd.una;
+    info->segs_in = pcb->stats.segs_in;
+    info->segs_out = pcb->stats.segs_out;
+    info->bytes_acked = pcb->stats.bytes_acked;
+    info->bytes_received = pcb->stats.bytes_received;
+    info->retrans_segs = pcb->stats.retrans_segs;
+    info->timeouts = pcb->stats.timeouts;
+    info->fast_retrans = pcb->stats.fast_retrans;
+}
+
+int
+tcp_get_info(int id, struct tcp_info *info)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
         return -1;
     }
-    net_event_subscribe(event_handler, NULL);
+    tcp_pcb_info(pcb, info);
+    tcp_pcb_unlock(pcb);
     return 0;
 }
 
-/*
- * TCP User Command (RFC793)
- */
-
+/* NOTE: returns the events (NET_POLLXXX) ready now, the PCB released has hung up with an error */
 int
-tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int active)
+tcp_poll(int id)
 {
     struct tcp_pcb *pcb;
-    char ep1[IP_ENDPOINT_STR_LEN];
-    char ep2[IP_ENDPOINT_STR_LEN];
-    int state, id;
+    int events = 0;
 
-    mutex_lock(&mutex);
-    pcb = tcp_pcb_alloc();
+    pcb = tcp_pcb_get(id);
     if (!pcb) {
-        errorf("tcp_pcb_alloc() failure");
-        mutex_unlock(&mutex);
-        return -1;
+        return NET_POLLERR | NET_POLLHUP;
     }
-    pcb->mode = TCP_PCB_MODE_RFC793;
-    if (!active) {
-        debugf("passive open: local=%s, waiting for connection...", ip_endpoint_ntop(local, ep1, sizeof(ep1)));
-        pcb->local = *local;
-        if (foreign) {
-            pcb->foreign = *foreign;
-        }
-        pcb->state = TCP_PCB_STATE_LISTEN;
-    } else {
-        debugf("active open: local=%s, foreign=%s, connecting...",
-            ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)));
-        pcb->local = *local;
-        pcb->foreign = *foreign;
-        pcb->rcv.wnd = sizeof(pcb->buf);
-        pcb->iss = random();
-        if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0) == -1) {
-            errorf("tcp_output() failure");
-            pcb->state = TCP_PCB_STATE_CLOSED;
-            tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
-            return -1;
+    switch (pcb->state) {
+    case TCP_PCB_STATE_CLOSED:
+        /* NOTE: never connected, or aborted (e.g. by the retransmission deadline) */
+        events = NET_POLLHUP;
+        break;
+    case TCP_PCB_STATE_LISTEN:
+        mutex_lock(&pcb->backlog_mutex);
+        if (!list_empty(&pcb->backlog)) {
+            events |= NET_POLLIN;
         }
-        pcb->snd.una = pcb->iss;
-        pcb->snd.nxt = pcb->iss + 1;
-        pcb->state = TCP_PCB_STATE_SYN_SENT;
-    }
-AGAIN:
-    state = pcb->state;
-    /* waiting for state changed */
-    while (pcb->state == state) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
-            debugf("interrupted");
-            pcb->state = TCP_PCB_STATE_CLOSED;
-            tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
-            errno = EINTR;
-            return -1;
+        mutex_unlock(&pcb->backlog_mutex);
+        break;
+    case TCP_PCB_STATE_ESTABLISHED:
+    case TCP_PCB_STATE_CLOSE_WAIT:
+        if (tcp_sndbuf_count(pcb) < TCP_SNDBUF_SIZE) {
+            events |= NET_POLLOUT;
         }
-    }
-    if (pcb->state != TCP_PCB_STATE_ESTABLISHED) {
-        if (pcb->state == TCP_PCB_STATE_SYN_RECEIVED) {
-            goto AGAIN;
+        /* fall through */
+    case TCP_PCB_STATE_FIN_WAIT1:
+    case TCP_PCB_STATE_FIN_WAIT2:
+        if (pcb->state == TCP_PCB_STATE_CLOSE_WAIT || tcp_rcvbuf_count(pcb)) {
+            events |= NET_POLLIN;
         }
-        errorf("open error: %d", pcb->state);
-        pcb->state = TCP_PCB_STATE_CLOSED;
-        tcp_pcb_release(pcb);
-        mutex_unlock(&mutex);
-        return -1;
+        break;
+    case TCP_PCB_STATE_CLOSING:
+    case TCP_PCB_STATE_LAST_ACK:
+    case TCP_PCB_STATE_TIME_WAIT:
+        /* NOTE: the end of the stream (or the data before it) is readable */
+        events |= NET_POLLIN;
+        break;
     }
-    id = tcp_pcb_id(pcb);
-    debugf("connection established: local=%s, foreign=%s",
-        ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
-    mutex_unlock(&mutex);
-    return id;
+    tcp_pcb_unlock(pcb);
+    return events;
 }
 
 int
@@ -965,20 +2955,18 @@ tcp_state(int id)
     struct tcp_pcb *pcb;
     int state;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_RFC793) {
         errorf("not opened in rfc793 mode");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     state = pcb->state;
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return state;
 }
 
@@ -992,16 +2980,14 @@ tcp_open(void)
     struct tcp_pcb *pcb;
     int id;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_alloc();
     if (!pcb) {
         errorf("tcp_pcb_alloc() failure");
-        mutex_unlock(&mutex);
         return -1;
     }
     pcb->mode = TCP_PCB_MODE_SOCKET;
     id = tcp_pcb_id(pcb);
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return id;
 }
 
@@ -1012,19 +2998,17 @@ tcp_connect(int id, struct ip_endpoint *foreign)
     struct ip_endpoint local;
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
-    int p;
+    int p, i;
     int state;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     local.addr = pcb->local.addr;
@@ -1033,52 +3017,61 @@ tcp_connect(int id, struct ip_endpoint *foreign)
         iface = ip_route_get_iface(foreign->addr);
         if (!iface) {
             errorf("ip_route_get_iface() failure");
-            mutex_unlock(&mutex);
+            tcp_pcb_unlock(pcb);
             return -1;
         }
         debugf("select source address: %s", ip_addr_ntop(iface->unicast, addr, sizeof(addr)));
         local.addr = iface->unicast;
     }
+    /* NOTE: pick the port and hash the PCB at once, so that no one else can take the same one */
+    mutex_lock(&mutex);
     if (!local.port) {
-        for (p = TCP_SOURCE_PORT_MIN; p <= TCP_SOURCE_PORT_MAX; p++) {
-            local.port = p;
+        /* NOTE: start from where the last search ended, not to walk over the ports in use every time */
+        for (i = 0; i <= TCP_SOURCE_PORT_MAX - TCP_SOURCE_PORT_MIN; i++) {
+            p = TCP_SOURCE_PORT_MIN + (port_cursor + i) % (TCP_SOURCE_PORT_MAX - TCP_SOURCE_PORT_MIN + 1);
+            local.port = hton16(p);
             if (!tcp_pcb_select(&local, foreign)) {
-                debugf("dynamic assign source port: %d", ntoh16(local.port));
-                pcb->local.port = local.port;
+                debugf("dynamic assign source port: %d", p);
+                port_cursor = p - TCP_SOURCE_PORT_MIN + 1;
                 break;
             }
+            local.port = 0;
         }
         if (!local.port) {
-            debugf("failed to dynamic assign source port");
             mutex_unlock(&mutex);
+            debugf("failed to dynamic assign source port");
+            tcp_pcb_unlock(pcb);
             return -1;
         }
     }
-    pcb->local.addr = local.addr;
-    pcb->local.port = local.port;
-    pcb->foreign.addr = foreign->addr;
-    pcb->foreign.port = foreign->port;
-    pcb->rcv.wnd = sizeof(pcb->buf);
+    tcp_pcb_rehash(pcb, &local, foreign);
+    mutex_unlock(&mutex);
+    pcb->rcv.wnd = TCP_RCVBUF_SIZE - 1;
     pcb->iss = random();
+    tcp_options_negotiate(pcb, NULL);
     if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0) == -1) {
         errorf("tcp_output() failure");
         pcb->state = TCP_PCB_STATE_CLOSED;
         tcp_pcb_release(pcb);
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
-    pcb->snd.una = pcb->iss;
-    pcb->snd.nxt = pcb->iss + 1;
     pcb->state = TCP_PCB_STATE_SYN_SENT;
+    if (pcb->nonblock) {
+        /* NOTE: the completion is reported by tcp_poll() as NET_POLLOUT (or NET_POLLHUP) */
+        tcp_pcb_unlock(pcb);
+        errno = EINPROGRESS;
+        return -1;
+    }
 AGAIN:
     state = pcb->state;
     // waiting for state changed
     while (pcb->state == state) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+        if (sched_sleep(&pcb->ctx, &pcb->mutex, NULL) == -1) {
             debugf("interrupted");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            tcp_pcb_unlock(pcb);
             errno = EINTR;
             return -1;
         }
@@ -1090,11 +3083,11 @@ AGAIN:
         errorf("open error: %d", pcb->state);
         pcb->state = TCP_PCB_STATE_CLOSED;
         tcp_pcb_release(pcb);
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     id = tcp_pcb_id(pcb);
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return id;
 }
 
@@ -1104,27 +3097,35 @@ tcp_bind(int id, struct ip_endpoint *local)
     struct tcp_pcb *pcb, *exist;
     char ep[IP_ENDPOINT_STR_LEN];
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
+    mutex_lock(&mutex);
     exist = tcp_pcb_select(local, NULL);
     if (exist) {
         errorf("already bound, exist=%s", ip_endpoint_ntop(&exist->local, ep, sizeof(ep)));
         mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
-    pcb->local = *local;
-    debugf("success: local=%s", ip_endpoint_ntop(&pcb->local, ep, sizeof(ep)));
+    /* NOTE: the connections (in ehash) are not found by the lookup above */
+    if (port_refs[ntoh16(local->port)]) {
+        errorf("already in use, port=%u", ntoh16(local->port));
+        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
+        return -1;
+    }
+    tcp_pcb_rehash(pcb, local, NULL);
     mutex_unlock(&mutex);
+    debugf("success: local=%s", ip_endpoint_ntop(&pcb->local, ep, sizeof(ep)));
+    tcp_pcb_unlock(pcb);
     return 0;
 }
 
@@ -1133,139 +3134,169 @@ tcp_listen(int id, int backlog)
 {
     struct tcp_pcb *pcb;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     pcb->state = TCP_PCB_STATE_LISTEN;
     (void)backlog; // TODO: set backlog
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return 0;
 }
 
-int
-tcp_accept(int id, struct ip_endpoint *foreign)
+static int
+tcp_accept_core(int id, struct ip_endpoint *foreign, int nowait)
 {
     struct tcp_pcb *pcb, *new_pcb;
     int new_id;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     if (pcb->state != TCP_PCB_STATE_LISTEN) {
         errorf("not in LISTEN state");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
-    while (!(new_pcb = queue_pop(&pcb->backlog))) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
-            debugf("interrupted");
-            mutex_unlock(&mutex);
-            errno = EINTR;
+    /* NOTE: wait on the backlog only, the listener itself must keep accepting SYNs */
+    mutex_unlock(&pcb->mutex);
+    mutex_lock(&pcb->backlog_mutex);
+    while (list_empty(&pcb->backlog)) {
+        if (pcb->backlog_closed) {
+            debugf("closed");
+            mutex_unlock(&pcb->backlog_mutex);
+            tcp_pcb_put(pcb);
             return -1;
         }
-        if (pcb->state == TCP_PCB_STATE_CLOSED) {
-            debugf("closed");
-            tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+        if (pcb->nonblock || nowait) {
+            mutex_unlock(&pcb->backlog_mutex);
+            tcp_pcb_put(pcb);
+            errno = EAGAIN;
+            return -1;
+        }
+        if (sched_sleep(&pcb->accept_ctx, &pcb->backlog_mutex, NULL) == -1) {
+            debugf("interrupted");
+            mutex_unlock(&pcb->backlog_mutex);
+            tcp_pcb_put(pcb);
+            errno = EINTR;
             return -1;
         }
     }
+    new_pcb = list_entry(list_pop(&pcb->backlog), struct tcp_pcb, backlog_entry);
     if (foreign) {
         *foreign = new_pcb->foreign;
     }
     new_id = tcp_pcb_id(new_pcb);
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->backlog_mutex);
+    tcp_pcb_put(pcb);
     return new_id;
 }
 
+int
+tcp_accept(int id, struct ip_endpoint *foreign)
+{
+    return tcp_accept_core(id, foreign, 0);
+}
+
+/* NOTE: fails with EAGAIN instead of sleeping, regardless of the nonblocking flag */
+int
+tcp_accept_nowait(int id, struct ip_endpoint *foreign)
+{
+    return tcp_accept_core(id, foreign, 1);
+}
+
 /*
  * TCP User Command (Common)
  */
 
-ssize_t
-tcp_send(int id, uint8_t *data, size_t len)
+static ssize_t
+tcp_send_core(int id, uint8_t *data, size_t len, int nowait)
 {
     struct tcp_pcb *pcb;
     ssize_t sent = 0;
-    struct ip_iface *iface;
-    size_t mss, cap, slen;
+    size_t space, n;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
 RETRY:
     switch (pcb->state) {
+    case TCP_PCB_STATE_FREE: /* released while sleeping */
     case TCP_PCB_STATE_CLOSED:
         errorf("connection does not exist");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     case TCP_PCB_STATE_LISTEN:
         // ignore: change the connection from passive to active
         errorf("this connection is passive");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     case TCP_PCB_STATE_SYN_SENT:
     case TCP_PCB_STATE_SYN_RECEIVED:
         // ignore: Queue the data for transmission after entering ESTABLISHED state
         errorf("insufficient resources");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     case TCP_PCB_STATE_ESTABLISHED:
     case TCP_PCB_STATE_CLOSE_WAIT:
-        iface = ip_route_get_iface(pcb->local.addr);
-        if (!iface) {
-            errorf("iface not found");
-            mutex_unlock(&mutex);
-            return -1;
-        }
-        mss = NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
+        net_tx_batch_begin();
         while (sent < (ssize_t)len) {
-            cap = pcb->snd.wnd - (pcb->snd.nxt - pcb->snd.una);
-            if (!cap) {
-                if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+            space = TCP_SNDBUF_SIZE - tcp_sndbuf_count(pcb);
+            if (!space) {
+                net_tx_batch_end(); /* NOTE: send out the queued segments before sleeping */
+                if (pcb->nonblock || nowait) {
+                    tcp_pcb_unlock(pcb);
+                    if (!sent) {
+                        errno = EAGAIN;
+                        return -1;
+                    }
+                    return sent;
+                }
+                if (sched_sleep(&pcb->ctx, &pcb->mutex, NULL) == -1) {
                     debugf("interrupted");
+                    tcp_pcb_unlock(pcb);
                     if (!sent) {
-                        mutex_unlock(&mutex);
                         errno = EINTR;
                         return -1;
                     }
-                    break;
+                    return sent;
                 }
                 goto RETRY;
             }
-            slen = MIN(MIN(mss, len - sent), cap);
-            if (tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_PSH, data + sent, slen) == -1) {
-                errorf("tcp_output() failure");
+            n = MIN(space, len - sent);
+            if (tcp_sndbuf_write(pcb, data + sent, n) == -1) {
+                net_tx_batch_end();
+                tcp_pcb_unlock(pcb);
+                if (!sent) {
+                    return -1;
+                }
+                return sent;
+            }
+            sent += n;
+            if (tcp_sndbuf_flush(pcb, 0) == -1) {
+                net_tx_batch_end();
                 pcb->state = TCP_PCB_STATE_CLOSED;
                 tcp_pcb_release(pcb);
-                mutex_unlock(&mutex);
+                tcp_pcb_unlock(pcb);
                 return -1;
             }
-            pcb->snd.nxt += slen;
-            sent += slen;
         }
+        net_tx_batch_end();
         break;
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
@@ -1273,51 +3304,59 @@ RETRY:
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         errorf("connection closing");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     default:
         errorf("unknown state '%u'", pcb->state);
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return sent;
 }
 
 ssize_t
-tcp_receive(int id, uint8_t *buf, size_t size)
+tcp_send(int id, uint8_t *data, size_t len)
 {
-    struct tcp_pcb *pcb;
-    size_t remain, len;
+    return tcp_send_core(id, data, len, 0);
+}
+
+/* NOTE: sends as much as the buffer takes now, fails with EAGAIN if nothing, regardless of the nonblocking flag */
+ssize_t
+tcp_send_nowait(int id, uint8_t *data, size_t len)
+{
+    return tcp_send_core(id, data, len, 1);
+}
+
+/* NOTE: wait for data to read, returns the readable length, 0 at the end of the stream, or -1 */
+static ssize_t
+tcp_receive_wait(struct tcp_pcb *pcb, int nowait)
+{
+    size_t remain;
 
-    mutex_lock(&mutex);
-    pcb = tcp_pcb_get(id);
-    if (!pcb) {
-        errorf("pcb not found");
-        mutex_unlock(&mutex);
-        return -1;
-    }
 RETRY:
     switch (pcb->state) {
+    case TCP_PCB_STATE_FREE: /* released while sleeping */
     case TCP_PCB_STATE_CLOSED:
         errorf("connection does not exist");
-        mutex_unlock(&mutex);
         return -1;
     case TCP_PCB_STATE_LISTEN:
     case TCP_PCB_STATE_SYN_SENT:
     case TCP_PCB_STATE_SYN_RECEIVED:
         /* ignore: Queue for processing after entering ESTABLISHED state */
         errorf("insufficient resources");
-        mutex_unlock(&mutex);
         return -1;
     case TCP_PCB_STATE_ESTABLISHED:
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
-        remain = sizeof(pcb->buf) - pcb->rcv.wnd;
+        remain = tcp_rcvbuf_count(pcb);
         if (!remain) {
-            if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+            if (pcb->nonblock || nowait) {
+                errno = EAGAIN;
+                return -1;
+            }
+            if (sched_sleep(&pcb->ctx, &pcb->mutex, NULL) == -1) {
                 debugf("interrupted");
-                mutex_unlock(&mutex);
                 errno = EINTR;
                 return -1;
             }
@@ -1325,27 +3364,132 @@ RETRY:
         }
         break;
     case TCP_PCB_STATE_CLOSE_WAIT:
-        remain = sizeof(pcb->buf) - pcb->rcv.wnd;
-        if (remain) {
-            break;
-        }
-        /* fall through */
     case TCP_PCB_STATE_CLOSING:
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
+        /* NOTE: the data received before the FIN is still readable */
+        remain = tcp_rcvbuf_count(pcb);
+        if (remain) {
+            break;
+        }
         debugf("connection closing");
-        mutex_unlock(&mutex);
         return 0;
     default:
         errorf("unknown state '%u'", pcb->state);
+        return -1;
+    }
+    return remain;
+}
+
+static ssize_t
+tcp_receive_core(int id, uint8_t *buf, size_t size, int nowait)
+{
+    struct tcp_pcb *pcb;
+    struct iovec iov[2];
+    ssize_t remain;
+    size_t len, n;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    if (pcb->rcvbuf.peeking) {
+        errorf("tcp_peek() in progress");
+        tcp_pcb_unlock(pcb);
+        return -1;
+    }
+    remain = tcp_receive_wait(pcb, nowait);
+    if (remain <= 0) {
+        tcp_pcb_unlock(pcb);
+        return remain;
+    }
+    tcp_rcvbuf_iov(pcb, iov);
+    len = MIN(size, (size_t)remain);
+    n = MIN(len, iov[0].iov_len);
+    memcpy(buf, iov[0].iov_base, n);
+    memcpy(buf + n, iov[1].iov_base, len - n);
+    tcp_rcvbuf_consume(pcb, len);
+    tcp_pcb_unlock(pcb);
+    return len;
+}
+
+ssize_t
+tcp_receive(int id, uint8_t *buf, size_t size)
+{
+    return tcp_receive_core(id, buf, size, 0);
+}
+
+/* NOTE: fails with EAGAIN instead of sleeping, regardless of the nonblocking flag */
+ssize_t
+tcp_receive_nowait(int id, uint8_t *buf, size_t size)
+{
+    return tcp_receive_core(id, buf, size, 1);
+}
+
+/*
+ * NOTE: Returns the received data in place (at most two regions, iov[1] is used when it wraps around)
+ *       without consuming it. It stays valid until tcp_consume() is called by the same thread,
+ *       which must follow even if the connection is closed in the meantime.
+ */
+ssize_t
+tcp_peek(int id, struct iovec iov[2])
+{
+    struct tcp_pcb *pcb;
+    ssize_t remain;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    if (pcb->rcvbuf.peeking) {
+        errorf("tcp_peek() in progress");
+        tcp_pcb_unlock(pcb);
+        return -1;
+    }
+    remain = tcp_receive_wait(pcb, 0);
+    if (remain <= 0) {
+        tcp_pcb_unlock(pcb);
+        return remain;
+    }
+    tcp_rcvbuf_iov(pcb, iov);
+    mutex_lock(&mutex);
+    pcb->rcvbuf.peeking = 1;
+    mutex_unlock(&mutex);
+    /* NOTE: keep the reference until tcp_consume(), the buffer must not go away */
+    mutex_unlock(&pcb->mutex);
+    return remain;
+}
+
+/* NOTE: finish tcp_peek(), len bytes of the data are consumed (0 to keep all of them) */
+ssize_t
+tcp_consume(int id, size_t len)
+{
+    struct tcp_pcb *pcb;
+
+    mutex_lock(&mutex);
+    pcb = table_get(&pcbs, id);
+    if (!pcb || !pcb->rcvbuf.peeking) {
+        errorf("not peeking, id=%d", id);
         mutex_unlock(&mutex);
         return -1;
     }
-    len = MIN(size, remain);
-    memcpy(buf, pcb->buf, len);
-    memmove(pcb->buf, pcb->buf + len, remain - len);
-    pcb->rcv.wnd += len;
     mutex_unlock(&mutex);
+    mutex_lock(&pcb->mutex);
+    mutex_lock(&mutex);
+    pcb->rcvbuf.peeking = 0;
+    mutex_unlock(&mutex);
+    if (pcb->state == TCP_PCB_STATE_FREE) {
+        /* released while peeking, tcp_pcb_release() has left the buffer to us */
+        memory_free(pcb->rcvbuf.buf);
+        pcb->rcvbuf.buf = NULL;
+        tcp_pcb_unlock(pcb);
+        return 0;
+    }
+    len = MIN(len, tcp_rcvbuf_count(pcb));
+    tcp_rcvbuf_consume(pcb, len);
+    tcp_pcb_unlock(pcb); /* drop the reference taken by tcp_peek() */
     return len;
 }
 
@@ -1354,18 +3498,15 @@ tcp_close(int id)
 {
     struct tcp_pcb *pcb;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     switch (pcb->state) {
     case TCP_PCB_STATE_CLOSED:
-        errorf("connection does not exist");
-        mutex_unlock(&mutex);
-        return -1;
+        /* NOTE: never connected, or aborted (e.g. by the retransmission deadline) */
+        break;
     case TCP_PCB_STATE_LISTEN:
         pcb->state = TCP_PCB_STATE_CLOSED;
         break;
@@ -1374,40 +3515,40 @@ tcp_close(int id)
         break;
     case TCP_PCB_STATE_SYN_RECEIVED:
         tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0);
-        pcb->snd.nxt++;
         pcb->state = TCP_PCB_STATE_FIN_WAIT1;
         break;
     case TCP_PCB_STATE_ESTABLISHED:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN,  NULL, 0);
-        pcb->snd.nxt++;
         pcb->state = TCP_PCB_STATE_FIN_WAIT1;
+        /* NOTE: the FIN follows the buffered data, which is pushed out without waiting for more */
+        pcb->sndbuf.fin = 1;
+        tcp_sndbuf_flush(pcb, 1);
         break;
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
         errorf("connection closing");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     case TCP_PCB_STATE_CLOSE_WAIT:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0);
-        pcb->snd.nxt++;
         pcb->state = TCP_PCB_STATE_LAST_ACK; /* RFC793 says "enter CLOSING state", but it seems to be LAST-ACK state */
+        pcb->sndbuf.fin = 1;
+        tcp_sndbuf_flush(pcb, 1);
         break;
     case TCP_PCB_STATE_CLOSING:
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         errorf("connection closing");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     default:
         errorf("unknown state '%u'", pcb->state);
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     if (pcb->state == TCP_PCB_STATE_CLOSED) {
         tcp_pcb_release(pcb);
     } else {
-        sched_wakeup(&pcb->ctx);
+        tcp_pcb_wakeup(pcb);
     }
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return 0;
 }
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "ip.h"
 
@@ -18,8 +19,70 @@
 #define TCP_STATE_CLOSE_WAIT  10
 #define TCP_STATE_LAST_ACK    11
 
+/* NOTE: the counters of the module, see net_stats_get() ("tcp") */
+#define TCP_STATS_IN_SEGS       0 /* counting the ones coalesced by GRO */
+#define TCP_STATS_IN_ERRORS     1 /* too short, bad header length or options, or not unicast */
+#define TCP_STATS_CSUM_ERRORS   2
+#define TCP_STATS_NO_PCBS       3 /* reset, no connection (or listener) for them */
+#define TCP_STATS_OUT_SEGS      4 /* before the segmentation offload */
+#define TCP_STATS_OUT_RSTS      5
+#define TCP_STATS_RETRANS_SEGS  6
+#define TCP_STATS_TIMEOUTS      7 /* the retransmission timer expired */
+#define TCP_STATS_FAST_RETRANS  8
+#define TCP_STATS_ACTIVE_OPENS  9
+#define TCP_STATS_PASSIVE_OPENS 10
+#define TCP_STATS_ABORTS       11 /* the retransmission deadline passed */
+#define TCP_STATS_NUM          12
+
+/* NOTE: a snapshot of a connection, see tcp_get_info() */
+struct tcp_info {
+    int state; /* TCP_STATE_XXX */
+    uint16_t mss;
+    uint32_t rto; /* micro seconds */
+    uint32_t srtt; /* micro seconds, 0 until the first measurement */
+    uint32_t rttvar; /* micro seconds */
+    uint32_t snd_cwnd; /* bytes */
+    uint32_t snd_ssthresh; /* bytes */
+    uint32_t snd_wnd; /* bytes */
+    uint32_t rcv_wnd; /* bytes */
+    uint32_t unacked; /* bytes in flight */
+    uint64_t segs_in;
+    uint64_t segs_out;
+    uint64_t bytes_acked; /* by the peer */
+    uint64_t bytes_received; /* in sequence */
+    uint32_t retrans_segs;
+    uint32_t timeouts;
+    uint32_t fast_retrans;
+};
+
 extern int
 tcp_init(void);
+extern int
+tcp_set_pcb_max(size_t max);
+extern int
+tcp_set_congestion(int id, const char *name);
+extern int
+tcp_get_congestion(int id, char *name, size_t size);
+extern int
+tcp_set_quickack(int id, int on);
+extern int
+tcp_get_quickack(int id, int *on);
+extern int
+tcp_set_nodelay(int id, int on);
+extern int
+tcp_get_nodelay(int id, int *on);
+extern int
+tcp_set_cork(int id, int on);
+extern int
+tcp_get_cork(int id, int *on);
+extern int
+tcp_set_nonblock(int id, int on);
+extern int
+tcp_set_notify(int id, void (*notify)(void *arg), void *arg);
+extern int
+tcp_poll(int id);
+extern int
+tcp_get_info(int id, struct tcp_info *info);
 
 extern int
 tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int active);
@@ -30,7 +93,15 @@ tcp_close(int id);
 extern ssize_t
 tcp_send(int id, uint8_t *data, size_t len);
 extern ssize_t
+tcp_send_nowait(int id, uint8_t *data, size_t len);
+extern ssize_t
 tcp_receive(int id, uint8_t *buf, size_t size);
+extern ssize_t
+tcp_receive_nowait(int id, uint8_t *buf, size_t size);
+extern ssize_t
+tcp_peek(int id, struct iovec iov[2]);
+extern ssize_t
+tcp_consume(int id, size_t len);
 
 extern int
 tcp_open(void);
@@ -42,5 +113,7 @@ extern int
 tcp_listen(int id, int backlog);
 extern int
 tcp_accept(int id, struct ip_endpoint *foreign);
+extern int
+tcp_accept_nowait(int id, struct ip_endpoint *foreign);
 
 #endif
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "pbuf.h"
+#include "trace.h"
+
+/* NOTE: seq is the index + 1 once written, a reader skips the event if it changes while copying */
+struct trace_event {
+    uint64_t seq;
+    uint64_t start; /* clock_nsec() */
+    uint64_t end;
+    uint32_t id; /* of the packet, 0 for the spans not per packet */
+    uint32_t len;
+    uint16_t stage;
+    uint16_t tid;
+};
+
+static const char * const stage_names[TRACE_STAGE_NUM] = {
+    "irq", "enqueue", "dequeue", "ip_input", "tcp_input", "udp_input", "softirq", "wakeup",
+};
+
+static const char * const histogram_names[TRACE_STAGE_NUM] = {
+    "trace_irq", "trace_enqueue", "trace_dequeue", "trace_ip_input",
+    "trace_tcp_input", "trace_udp_input", "trace_softirq", "trace_wakeup",
+};
+
+int trace_enabled;
+
+static struct histogram histograms[TRACE_STAGE_NUM];
+static struct trace_event *events; /* NULL until the first trace_start() */
+static uint64_t head;
+static uint32_t next_id;
+static uint64_t softirq_raised[NET_WORKER_MAX]; /* clock_nsec() of the first raise not handled yet */
+static __thread uint64_t irq_entered;
+
+static unsigned int
+trace_tid(void)
+{
+    static unsigned int next;
+    static __thread unsigned int tid;
+
+    if (!tid) {
+        tid = __atomic_add_fetch(&next, 1, __ATOMIC_RELAXED);
+    }
+    return tid;
+}
+
+static void
+trace_event_push(int stage, uint32_t id, uint64_t start, uint64_t end, uint32_t len)
+{
+    struct trace_event *ring, *ev;
+    uint64_t seq;
+
+    ring = __atomic_load_n(&events, __ATOMIC_ACQUIRE);
+    if (!ring) {
+        return;
+    }
+    seq = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+    ev = &ring[seq & (TRACE_RING_SIZE - 1)];
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ev->start = start;
+    ev->end = end;
+    ev->id = id;
+    ev->len = len;
+    ev->stage = stage;
+    ev->tid = trace_tid();
+    __atomic_store_n(&ev->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* NOTE: the time since the last tracepoint of the packet (or the ISR entry) is taken by the stage */
+void
+trace_point(int stage, struct pbuf *pb)
+{
+    uint64_t now, prev;
+
+    now = clock_nsec();
+    prev = pb->trace_ts;
+    if (!prev) {
+        pb->trace_id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+        prev = irq_entered;
+    }
+    if (prev) {
+        histogram_add(&histograms[stage], now - prev);
+    }
+    trace_event_push(stage, pb->trace_id, prev ? prev : now, now, pb->len);
+    pb->trace_ts = now;
+}
+
+/* NOTE: called by the interrupt backends around the device's ISR */
+void
+trace_irq_enter(void)
+{
+    if (TRACE_ENABLED()) {
+        irq_entered = clock_nsec();
+    }
+}
+
+void
+trace_irq_exit(void)
+{
+    if (irq_entered) {
+        trace_span(TRACE_STAGE_IRQ, irq_entered);
+        irq_entered = 0;
+    }
+}
+
+/* NOTE: only the first raise counts until the worker handles it, the later ones are merged into it */
+void
+trace_softirq_raise(unsigned int worker)
+{
+    uint64_t none = 0;
+
+    if (TRACE_ENABLED()) {
+        __atomic_compare_exchange_n(&softirq_raised[worker], &none, clock_nsec(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+void
+trace_softirq_entry(unsigned int worker)
+{
+    uint64_t raised;
+
+    if (!__atomic_load_n(&softirq_raised[worker], __ATOMIC_RELAXED)) {
+        return;
+    }
+    raised = __atomic_exchange_n(&softirq_raised[worker], 0, __ATOMIC_RELAXED);
+    if (raised) {
+        trace_span(TRACE_STAGE_SOFTIRQ, raised);
+    }
+}
+
+/* NOTE: a span not bound to a packet, from start to now */
+void
+trace_span(int stage, uint64_t start)
+{
+    uint64_t now;
+
+    if (!TRACE_ENABLED()) {
+        return;
+    }
+    now = clock_nsec();
+    histogram_add(&histograms[stage], now - start);
+    trace_event_push(stage, 0, start, now, 0);
+}
+
+/* NOTE: the ring is allocated on the first call and kept, the histograms keep counting across the runs */
+int
+trace_start(void)
+{
+    struct trace_event *ring;
+
+    if (!events) {
+        ring = memory_alloc(sizeof(*ring) * TRACE_RING_SIZE);
+        if (!ring) {
+            errorf("memory_alloc() failure");
+            return -1;
+        }
+        __atomic_store_n(&events, ring, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+    infof("started");
+    return 0;
+}
+
+void
+trace_stop(void)
+{
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+    infof("stopped");
+}
+
+const char *
+trace_stage_name(int stage)
+{
+    if (stage < 0 || stage >= TRACE_STAGE_NUM) {
+        return "unknown";
+    }
+    return stage_names[stage];
+}
+
+/* NOTE: snapshot it with histogram_snapshot(), the values are in nanoseconds */
+struct histogram *
+trace_histogram(int stage)
+{
+    if (stage < 0 || stage >= TRACE_STAGE_NUM) {
+        return NULL;
+    }
+    return &histograms[stage];
+}
+
+/*
+ * NOTE: The events in the ring as the Chrome trace format (about://tracing, or ui.perfetto.dev),
+ *       a complete event per span. May be called while tracing, the events being overwritten are skipped.
+ */
+int
+trace_dump(FILE *fp)
+{
+    uint64_t end, seq;
+    struct trace_event *ev, copy;
+    int first = 1;
+    pid_t pid;
+
+    if (!events) {
+        errorf("not started");
+        return -1;
+    }
+    pid = getpid();
+    end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    seq = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+    fprintf(fp, "{\"traceEvents\":[");
+    for (; seq < end; seq++) {
+        ev = &events[seq & (TRACE_RING_SIZE - 1)];
+        if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != seq + 1) {
+            continue;
+        }
+        memcpy(&copy, ev, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ev->seq, __ATOMIC_RELAXED) != seq + 1) {
+            continue;
+        }
+        fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u",
+            first ? "" : ",", stage_names[copy.stage], copy.id ? "packet" : "sched",
+            copy.start / 1000.0, (copy.end - copy.start) / 1000.0, (int)pid, copy.tid);
+        if (copy.id) {
+            fprintf(fp, ",\"args\":{\"packet\":%" PRIu32 ",\"len\":%" PRIu32 "}", copy.id, copy.len);
+        }
+        fprintf(fp, "}");
+        first = 0;
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    return 0;
+}
+
+/* NOTE: registered with net_stats_register(), the stages never traced are omitted */
+void
+trace_stats_dump(FILE *fp)
+{
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    int stage;
+
+    for (stage = 0; stage < TRACE_STAGE_NUM; stage++) {
+        histogram_snapshot(&histograms[stage], buckets);
+        if (histogram_count(buckets)) {
+            histogram_dump(&histograms[stage], "ns", fp);
+        }
+    }
+}
+
+int
+trace_init(void)
+{
+    int stage;
+
+    for (stage = 0; stage < TRACE_STAGE_NUM; stage++) {
+        if (histogram_init(&histograms[stage], histogram_names[stage]) == -1) {
+            errorf("histogram_init() failure");
+            return -1;
+        }
+    }
+    if (net_stats_register(NULL, trace_stats_dump) == -1) {
+        errorf("net_stats_register() failure");
+        return -1;
+    }
+    return 0;
+}
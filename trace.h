@@ -0,0 +1,72 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "util.h"
+
+/*
+ * Tracepoints (the receive path of the packets, and the scheduling around it)
+ *
+ * NOTE: Disabled by default, a tracepoint costs a relaxed load and a branch then.
+ *       While enabled (trace_start()), each packet carries the clock_nsec() of the last
+ *       tracepoint it passed, the time since then goes to the histogram of the stage and
+ *       an event goes to the trace ring (trace_dump() writes it in the Chrome trace format).
+ */
+
+#define TRACE_STAGE_IRQ       0 /* the driver's ISR entered, the origin of the packets read there */
+#define TRACE_STAGE_ENQUEUE   1 /* net_input_handler(), pushed to the protocol queue */
+#define TRACE_STAGE_DEQUEUE   2 /* net_protocol_handler(), popped by the worker (the queueing delay) */
+#define TRACE_STAGE_IP_INPUT  3
+#define TRACE_STAGE_TCP_INPUT 4
+#define TRACE_STAGE_UDP_INPUT 5
+#define TRACE_STAGE_SOFTIRQ   6 /* raise_softirq() to net_protocol_handler(), per softirq */
+#define TRACE_STAGE_WAKEUP    7 /* sched_wakeup() to the sleeper running again, per wakeup */
+#define TRACE_STAGE_NUM       8
+
+#define TRACE_RING_SIZE 65536 /* power of two, the latest events are kept */
+
+struct pbuf; /* forward declaration */
+
+extern int trace_enabled;
+
+#define TRACE_ENABLED() __builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0)
+
+#define TRACE_POINT(stage, pb) \
+    do { \
+        if (TRACE_ENABLED()) { \
+            trace_point((stage), (pb)); \
+        } \
+    } while (0)
+
+extern void
+trace_point(int stage, struct pbuf *pb);
+extern void
+trace_irq_enter(void);
+extern void
+trace_irq_exit(void);
+extern void
+trace_softirq_raise(unsigned int worker);
+extern void
+trace_softirq_entry(unsigned int worker);
+extern void
+trace_span(int stage, uint64_t start);
+
+extern int
+trace_start(void);
+extern void
+trace_stop(void);
+extern const char *
+trace_stage_name(int stage);
+extern struct histogram *
+trace_histogram(int stage);
+extern int
+trace_dump(FILE *fp);
+extern void
+trace_stats_dump(FILE *fp);
+
+extern int
+trace_init(void);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -9,10 +10,17 @@
 
 #include "util.h"
 #include "net.h"
+#include "pbuf.h"
 #include "ip.h"
 #include "udp.h"
+#include "trace.h"
 
-#define UDP_PCB_SIZE 16
+#define UDP_PCB_MAX 1024 /* default limit, see udp_set_pcb_max() */
+#define UDP_PCB_QUEUE_SIZE 1024 /* datagrams (power of two) */
+#define UDP_PCB_RCVBUF_DEFAULT (256 * 1024) /* bytes held by the queued buffers, see udp_set_rcvbuf() */
+#define UDP_PCB_RCVBUF_MAX (16 * 1024 * 1024)
+
+#define UDP_RECV_BATCH 64 /* max number of datagrams popped at once */
 
 #define UDP_PCB_STATE_FREE    0
 #define UDP_PCB_STATE_OPEN    1
@@ -37,27 +45,45 @@ struct udp_hdr {
     uint16_t sum;
 };
 
+struct udp_queue_entry {
+    struct ip_endpoint foreign;
+    uint32_t sum; /* partial checksum of the pseudo header and the UDP header */
+    struct pbuf *pb; /* payload only, the UDP header is pulled */
+};
+
 struct udp_pcb {
+    int id;
     int state;
     struct ip_endpoint local;
-    struct queue_head queue; /* receive queue */
+    struct udp_queue_entry *queue; /* receive queue, a ring of UDP_PCB_QUEUE_SIZE entries */
+    unsigned int head; /* next to be popped */
+    unsigned int tail; /* next to be pushed */
+    size_t rcvbuf; /* limit of rmem */
+    size_t rmem; /* bytes held by the queued buffers (pb->size, not only the payload) */
+    uint32_t drops; /* datagrams dropped for the queue (or rcvbuf) overflow */
     struct sched_ctx ctx;
-};
-
-/* NOTE: the data follows immediately after the structure */
-struct udp_queue_entry {
-    struct ip_endpoint foreign;
-    uint16_t len;
+    int nonblock; /* udp_recvfrom() fails with EAGAIN instead of sleeping */
+    void (*notify)(void *arg); /* called when the queue gets a datagram, see udp_set_notify() */
+    void *notify_arg;
 };
 
 static mutex_t mutex = MUTEX_INITIALIZER;
-static struct udp_pcb pcbs[UDP_PCB_SIZE];
+static struct table pcbs = TABLE_INITIALIZER(struct udp_pcb, UDP_PCB_MAX);
+
+static struct counters stats;
+static const char * const stats_names[UDP_STATS_NUM] = {
+    "in_datagrams", "no_ports", "in_errors", "csum_errors", "rcvbuf_errors", "out_datagrams"
+};
 
 static void
 udp_dump(const uint8_t *data, size_t len)
 {
     struct udp_hdr *hdr;
 
+    if (!LOG_ENABLED(LOG_LEVEL_DEBUG)) {
+        return;
+    }
+
     flockfile(stderr);
     hdr = (struct udp_hdr *)data;
     fprintf(stderr, "        src: %u\n", ntoh16(hdr->src));
@@ -80,23 +106,30 @@ static struct udp_pcb *
 udp_pcb_alloc(void)
 {
     struct udp_pcb *pcb;
+    int id;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == UDP_PCB_STATE_FREE) {
-            pcb->state = UDP_PCB_STATE_OPEN;
-            sched_ctx_init(&pcb->ctx);
-            return pcb;
-        }
+    pcb = table_alloc(&pcbs, &id);
+    if (!pcb) {
+        return NULL;
     }
-    return NULL;
+    pcb->queue = memory_alloc(sizeof(*pcb->queue) * UDP_PCB_QUEUE_SIZE);
+    if (!pcb->queue) {
+        errorf("memory_alloc() failure");
+        table_free(&pcbs, id);
+        return NULL;
+    }
+    pcb->id = id;
+    pcb->state = UDP_PCB_STATE_OPEN;
+    pcb->rcvbuf = UDP_PCB_RCVBUF_DEFAULT;
+    sched_ctx_init(&pcb->ctx);
+    return pcb;
 }
 
 static void
 udp_pcb_release(struct udp_pcb *pcb)
 {
-    struct queue_entry *entry;
-
     pcb->state = UDP_PCB_STATE_CLOSING;
+    pcb->notify = NULL;
     if (sched_ctx_destroy(&pcb->ctx) == -1) {
         sched_wakeup(&pcb->ctx);
         return;
@@ -104,18 +137,23 @@ udp_pcb_release(struct udp_pcb *pcb)
     pcb->state = UDP_PCB_STATE_FREE;
     pcb->local.addr = IP_ADDR_ANY;
     pcb->local.port = 0;
-    while ((entry = queue_pop(&pcb->queue)) != NULL) {
-        memory_free(entry);
+    for (; pcb->head != pcb->tail; pcb->head++) {
+        pbuf_free(pcb->queue[pcb->head & (UDP_PCB_QUEUE_SIZE - 1)].pb);
     }
+    memory_free(pcb->queue);
+    pcb->queue = NULL;
+    table_free(&pcbs, pcb->id);
 }
 
 static struct udp_pcb *
 udp_pcb_select(ip_addr_t addr, uint16_t port)
 {
     struct udp_pcb *pcb;
+    int id;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == UDP_PCB_STATE_OPEN) {
+    for (id = 0; id < table_size(&pcbs); id++) {
+        pcb = table_get(&pcbs, id);
+        if (pcb && pcb->state == UDP_PCB_STATE_OPEN) {
             if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == addr) && pcb->local.port == port) {
                 return pcb;
             }
@@ -129,12 +167,8 @@ udp_pcb_get(int id)
 {
     struct udp_pcb *pcb;
 
-    if (id < 0 || id >= (int)countof(pcbs)) {
-        /* out of range */
-        return NULL;
-    }
-    pcb = &pcbs[id];
-    if (pcb->state != UDP_PCB_STATE_OPEN) {
+    pcb = table_get(&pcbs, id);
+    if (!pcb || pcb->state != UDP_PCB_STATE_OPEN) {
         return NULL;
     }
     return pcb;
@@ -143,27 +177,33 @@ udp_pcb_get(int id)
 static int
 udp_pcb_id(struct udp_pcb *pcb)
 {
-    return indexof(pcbs, pcb);
+    return pcb->id;
 }
 
 static void
-udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+udp_input(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
 {
     struct pseudo_hdr pseudo;
-    uint16_t psum = 0;
+    uint32_t sum;
     struct udp_hdr *hdr;
+    size_t len;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     struct udp_pcb *pcb;
     struct udp_queue_entry *entry;
+    struct pbuf *own;
 
+    TRACE_POINT(TRACE_STAGE_UDP_INPUT, pb);
+    len = pb->len;
     if (len < sizeof(*hdr)) {
         errorf("too short");
+        counters_add(&stats, UDP_STATS_IN_ERRORS, 1);
         return;
     }
-    hdr = (struct udp_hdr *)data;
+    hdr = (struct udp_hdr *)pb->data;
     if (len != ntoh16(hdr->len)) { /* just to make sure */
         errorf("length error: len=%zu, hdr->len=%u", len, ntoh16(hdr->len));
+        counters_add(&stats, UDP_STATS_IN_ERRORS, 1);
         return;
     }
     pseudo.src = src;
@@ -171,88 +211,136 @@ udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     pseudo.zero = 0;
     pseudo.protocol = IP_PROTOCOL_UDP;
     pseudo.len = hton16(len);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    if (cksum16((uint16_t *)hdr, len, psum) != 0) {
-        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
-        return;
-    }
+    /* NOTE: the payload is verified while being copied out (see udp_recvfrom()), it is read only once */
+    sum = cksum16_partial(&pseudo, sizeof(pseudo), 0);
+    sum = cksum16_partial(hdr, sizeof(*hdr), sum);
     debugf("%s:%d => %s:%d, len=%zu (payload=%zu)",
         ip_addr_ntop(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
         ip_addr_ntop(dst, addr2, sizeof(addr2)), ntoh16(hdr->dst),
         len, len - sizeof(*hdr));
-    udp_dump(data, len);
+    udp_dump(pb->data, len);
     mutex_lock(&mutex);
     pcb = udp_pcb_select(dst, hdr->dst);
     if (!pcb) {
         /* port is not in use */
         mutex_unlock(&mutex);
+        counters_add(&stats, UDP_STATS_NO_PORTS, 1);
         return;
     }
-    entry = memory_alloc(sizeof(*entry) + (len - sizeof(*hdr)));
-    if (!entry) {
+    if (pcb->tail - pcb->head == UDP_PCB_QUEUE_SIZE || pcb->rmem >= pcb->rcvbuf) {
+        pcb->drops++;
         mutex_unlock(&mutex);
-        errorf("memory_alloc() failure");
+        counters_add(&stats, UDP_STATS_RCVBUF_ERRORS, 1);
+        debugf("receive queue is full, drop, port=%u, drops=%u", ntoh16(hdr->dst), pcb->drops);
         return;
     }
-    entry->foreign.addr = src;
-    entry->foreign.port = hdr->src;
-    entry->len = len - sizeof(*hdr);
-    memcpy(entry + 1, hdr + 1, entry->len);
-    if (!queue_push(&pcb->queue, entry)) {
+    own = pbuf_own(pb); /* keep the received buffer instead of copying the payload */
+    if (!own) {
         mutex_unlock(&mutex);
-        errorf("queue_push() failure");
+        errorf("pbuf_own() failure");
         return;
     }
-    sched_wakeup(&pcb->ctx);
+    pbuf_pull(own, sizeof(*hdr));
+    entry = &pcb->queue[pcb->tail & (UDP_PCB_QUEUE_SIZE - 1)];
+    entry->foreign.addr = src;
+    entry->foreign.port = hdr->src;
+    entry->sum = sum;
+    entry->pb = own;
+    pcb->rmem += own->size;
+    if (pcb->tail++ == pcb->head) {
+        /* NOTE: the receivers sleep only on an empty queue */
+        sched_wakeup(&pcb->ctx);
+        if (pcb->notify) {
+            pcb->notify(pcb->notify_arg);
+        }
+    }
     mutex_unlock(&mutex);
+    counters_add(&stats, UDP_STATS_IN_DATAGRAMS, 1);
 }
 
-ssize_t
-udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len)
+/* NOTE: the headers are built in place in front of the payload, path is the one to dst */
+static ssize_t
+udp_output_path(struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *data, size_t len, struct ip_path *path)
 {
-    uint8_t buf[IP_PAYLOAD_SIZE_MAX];
+    struct pbuf *pb;
     struct udp_hdr *hdr;
     struct pseudo_hdr pseudo;
-    uint16_t total, psum = 0;
+    struct net_device *dev;
+    uint16_t total;
+    uint32_t sum;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
+    ssize_t ret;
 
     if (len > IP_PAYLOAD_SIZE_MAX - sizeof(*hdr)) {
         errorf("too long");
         return -1;
     }
-    hdr = (struct udp_hdr *)buf;
+    total = sizeof(*hdr) + len;
+    pb = pbuf_alloc(PBUF_HEADROOM, total);
+    if (!pb) {
+        errorf("pbuf_alloc() failure");
+        return -1;
+    }
+    hdr = (struct udp_hdr *)pb->data;
     hdr->src = src->port;
     hdr->dst = dst->port;
-    total = sizeof(*hdr) + len;
     hdr->len = hton16(total);
     hdr->sum = 0;
-    memcpy(hdr + 1, data, len);
     pseudo.src = src->addr;
     pseudo.dst = dst->addr;
     pseudo.zero = 0;
     pseudo.protocol = IP_PROTOCOL_UDP;
     pseudo.len = hton16(total);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    hdr->sum = cksum16((uint16_t *)hdr, total, psum);
+    dev = NET_IFACE(path->iface)->dev;
+    if (dev->features & NET_DEVICE_FEATURE_TXCSUM && IP_HDR_SIZE_MIN + total <= dev->mtu) {
+        /* NOTE: the device sums the datagram (unless fragmented), only the pseudo header is left in the field */
+        memcpy(hdr + 1, data, len);
+        hdr->sum = ~cksum16_fold(cksum16_partial(&pseudo, sizeof(pseudo), 0));
+        pb->flags |= PBUF_FLAG_CSUM_PARTIAL;
+        pb->csum_start = (uint8_t *)hdr - pb->head;
+        pb->csum_offset = offsetof(struct udp_hdr, sum);
+    } else {
+        /* NOTE: the payload is summed while being copied, it is read only once */
+        sum = cksum16_copy(hdr + 1, data, len, 0);
+        sum = cksum16_partial(&pseudo, sizeof(pseudo), sum);
+        hdr->sum = cksum16_fold(cksum16_partial(hdr, sizeof(*hdr), sum));
+    }
     debugf("%s => %s, len=%u (payload=%zu)",
         ip_endpoint_ntop(src, ep1, sizeof(ep1)), ip_endpoint_ntop(dst, ep2, sizeof(ep2)), total, len);
     udp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_UDP, (uint8_t *)hdr, total, src->addr, dst->addr) == -1) {
-        errorf("ip_output() failure");
+    ret = ip_output_path(IP_PROTOCOL_UDP, pb, src->addr, path);
+    pbuf_free(pb);
+    if (ret == -1) {
+        errorf("ip_output_path() failure");
         return -1;
     }
+    counters_add(&stats, UDP_STATS_OUT_DATAGRAMS, 1);
     return len;
 }
 
+ssize_t
+udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len)
+{
+    struct ip_path path;
+
+    if (ip_path_resolve(dst->addr, &path) == -1) {
+        errorf("ip_path_resolve() failure");
+        return -1;
+    }
+    return udp_output_path(src, dst, data, len, &path);
+}
+
 static void
 event_handler(void *arg)
 {
     struct udp_pcb *pcb;
+    int id;
 
     mutex_lock(&mutex);
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == UDP_PCB_STATE_OPEN) {
+    for (id = 0; id < table_size(&pcbs); id++) {
+        pcb = table_get(&pcbs, id);
+        if (pcb && pcb->state == UDP_PCB_STATE_OPEN) {
             sched_interrupt(&pcb->ctx);
         }
     }
@@ -262,6 +350,14 @@ event_handler(void *arg)
 int
 udp_init(void)
 {
+    if (counters_init(&stats, "udp", stats_names, UDP_STATS_NUM) == -1) {
+        errorf("counters_init() failure");
+        return -1;
+    }
+    if (net_stats_register(&stats, NULL) == -1) {
+        errorf("net_stats_register() failure");
+        return -1;
+    }
     if (ip_protocol_register("UDP", IP_PROTOCOL_UDP, udp_input) == -1) {
         errorf("ip_protocol_register() failure");
         return -1;
@@ -270,6 +366,17 @@ udp_init(void)
     return 0;
 }
 
+int
+udp_set_pcb_max(size_t max)
+{
+    int ret;
+
+    mutex_lock(&mutex);
+    ret = table_set_max(&pcbs, max);
+    mutex_unlock(&mutex);
+    return ret;
+}
+
 /*
  * UDP User Commands
  */
@@ -336,12 +443,11 @@ udp_bind(int id, struct ip_endpoint *local)
     return 0;
 }
 
-ssize_t
-udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
+/* NOTE: the local endpoint to send from through iface, a port is assigned if not bound yet */
+static int
+udp_select_local(int id, struct ip_iface *iface, struct ip_endpoint *local)
 {
     struct udp_pcb *pcb;
-    struct ip_endpoint local;
-    struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
     uint32_t p;
 
@@ -352,44 +458,127 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
         mutex_unlock(&mutex);
         return -1;
     }
-    local.addr = pcb->local.addr;
-    if (local.addr == IP_ADDR_ANY) {
-        iface = ip_route_get_iface(foreign->addr);
-        if (!iface) {
-            errorf("iface not found that can reach foreign address, addr=%s",
-                ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
-            mutex_unlock(&mutex);
-            return -1;
-        }
-        local.addr = iface->unicast;
-        debugf("select local address, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
+    local->addr = pcb->local.addr;
+    if (local->addr == IP_ADDR_ANY) {
+        local->addr = iface->unicast;
+        debugf("select local address, addr=%s", ip_addr_ntop(local->addr, addr, sizeof(addr)));
     }
     if (!pcb->local.port) {
         for (p = UDP_SOURCE_PORT_MIN; p <= UDP_SOURCE_PORT_MAX; p++) {
-            if (!udp_pcb_select(local.addr, hton16(p))) {
+            if (!udp_pcb_select(local->addr, hton16(p))) {
                 pcb->local.port = hton16(p);
                 debugf("dynamic assign local port, port=%d", p);
                 break;
             }
         }
         if (!pcb->local.port) {
-            debugf("failed to dynamic assign local port, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
+            debugf("failed to dynamic assign local port, addr=%s", ip_addr_ntop(local->addr, addr, sizeof(addr)));
             mutex_unlock(&mutex);
             return -1;
         }
     }
-    local.port = pcb->local.port;
+    local->port = pcb->local.port;
     mutex_unlock(&mutex);
-    return udp_output(&local, foreign, data, len);
+    return 0;
 }
 
 ssize_t
-udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
+udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
+{
+    struct ip_path path;
+    struct ip_endpoint local;
+    char addr[IP_ADDR_STR_LEN];
+
+    if (ip_path_resolve(foreign->addr, &path) == -1) {
+        errorf("iface not found that can reach foreign address, addr=%s",
+            ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
+        return -1;
+    }
+    if (udp_select_local(id, path.iface, &local) == -1) {
+        return -1;
+    }
+    return udp_output_path(&local, foreign, data, len, &path);
+}
+
+/*
+ * NOTE: Send msgs[].len bytes of msgs[].buf to msgs[].foreign each, returns the number of datagrams sent.
+ *       The route (and the neighbor) is resolved once for a run of them to the same address, and the
+ *       frames are queued on the device to be handed to the driver together.
+ */
+ssize_t
+udp_sendto_batch(int id, struct udp_msg *msgs, size_t n)
+{
+    struct ip_path path;
+    struct ip_endpoint local;
+    char addr[IP_ADDR_STR_LEN];
+    size_t i;
+
+    if (!n) {
+        return 0;
+    }
+    net_tx_batch_begin();
+    for (i = 0; i < n; i++) {
+        if (!i || msgs[i].foreign.addr != path.dst) {
+            if (ip_path_resolve(msgs[i].foreign.addr, &path) == -1) {
+                errorf("iface not found that can reach foreign address, addr=%s",
+                    ip_addr_ntop(msgs[i].foreign.addr, addr, sizeof(addr)));
+                break;
+            }
+            if (udp_select_local(id, path.iface, &local) == -1) {
+                break;
+            }
+        }
+        if (udp_output_path(&local, &msgs[i].foreign, msgs[i].buf, msgs[i].len, &path) == -1) {
+            break;
+        }
+    }
+    net_tx_batch_end();
+    return i ? (ssize_t)i : -1;
+}
+
+/* NOTE: copy the payload out (truncated to size) and verify the checksum on the way unless done already */
+static ssize_t
+udp_copyout(struct udp_queue_entry *entry, uint8_t *buf, size_t size)
+{
+    struct pbuf *pb = entry->pb;
+    size_t len, even;
+    uint32_t sum;
+
+    len = MIN(size, pb->len); /* truncate */
+    if (pb->flags & (PBUF_FLAG_CSUM_VALID | PBUF_FLAG_CSUM_PARTIAL)) {
+        /* NOTE: verified by the device, or looped back with the checksum left to the device */
+        memcpy(buf, pb->data, len);
+        return len;
+    }
+    /* NOTE: sum the copied part (but the odd byte) with the copy, and the rest (if truncated) by itself */
+    even = len & ~(size_t)1;
+    sum = cksum16_copy(buf, pb->data, even, entry->sum);
+    sum = cksum16_partial(pb->data + even, pb->len - even, sum);
+    if (cksum16_fold(sum) != 0) {
+        errorf("checksum error, drop, len=%zu", pb->len);
+        counters_add(&stats, UDP_STATS_CSUM_ERRORS, 1);
+        return -1;
+    }
+    memcpy(buf + even, pb->data + even, len - even);
+    return len;
+}
+
+/*
+ * NOTE: Receive up to n datagrams at once (at most UDP_RECV_BATCH), blocking until the first one.
+ *       msgs[].size is the size of msgs[].buf, msgs[].len and msgs[].foreign are set by this.
+ */
+static ssize_t
+udp_recvfrom_core(int id, struct udp_msg *msgs, size_t n, int nowait)
 {
     struct udp_pcb *pcb;
-    struct udp_queue_entry *entry;
+    struct udp_queue_entry entries[UDP_RECV_BATCH];
+    size_t num, i, ret;
     ssize_t len;
 
+    if (!n) {
+        return 0;
+    }
+RETRY:
     mutex_lock(&mutex);
     pcb = udp_pcb_get(id);
     if (!pcb) {
@@ -397,7 +586,12 @@ udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
         mutex_unlock(&mutex);
         return -1;
     }
-    while (!(entry = queue_pop(&pcb->queue))) {
+    while (pcb->head == pcb->tail) {
+        if (pcb->nonblock || nowait) {
+            mutex_unlock(&mutex);
+            errno = EAGAIN;
+            return -1;
+        }
         if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
             debugf("interrupted");
             mutex_unlock(&mutex);
@@ -411,12 +605,177 @@ udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
             return -1;
         }
     }
+    n = MIN(n, UDP_RECV_BATCH);
+    for (num = 0; num < n && pcb->head != pcb->tail; num++) {
+        entries[num] = pcb->queue[pcb->head++ & (UDP_PCB_QUEUE_SIZE - 1)];
+        pcb->rmem -= entries[num].pb->size;
+    }
     mutex_unlock(&mutex);
+    /* NOTE: the payloads are copied out of the lock */
+    for (i = 0, ret = 0; i < num; i++) {
+        len = udp_copyout(&entries[i], msgs[ret].buf, msgs[ret].size);
+        if (len != -1) {
+            msgs[ret].len = len;
+            msgs[ret].foreign = entries[i].foreign;
+            ret++;
+        }
+        pbuf_free(entries[i].pb);
+    }
+    if (!ret) {
+        /* NOTE: all of the popped ones were dropped (e.g. a checksum error), wait for the next */
+        goto RETRY;
+    }
+    return ret;
+}
+
+ssize_t
+udp_recvfrom_batch(int id, struct udp_msg *msgs, size_t n)
+{
+    return udp_recvfrom_core(id, msgs, n, 0);
+}
+
+ssize_t
+udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
+{
+    struct udp_msg msg;
+
+    msg.buf = buf;
+    msg.size = size;
+    if (udp_recvfrom_core(id, &msg, 1, 0) == -1) {
+        return -1;
+    }
     if (foreign) {
-        *foreign = entry->foreign;
+        *foreign = msg.foreign;
     }
-    len = MIN(size, entry->len); /* truncate */
-    memcpy(buf, entry + 1, len);
-    memory_free(entry);
-    return len;
+    return msg.len;
+}
+
+/* NOTE: fails with EAGAIN instead of sleeping, regardless of the nonblocking flag */
+ssize_t
+udp_recvfrom_nowait(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
+{
+    struct udp_msg msg;
+
+    msg.buf = buf;
+    msg.size = size;
+    if (udp_recvfrom_core(id, &msg, 1, 1) == -1) {
+        return -1;
+    }
+    if (foreign) {
+        *foreign = msg.foreign;
+    }
+    return msg.len;
+}
+
+/* NOTE: the limit of the memory held by the receive queue (like SO_RCVBUF), in bytes */
+int
+udp_set_rcvbuf(int id, size_t size)
+{
+    struct udp_pcb *pcb;
+
+    if (!size || size > UDP_PCB_RCVBUF_MAX) {
+        errorf("invalid size, size=%zu", size);
+        return -1;
+    }
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    pcb->rcvbuf = size;
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+int
+udp_get_rcvbuf(int id, size_t *size)
+{
+    struct udp_pcb *pcb;
+
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    *size = pcb->rcvbuf;
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+/* NOTE: the number of datagrams dropped for the receive queue overflow since opened */
+int
+udp_get_drops(int id, uint32_t *drops)
+{
+    struct udp_pcb *pcb;
+
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    *drops = pcb->drops;
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+int
+udp_set_nonblock(int id, int on)
+{
+    struct udp_pcb *pcb;
+
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    pcb->nonblock = !!on;
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+/* NOTE: notify(arg) is called (with the UDP mutex held) when the queue gets non-empty, NULL to stop it */
+int
+udp_set_notify(int id, void (*notify)(void *arg), void *arg)
+{
+    struct udp_pcb *pcb;
+
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    pcb->notify = notify;
+    pcb->notify_arg = arg;
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+/* NOTE: returns the events (NET_POLLXXX) ready now, a datagram socket is always writable */
+int
+udp_poll(int id)
+{
+    struct udp_pcb *pcb;
+    int events = NET_POLLOUT;
+
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        mutex_unlock(&mutex);
+        return NET_POLLERR | NET_POLLHUP;
+    }
+    if (pcb->head != pcb->tail) {
+        events |= NET_POLLIN;
+    }
+    mutex_unlock(&mutex);
+    return events;
 }
@@ -6,11 +6,29 @@
 
 #include "ip.h"
 
+/* NOTE: the counters of the module, see net_stats_get() ("udp") */
+#define UDP_STATS_IN_DATAGRAMS  0 /* queued to the sockets */
+#define UDP_STATS_NO_PORTS      1
+#define UDP_STATS_IN_ERRORS     2 /* too short, or bad length */
+#define UDP_STATS_CSUM_ERRORS   3 /* found when received by the application */
+#define UDP_STATS_RCVBUF_ERRORS 4 /* the receive queue (or rcvbuf) is full */
+#define UDP_STATS_OUT_DATAGRAMS 5
+#define UDP_STATS_NUM           6
+
+struct udp_msg {
+    uint8_t *buf;
+    size_t size; /* of buf (receive only) */
+    size_t len; /* of the datagram (truncated to size on receive) */
+    struct ip_endpoint foreign;
+};
+
 extern ssize_t
 udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *buf, size_t len);
 
 extern int
 udp_init(void);
+extern int
+udp_set_pcb_max(size_t max);
 
 extern int
 udp_open(void);
@@ -19,7 +37,25 @@ udp_bind(int index, struct ip_endpoint *local);
 extern ssize_t
 udp_sendto(int id, uint8_t *buf, size_t len, struct ip_endpoint *foreign);
 extern ssize_t
+udp_sendto_batch(int id, struct udp_msg *msgs, size_t n);
+extern ssize_t
 udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign);
+extern ssize_t
+udp_recvfrom_batch(int id, struct udp_msg *msgs, size_t n);
+extern ssize_t
+udp_recvfrom_nowait(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign);
+extern int
+udp_set_rcvbuf(int id, size_t size);
+extern int
+udp_get_rcvbuf(int id, size_t *size);
+extern int
+udp_get_drops(int id, uint32_t *drops);
+extern int
+udp_set_nonblock(int id, int on);
+extern int
+udp_set_notify(int id, void (*notify)(void *arg), void *arg);
+extern int
+udp_poll(int id);
 extern int
 udp_close(int id);
 
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -8,24 +9,213 @@
 #include <ctype.h>
 #include <time.h>
 #include <sys/time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "platform.h"
 
 #include "util.h"
 
+/*
+ * Logging
+ *
+ * NOTE: With the async logger running, the warnings and the errors are formatted by the caller
+ *       into a record of the ring and written by the logger thread, so the caller does not wait
+ *       for the output. The ring drops the records (and counts them) while it is full.
+ */
+
+#define LOG_RING_SIZE 256 /* records, power of two */
+#define LOG_RECORD_LEN 256 /* bytes, a longer message is truncated */
+
+struct log_record {
+    struct timeval tv;
+    int level;
+    char msg[LOG_RECORD_LEN];
+};
+
+int log_level = LOG_LEVEL_DEBUG;
+
+static struct {
+    mutex_t mutex; /* protects everything below */
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int stopping;
+    FILE *fp;
+    unsigned int head;
+    unsigned int tail;
+    uint64_t dropped; /* NOTE: also added to without the lock when the ring is full */
+    struct log_record records[LOG_RING_SIZE];
+} logger = {
+    .mutex = MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+void
+log_set_level(int level)
+{
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+/* NOTE: "HH:MM:SS" of the second, cached per thread since localtime_r() is slow */
+static const char *
+log_timestamp(const struct timeval *tv)
+{
+    static __thread time_t sec = -1;
+    static __thread char timestamp[32];
+    struct tm tm;
+
+    if (tv->tv_sec != sec) {
+        strftime(timestamp, sizeof(timestamp), "%T", localtime_r(&tv->tv_sec, &tm));
+        sec = tv->tv_sec;
+    }
+    return timestamp;
+}
+
+static void *
+log_thread(void *arg)
+{
+    struct log_record record;
+    struct timeval tv;
+    uint64_t dropped;
+
+    mutex_lock(&logger.mutex);
+    while (1) {
+        while (logger.head == logger.tail && !logger.dropped && !logger.stopping) {
+            pthread_cond_wait(&logger.cond, &logger.mutex);
+        }
+        if (logger.head == logger.tail && !logger.dropped) {
+            break;
+        }
+        dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_RELAXED);
+        if (logger.head != logger.tail) {
+            record = logger.records[logger.head++ & (LOG_RING_SIZE - 1)];
+        } else {
+            record.level = 0;
+        }
+        mutex_unlock(&logger.mutex);
+        if (dropped) {
+            gettimeofday(&tv, NULL);
+            fprintf(logger.fp, "%s.%03d [W] %s: %" PRIu64 " messages dropped, the ring is full\n", log_timestamp(&tv), (int)(tv.tv_usec / 1000), __func__, dropped);
+        }
+        if (record.level) {
+            fprintf(logger.fp, "%s.%03d [%c] %s\n", log_timestamp(&record.tv), (int)(record.tv.tv_usec / 1000), record.level, record.msg);
+        }
+        mutex_lock(&logger.mutex);
+    }
+    mutex_unlock(&logger.mutex);
+    fflush(logger.fp);
+    return NULL;
+}
+
+/* NOTE: the warnings and the errors written to fp go through the logger thread from now on */
+int
+log_async_start(FILE *fp)
+{
+    int err;
+
+    mutex_lock(&logger.mutex);
+    if (logger.running) {
+        mutex_unlock(&logger.mutex);
+        return -1;
+    }
+    __atomic_store_n(&logger.fp, fp, __ATOMIC_RELAXED);
+    __atomic_store_n(&logger.stopping, 0, __ATOMIC_RELAXED);
+    err = pthread_create(&logger.thread, NULL, log_thread, NULL);
+    if (err) {
+        mutex_unlock(&logger.mutex);
+        fprintf(stderr, "pthread_create() failure: %s\n", strerror(err));
+        return -1;
+    }
+    logger.running = 1;
+    mutex_unlock(&logger.mutex);
+    return 0;
+}
+
+/* NOTE: writes out the records left in the ring before it returns */
+void
+log_async_stop(void)
+{
+    pthread_t thread;
+
+    mutex_lock(&logger.mutex);
+    if (!logger.running || logger.stopping) {
+        mutex_unlock(&logger.mutex);
+        return;
+    }
+    __atomic_store_n(&logger.stopping, 1, __ATOMIC_RELAXED);
+    thread = logger.thread;
+    pthread_cond_signal(&logger.cond);
+    mutex_unlock(&logger.mutex);
+    pthread_join(thread, NULL);
+    mutex_lock(&logger.mutex);
+    logger.running = 0;
+    mutex_unlock(&logger.mutex);
+}
+
+static int
+log_async_push(FILE *fp, int level, const char *file, int line, const char *func, const char *fmt, va_list ap)
+{
+    struct log_record *record;
+    struct timeval tv;
+    char msg[LOG_RECORD_LEN];
+    int n, len;
+
+    /* NOTE: a peek without the lock (checked again below), the records dropped are neither formatted nor locked for */
+    if (__atomic_load_n(&logger.tail, __ATOMIC_RELAXED) - __atomic_load_n(&logger.head, __ATOMIC_RELAXED) == LOG_RING_SIZE &&
+        __atomic_load_n(&logger.fp, __ATOMIC_RELAXED) == fp && !__atomic_load_n(&logger.stopping, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&logger.dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    gettimeofday(&tv, NULL);
+    n = snprintf(msg, sizeof(msg), "%s: ", func);
+    len = MIN(n, (int)sizeof(msg) - 1);
+    n += vsnprintf(msg + len, sizeof(msg) - len, fmt, ap);
+    len = MIN(n, (int)sizeof(msg) - 1);
+    n += snprintf(msg + len, sizeof(msg) - len, " (%s:%d)", file, line);
+    mutex_lock(&logger.mutex);
+    if (!logger.running || logger.stopping || logger.fp != fp) {
+        mutex_unlock(&logger.mutex);
+        return -1;
+    }
+    if (logger.tail - logger.head == LOG_RING_SIZE) {
+        __atomic_add_fetch(&logger.dropped, 1, __ATOMIC_RELAXED);
+        mutex_unlock(&logger.mutex);
+        return n;
+    }
+    record = &logger.records[logger.tail & (LOG_RING_SIZE - 1)];
+    record->tv = tv;
+    record->level = level;
+    memcpy(record->msg, msg, sizeof(msg));
+    if (logger.tail++ == logger.head) {
+        pthread_cond_signal(&logger.cond);
+    }
+    mutex_unlock(&logger.mutex);
+    return n;
+}
+
 int
 lprintf(FILE *fp, int level, const char *file, int line, const char *func, const char *fmt, ...)
 {
     struct timeval tv;
-    struct tm tm;
-    char timestamp[32];
     int n = 0;
     va_list ap;
 
+    if ((level == 'E' || level == 'W') && __atomic_load_n(&logger.running, __ATOMIC_RELAXED)) {
+        va_start(ap, fmt);
+        n = log_async_push(fp, level, file, line, func, fmt, ap);
+        va_end(ap);
+        if (n != -1) {
+            return n;
+        }
+        n = 0;
+    }
     flockfile(fp);
     gettimeofday(&tv, NULL);
-    strftime(timestamp, sizeof(timestamp), "%T", localtime_r(&tv.tv_sec, &tm));
-    n += fprintf(fp, "%s.%03d [%c] %s: ", timestamp, (int)(tv.tv_usec / 1000), level, func);
+    n += fprintf(fp, "%s.%03d [%c] %s: ", log_timestamp(&tv), (int)(tv.tv_usec / 1000), level, func);
     va_start(ap, fmt);
     n += vfprintf(fp, fmt, ap);
     va_end(ap);
@@ -70,84 +260,365 @@ hexdump(FILE *fp, const void *data, size_t size)
     funlockfile(fp);
 }
 
-struct queue_entry {
-    struct queue_entry *next;
-    void *data;
-};
+int
+ring_init(struct ring *ring, unsigned int size)
+{
+    unsigned int n;
+
+    for (n = 1; n < size; n <<= 1); /* round up to a power of two */
+    ring->slots = memory_alloc(sizeof(*ring->slots) * n);
+    if (!ring->slots) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    ring->size = n;
+    ring->mask = n - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    return 0;
+}
 
 void
-queue_init(struct queue_head *queue)
+ring_destroy(struct ring *ring)
+{
+    memory_free(ring->slots);
+    ring->slots = NULL;
+}
+
+/* NOTE: producer side, returns -1 if the ring is full */
+int
+ring_push(struct ring *ring, void *data)
 {
-    queue->head = NULL;
-    queue->tail = NULL;
-    queue->num = 0;
+    unsigned int head, tail;
+
+    tail = ring->tail; /* only the producer writes tail */
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail - head == ring->size) {
+        return -1;
+    }
+    ring->slots[tail & ring->mask] = data;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
 }
 
+/* NOTE: consumer side, returns NULL if the ring is empty */
 void *
-queue_push(struct queue_head *queue, void *data)
+ring_pop(struct ring *ring)
 {
-    struct queue_entry *entry;
+    unsigned int head, tail;
+    void *data;
 
-    if (!queue) {
+    head = ring->head; /* only the consumer writes head */
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
         return NULL;
     }
-    entry = memory_alloc(sizeof(*entry));
-    if (!entry) {
+    data = ring->slots[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return data;
+}
+
+/* NOTE: consumer side */
+void *
+ring_peek(struct ring *ring)
+{
+    unsigned int head, tail;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
         return NULL;
     }
-    entry->next = NULL;
-    entry->data = data;
-    if (queue->tail) {
-        queue->tail->next = entry;
+    return ring->slots[head & ring->mask];
+}
+
+unsigned int
+ring_count(struct ring *ring)
+{
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Table
+ */
+
+static int
+table_grow(struct table *table)
+{
+    void *chunk;
+
+    if (table->nchunks == TABLE_CHUNK_NUM) {
+        return -1;
     }
-    queue->tail = entry;
-    if (!queue->head) {
-        queue->head = entry;
+    chunk = memory_alloc(table->esize * TABLE_CHUNK_SIZE);
+    if (!chunk) {
+        errorf("memory_alloc() failure");
+        return -1;
     }
-    queue->num++;
-    return data;
+    /* NOTE: publish the chunk before the count so that lock-free readers never see a NULL */
+    __atomic_store_n(&table->chunks[table->nchunks], chunk, __ATOMIC_RELEASE);
+    __atomic_store_n(&table->nchunks, table->nchunks + 1, __ATOMIC_RELEASE);
+    return 0;
 }
 
+/* NOTE: returns a zero-filled entry with the lowest free id, or NULL if the limit is reached */
 void *
-queue_pop(struct queue_head *queue)
+table_alloc(struct table *table, int *id)
 {
-    struct queue_entry *entry;
-    void *data;
+    unsigned int c;
+    int bit;
+    void *entry;
 
-    if (!queue || !queue->head) {
+    if (table->count >= table->max) {
         return NULL;
     }
-    entry = queue->head;
-    queue->head = entry->next;
-    if (!queue->head) {
-        queue->tail = NULL;
+    for (c = 0; c < table->nchunks; c++) {
+        if (~table->used[c]) {
+            break;
+        }
     }
-    queue->num--;
-    data = entry->data;
-    memory_free(entry);
-    return data;
+    if (c == table->nchunks && table_grow(table) == -1) {
+        return NULL;
+    }
+    bit = __builtin_ctzll(~table->used[c]);
+    __atomic_or_fetch(&table->used[c], (uint64_t)1 << bit, __ATOMIC_RELEASE);
+    table->count++;
+    entry = (uint8_t *)table->chunks[c] + table->esize * bit;
+    memset(entry, 0, table->esize);
+    *id = c * TABLE_CHUNK_SIZE + bit;
+    return entry;
+}
+
+void
+table_free(struct table *table, int id)
+{
+    if (!table_get(table, id)) {
+        return;
+    }
+    __atomic_and_fetch(&table->used[id / TABLE_CHUNK_SIZE], ~((uint64_t)1 << (id % TABLE_CHUNK_SIZE)), __ATOMIC_RELEASE);
+    table->count--;
 }
 
+/* NOTE: returns NULL if the id is out of range or not in use */
 void *
-queue_peek(struct queue_head *queue)
+table_get(struct table *table, int id)
 {
-    if (!queue || !queue->head) {
+    unsigned int c;
+
+    if (id < 0 || id >= table_size(table)) {
         return NULL;
     }
-    return queue->head->data;
+    c = id / TABLE_CHUNK_SIZE;
+    if (!(__atomic_load_n(&table->used[c], __ATOMIC_ACQUIRE) & ((uint64_t)1 << (id % TABLE_CHUNK_SIZE)))) {
+        return NULL;
+    }
+    return (uint8_t *)__atomic_load_n(&table->chunks[c], __ATOMIC_ACQUIRE) + table->esize * (id % TABLE_CHUNK_SIZE);
 }
 
+/* NOTE: ids are less than this, for iteration */
+int
+table_size(struct table *table)
+{
+    return __atomic_load_n(&table->nchunks, __ATOMIC_ACQUIRE) * TABLE_CHUNK_SIZE;
+}
+
+/* NOTE: lowering the limit does not release the entries in use */
+int
+table_set_max(struct table *table, size_t max)
+{
+    if (!max || max > TABLE_SIZE_MAX) {
+        return -1;
+    }
+    table->max = max;
+    return 0;
+}
+
+/*
+ * Counters
+ */
+
+#define COUNTERS_CACHE_LINE 64
+
+/* NOTE: the threads take the slots in turn, the first time they count */
+static unsigned int
+counters_slot(void)
+{
+    static unsigned int next;
+    static __thread unsigned int slot; /* 1-origin, 0 if not taken yet */
+
+    if (!slot) {
+        slot = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % COUNTERS_SLOTS + 1;
+    }
+    return slot - 1;
+}
+
+/* NOTE: names must outlive the counters, they are never released */
+int
+counters_init(struct counters *counters, const char *name, const char * const *names, unsigned int num)
+{
+    uint8_t *p;
+
+    counters->stride = (num * sizeof(uint64_t) + COUNTERS_CACHE_LINE - 1) / COUNTERS_CACHE_LINE * COUNTERS_CACHE_LINE / sizeof(uint64_t);
+    p = memory_alloc(COUNTERS_SLOTS * counters->stride * sizeof(uint64_t) + COUNTERS_CACHE_LINE);
+    if (!p) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    p += COUNTERS_CACHE_LINE - (uintptr_t)p % COUNTERS_CACHE_LINE;
+    counters->name = name;
+    counters->names = names;
+    counters->num = num;
+    __atomic_store_n(&counters->slots, (uint64_t *)p, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void
+counters_add(struct counters *counters, unsigned int index, uint64_t n)
+{
+    uint64_t *slots;
+
+    slots = __atomic_load_n(&counters->slots, __ATOMIC_ACQUIRE);
+    if (!slots || index >= counters->num) {
+        return;
+    }
+    __atomic_add_fetch(&slots[counters_slot() * counters->stride + index], n, __ATOMIC_RELAXED);
+}
+
+/* NOTE: values must have room for counters->num entries */
 void
-queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), void *arg)
+counters_snapshot(struct counters *counters, uint64_t *values)
 {
-    struct queue_entry *entry;
+    uint64_t *slots;
+    unsigned int i, slot;
 
-    if (!queue || !func) {
+    memset(values, 0, sizeof(*values) * counters->num);
+    slots = __atomic_load_n(&counters->slots, __ATOMIC_ACQUIRE);
+    if (!slots) {
         return;
     }
-    for (entry = queue->head; entry; entry = entry->next) {
-        func(arg, entry->data);
+    for (slot = 0; slot < COUNTERS_SLOTS; slot++) {
+        for (i = 0; i < counters->num; i++) {
+            values[i] += __atomic_load_n(&slots[slot * counters->stride + i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void
+counters_dump(struct counters *counters, FILE *fp)
+{
+    uint64_t values[counters->num ? counters->num : 1];
+    unsigned int i;
+
+    counters_snapshot(counters, values);
+    flockfile(fp);
+    fprintf(fp, "%s:", counters->name);
+    for (i = 0; i < counters->num; i++) {
+        fprintf(fp, "%s %s=%" PRIu64, i ? "," : "", counters->names[i], values[i]);
+    }
+    fprintf(fp, "\n");
+    funlockfile(fp);
+}
+
+/*
+ * Histogram
+ */
+
+static unsigned int
+histogram_index(uint64_t value)
+{
+    unsigned int exp;
+
+    if (value < (1 << HISTOGRAM_SUB_BITS)) {
+        return value;
+    }
+    exp = 63 - __builtin_clzll(value);
+    if (exp >= HISTOGRAM_EXP_MAX) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    /* NOTE: the top HISTOGRAM_SUB_BITS bits below the leading one select the bucket within the power of two */
+    return ((exp - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + ((value >> (exp - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+/* NOTE: the largest value of the bucket */
+static uint64_t
+histogram_upper(unsigned int index)
+{
+    unsigned int exp, sub;
+
+    if (index < (1 << HISTOGRAM_SUB_BITS)) {
+        return index;
     }
+    exp = (index >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    sub = index & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return ((uint64_t)((1 << HISTOGRAM_SUB_BITS) + sub + 1) << (exp - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+int
+histogram_init(struct histogram *histogram, const char *name)
+{
+    return counters_init(&histogram->counters, name, NULL, HISTOGRAM_BUCKETS);
+}
+
+void
+histogram_add(struct histogram *histogram, uint64_t value)
+{
+    counters_add(&histogram->counters, histogram_index(value), 1);
+}
+
+/* NOTE: buckets must have room for HISTOGRAM_BUCKETS entries */
+void
+histogram_snapshot(struct histogram *histogram, uint64_t *buckets)
+{
+    counters_snapshot(&histogram->counters, buckets);
+}
+
+uint64_t
+histogram_count(const uint64_t *buckets)
+{
+    uint64_t count = 0;
+    unsigned int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += buckets[i];
+    }
+    return count;
+}
+
+/* NOTE: the upper bound of the bucket holding the p (0.0-1.0) quantile, 0 if empty */
+uint64_t
+histogram_percentile(const uint64_t *buckets, double p)
+{
+    uint64_t count, rank, sum = 0;
+    unsigned int i;
+
+    count = histogram_count(buckets);
+    if (!count) {
+        return 0;
+    }
+    rank = (uint64_t)(p * count);
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        sum += buckets[i];
+        if (sum > rank) {
+            break;
+        }
+    }
+    return histogram_upper(i);
+}
+
+void
+histogram_dump(struct histogram *histogram, const char *unit, FILE *fp)
+{
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+
+    histogram_snapshot(histogram, buckets);
+    fprintf(fp, "%s: count=%" PRIu64 ", p50=%" PRIu64 "%s, p90=%" PRIu64 "%s, p99=%" PRIu64 "%s, p999=%" PRIu64 "%s, max=%" PRIu64 "%s\n",
+        histogram->counters.name, histogram_count(buckets),
+        histogram_percentile(buckets, 0.5), unit, histogram_percentile(buckets, 0.9), unit,
+        histogram_percentile(buckets, 0.99), unit, histogram_percentile(buckets, 0.999), unit,
+        histogram_percentile(buckets, 1.0), unit);
 }
 
 #ifndef __BIG_ENDIAN
@@ -214,21 +685,287 @@ ntoh32(uint32_t n)
     return endian == __LITTLE_ENDIAN ? byteswap32(n) : n;
 }
 
-uint16_t
-cksum16(uint16_t *addr, uint16_t count, uint32_t init)
+/*
+ * Internet Checksum (rfc1071)
+ *
+ * NOTE: The words are summed into a 64-bit accumulator (32 bits at a time, or a vector
+ *       at a time) and folded at the end. The one's complement sum does not depend on
+ *       the byte order, so the data is summed as is. The implementation is chosen
+ *       at the first use by the features of the CPU.
+ */
+
+struct cksum16_impl {
+    const char *name;
+    uint64_t (*add)(const uint8_t *p, size_t len, uint64_t sum);
+    uint64_t (*copy)(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum);
+};
+
+static uint64_t
+cksum16_add_generic(const uint8_t *p, size_t len, uint64_t sum)
+{
+    uint32_t w[8];
+    uint16_t h = 0;
+
+    while (len >= sizeof(w)) {
+        memcpy(w, p, sizeof(w));
+        sum += (uint64_t)w[0] + w[1] + w[2] + w[3] + w[4] + w[5] + w[6] + w[7];
+        p += sizeof(w);
+        len -= sizeof(w);
+    }
+    while (len >= 4) {
+        memcpy(w, p, 4);
+        sum += w[0];
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        memcpy(&h, p, 2);
+        sum += h;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        /* NOTE: the odd byte is padded with zero at the end (rfc1071), whatever the byte order is */
+        h = 0;
+        memcpy(&h, p, 1);
+        sum += h;
+    }
+    return sum;
+}
+
+static uint64_t
+cksum16_copy_generic(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum)
+{
+    uint32_t w[8];
+
+    while (len >= sizeof(w)) {
+        memcpy(w, src, sizeof(w));
+        memcpy(dst, w, sizeof(w));
+        sum += (uint64_t)w[0] + w[1] + w[2] + w[3] + w[4] + w[5] + w[6] + w[7];
+        src += sizeof(w);
+        dst += sizeof(w);
+        len -= sizeof(w);
+    }
+    memcpy(dst, src, len);
+    return cksum16_add_generic(src, len, sum);
+}
+
+static const struct cksum16_impl cksum16_generic = {"generic", cksum16_add_generic, cksum16_copy_generic};
+
+#if defined(__x86_64__) || defined(__i386__)
+/* NOTE: widen the 32-bit lanes to 64 bits (so that no carry is lost) and add them to the accumulators */
+__attribute__((target("sse2")))
+static uint64_t
+cksum16_add_sse2(const uint8_t *p, size_t len, uint64_t sum)
+{
+    __m128i zero, acc0, acc1, v;
+    uint64_t lanes[2];
+
+    zero = _mm_setzero_si128();
+    acc0 = acc1 = zero;
+    while (len >= 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
+        p += 16;
+        len -= 16;
+    }
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+    return cksum16_add_generic(p, len, sum + lanes[0] + lanes[1]);
+}
+
+__attribute__((target("sse2")))
+static uint64_t
+cksum16_copy_sse2(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum)
+{
+    __m128i zero, acc0, acc1, v;
+    uint64_t lanes[2];
+
+    zero = _mm_setzero_si128();
+    acc0 = acc1 = zero;
+    while (len >= 16) {
+        v = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, v);
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
+        src += 16;
+        dst += 16;
+        len -= 16;
+    }
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+    return cksum16_copy_generic(dst, src, len, sum + lanes[0] + lanes[1]);
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+cksum16_add_avx2(const uint8_t *p, size_t len, uint64_t sum)
+{
+    __m256i zero, acc0, acc1, v;
+    uint64_t lanes[4];
+
+    zero = _mm256_setzero_si256();
+    acc0 = acc1 = zero;
+    while (len >= 32) {
+        v = _mm256_loadu_si256((const __m256i *)p);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+        p += 32;
+        len -= 32;
+    }
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+    return cksum16_add_sse2(p, len, sum + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+cksum16_copy_avx2(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum)
+{
+    __m256i zero, acc0, acc1, v;
+    uint64_t lanes[4];
+
+    zero = _mm256_setzero_si256();
+    acc0 = acc1 = zero;
+    while (len >= 32) {
+        v = _mm256_loadu_si256((const __m256i *)src);
+        _mm256_storeu_si256((__m256i *)dst, v);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+        src += 32;
+        dst += 32;
+        len -= 32;
+    }
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+    return cksum16_copy_sse2(dst, src, len, sum + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+static const struct cksum16_impl cksum16_sse2 = {"sse2", cksum16_add_sse2, cksum16_copy_sse2};
+static const struct cksum16_impl cksum16_avx2 = {"avx2", cksum16_add_avx2, cksum16_copy_avx2};
+#endif
+
+#if defined(__ARM_NEON)
+/* NOTE: vpadalq_u32() adds the pairs of 32-bit lanes into the 64-bit accumulator */
+static uint64_t
+cksum16_add_neon(const uint8_t *p, size_t len, uint64_t sum)
 {
-    uint32_t sum;
+    uint64x2_t acc0, acc1;
 
-    sum = init;
-    while (count > 1) {
-        sum += *(addr++);
-        count -= 2;
+    acc0 = acc1 = vdupq_n_u64(0);
+    while (len >= 32) {
+        acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(p)));
+        acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(p + 16)));
+        p += 32;
+        len -= 32;
     }
-    if (count > 0) {
-        sum += *(uint8_t *)addr;
+    acc0 = vaddq_u64(acc0, acc1);
+    return cksum16_add_generic(p, len, sum + vgetq_lane_u64(acc0, 0) + vgetq_lane_u64(acc0, 1));
+}
+
+static uint64_t
+cksum16_copy_neon(uint8_t *dst, const uint8_t *src, size_t len, uint64_t sum)
+{
+    uint64x2_t acc0, acc1;
+    uint8x16_t v0, v1;
+
+    acc0 = acc1 = vdupq_n_u64(0);
+    while (len >= 32) {
+        v0 = vld1q_u8(src);
+        v1 = vld1q_u8(src + 16);
+        vst1q_u8(dst, v0);
+        vst1q_u8(dst + 16, v1);
+        acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(v0));
+        acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(v1));
+        src += 32;
+        dst += 32;
+        len -= 32;
     }
-    while (sum >> 16) {
-        sum = (sum & 0xffff) + (sum >> 16);
+    acc0 = vaddq_u64(acc0, acc1);
+    return cksum16_copy_generic(dst, src, len, sum + vgetq_lane_u64(acc0, 0) + vgetq_lane_u64(acc0, 1));
+}
+
+static const struct cksum16_impl cksum16_neon = {"neon", cksum16_add_neon, cksum16_copy_neon};
+#endif
+
+static const struct cksum16_impl *cksum16_impl;
+
+static const struct cksum16_impl *
+cksum16_select(void)
+{
+    const struct cksum16_impl *impl = &cksum16_generic;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        impl = &cksum16_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        impl = &cksum16_sse2;
     }
-    return ~(uint16_t)sum;
+#elif defined(__ARM_NEON)
+    impl = &cksum16_neon;
+#endif
+    /* NOTE: racing threads pick the same one, no lock is needed */
+    __atomic_store_n(&cksum16_impl, impl, __ATOMIC_RELEASE);
+    return impl;
+}
+
+static inline const struct cksum16_impl *
+cksum16_get_impl(void)
+{
+    const struct cksum16_impl *impl;
+
+    impl = __atomic_load_n(&cksum16_impl, __ATOMIC_ACQUIRE);
+    return impl ? impl : cksum16_select();
+}
+
+static inline uint32_t
+cksum16_reduce(uint64_t sum)
+{
+    /* NOTE: fold into 16 bits with the end-around carries (at most 4 rounds) */
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (sum & 0xffff) + (sum >> 16);
+}
+
+/*
+ * NOTE: A partial sum (not complemented) to be continued by another call or finished by cksum16_fold().
+ *       The data may be split into pieces, all of them but the last must have an even length.
+ */
+uint32_t
+cksum16_partial(const void *data, size_t len, uint32_t sum)
+{
+    return cksum16_reduce(cksum16_get_impl()->add(data, len, sum));
+}
+
+/* NOTE: memcpy() and cksum16_partial() in a single pass over the data */
+uint32_t
+cksum16_copy(void *dst, const void *src, size_t len, uint32_t sum)
+{
+    return cksum16_reduce(cksum16_get_impl()->copy(dst, src, len, sum));
+}
+
+uint16_t
+cksum16_fold(uint32_t sum)
+{
+    return ~(uint16_t)cksum16_reduce(sum);
+}
+
+uint16_t
+cksum16(uint16_t *addr, uint16_t count, uint32_t init)
+{
+    return cksum16_fold(cksum16_partial(addr, count, init));
+}
+
+/* NOTE: update the checksum for a 16-bit field rewritten from old to new, HC' = ~(~HC + ~m + m') (rfc1624) */
+uint16_t
+cksum16_update(uint16_t sum, uint16_t old, uint16_t new)
+{
+    return cksum16_fold((uint16_t)~sum + (uint32_t)(uint16_t)~old + new);
+}
+
+uint16_t
+cksum16_update32(uint16_t sum, uint32_t old, uint32_t new)
+{
+    sum = cksum16_update(sum, old >> 16, new >> 16);
+    return cksum16_update(sum, old & 0xffff, new & 0xffff);
 }
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
 
 #ifndef MAX
@@ -36,40 +37,249 @@
         }                                 \
     } while(0);
 
-#define errorf(...) lprintf(stderr, 'E', __FILE__, __LINE__, __func__, __VA_ARGS__)
-#define warnf(...) lprintf(stderr, 'W', __FILE__, __LINE__, __func__, __VA_ARGS__)
-#define infof(...) lprintf(stderr, 'I', __FILE__, __LINE__, __func__, __VA_ARGS__)
-#define debugf(...) lprintf(stderr, 'D', __FILE__, __LINE__, __func__, __VA_ARGS__)
+/*
+ * Logging
+ *
+ * NOTE: The messages above LOG_LEVEL_MAX are compiled out (the arguments are not evaluated
+ *       either), see the release target of Makefile. The rest are filtered by the level set
+ *       at runtime (see log_set_level()), which costs a load and a compare.
+ */
+
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#endif
+
+extern int log_level;
+
+#define LOG_ENABLED(x) ((x) <= LOG_LEVEL_MAX && (x) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+
+#define LOG_PRINTF(x, c, ...)                                                   \
+    do {                                                                        \
+        if (LOG_ENABLED(x)) {                                                   \
+            lprintf(stderr, (c), __FILE__, __LINE__, __func__, __VA_ARGS__);    \
+        }                                                                       \
+    } while (0)
+
+#define errorf(...) LOG_PRINTF(LOG_LEVEL_ERROR, 'E', __VA_ARGS__)
+#define warnf(...) LOG_PRINTF(LOG_LEVEL_WARN, 'W', __VA_ARGS__)
+#define infof(...) LOG_PRINTF(LOG_LEVEL_INFO, 'I', __VA_ARGS__)
+#define debugf(...) LOG_PRINTF(LOG_LEVEL_DEBUG, 'D', __VA_ARGS__)
 
 #ifdef HEXDUMP
-#define debugdump(...) hexdump(stderr, __VA_ARGS__)
+#define debugdump(...)                      \
+    do {                                    \
+        if (LOG_ENABLED(LOG_LEVEL_DEBUG)) { \
+            hexdump(stderr, __VA_ARGS__);   \
+        }                                   \
+    } while (0)
 #else
 #define debugdump(...)
 #endif
 
 extern int
-lprintf(FILE *fp, int level, const char *file, int line, const char *func, const char *fmt, ...);
+lprintf(FILE *fp, int level, const char *file, int line, const char *func, const char *fmt, ...) __attribute__((format(printf, 6, 7)));
 extern void
 hexdump(FILE *fp, const void *data, size_t size);
+extern void
+log_set_level(int level);
+extern int
+log_async_start(FILE *fp);
+extern void
+log_async_stop(void);
 
-struct queue_entry;
+/*
+ * Ring (bounded, single-producer/single-consumer)
+ *
+ * NOTE: push and pop may run concurrently in two threads without a lock,
+ *       multiple producers (or consumers) must be serialized by the caller
+ */
 
-struct queue_head {
-    struct queue_entry *head;
-    struct queue_entry *tail;
-    unsigned int num;
+struct ring {
+    unsigned int size; /* power of two */
+    unsigned int mask;
+    void **slots;
+    unsigned int head; /* written by the consumer */
+    uint8_t pad[64]; /* keep head and tail on different cache lines */
+    unsigned int tail; /* written by the producer */
 };
 
+extern int
+ring_init(struct ring *ring, unsigned int size);
 extern void
-queue_init(struct queue_head *queue);
+ring_destroy(struct ring *ring);
+extern int
+ring_push(struct ring *ring, void *data);
 extern void *
-queue_push(struct queue_head *queue, void *data);
+ring_pop(struct ring *ring);
 extern void *
-queue_pop(struct queue_head *queue);
+ring_peek(struct ring *ring);
+extern unsigned int
+ring_count(struct ring *ring);
+
+/*
+ * Table (growable array of fixed size entries, indexed by id)
+ *
+ * NOTE: Entries are allocated in chunks which are never moved or released, so pointers
+ *       to them stay valid. table_alloc()/table_free()/table_set_max() must be serialized
+ *       by the caller, table_get() can be called from anywhere.
+ */
+
+#define TABLE_CHUNK_SIZE 64 /* entries per chunk, one word of the used bitmap */
+#define TABLE_CHUNK_NUM 1024
+#define TABLE_SIZE_MAX (TABLE_CHUNK_SIZE * TABLE_CHUNK_NUM)
+
+struct table {
+    size_t esize; /* size of an entry */
+    size_t max; /* runtime limit of the number of entries */
+    size_t count; /* entries in use */
+    unsigned int nchunks;
+    void *chunks[TABLE_CHUNK_NUM];
+    uint64_t used[TABLE_CHUNK_NUM];
+};
+
+#define TABLE_INITIALIZER(type, limit) {.esize = sizeof(type), .max = (limit)}
+
 extern void *
-queue_peek(struct queue_head *queue);
+table_alloc(struct table *table, int *id);
 extern void
-queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), void *arg);
+table_free(struct table *table, int id);
+extern void *
+table_get(struct table *table, int id);
+extern int
+table_size(struct table *table);
+extern int
+table_set_max(struct table *table, size_t max);
+
+/*
+ * List (intrusive, doubly-linked)
+ */
+
+struct list_head {
+    struct list_head *next;
+    struct list_head *prev;
+};
+
+#define LIST_HEAD_INITIALIZER(name) {&(name), &(name)}
+
+#define container_of(ptr, type, member) ((type *)((uintptr_t)(ptr) - offsetof(type, member)))
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+
+#define list_foreach(pos, head) \
+    for (pos = (head)->next; pos != (head); pos = pos->next)
+#define list_foreach_safe(pos, n, head) \
+    for (pos = (head)->next, n = pos->next; pos != (head); pos = n, n = pos->next)
+
+static inline void
+list_init(struct list_head *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static inline int
+list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+static inline void
+list_add_tail(struct list_head *entry, struct list_head *head)
+{
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+/* NOTE: the entry is re-initialized, so deleting it twice is harmless */
+static inline void
+list_del(struct list_head *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    list_init(entry);
+}
+
+static inline struct list_head *
+list_first(const struct list_head *head)
+{
+    return list_empty(head) ? NULL : head->next;
+}
+
+static inline struct list_head *
+list_pop(struct list_head *head)
+{
+    struct list_head *entry;
+
+    entry = list_first(head);
+    if (entry) {
+        list_del(entry);
+    }
+    return entry;
+}
+
+/*
+ * Counters (statistics, split into per-thread slots)
+ *
+ * NOTE: Each thread adds to a slot of its own (cache line aligned) with a relaxed atomic,
+ *       so the hot paths take no lock and share no cache line while the threads are fewer
+ *       than the slots. A snapshot sums up the slots, each value is monotonic but the set
+ *       is not taken atomically.
+ */
+
+#define COUNTERS_SLOTS 16
+
+struct counters {
+    const char *name;
+    const char * const *names; /* of each counter, for the dump */
+    unsigned int num;
+    unsigned int stride; /* words per slot, rounded up to a cache line */
+    uint64_t *slots; /* NULL until initialized, counting is ignored then */
+};
+
+extern int
+counters_init(struct counters *counters, const char *name, const char * const *names, unsigned int num);
+extern void
+counters_add(struct counters *counters, unsigned int index, uint64_t n);
+extern void
+counters_snapshot(struct counters *counters, uint64_t *values);
+extern void
+counters_dump(struct counters *counters, FILE *fp);
+
+/*
+ * Histogram (log-linear buckets on top of the counters)
+ *
+ * NOTE: The values below 2^HISTOGRAM_SUB_BITS have a bucket each, the others are split into
+ *       2^HISTOGRAM_SUB_BITS buckets per power of two, i.e. within 12.5% of the value.
+ *       The values of 2^HISTOGRAM_EXP_MAX and over fall into the last bucket.
+ */
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_EXP_MAX 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_EXP_MAX - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram {
+    struct counters counters; /* a counter per bucket */
+};
+
+extern int
+histogram_init(struct histogram *histogram, const char *name);
+extern void
+histogram_add(struct histogram *histogram, uint64_t value);
+extern void
+histogram_snapshot(struct histogram *histogram, uint64_t *buckets);
+extern uint64_t
+histogram_count(const uint64_t *buckets);
+extern uint64_t
+histogram_percentile(const uint64_t *buckets, double p);
+extern void
+histogram_dump(struct histogram *histogram, const char *unit, FILE *fp);
 
 extern uint16_t
 hton16(uint16_t h);
@@ -82,5 +292,15 @@ ntoh32(uint32_t n);
 
 extern uint16_t
 cksum16(uint16_t *addr, uint16_t count, uint32_t init);
+extern uint32_t
+cksum16_partial(const void *data, size_t len, uint32_t sum);
+extern uint32_t
+cksum16_copy(void *dst, const void *src, size_t len, uint32_t sum);
+extern uint16_t
+cksum16_fold(uint32_t sum);
+extern uint16_t
+cksum16_update(uint16_t sum, uint16_t old, uint16_t new);
+extern uint16_t
+cksum16_update32(uint16_t sum, uint32_t old, uint32_t new);
 
 #endif